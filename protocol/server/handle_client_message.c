@@ -20,6 +20,7 @@ Includes
 
 #include <whist/input/input.h>
 #include <whist/network/network.h>
+#include <whist/network/network_algorithm.h>
 #include <whist/utils/clock.h>
 #include <whist/logging/logging.h>
 #include <whist/logging/log_statistic.h>
@@ -209,6 +210,10 @@ static int handle_dimensions_message(WhistServerState *state, WhistClientMessage
         state->client_width = wcmsg->dimensions.width;
         state->client_height = wcmsg->dimensions.height;
         state->client_dpi = wcmsg->dimensions.dpi;
+        // The bitrate limits depend on these, if the server estimates the bandwidth from
+        // transport feedback
+        network_algo_set_dimensions(state->client_width, state->client_height);
+        network_algo_set_dpi(state->client_dpi);
         // Update device if knowledge changed
         state->update_device = true;
     } else {
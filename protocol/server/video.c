@@ -63,11 +63,22 @@ Includes
 // Please note that this number will be multiplied by BURST_BITRATE_RATIO to get the VBV size in sec
 #define VBV_IN_SEC_BY_BURST_BITRATE_RATIO 0.2
 
+// How long the video send thread waits for an event before checking for NACKs anyway,
+// in case they arrived before it registered for NACK notifications
+#define VIDEO_SEND_IDLE_TIMEOUT_MS 100
+
 static WhistSemaphore consumer;
-static WhistSemaphore producer;
+// The video send thread waits on send_event_cond until there's a new frame to send,
+// NACKs to answer, or it should exit. These are all guarded by send_event_mutex.
+static WhistMutex send_event_mutex;
+static WhistCondition send_event_cond;
+static bool has_pending_frame;
+static bool has_pending_nacks;
 // send_populated_frames/send_empty_frame will populate one of the frame_buf's, and then wait
 // While multithreaded_send_video_packets is working to send the other frame_buf over the network
 static char encoded_frame_buf[2][LARGEST_VIDEOFRAME_SIZE];
+// How strongly each of the frame_buf's should be protected by FEC
+static FECProtectionClass encoded_frame_protection[2];
 static bool run_multithreaded_send_video_packets;
 static int send_frame_id;
 static int currently_sending_index;
@@ -80,6 +91,8 @@ Private Functions
 
 static int32_t multithreaded_encoder_factory(void* opaque);
 static int32_t multithreaded_destroy_encoder(void* opaque);
+static void notify_send_thread(bool* pending_event);
+static void notify_send_thread_of_nacks(void* data);
 
 /*
 ============================
@@ -107,6 +120,18 @@ static int32_t multithreaded_destroy_encoder(void* opaque) {
     return 0;
 }
 
+static void notify_send_thread(bool* pending_event) {
+    whist_lock_mutex(send_event_mutex);
+    *pending_event = true;
+    whist_broadcast_cond(send_event_cond);
+    whist_unlock_mutex(send_event_mutex);
+}
+
+static void notify_send_thread_of_nacks(void* data) {
+    UNUSED(data);
+    notify_send_thread(&has_pending_nacks);
+}
+
 /**
  * @brief                   Creates a new CaptureDevice
  *
@@ -168,12 +193,14 @@ static int32_t create_new_device(WhistServerState* state, WhistTimer* statistics
  * @param id                        Pointer to frame id
  * @param client_input_timestamp    Estimated client timestamp at which user input is sent
  * @param server_timestamp          Server timestamp at which this frame is captured
+ * @param protection_class          How strongly this frame should be protected by FEC
  */
 static void send_populated_frames(WhistServerState* state, WhistTimer* statistics_timer,
                                   WhistTimer* server_frame_timer, CaptureDevice* device,
                                   VideoEncoder* encoder, int id,
                                   timestamp_us client_input_timestamp,
-                                  timestamp_us server_timestamp) {
+                                  timestamp_us server_timestamp,
+                                  FECProtectionClass protection_class) {
     // transfer the capture of the latest frame from the device to
     // the encoder,
     // This function will try to CUDA/OpenGL optimize the transfer by
@@ -241,6 +268,7 @@ static void send_populated_frames(WhistServerState* state, WhistTimer* statistic
     // Write frame data to the frame struct
     write_avpackets_to_buffer(encoder->num_packets, encoder->packets, get_frame_videodata(frame));
     whist_wait_semaphore(consumer);
+    encoded_frame_protection[1 - currently_sending_index] = protection_class;
     send_frame_id = id;
     currently_sending_index = 1 - currently_sending_index;
 
@@ -249,7 +277,7 @@ static void send_populated_frames(WhistServerState* state, WhistTimer* statistic
                  video_frame_type_string(frame->frame_type));
     }
 
-    whist_post_semaphore(producer);
+    notify_send_thread(&has_pending_frame);
     timestamp_us time_to_transmit =
         ((uint64_t)get_total_frame_size(frame) * BITS_IN_BYTE * US_IN_SECOND) /
         network_settings.burst_bitrate;
@@ -353,9 +381,11 @@ static void send_empty_frame(WhistServerState* state, int id) {
     if (network_settings.saturate_bandwidth) {
         frame->videodata_length = MAX_PAYLOAD_SIZE - sizeof(VideoFrame);
     }
+    // Nothing depends on an empty frame
+    encoded_frame_protection[1 - currently_sending_index] = FEC_PROTECTION_LOW;
     send_frame_id = id;
     currently_sending_index = 1 - currently_sending_index;
-    whist_post_semaphore(producer);
+    notify_send_thread(&has_pending_frame);
 }
 
 /**
@@ -465,64 +495,90 @@ static int32_t multithreaded_send_video_packets(void* opaque) {
     int previous_connection_id = -1;
     int packet_sent = -1;
     int index = 0;
+    // Whether to keep resending the previous frame to saturate the bandwidth,
+    // instead of waiting for the next event
+    bool keep_resending = false;
     while (true) {
-        // TODO: Move to UDP's update_socket, and remove the sleep-loop
+        // Wait for a new frame, or for NACKs to answer
+        whist_lock_mutex(send_event_mutex);
+        bool timed_out = false;
+        while (run_multithreaded_send_video_packets && !has_pending_frame && !has_pending_nacks &&
+               !keep_resending && !timed_out) {
+            timed_out = !whist_timedwait_cond(send_event_cond, send_event_mutex,
+                                              VIDEO_SEND_IDLE_TIMEOUT_MS);
+        }
+        bool running = run_multithreaded_send_video_packets;
+        bool new_frame = has_pending_frame;
+        has_pending_frame = false;
+        has_pending_nacks = false;
+        whist_unlock_mutex(send_event_mutex);
+        log_double_statistic(VIDEO_SEND_THREAD_WAKEUPS, 1.0);
+        // Exit if this was an exit state
+        if (!running) {
+            break;
+        }
+
         // Till a new frame, send any nack or duplicate packets as required
-        if (whist_semaphore_value(producer) == 0 && packet_sent != -1) {
-            bool did_work = false;
+        if (!new_frame) {
+            keep_resending = false;
+            if (packet_sent == -1) {
+                continue;
+            }
 
             ClientLock* client_lock = client_active_trylock(state->client);
             if (client_lock != NULL) {
                 // If there are nack packets to send, then don't send duplicate packets
                 if (udp_handle_pending_nacks(state->client->udp_context.context)) {
-                    did_work = true;
+                    keep_resending = network_settings.saturate_bandwidth;
+                } else if (network_settings.saturate_bandwidth &&
+                           state->client->connection_id == previous_connection_id &&
+                           udp_send_probe_parity(&state->client->udp_context, last_id)) {
+                    // If requested by the client, saturate the network bandwidth with the frame's
+                    // probe parity first, which also helps the client recover the frame
+                    keep_resending = true;
                 } else if (network_settings.saturate_bandwidth &&
                            state->client->connection_id == previous_connection_id) {
                     // TODO: Make network saturation work, even when connection_id is new
-                    // If requested by the client, keep sending duplicate packets to saturate the
-                    // network bandwidth, till a new frame is available. Re-send all indices of this
-                    // video frame in a round-robin manner
+                    // Once the probe parity runs out, keep sending duplicate packets to saturate
+                    // the network bandwidth, till a new frame is available. Re-send all indices of
+                    // this video frame in a round-robin manner
                     udp_resend_packet(&state->client->udp_context, PACKET_VIDEO, last_id, index);
                     index++;
                     int num_indices =
                         udp_get_num_indices(&state->client->udp_context, PACKET_VIDEO, last_id);
                     if (num_indices < 0) {
-                        // Something wrong happened
+                        // Something wrong happened, so wait for the next frame
                         LOG_ERROR("udp_get_num_indices returned %d", num_indices);
                         index = 0;
-                        did_work = false;
-                    } else if (num_indices == index) {
-                        index = 0;
-                        did_work = true;
+                    } else {
+                        if (num_indices == index) {
+                            index = 0;
+                        }
+                        keep_resending = true;
                     }
                 }
 
                 client_active_unlock(client_lock);
             }
-
-            if (!did_work) {
-                // Sleep for 0.1ms before checking again.
-                whist_usleep(100);
-            }
             continue;
         }
 
-        // Wait for us to receive a video frame
-        whist_wait_semaphore(producer);
-        // Exit if this was an exit state
-        if (!run_multithreaded_send_video_packets) {
-            break;
-        }
-
         // Consume the video frame
         WhistTimer statistics_timer;
         start_timer(&statistics_timer);
         VideoFrame* frame = (VideoFrame*)encoded_frame_buf[currently_sending_index];
         ClientLock* client_lock = client_active_trylock(state->client);
         if (client_lock != NULL) {
-            packet_sent = send_packet(&state->client->udp_context, PACKET_VIDEO, frame,
-                                      get_total_frame_size(frame), send_frame_id,
-                                      VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(frame->frame_type));
+            // Get woken up by the NACKs of every new connection
+            if (state->client->connection_id != previous_connection_id) {
+                udp_set_nack_notify(&state->client->udp_context, notify_send_thread_of_nacks,
+                                    NULL);
+            }
+            UDPPayloadChunk chunk = {frame, get_total_frame_size(frame)};
+            packet_sent = udp_send_packet_chunks(
+                &state->client->udp_context, PACKET_VIDEO, &chunk, 1, send_frame_id,
+                VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(frame->frame_type),
+                encoded_frame_protection[currently_sending_index]);
             if (packet_sent != 0) {
                 LOG_WARNING("Failed to send the video packet!");
             }
@@ -536,6 +592,16 @@ static int32_t multithreaded_send_video_packets(void* opaque) {
         udp_reset_duplicate_packet_counter(&state->client->udp_context, PACKET_VIDEO);
         // Variables for network saturation resending
         index = 0;
+        keep_resending = network_settings.saturate_bandwidth;
+    }
+
+    // Stop getting woken up, since the send events are about to be destroyed. This waits out
+    // a deactivating client, whose UDP context may still notify us until it's destroyed, and
+    // returns NULL once the client is permanently deactivated, when nothing updates it anymore.
+    ClientLock* client_lock = client_active_lock(state->client);
+    if (client_lock != NULL) {
+        udp_set_nack_notify(&state->client->udp_context, NULL, NULL);
+        client_active_unlock(client_lock);
     }
 
     // Post this to unblock any `multithreaded_send_video()` semaphore waits
@@ -599,9 +665,12 @@ int32_t multithreaded_send_video(void* opaque) {
 
     NetworkSettings last_network_settings = {0};
 
-    // Create producer-consumer semaphore pair with queue size of 1
-    producer = whist_create_semaphore(0);
+    // Create the consumer semaphore with a queue size of 1, and the producer's send events
     consumer = whist_create_semaphore(1);
+    send_event_mutex = whist_create_mutex();
+    send_event_cond = whist_create_cond();
+    has_pending_frame = false;
+    has_pending_nacks = false;
     run_multithreaded_send_video_packets = true;
     WhistThread video_send_packets = whist_create_thread(multithreaded_send_video_packets,
                                                          "multithreaded_send_video_packets", state);
@@ -817,6 +886,7 @@ int32_t multithreaded_send_video(void* opaque) {
                                      get_timer(&statistics_timer) * MS_IN_SECOND);
 
                 VideoFrameType frame_type;
+                FECProtectionClass protection_class;
                 if (FEATURE_ENABLED(LONG_TERM_REFERENCE_FRAMES)) {
                     if (state->stream_needs_restart || state->stream_needs_recovery) {
                         if (state->stream_needs_restart) {
@@ -839,6 +909,8 @@ int32_t multithreaded_send_video(void* opaque) {
 
                     video_encoder_set_ltr_action(encoder, &ltr_action);
                     frame_type = ltr_action.frame_type;
+                    protection_class = video_frame_type_protection_class(
+                        frame_type, ltr_action.long_term_recovery_available);
                 } else {
                     if (state->stream_needs_restart || state->stream_needs_recovery) {
                         video_encoder_set_iframe(encoder);
@@ -848,6 +920,7 @@ int32_t multithreaded_send_video(void* opaque) {
                     }
                     state->stream_needs_restart = false;
                     state->stream_needs_recovery = false;
+                    protection_class = video_frame_type_protection_class(frame_type, false);
                 }
 
                 start_timer(&statistics_timer);
@@ -888,7 +961,7 @@ int32_t multithreaded_send_video(void* opaque) {
                         }
                         send_populated_frames(state, &statistics_timer, &server_frame_timer, device,
                                               encoder, id, client_input_timestamp,
-                                              server_timestamp);
+                                              server_timestamp, protection_class);
 
                         log_double_statistic(VIDEO_FPS_SENT, 1.0);
                         log_double_statistic(VIDEO_FRAME_SIZE, encoder->encoded_frame_size);
@@ -914,12 +987,15 @@ int32_t multithreaded_send_video(void* opaque) {
     if (SAVE_VIDEO_OUTPUT) {
         fclose(fp);
     }
-    // Post this to unblock `multithreaded_send_video_packets()` semaphore waits
+    // Wake up `multithreaded_send_video_packets()`, so that it exits
+    whist_lock_mutex(send_event_mutex);
     run_multithreaded_send_video_packets = false;
-    whist_post_semaphore(producer);
+    whist_broadcast_cond(send_event_cond);
+    whist_unlock_mutex(send_event_mutex);
     whist_wait_thread(video_send_packets, NULL);
     whist_destroy_semaphore(consumer);
-    whist_destroy_semaphore(producer);
+    whist_destroy_cond(send_event_cond);
+    whist_destroy_mutex(send_event_mutex);
     // The Nvidia Encoder must be wrapped in the lifetime of the capture device,
     // So we destroy the encoder first
     if (encoder) {
@@ -0,0 +1,401 @@
+/**
+ * Copyright 2022 Whist Technologies, Inc.
+ * @file fec_benchmark.c
+ * @brief FEC benchmark utility.
+============================
+Usage
+============================
+
+WhistFECBenchmark encodes and decodes frames with every FEC backend, on every CPU code path
+that gf256 can be forced to, over a sweep of group sizes, FEC ratios, segment sizes and
+loss patterns. For each configuration, it reports the per-frame encode and decode latency
+percentiles and the throughput, as a table in the log and as JSON:
+
+    WhistFECBenchmark --frames 200 --json-file fec_benchmark.json
+
+The JSON is written to stdout when no file is given. Frames are decoded the way the ring
+buffer does it, by registering the segments that weren't lost in order, and trying to decode
+after each one. The loss patterns are seeded, so that runs are comparable.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+#include <whist/fec/fec.h>
+#include <whist/fec/rs_wrapper.h>
+#include <whist/fec/gf256/gf256_cpuinfo.h>
+#include <whist/utils/clock.h>
+#include <whist/utils/command_line.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+typedef enum {
+    BENCHMARK_BACKEND_CM256,
+    BENCHMARK_BACKEND_LUGI_RS,
+    BENCHMARK_BACKEND_WIREHAIR,
+    NUM_BENCHMARK_BACKENDS,
+} BenchmarkBackend;
+
+typedef enum {
+    LOSS_PATTERN_NONE,
+    // Every segment is lost independently
+    LOSS_PATTERN_RANDOM,
+    // Segments are lost in bursts, as a two-state Markov chain
+    LOSS_PATTERN_BURST,
+    NUM_LOSS_PATTERNS,
+} LossPattern;
+
+// The loss rate of LOSS_PATTERN_RANDOM
+#define RANDOM_LOSS_RATE 0.05
+// The chances of a burst starting after a received segment, and ending after a lost one,
+// which average to bursts of 4 segments and a loss rate of about 7%
+#define BURST_START_RATE 0.02
+#define BURST_END_RATE 0.25
+
+typedef struct {
+    BenchmarkBackend backend;
+    Gf256CpuPath cpu_path;
+    int num_real_buffers;
+    double fec_ratio;
+    int segment_size;
+    LossPattern loss_pattern;
+} BenchmarkConfig;
+
+typedef struct {
+    double p50;
+    double p90;
+    double p99;
+    // In MB/s of original data
+    double throughput;
+} LatencyStats;
+
+typedef struct {
+    int num_fec_buffers;
+    int frame_size;
+    int num_frames;
+    int num_recovered;
+    double loss_rate;
+    // In milliseconds per frame
+    LatencyStats encode;
+    // Only over the recovered frames
+    LatencyStats decode;
+} BenchmarkResult;
+
+/*
+============================
+Globals
+============================
+*/
+
+static const int group_sizes[] = {8, 32, 128, 512};
+static const double fec_ratios[] = {0.1, 0.3};
+static const int segment_sizes[] = {500, 1280};
+
+static int num_frames = 200;
+static int seed = 1;
+static const char *json_file;
+
+COMMAND_LINE_INT_OPTION(num_frames, 'n', "frames", 1, 1000000,
+                        "Number of frames per configuration (defaults to 200).")
+COMMAND_LINE_INT_OPTION(seed, 0, "seed", 0, INT_MAX, "Seed of the loss patterns (defaults to 1).")
+COMMAND_LINE_STRING_OPTION(json_file, 0, "json-file", 256,
+                           "File to write the JSON results to (defaults to stdout).")
+
+/*
+============================
+Private Functions
+============================
+*/
+
+static const char *backend_to_str(BenchmarkBackend backend) {
+    switch (backend) {
+        case BENCHMARK_BACKEND_CM256: {
+            return "cm256";
+        }
+        case BENCHMARK_BACKEND_LUGI_RS: {
+            return "lugi_rs";
+        }
+        case BENCHMARK_BACKEND_WIREHAIR: {
+            return "wirehair";
+        }
+        default: {
+            return "invalid";
+        }
+    }
+}
+
+static const char *loss_pattern_to_str(LossPattern loss_pattern) {
+    switch (loss_pattern) {
+        case LOSS_PATTERN_NONE: {
+            return "none";
+        }
+        case LOSS_PATTERN_RANDOM: {
+            return "random";
+        }
+        case LOSS_PATTERN_BURST: {
+            return "burst";
+        }
+        default: {
+            return "invalid";
+        }
+    }
+}
+
+// A xorshift generator, so that the loss patterns don't depend on the platform's rand()
+static double next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (double)(*state >> 11) / (double)(1ULL << 53);
+}
+
+static void generate_losses(bool *lost, int num_buffers, LossPattern loss_pattern,
+                            uint64_t *state) {
+    bool in_burst = false;
+    for (int i = 0; i < num_buffers; i++) {
+        switch (loss_pattern) {
+            case LOSS_PATTERN_RANDOM: {
+                lost[i] = next_random(state) < RANDOM_LOSS_RATE;
+                break;
+            }
+            case LOSS_PATTERN_BURST: {
+                double burst_rate = in_burst ? 1.0 - BURST_END_RATE : BURST_START_RATE;
+                in_burst = next_random(state) < burst_rate;
+                lost[i] = in_burst;
+                break;
+            }
+            default: {
+                lost[i] = false;
+                break;
+            }
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static LatencyStats compute_latency_stats(double *latencies, int num_latencies, int frame_size) {
+    LatencyStats stats = {0};
+    if (num_latencies == 0) {
+        return stats;
+    }
+
+    qsort(latencies, num_latencies, sizeof(double), compare_doubles);
+    stats.p50 = latencies[(num_latencies - 1) * 50 / 100] * MS_IN_SECOND;
+    stats.p90 = latencies[(num_latencies - 1) * 90 / 100] * MS_IN_SECOND;
+    stats.p99 = latencies[(num_latencies - 1) * 99 / 100] * MS_IN_SECOND;
+
+    double total_time = 0;
+    for (int i = 0; i < num_latencies; i++) {
+        total_time += latencies[i];
+    }
+    stats.throughput =
+        (double)frame_size * num_latencies / total_time / (BYTES_IN_KILOBYTE * BYTES_IN_KILOBYTE);
+    return stats;
+}
+
+static BenchmarkResult run_benchmark(const BenchmarkConfig *config) {
+    BenchmarkResult result = {0};
+    int num_real_buffers = config->num_real_buffers;
+    int num_fec_buffers = get_num_fec_packets(num_real_buffers, config->fec_ratio);
+    int num_buffers = num_real_buffers + num_fec_buffers;
+    // The largest frame that fits in exactly num_real_buffers segments
+    int frame_size = num_real_buffers * (config->segment_size - FEC_HEADER_SIZE);
+    FECCodec codec = config->backend == BENCHMARK_BACKEND_WIREHAIR ? FEC_CODEC_WIREHAIR
+                                                                     : FEC_CODEC_REED_SOLOMON;
+
+    result.num_fec_buffers = num_fec_buffers;
+    result.frame_size = frame_size;
+    result.num_frames = num_frames;
+
+    char *frame = safe_malloc(frame_size);
+    char *decoded_frame = safe_malloc(frame_size);
+    void **buffers = safe_malloc(num_buffers * sizeof(void *));
+    int *buffer_sizes = safe_malloc(num_buffers * sizeof(int));
+    bool *lost = safe_malloc(num_buffers * sizeof(bool));
+    double *encode_latencies = safe_malloc(num_frames * sizeof(double));
+    double *decode_latencies = safe_malloc(num_frames * sizeof(double));
+
+    uint64_t random_state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)seed;
+    int num_lost = 0;
+    for (int i = 0; i < frame_size; i++) {
+        frame[i] = (char)(next_random(&random_state) * 256);
+    }
+
+    for (int frame_id = 0; frame_id < num_frames; frame_id++) {
+        // Vary the frame, so that the caches don't only ever see the same data
+        frame[frame_id % frame_size]++;
+
+        WhistTimer timer;
+        start_timer(&timer);
+        FECEncoder *fec_encoder =
+            create_fec_encoder(num_real_buffers, num_fec_buffers, config->segment_size, codec);
+        fec_encoder_register_buffer(fec_encoder, frame, frame_size);
+        fec_get_encoded_buffers(fec_encoder, buffers, buffer_sizes);
+        encode_latencies[frame_id] = get_timer(&timer);
+
+        generate_losses(lost, num_buffers, config->loss_pattern, &random_state);
+
+        start_timer(&timer);
+        FECDecoder *fec_decoder =
+            create_fec_decoder(num_real_buffers, num_fec_buffers, config->segment_size, codec);
+        int decoded_size = -1;
+        for (int i = 0; i < num_buffers && decoded_size < 0; i++) {
+            if (lost[i]) {
+                num_lost++;
+                continue;
+            }
+            fec_decoder_register_buffer(fec_decoder, i, buffers[i], buffer_sizes[i]);
+            decoded_size = fec_get_decoded_buffer(fec_decoder, NULL);
+        }
+        if (decoded_size >= 0) {
+            fec_get_decoded_buffer(fec_decoder, decoded_frame);
+            decode_latencies[result.num_recovered++] = get_timer(&timer);
+            FATAL_ASSERT(decoded_size == frame_size);
+            FATAL_ASSERT(memcmp(frame, decoded_frame, frame_size) == 0);
+        }
+
+        destroy_fec_decoder(fec_decoder);
+        destroy_fec_encoder(fec_encoder);
+    }
+
+    // Segments that weren't needed to decode a frame aren't counted as lost,
+    // so this is the loss rate the decoder saw, rather than that of the pattern
+    result.loss_rate = (double)num_lost / ((double)num_buffers * num_frames);
+    result.encode = compute_latency_stats(encode_latencies, num_frames, frame_size);
+    result.decode = compute_latency_stats(decode_latencies, result.num_recovered, frame_size);
+
+    free(decode_latencies);
+    free(encode_latencies);
+    free(lost);
+    free(buffer_sizes);
+    free(buffers);
+    free(decoded_frame);
+    free(frame);
+    return result;
+}
+
+static void write_latency_stats_json(FILE *fp, const char *name, const LatencyStats *stats) {
+    fprintf(fp,
+            "\"%s\": {\"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, "
+            "\"throughput_mbps\": %.2f}",
+            name, stats->p50, stats->p90, stats->p99, stats->throughput);
+}
+
+static void write_result_json(FILE *fp, const BenchmarkConfig *config,
+                              const BenchmarkResult *result, bool first) {
+    fprintf(fp, "%s\n    {", first ? "" : ",");
+    fprintf(fp, "\"backend\": \"%s\", \"cpu_path\": \"%s\", ", backend_to_str(config->backend),
+            gf256_cpu_path_to_str(config->cpu_path));
+    fprintf(fp, "\"num_real_buffers\": %d, \"num_fec_buffers\": %d, \"fec_ratio\": %.2f, ",
+            config->num_real_buffers, result->num_fec_buffers, config->fec_ratio);
+    fprintf(fp, "\"segment_size\": %d, \"frame_size\": %d, \"loss_pattern\": \"%s\", ",
+            config->segment_size, result->frame_size, loss_pattern_to_str(config->loss_pattern));
+    fprintf(fp, "\"loss_rate\": %.4f, \"frames\": %d, \"recovered\": %d, ", result->loss_rate,
+            result->num_frames, result->num_recovered);
+    write_latency_stats_json(fp, "encode", &result->encode);
+    fprintf(fp, ", ");
+    write_latency_stats_json(fp, "decode", &result->decode);
+    fprintf(fp, "}");
+}
+
+static void log_result(const BenchmarkConfig *config, const BenchmarkResult *result) {
+    LOG_INFO(
+        "%-8s %-8s k=%-4d n=%-4d seg=%-4d loss=%-6s | encode p50=%.3fms p99=%.3fms %.0fMB/s | "
+        "decode p50=%.3fms p99=%.3fms %.0fMB/s recovered=%d/%d",
+        backend_to_str(config->backend), gf256_cpu_path_to_str(config->cpu_path),
+        config->num_real_buffers, result->num_fec_buffers, config->segment_size,
+        loss_pattern_to_str(config->loss_pattern), result->encode.p50, result->encode.p99,
+        result->encode.throughput, result->decode.p50, result->decode.p99,
+        result->decode.throughput, result->num_recovered, result->num_frames);
+}
+
+/*
+============================
+Main
+============================
+*/
+
+int main(int argc, const char **argv) {
+    WhistStatus err = whist_parse_command_line(argc, argv, NULL);
+    if (err != WHIST_SUCCESS) {
+        LOG_ERROR("Failed to parse command line: %s.", whist_error_string(err));
+        return 1;
+    }
+
+    whist_init_subsystems();
+
+    FILE *fp = stdout;
+    if (json_file) {
+        fp = fopen(json_file, "w");
+        if (!fp) {
+            LOG_ERROR("Failed to open %s for writing.", json_file);
+            return 1;
+        }
+    }
+
+    CpuInfo cpu_info = gf256_get_cpuinfo();
+    fprintf(fp, "{\"cpu_type\": \"%s\", \"frames\": %d, \"seed\": %d, \"results\": [",
+            cpu_type_to_str(cpu_info.cpu_type), num_frames, seed);
+
+    // Paths the CPU doesn't support are skipped. lugi_rs doesn't use gf256,
+    // so it only runs on the path that gf256 would pick anyway
+    const Gf256CpuPath cpu_paths[] = {GF256_CPU_PATH_GFNI, GF256_CPU_PATH_AVX512,
+                                      GF256_CPU_PATH_AVX2, GF256_CPU_PATH_SSSE3,
+                                      GF256_CPU_PATH_NEON, GF256_CPU_PATH_PORTABLE};
+    const Gf256CpuPath auto_cpu_path[] = {GF256_CPU_PATH_AUTO};
+    bool first = true;
+    for (int backend = 0; backend < NUM_BENCHMARK_BACKENDS; backend++) {
+        bool uses_gf256 = backend != BENCHMARK_BACKEND_LUGI_RS;
+        const Gf256CpuPath *backend_cpu_paths = uses_gf256 ? cpu_paths : auto_cpu_path;
+        size_t num_cpu_paths = uses_gf256 ? ARRAY_LENGTH(cpu_paths) : ARRAY_LENGTH(auto_cpu_path);
+        rs_wrapper_set_implementation(uses_gf256 ? CM256 : LUGI_RS);
+        for (size_t p = 0; p < num_cpu_paths; p++) {
+            if (!gf256_force_cpu_path(backend_cpu_paths[p])) {
+                continue;
+            }
+            for (size_t k = 0; k < ARRAY_LENGTH(group_sizes); k++) {
+                for (size_t r = 0; r < ARRAY_LENGTH(fec_ratios); r++) {
+                    for (size_t s = 0; s < ARRAY_LENGTH(segment_sizes); s++) {
+                        for (int loss = 0; loss < NUM_LOSS_PATTERNS; loss++) {
+                            BenchmarkConfig config = {
+                                .backend = backend,
+                                .cpu_path = backend_cpu_paths[p],
+                                .num_real_buffers = group_sizes[k],
+                                .fec_ratio = fec_ratios[r],
+                                .segment_size = segment_sizes[s],
+                                .loss_pattern = loss,
+                            };
+                            BenchmarkResult result = run_benchmark(&config);
+                            log_result(&config, &result);
+                            write_result_json(fp, &config, &result, first);
+                            first = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    gf256_force_cpu_path(GF256_CPU_PATH_AUTO);
+    rs_wrapper_set_implementation(CM256);
+
+    fprintf(fp, "\n]}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    destroy_logger();
+    return 0;
+}
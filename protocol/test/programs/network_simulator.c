@@ -0,0 +1,1199 @@
+/**
+ * Copyright 2022 Whist Technologies, Inc.
+ * @file network_simulator.c
+ * @brief Trace-driven network simulator for congestion control and FEC.
+============================
+Usage
+============================
+
+WhistNetworkSimulator streams synthetic video frames over a simulated link, and reports how well
+congestion control used it, as a summary in the log and as JSON:
+
+    WhistNetworkSimulator --trace lte.down --delay-ms 20 --loss-rate 0.01 --duration 60
+
+The trace is a Mahimahi packet delivery trace: each line is the time in milliseconds of an
+opportunity to deliver one MTU-sized packet, and the trace repeats once it ends. Without a trace,
+the link has a constant --bandwidth-kbps. Like Mahimahi, packets are lost at random as they enter
+the link, wait in its queue for a delivery opportunity, and then arrive after the one-way delay.
+The queue is unlimited, unless --queue-packets makes it drop-tail.
+
+Everything runs in a single thread on a simulated clock (see start_simulated_clock), so runs are
+deterministic and take seconds. The server side sends its segments through the real egress
+scheduler and network throttler, answers NACKs from its sent frames, sends an intra frame for
+stream resets, and sends probe parity and then duplicates while asked to saturate the bandwidth.
+The client side receives into the real ring buffer, and runs the congestion feedback and the
+congestion controller just like udp.cpp does. Pings, NACKs, stream resets and network settings go
+back to the server after the one-way delay, without loss or a bandwidth limit.
+
+The reported metrics are:
+- convergence_time_sec: how long the video bitrate took to first get between
+  CONVERGENCE_THRESHOLD_LOW of the target and the target, which is the lower of the link capacity
+  and the highest bitrate that was ever picked
+- utilization: the fraction of the link's delivery opportunities that carried data
+- average_queueing_delay_ms: how long packets waited in the link's queue
+- frame_latency: percentiles of the time from capture to being ready to render, for every
+  rendered frame
+
+The congestion controller is picked with --congestion-control, so that algorithms can be compared
+on the same trace.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+#include <whist/core/whist_frame.h>
+#include <whist/fec/fec.h>
+#include <whist/network/network.h>
+#include <whist/network/network_algorithm.h>
+#include <whist/fec/fec_controller.h>
+#include <whist/network/congestion_feedback.h>
+#include <whist/network/egress_scheduler.h>
+#include <whist/network/ringbuffer.h>
+#include <whist/network/throttle.h>
+#include <whist/network/udp.h>
+#include <whist/utils/clock.h>
+#include <whist/utils/command_line.h>
+#include <whist/utils/linked_list.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// Every Mahimahi delivery opportunity is for an MTU-sized packet
+#define LINK_MTU 1500
+// The IP, UDP and Whist headers that are sent along with every segment
+#define SEGMENT_OVERHEAD_BYTES 64
+#define PONG_SIZE_BYTES 64
+// The simulated clock starts far enough from zero that timers can be adjusted backwards
+#define SIMULATION_START_TIME ((timestamp_us)1000 * US_IN_SECOND)
+// How often the client nacks, renders and pings, like its UDP update loop
+#define CLIENT_UPDATE_INTERVAL_US 1000
+// These match udp.cpp
+#define PING_INTERVAL_US (10 * US_IN_MS)
+#define PONG_CONGESTION_SEC 0.5
+#define NETWORK_SETTINGS_RESEND_SEC 1.0
+// This matches client/sync_packets.cpp
+#define VIDEO_RING_BUFFER_SIZE 256
+// How much larger an intra frame is than the frames that follow it
+#define INTRA_FRAME_SIZE_RATIO 4
+
+typedef enum {
+    SIM_PACKET_SEGMENT,
+    SIM_PACKET_PONG,
+} SimPacketType;
+
+// A packet on its way from the server to the client
+typedef struct {
+    LINKED_LIST_HEADER;
+    SimPacketType type;
+    // The size on the link, in bytes
+    int size;
+    int group_id;
+    timestamp_us enqueue_time;
+    // For pongs, when the client sent the ping
+    timestamp_us ping_send_time;
+    // For segments, only the first segment.segment_size bytes of data are used
+    WhistSegment segment;
+} SimPacket;
+
+typedef enum {
+    // A packet came out of the link, and reached the client after the delay
+    SIM_EVENT_CLIENT_RECEIVE,
+    SIM_EVENT_CLIENT_UPDATE,
+    SIM_EVENT_SERVER_RECEIVE_PING,
+    SIM_EVENT_SERVER_RECEIVE_NACK,
+    SIM_EVENT_SERVER_RECEIVE_STREAM_RESET,
+    SIM_EVENT_SERVER_RECEIVE_NETWORK_SETTINGS,
+} SimEventType;
+
+typedef struct {
+    timestamp_us time;
+    // Events of the same time run in the order that they were scheduled in
+    uint64_t order;
+    SimEventType type;
+    SimPacket *packet;
+    timestamp_us ping_send_time;
+    int id;
+    int index;
+    NetworkSettings network_settings;
+} SimEvent;
+
+typedef struct {
+    LINKED_LIST_HEADER;
+    int id;
+    int index;
+    timestamp_us arrival_time;
+} SimNack;
+
+// The segments of a sent frame, kept to answer NACKs and to send duplicates from
+typedef struct {
+    int id;
+    int num_segments;
+    int segments_capacity;
+    WhistSegment *segments;
+} SentFrame;
+
+typedef struct {
+    timestamp_us time;
+    int bitrate;
+} BitrateChange;
+
+typedef struct {
+    // The trace's delivery opportunities, in milliseconds, which repeat every period_ms
+    uint32_t *opportunities_ms;
+    int num_opportunities;
+    uint32_t period_ms;
+    // The next delivery opportunity, and the start of its repetition of the trace
+    int next_opportunity;
+    uint64_t repetition_start_ms;
+    LinkedList queue;
+} SimLink;
+
+typedef struct {
+    NetworkThrottleContext *throttler;
+    EgressScheduler *egress_scheduler;
+    NetworkSettings network_settings;
+    int last_frame_id;
+    SentFrame sent_frames[VIDEO_NACKBUFFER_SIZE];
+    LinkedList pending_nacks;
+    bool pending_stream_reset;
+    int greatest_failed_id;
+    int last_start_of_stream_id;
+    // Duplicates and probe parity sent since the last frame, and which indices go next
+    int num_duplicates;
+    int duplicate_index;
+    int probe_parity_index;
+} SimServer;
+
+typedef struct {
+    RingBuffer *ring_buffer;
+    CongestionFeedback feedback;
+    NetworkSettings network_settings;
+    void *fec_controller;
+    CongestionController *congestion_controller;
+    WhistTimer last_network_settings_send_timer;
+    WhistTimer last_pong_timer;
+    timestamp_us last_ping_time;
+} SimClient;
+
+typedef struct {
+    uint64_t delivered_bytes;
+    uint64_t total_queueing_delay_us;
+    int delivered_packets;
+    int lost_packets;
+    int dropped_packets;
+    int frames_captured;
+    int frames_skipped;
+    int frames_rendered;
+    int stream_resets;
+    int nacks;
+    int duplicates;
+    int probe_parity;
+    // Segments that the egress scheduler dropped as stale
+    int stale_packets;
+    double *frame_latencies;
+    int frame_latencies_capacity;
+    BitrateChange *bitrate_changes;
+    int num_bitrate_changes;
+    int bitrate_changes_capacity;
+} SimStats;
+
+/*
+============================
+Globals
+============================
+*/
+
+static const char *trace_file;
+static int bandwidth_kbps = 20000;
+static int delay_ms = 10;
+static double loss_rate = 0.0;
+static int queue_packets = 0;
+static int duration_sec = 60;
+static int fps = 60;
+static int width = 1920;
+static int height = 1080;
+static int dpi = 192;
+static double fec_ratio = -1.0;
+static int seed = 1;
+static const char *json_file;
+
+COMMAND_LINE_STRING_OPTION(trace_file, 't', "trace", 256,
+                           "Mahimahi packet delivery trace of the link (defaults to a link of "
+                           "constant bandwidth).")
+COMMAND_LINE_INT_OPTION(bandwidth_kbps, 'b', "bandwidth-kbps", 12, INT_MAX,
+                        "Bandwidth of the link when there's no trace (defaults to 20000).")
+COMMAND_LINE_INT_OPTION(delay_ms, 0, "delay-ms", 0, 10000,
+                        "One-way delay of the link, in both directions (defaults to 10).")
+COMMAND_LINE_INT_OPTION(queue_packets, 0, "queue-packets", 0, INT_MAX,
+                        "Drop-tail queue limit of the link, or 0 to not limit it (defaults to 0).")
+COMMAND_LINE_INT_OPTION(duration_sec, 'd', "duration", 1, 86400,
+                        "Number of seconds to simulate (defaults to 60).")
+COMMAND_LINE_INT_OPTION(fps, 0, "fps", 1, 1000, "Frames per second (defaults to 60).")
+COMMAND_LINE_INT_OPTION(width, 0, "width", 1, 8192, "Video width (defaults to 1920).")
+COMMAND_LINE_INT_OPTION(height, 0, "height", 1, 8192, "Video height (defaults to 1080).")
+COMMAND_LINE_INT_OPTION(dpi, 0, "dpi", 1, 1000, "Screen DPI (defaults to 192).")
+COMMAND_LINE_INT_OPTION(seed, 0, "seed", 0, INT_MAX, "Seed of the random losses (defaults to 1).")
+COMMAND_LINE_STRING_OPTION(json_file, 0, "json-file", 256,
+                           "File to write the JSON results to (defaults to stdout).")
+
+static WhistStatus set_ratio_option(double *ratio, double max_ratio, const char *value) {
+    char *end;
+    double parsed = strtod(value, &end);
+    if (end == value || *end != '\0' || parsed < 0.0 || parsed > max_ratio) {
+        return WHIST_ERROR_OUT_OF_RANGE;
+    }
+    *ratio = parsed;
+    return WHIST_SUCCESS;
+}
+
+static WhistStatus set_loss_rate_option(const WhistCommandLineOption *opt, const char *value) {
+    return set_ratio_option(&loss_rate, 1.0, value);
+}
+
+static WhistStatus set_fec_ratio_option(const WhistCommandLineOption *opt, const char *value) {
+    return set_ratio_option(&fec_ratio, MAX_FEC_RATIO, value);
+}
+
+COMMAND_LINE_CALLBACK_OPTION(set_loss_rate_option, 'l', "loss-rate", WHIST_OPTION_REQUIRED_ARGUMENT,
+                             "Fraction of the packets that the link loses (defaults to 0).")
+COMMAND_LINE_CALLBACK_OPTION(set_fec_ratio_option, 0, "fec-ratio", WHIST_OPTION_REQUIRED_ARGUMENT,
+                             "Send video with this FEC ratio, instead of the one that the "
+                             "network settings ask for.")
+
+static SimEvent *events;
+static int num_events;
+static int events_capacity;
+static uint64_t next_event_order;
+
+static SimLink sim_link;
+static SimServer server;
+static SimClient client;
+static SimStats stats;
+static uint64_t random_state;
+static timestamp_us end_time;
+// Set once the simulation is over, so that later sleeps don't run it any further
+static bool simulation_finished;
+
+/*
+============================
+Private Functions
+============================
+*/
+
+// A xorshift generator, so that the losses don't depend on the platform's rand()
+static double next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (double)(random_state >> 11) / (double)(1ULL << 53);
+}
+
+static bool event_before(const SimEvent *a, const SimEvent *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void schedule_event(SimEvent event) {
+    if (num_events == events_capacity) {
+        events_capacity = max(2 * events_capacity, 1024);
+        events = safe_realloc(events, sizeof(SimEvent) * events_capacity);
+    }
+    event.order = next_event_order++;
+    // Sift up the binary heap
+    int i = num_events++;
+    while (i > 0 && event_before(&event, &events[(i - 1) / 2])) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = event;
+}
+
+static SimEvent pop_event(void) {
+    SimEvent top = events[0];
+    SimEvent last = events[--num_events];
+    // Sift down the binary heap
+    int i = 0;
+    while (2 * i + 1 < num_events) {
+        int child = 2 * i + 1;
+        if (child + 1 < num_events && event_before(&events[child + 1], &events[child])) {
+            child++;
+        }
+        if (!event_before(&events[child], &last)) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+static void schedule_at_server(SimEvent event) {
+    event.time = current_time_us() + (timestamp_us)delay_ms * US_IN_MS;
+    schedule_event(event);
+}
+
+static bool load_trace(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        LOG_ERROR("Failed to open trace %s.", filename);
+        return false;
+    }
+    int capacity = 0;
+    unsigned long opportunity_ms;
+    while (fscanf(fp, "%lu", &opportunity_ms) == 1) {
+        if (sim_link.num_opportunities > 0 &&
+            opportunity_ms < sim_link.opportunities_ms[sim_link.num_opportunities - 1]) {
+            LOG_ERROR("Trace %s isn't sorted at line %d.", filename,
+                      sim_link.num_opportunities + 1);
+            fclose(fp);
+            return false;
+        }
+        if (sim_link.num_opportunities == capacity) {
+            capacity = max(2 * capacity, 4096);
+            sim_link.opportunities_ms =
+                safe_realloc(sim_link.opportunities_ms, sizeof(uint32_t) * capacity);
+        }
+        sim_link.opportunities_ms[sim_link.num_opportunities++] = (uint32_t)opportunity_ms;
+    }
+    fclose(fp);
+    if (sim_link.num_opportunities == 0 ||
+        sim_link.opportunities_ms[sim_link.num_opportunities - 1] == 0) {
+        LOG_ERROR("Trace %s must have opportunities after 0ms.", filename);
+        return false;
+    }
+    // Like Mahimahi, the trace repeats from its last opportunity
+    sim_link.period_ms = sim_link.opportunities_ms[sim_link.num_opportunities - 1];
+    return true;
+}
+
+// A one second trace, with the opportunities spread evenly
+static void generate_constant_trace(int kbps) {
+    sim_link.num_opportunities = max(kbps / (LINK_MTU * (int)BITS_IN_BYTE / 1000), 1);
+    sim_link.opportunities_ms = safe_malloc(sizeof(uint32_t) * sim_link.num_opportunities);
+    for (int i = 0; i < sim_link.num_opportunities; i++) {
+        sim_link.opportunities_ms[i] =
+            (uint32_t)(((uint64_t)i + 1) * MS_IN_SECOND / sim_link.num_opportunities);
+    }
+    sim_link.period_ms = MS_IN_SECOND;
+}
+
+static timestamp_us link_next_opportunity_time(void) {
+    uint64_t opportunity_ms =
+        sim_link.repetition_start_ms + sim_link.opportunities_ms[sim_link.next_opportunity];
+    return SIMULATION_START_TIME + opportunity_ms * US_IN_MS;
+}
+
+static void link_skip_opportunity(void) {
+    if (++sim_link.next_opportunity == sim_link.num_opportunities) {
+        sim_link.next_opportunity = 0;
+        sim_link.repetition_start_ms += sim_link.period_ms;
+    }
+}
+
+static double link_capacity_bps(void) {
+    return (double)sim_link.num_opportunities * LINK_MTU * BITS_IN_BYTE * MS_IN_SECOND /
+           sim_link.period_ms;
+}
+
+static void link_send(SimPacket *packet) {
+    if (next_random() < loss_rate) {
+        stats.lost_packets++;
+        free(packet);
+        return;
+    }
+    if (queue_packets > 0 && linked_list_size(&sim_link.queue) >= queue_packets) {
+        stats.dropped_packets++;
+        free(packet);
+        return;
+    }
+    timestamp_us now = current_time_us();
+    // Opportunities that passed while the queue was empty went unused
+    if (linked_list_size(&sim_link.queue) == 0) {
+        while (link_next_opportunity_time() < now) {
+            link_skip_opportunity();
+        }
+    }
+    packet->enqueue_time = now;
+    linked_list_add_tail(&sim_link.queue, packet);
+}
+
+// Use the current delivery opportunity, which is now
+static void link_deliver(void) {
+    timestamp_us now = current_time_us();
+    int remaining_bytes = LINK_MTU;
+    SimPacket *packet;
+    while ((packet = linked_list_head(&sim_link.queue)) != NULL &&
+           packet->size <= remaining_bytes) {
+        linked_list_remove(&sim_link.queue, packet);
+        remaining_bytes -= packet->size;
+        stats.delivered_bytes += packet->size;
+        stats.delivered_packets++;
+        stats.total_queueing_delay_us += now - packet->enqueue_time;
+        SimEvent event = {0};
+        event.type = SIM_EVENT_CLIENT_RECEIVE;
+        event.time = now + (timestamp_us)delay_ms * US_IN_MS;
+        event.packet = packet;
+        schedule_event(event);
+    }
+    link_skip_opportunity();
+}
+
+static void record_bitrate(int bitrate) {
+    if (stats.num_bitrate_changes == stats.bitrate_changes_capacity) {
+        stats.bitrate_changes_capacity = max(2 * stats.bitrate_changes_capacity, 64);
+        stats.bitrate_changes = safe_realloc(
+            stats.bitrate_changes, sizeof(BitrateChange) * stats.bitrate_changes_capacity);
+    }
+    BitrateChange *change = &stats.bitrate_changes[stats.num_bitrate_changes++];
+    change->time = current_time_us();
+    change->bitrate = bitrate;
+}
+
+static void record_frame_latency(double latency) {
+    if (stats.frames_rendered == stats.frame_latencies_capacity) {
+        stats.frame_latencies_capacity = max(2 * stats.frame_latencies_capacity, 1024);
+        stats.frame_latencies =
+            safe_realloc(stats.frame_latencies, sizeof(double) * stats.frame_latencies_capacity);
+    }
+    stats.frame_latencies[stats.frames_rendered++] = latency;
+}
+
+/*
+============================
+Server
+============================
+*/
+
+static void server_apply_network_settings(NetworkSettings network_settings) {
+    if (network_settings.video_bitrate != server.network_settings.video_bitrate) {
+        record_bitrate(network_settings.video_bitrate);
+    }
+    server.network_settings = network_settings;
+    network_throttler_set_burst_bitrate(server.throttler, network_settings.burst_bitrate);
+}
+
+static void server_send_segment(const WhistSegment *segment, int group_id, bool is_a_nack,
+                                bool is_a_duplicate) {
+    SimPacket *packet = safe_malloc(sizeof(SimPacket));
+    packet->type = SIM_PACKET_SEGMENT;
+    packet->size = segment->segment_size + SEGMENT_OVERHEAD_BYTES;
+    packet->group_id = group_id;
+    packet->segment = *segment;
+    packet->segment.departure_time = current_time_us();
+    packet->segment.is_a_nack = is_a_nack;
+    packet->segment.is_a_duplicate = is_a_duplicate;
+    link_send(packet);
+}
+
+// Move the NACKs that arrived to the egress scheduler as retransmits, like udp_queue_pending_nacks
+static bool server_queue_pending_nacks(void) {
+    bool queued = false;
+    SimNack *nack;
+    while ((nack = linked_list_extract_head(&server.pending_nacks)) != NULL) {
+        EgressPacket egress_packet = {nack->id, nack->index, nack->arrival_time, 0};
+        if (!egress_scheduler_enqueue(server.egress_scheduler, EGRESS_CLASS_RETRANSMIT,
+                                      &egress_packet)) {
+            LOG_WARNING("Too many NACKs are queued, dropping the NACK for %d %d", nack->id,
+                        nack->index);
+        }
+        free(nack);
+        queued = true;
+    }
+    return queued;
+}
+
+// Schedule the new frame's segments from first_index up to end_index as one batch, like
+// udp_schedule_frame_segments
+static int server_schedule_frame_segments(const SentFrame *frame, int first_index, int end_index,
+                                          size_t *packet_sizes, timestamp_us *departure_times) {
+    if (first_index == end_index) {
+        return -1;
+    }
+    for (int i = first_index; i < end_index; i++) {
+        packet_sizes[i] = (size_t)(frame->segments[i].segment_size + SEGMENT_OVERHEAD_BYTES);
+    }
+    return network_throttler_schedule_batch(server.throttler, &packet_sizes[first_index],
+                                            end_index - first_index, &departure_times[first_index]);
+}
+
+// Give the departure times of the new frame's segments from first_index up to end_index back to
+// the throttler, like udp_release_frame_segments
+static void server_release_frame_segments(const size_t *packet_sizes, int first_index,
+                                          int end_index) {
+    size_t bytes = 0;
+    for (int i = first_index; i < end_index; i++) {
+        bytes += packet_sizes[i];
+    }
+    network_throttler_release_bytes(server.throttler, bytes);
+}
+
+// Send everything that the egress scheduler holds, like udp_send_egress_packets. The new frame's
+// segments up to frame_end_index are scheduled as one batch, and the rest of them are only
+// rescheduled when a retransmit cuts in front of them or one of them is stale. Returns how many
+// probes were sent.
+static int server_send_egress_packets(const SentFrame *new_frame, int frame_end_index) {
+    size_t *packet_sizes = NULL;
+    timestamp_us *departure_times = NULL;
+    int frame_group_id = -1;
+    bool frame_is_scheduled = false;
+    if (new_frame != NULL) {
+        packet_sizes = safe_malloc(sizeof(size_t) * frame_end_index);
+        departure_times = safe_malloc(sizeof(timestamp_us) * frame_end_index);
+        frame_group_id = server_schedule_frame_segments(new_frame, 0, frame_end_index,
+                                                        packet_sizes, departure_times);
+        frame_is_scheduled = true;
+    }
+    // The next segment of the new frame that'll be dequeued
+    int next_frame_index = 0;
+    int num_probes_sent = 0;
+
+    while (true) {
+        // NACKs that arrived in the meantime cut in front of what's left of the frame
+        server_queue_pending_nacks();
+        EgressPacket egress_packet;
+        EgressClass egress_class;
+        bool is_stale;
+        if (!egress_scheduler_dequeue(server.egress_scheduler, current_time_us(),
+                                      server.greatest_failed_id, &egress_packet, &egress_class,
+                                      &is_stale)) {
+            break;
+        }
+        bool is_new = egress_class == EGRESS_CLASS_VIDEO || egress_class == EGRESS_CLASS_FEC;
+        if (is_new) {
+            FATAL_ASSERT(new_frame != NULL && egress_packet.id == new_frame->id &&
+                         egress_packet.index == next_frame_index);
+            next_frame_index++;
+            // Only stale once late for its departure, like in udp_send_egress_packets
+            if (!is_stale && frame_is_scheduled) {
+                is_stale = current_time_us() > departure_times[egress_packet.index] +
+                                                   EGRESS_VIDEO_DEADLINE_MS * US_IN_MS;
+            }
+        }
+        SentFrame *frame = &server.sent_frames[egress_packet.id % VIDEO_NACKBUFFER_SIZE];
+        if (frame->id != egress_packet.id || egress_packet.index >= frame->num_segments) {
+            // The frame was overwritten since
+            continue;
+        }
+        if (is_stale) {
+            stats.stale_packets++;
+            if (is_new && frame_is_scheduled) {
+                server_release_frame_segments(packet_sizes, egress_packet.index, frame_end_index);
+                frame_is_scheduled = false;
+            }
+            continue;
+        }
+
+        const WhistSegment *segment = &frame->segments[egress_packet.index];
+        timestamp_us departure_time;
+        int group_id;
+        if (is_new) {
+            if (!frame_is_scheduled) {
+                frame_group_id =
+                    server_schedule_frame_segments(new_frame, egress_packet.index, frame_end_index,
+                                                   packet_sizes, departure_times);
+                frame_is_scheduled = true;
+            }
+            departure_time = departure_times[egress_packet.index];
+            group_id = frame_group_id;
+        } else {
+            if (frame_is_scheduled && next_frame_index < frame_end_index) {
+                server_release_frame_segments(packet_sizes, next_frame_index, frame_end_index);
+                frame_is_scheduled = false;
+            }
+            size_t packet_size = (size_t)(segment->segment_size + SEGMENT_OVERHEAD_BYTES);
+            group_id = network_throttler_schedule_batch(server.throttler, &packet_size, 1,
+                                                        &departure_time);
+        }
+        network_throttler_wait_until(server.throttler, departure_time);
+        server_send_segment(segment, group_id, egress_class == EGRESS_CLASS_RETRANSMIT,
+                            egress_class == EGRESS_CLASS_PROBE);
+        if (egress_class == EGRESS_CLASS_PROBE) {
+            num_probes_sent++;
+        }
+    }
+    free(departure_times);
+    free(packet_sizes);
+    return num_probes_sent;
+}
+
+static bool server_handle_pending_nacks(void) {
+    bool queued = server_queue_pending_nacks();
+    server_send_egress_packets(NULL, 0);
+    return queued;
+}
+
+// Send the frame's probe parity, and then duplicates, like multithreaded_send_video_packets
+static void server_send_duplicate(void) {
+    SentFrame *frame = &server.sent_frames[server.last_frame_id % VIDEO_NACKBUFFER_SIZE];
+    bool is_probe_parity = server.probe_parity_index < frame->num_segments;
+    int index;
+    if (is_probe_parity) {
+        index = server.probe_parity_index++;
+    } else {
+        server.duplicate_index %= frame->num_segments;
+        index = server.duplicate_index++;
+    }
+    EgressPacket egress_packet = {frame->id, index, current_time_us(), 0};
+    if (!egress_scheduler_enqueue(server.egress_scheduler, EGRESS_CLASS_PROBE, &egress_packet)) {
+        return;
+    }
+    // This drains the queue, so the probe was either sent or dropped. Only the probes that went
+    // out are counted, like in udp_send_egress_packets.
+    if (server_send_egress_packets(NULL, 0) > 0) {
+        server.num_duplicates++;
+        if (is_probe_parity) {
+            stats.probe_parity++;
+        } else {
+            stats.duplicates++;
+        }
+    }
+}
+
+// Split a frame into segments like udp_send_packet_chunks, and keep them to resend from
+static SentFrame *server_segment_frame(VideoFrameType frame_type, timestamp_us capture_time) {
+    int id = ++server.last_frame_id;
+    int videodata_length = (int)(server.network_settings.video_bitrate / BITS_IN_BYTE / fps);
+    if (frame_type == VIDEO_FRAME_TYPE_INTRA) {
+        videodata_length *= INTRA_FRAME_SIZE_RATIO;
+    }
+    videodata_length = min(max(videodata_length, 1), MAX_VIDEOFRAME_DATA_SIZE);
+
+    int payload_size = (int)sizeof(VideoFrame) + videodata_length;
+    int whist_packet_size = (int)PACKET_HEADER_SIZE + payload_size;
+    char *whist_packet_buffer = safe_zalloc(whist_packet_size);
+    WhistPacket *whist_packet = (WhistPacket *)whist_packet_buffer;
+    whist_packet->type = PACKET_VIDEO;
+    whist_packet->id = id;
+    whist_packet->payload_size = payload_size;
+    VideoFrame *video_frame = (VideoFrame *)whist_packet->data;
+    video_frame->width = width;
+    video_frame->height = height;
+    video_frame->codec_type = server.network_settings.desired_codec;
+    video_frame->frame_type = frame_type;
+    video_frame->frame_id = id;
+    video_frame->is_window_visible = true;
+    video_frame->videodata_length = videodata_length;
+    video_frame->server_timestamp = capture_time;
+
+    int segment_size = MAX_PACKET_SEGMENT_SIZE;
+    double frame_fec_ratio = fec_ratio >= 0.0 ? fec_ratio : server.network_settings.video_fec_ratio;
+    int num_indices_if_use_fec = fec_encoder_get_num_real_buffers(whist_packet_size, segment_size);
+    int num_fec_packets = 0;
+    if (frame_fec_ratio > 0.0) {
+        num_fec_packets = get_num_fec_packets(num_indices_if_use_fec, frame_fec_ratio);
+    }
+    // Probe parity, only for frames that have FEC anyway, like udp_send_payload_chunks
+    int num_probe_packets = 0;
+    if (server.network_settings.saturate_bandwidth &&
+        server.network_settings.video_probe_ratio > 0.0 && num_fec_packets > 0) {
+        double fec_ratio_with_probes =
+            min(frame_fec_ratio + server.network_settings.video_probe_ratio, MAX_FEC_RATIO);
+        num_probe_packets =
+            max(get_num_fec_packets(num_indices_if_use_fec, fec_ratio_with_probes) -
+                    num_fec_packets,
+                0);
+        num_fec_packets += num_probe_packets;
+    }
+    int num_indices = num_fec_packets > 0 ? num_indices_if_use_fec
+                                          : int_div_roundup(whist_packet_size, segment_size);
+    int num_total_packets = num_indices + num_fec_packets;
+
+    char **buffers = safe_malloc(sizeof(char *) * num_total_packets);
+    int *buffer_sizes = safe_malloc(sizeof(int) * num_total_packets);
+    FECEncoder *fec_encoder = NULL;
+    if (num_fec_packets > 0) {
+        fec_encoder = create_fec_encoder(num_indices, num_fec_packets, segment_size,
+                                         fec_get_codec(num_indices));
+        fec_encoder_register_buffer(fec_encoder, whist_packet_buffer, whist_packet_size);
+        fec_get_encoded_buffers(fec_encoder, (void **)buffers, buffer_sizes);
+    } else {
+        for (int i = 0; i < num_indices; i++) {
+            buffers[i] = whist_packet_buffer + i * segment_size;
+            buffer_sizes[i] = min(whist_packet_size - i * segment_size, segment_size);
+        }
+    }
+
+    SentFrame *frame = &server.sent_frames[id % VIDEO_NACKBUFFER_SIZE];
+    if (frame->segments_capacity < num_total_packets) {
+        frame->segments_capacity = num_total_packets;
+        frame->segments =
+            safe_realloc(frame->segments, sizeof(WhistSegment) * frame->segments_capacity);
+    }
+    frame->id = id;
+    frame->num_segments = num_total_packets;
+    for (int i = 0; i < num_total_packets; i++) {
+        WhistSegment *segment = &frame->segments[i];
+        segment->whist_type = PACKET_VIDEO;
+        segment->departure_time = 0;
+        segment->id = id;
+        segment->index = (unsigned short)i;
+        segment->num_indices = (unsigned short)num_total_packets;
+        segment->num_fec_indices = (unsigned short)num_fec_packets;
+        segment->num_probe_indices = (unsigned short)num_probe_packets;
+        segment->segment_size = (unsigned short)buffer_sizes[i];
+        segment->segment_stride = (unsigned short)segment_size;
+        segment->prev_frame_num_duplicates = (unsigned short)server.num_duplicates;
+        segment->is_a_nack = false;
+        segment->is_a_duplicate = false;
+        memcpy(segment->segment_data, buffers[i], buffer_sizes[i]);
+    }
+
+    if (fec_encoder) {
+        destroy_fec_encoder(fec_encoder);
+    }
+    free(buffer_sizes);
+    free(buffers);
+    free(whist_packet_buffer);
+    return frame;
+}
+
+static void server_send_frame(VideoFrameType frame_type, timestamp_us capture_time) {
+    SentFrame *frame = server_segment_frame(frame_type, capture_time);
+    if (VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(frame_type)) {
+        server.last_start_of_stream_id = frame->id;
+    }
+    server.num_duplicates = 0;
+    server.duplicate_index = 0;
+    server.probe_parity_index = frame->num_segments - frame->segments[0].num_probe_indices;
+
+    // Queue the whole frame but its probe parity, and send it along with any NACKs, like
+    // udp_send_video_segments
+    int num_original_segments = frame->num_segments - frame->segments[0].num_fec_indices;
+    for (int i = 0; i < server.probe_parity_index; i++) {
+        EgressPacket egress_packet = {frame->id, i, current_time_us(), 0};
+        bool queued = egress_scheduler_enqueue(
+            server.egress_scheduler,
+            i < num_original_segments ? EGRESS_CLASS_VIDEO : EGRESS_CLASS_FEC, &egress_packet);
+        FATAL_ASSERT(queued);
+    }
+    server_send_egress_packets(frame, server.probe_parity_index);
+}
+
+/*
+============================
+Client
+============================
+*/
+
+static void client_send_network_settings(void) {
+    SimEvent event = {0};
+    event.type = SIM_EVENT_SERVER_RECEIVE_NETWORK_SETTINGS;
+    event.network_settings = client.network_settings;
+    schedule_at_server(event);
+    start_timer(&client.last_network_settings_send_timer);
+}
+
+static void client_nack_packet(SocketContext *socket_context, WhistPacketType frame_type, int id,
+                               int index) {
+    SimEvent event = {0};
+    event.type = SIM_EVENT_SERVER_RECEIVE_NACK;
+    event.id = id;
+    event.index = index;
+    schedule_at_server(event);
+    stats.nacks++;
+}
+
+static void client_request_stream_reset(SocketContext *socket_context, WhistPacketType frame_type,
+                                        int last_failed_id) {
+    SimEvent event = {0};
+    event.type = SIM_EVENT_SERVER_RECEIVE_STREAM_RESET;
+    event.id = last_failed_id;
+    schedule_at_server(event);
+}
+
+// The congestion path of udp_handle_received_packet and udp_congestion_control
+static void client_receive_segment(SimPacket *packet) {
+    timestamp_us arrival_time = current_time_us();
+    WhistSegment *segment = &packet->segment;
+    CongestionFeedback *feedback = &client.feedback;
+    congestion_feedback_add_incoming_bits(feedback, arrival_time,
+                                          (int)(packet->size * BITS_IN_BYTE));
+    GroupStats curr_group_stats;
+    GroupStats prev_group_stats;
+    if (!segment->is_a_nack && !segment->is_a_duplicate &&
+        congestion_feedback_add_group_sample(feedback, segment->departure_time, arrival_time,
+                                             packet->group_id, &curr_group_stats,
+                                             &prev_group_stats)) {
+        int incoming_bitrate = congestion_feedback_get_incoming_bitrate(feedback, arrival_time);
+        double packet_loss_ratio =
+            get_packet_loss_ratio(client.ring_buffer, feedback->short_term_latency);
+        if (ENABLE_FEC) {
+            fec_controller_feed_latency(client.fec_controller, get_timestamp_sec(),
+                                        feedback->short_term_latency);
+        }
+        congestion_controller_on_rtt(client.congestion_controller, feedback->short_term_latency,
+                                     feedback->long_term_latency);
+        congestion_controller_on_loss(client.congestion_controller, packet_loss_ratio);
+        if (congestion_controller_on_group_feedback(client.congestion_controller,
+                                                    &curr_group_stats, &prev_group_stats,
+                                                    incoming_bitrate, &client.network_settings)) {
+            client_send_network_settings();
+        }
+    }
+    ring_buffer_receive_segment(client.ring_buffer, segment);
+}
+
+// Render every frame that's ready, catching up to recovery points like udp_get_packet
+static void client_render(void) {
+    RingBuffer *ring_buffer = client.ring_buffer;
+    for (int i = ring_buffer->max_id;
+         i >= max(max(0, ring_buffer->last_rendered_id + 1),
+                  ring_buffer->max_id - ring_buffer->ring_buffer_size - 10);
+         i--) {
+        if (is_ready_to_render(ring_buffer, i)) {
+            FrameData *frame_data = get_frame_at_id(ring_buffer, i);
+            VideoFrame *video_frame = (VideoFrame *)((WhistPacket *)frame_data->frame_buffer)->data;
+            if (VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(video_frame->frame_type)) {
+                reset_stream(ring_buffer, i);
+                break;
+            }
+        }
+    }
+
+    while (is_ready_to_render(ring_buffer, ring_buffer->last_rendered_id + 1)) {
+        FrameData *frame_data = set_rendering(ring_buffer, ring_buffer->last_rendered_id + 1);
+        VideoFrame *video_frame = (VideoFrame *)((WhistPacket *)frame_data->frame_buffer)->data;
+        record_frame_latency((double)(current_time_us() - video_frame->server_timestamp) /
+                             US_IN_SECOND);
+    }
+}
+
+// What udp_update does on the client, besides receiving
+static void client_update(void) {
+    timestamp_us now = current_time_us();
+    if (now - client.last_ping_time >= PING_INTERVAL_US) {
+        SimEvent event = {0};
+        event.type = SIM_EVENT_SERVER_RECEIVE_PING;
+        event.ping_send_time = now;
+        schedule_at_server(event);
+        client.last_ping_time = now;
+    }
+
+    if (get_timer(&client.last_pong_timer) > PONG_CONGESTION_SEC &&
+        congestion_controller_handle_severe_congestion(client.congestion_controller,
+                                                       &client.network_settings)) {
+        client_send_network_settings();
+    }
+
+    WhistTimer current_time;
+    start_timer(&current_time);
+    try_recovering_missing_packets_or_frames(client.ring_buffer,
+                                             client.feedback.short_term_latency, 0,
+                                             &client.network_settings, &current_time);
+    client_render();
+
+    // Resend the network settings periodically, like udp_congestion_control
+    if (get_timer(&client.last_network_settings_send_timer) > NETWORK_SETTINGS_RESEND_SEC) {
+        client_send_network_settings();
+    }
+}
+
+/*
+============================
+Simulation
+============================
+*/
+
+static void handle_event(SimEvent *event) {
+    switch (event->type) {
+        case SIM_EVENT_CLIENT_RECEIVE: {
+            SimPacket *packet = event->packet;
+            if (packet->type == SIM_PACKET_SEGMENT) {
+                client_receive_segment(packet);
+            } else {
+                start_timer(&client.last_pong_timer);
+                double rtt = (double)(current_time_us() - packet->ping_send_time) / US_IN_SECOND;
+                congestion_feedback_add_rtt(&client.feedback, rtt,
+                                            client.network_settings.congestion_detected);
+            }
+            free(packet);
+            break;
+        }
+        case SIM_EVENT_CLIENT_UPDATE: {
+            client_update();
+            event->time += CLIENT_UPDATE_INTERVAL_US;
+            schedule_event(*event);
+            break;
+        }
+        case SIM_EVENT_SERVER_RECEIVE_PING: {
+            // Pongs aren't queued, so they're answered right away, and only take their share of
+            // the throttler's budget
+            SimPacket *pong = safe_malloc(sizeof(SimPacket));
+            pong->type = SIM_PACKET_PONG;
+            pong->size = PONG_SIZE_BYTES;
+            pong->group_id = -1;
+            pong->ping_send_time = event->ping_send_time;
+            network_throttler_charge_bytes(server.throttler, PONG_SIZE_BYTES);
+            link_send(pong);
+            break;
+        }
+        case SIM_EVENT_SERVER_RECEIVE_NACK: {
+            // NACKs wait for the server's send loop, since they go through the throttler
+            SimNack *nack = safe_malloc(sizeof(SimNack));
+            nack->id = event->id;
+            nack->index = event->index;
+            nack->arrival_time = event->time;
+            linked_list_add_tail(&server.pending_nacks, nack);
+            break;
+        }
+        case SIM_EVENT_SERVER_RECEIVE_STREAM_RESET: {
+            server.greatest_failed_id = max(server.greatest_failed_id, event->id);
+            if (server.greatest_failed_id > server.last_start_of_stream_id) {
+                server.pending_stream_reset = true;
+            }
+            break;
+        }
+        case SIM_EVENT_SERVER_RECEIVE_NETWORK_SETTINGS: {
+            server_apply_network_settings(event->network_settings);
+            break;
+        }
+    }
+}
+
+// The simulated clock's sleep handler, which runs everything that happens until target_time.
+// The server's send loop is the only thing that sleeps, so this runs the link and the client,
+// and queues up what the server receives for the send loop.
+static void run_simulation_until(void *data, timestamp_us target_time) {
+    if (simulation_finished) {
+        return;
+    }
+    while (true) {
+        bool link_is_next = false;
+        timestamp_us next_time = num_events > 0 ? events[0].time : UINT64_MAX;
+        if (linked_list_size(&sim_link.queue) > 0 && link_next_opportunity_time() <= next_time) {
+            next_time = link_next_opportunity_time();
+            link_is_next = true;
+        }
+        if (next_time > target_time) {
+            break;
+        }
+        set_simulated_time(max(next_time, current_time_us()));
+        if (link_is_next) {
+            link_deliver();
+        } else {
+            SimEvent event = pop_event();
+            handle_event(&event);
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double get_convergence_time(double capacity_bps) {
+    int highest_bitrate = 0;
+    for (int i = 0; i < stats.num_bitrate_changes; i++) {
+        highest_bitrate = max(highest_bitrate, stats.bitrate_changes[i].bitrate);
+    }
+    double target_bitrate = min(capacity_bps, (double)highest_bitrate);
+    for (int i = 0; i < stats.num_bitrate_changes; i++) {
+        int bitrate = stats.bitrate_changes[i].bitrate;
+        if (bitrate >= CONVERGENCE_THRESHOLD_LOW * target_bitrate && bitrate <= target_bitrate) {
+            return (double)(stats.bitrate_changes[i].time - SIMULATION_START_TIME) / US_IN_SECOND;
+        }
+    }
+    return -1.0;
+}
+
+// The time-weighted average of the video bitrate
+static double get_average_bitrate(void) {
+    double total = 0.0;
+    for (int i = 0; i < stats.num_bitrate_changes; i++) {
+        timestamp_us until =
+            i + 1 < stats.num_bitrate_changes ? stats.bitrate_changes[i + 1].time : end_time;
+        total += (double)stats.bitrate_changes[i].bitrate *
+                 (double)(until - stats.bitrate_changes[i].time);
+    }
+    return total / (double)(end_time - SIMULATION_START_TIME);
+}
+
+static void write_results(FILE *fp) {
+    double capacity_bps = link_capacity_bps();
+    double capacity_bytes = capacity_bps / BITS_IN_BYTE * duration_sec;
+    double convergence_time = get_convergence_time(capacity_bps);
+    double average_bitrate = get_average_bitrate();
+    double utilization = stats.delivered_bytes / capacity_bytes;
+    double average_queueing_delay =
+        stats.delivered_packets > 0
+            ? (double)stats.total_queueing_delay_us / stats.delivered_packets / US_IN_MS
+            : 0.0;
+
+    double p50 = 0.0, p90 = 0.0, p99 = 0.0;
+    int n = stats.frames_rendered;
+    if (n > 0) {
+        qsort(stats.frame_latencies, n, sizeof(double), compare_doubles);
+        p50 = stats.frame_latencies[(n - 1) * 50 / 100] * MS_IN_SECOND;
+        p90 = stats.frame_latencies[(n - 1) * 90 / 100] * MS_IN_SECOND;
+        p99 = stats.frame_latencies[(n - 1) * 99 / 100] * MS_IN_SECOND;
+    }
+
+    LOG_INFO(
+        "Link %.0fkbps, delay %dms, loss %.2f%% | converged in %.2fs, average bitrate %.0fkbps, "
+        "utilization %.1f%%, queueing delay %.1fms | frame latency p50=%.1fms p90=%.1fms "
+        "p99=%.1fms, rendered %d/%d, stream resets %d",
+        capacity_bps / 1000, delay_ms, loss_rate * 100, convergence_time, average_bitrate / 1000,
+        utilization * 100, average_queueing_delay, p50, p90, p99, stats.frames_rendered,
+        stats.frames_captured, stats.stream_resets);
+
+    fprintf(fp, "{\"trace\": \"%s\", \"duration_sec\": %d, ", trace_file ? trace_file : "",
+            duration_sec);
+    fprintf(fp, "\"link_capacity_kbps\": %.1f, \"delay_ms\": %d, \"loss_rate\": %.4f, ",
+            capacity_bps / 1000, delay_ms, loss_rate);
+    fprintf(fp, "\"convergence_time_sec\": %.3f, \"average_bitrate_kbps\": %.1f, ",
+            convergence_time, average_bitrate / 1000);
+    fprintf(fp, "\"utilization\": %.4f, \"average_queueing_delay_ms\": %.3f, ", utilization,
+            average_queueing_delay);
+    fprintf(fp, "\"frame_latency\": {\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f}, ",
+            p50, p90, p99);
+    fprintf(fp, "\"frames_captured\": %d, \"frames_skipped\": %d, \"frames_rendered\": %d, ",
+            stats.frames_captured, stats.frames_skipped, stats.frames_rendered);
+    fprintf(fp, "\"stream_resets\": %d, \"nacks\": %d, \"duplicates\": %d, ", stats.stream_resets,
+            stats.nacks, stats.duplicates);
+    fprintf(fp, "\"probe_parity\": %d, \"stale_packets\": %d, ", stats.probe_parity,
+            stats.stale_packets);
+    fprintf(fp, "\"packets_lost\": %d, \"packets_dropped\": %d}\n", stats.lost_packets,
+            stats.dropped_packets);
+}
+
+/*
+============================
+Main
+============================
+*/
+
+int main(int argc, const char **argv) {
+    WhistStatus err = whist_parse_command_line(argc, argv, NULL);
+    if (err != WHIST_SUCCESS) {
+        LOG_ERROR("Failed to parse command line: %s.", whist_error_string(err));
+        return 1;
+    }
+
+    whist_init_subsystems();
+
+    if (trace_file) {
+        if (!load_trace(trace_file)) {
+            return 1;
+        }
+    } else {
+        generate_constant_trace(bandwidth_kbps);
+    }
+    FILE *fp = stdout;
+    if (json_file) {
+        fp = fopen(json_file, "w");
+        if (!fp) {
+            LOG_ERROR("Failed to open %s for writing.", json_file);
+            return 1;
+        }
+    }
+    random_state = (uint64_t)seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    // From here on, time only moves when the server's send loop sleeps
+    start_simulated_clock(SIMULATION_START_TIME, run_simulation_until, NULL);
+    end_time = SIMULATION_START_TIME + (timestamp_us)duration_sec * US_IN_SECOND;
+    network_algo_set_dimensions(width, height);
+    network_algo_set_dpi(dpi);
+
+    server.throttler = network_throttler_create(UDP_NETWORK_THROTTLER_GROUP_MS);
+    // Enough for every segment of every frame that NACKs are answered from
+    server.egress_scheduler =
+        egress_scheduler_create(MAX_PACKETS, VIDEO_NACKBUFFER_SIZE * MAX_VIDEO_PACKETS);
+    server.network_settings = get_starting_network_settings();
+    server_apply_network_settings(server.network_settings);
+    record_bitrate(server.network_settings.video_bitrate);
+
+    client.ring_buffer =
+        init_ring_buffer(PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, VIDEO_RING_BUFFER_SIZE, NULL,
+                         client_nack_packet, NULL, client_request_stream_reset);
+    congestion_feedback_init(&client.feedback);
+    client.network_settings = get_starting_network_settings();
+    client.fec_controller = create_fec_controller(get_timestamp_sec());
+    client.congestion_controller = create_congestion_controller(NULL, client.fec_controller);
+    if (client.congestion_controller == NULL) {
+        return 1;
+    }
+    start_timer(&client.last_pong_timer);
+    client.last_ping_time = 0;
+    client_send_network_settings();
+    SimEvent update_event = {0};
+    update_event.type = SIM_EVENT_CLIENT_UPDATE;
+    update_event.time = SIMULATION_START_TIME;
+    schedule_event(update_event);
+
+    // The server's send loop, like multithreaded_send_video_packets. Frames are captured at a
+    // fixed rate, and the ones captured while the previous frame was still being sent are
+    // skipped, as the encoder would.
+    timestamp_us frame_interval = US_IN_SECOND / fps;
+    timestamp_us next_frame_time = SIMULATION_START_TIME;
+    while (current_time_us() < end_time) {
+        timestamp_us now = current_time_us();
+        if (now >= next_frame_time) {
+            while (next_frame_time + frame_interval <= now) {
+                next_frame_time += frame_interval;
+                stats.frames_captured++;
+                stats.frames_skipped++;
+            }
+            timestamp_us capture_time = next_frame_time;
+            next_frame_time += frame_interval;
+            stats.frames_captured++;
+
+            VideoFrameType frame_type = VIDEO_FRAME_TYPE_NORMAL;
+            if (server.last_frame_id == 0 || server.pending_stream_reset) {
+                frame_type = VIDEO_FRAME_TYPE_INTRA;
+                if (server.pending_stream_reset) {
+                    stats.stream_resets++;
+                }
+                server.pending_stream_reset = false;
+            }
+            server_send_frame(frame_type, capture_time);
+        } else if (server_handle_pending_nacks()) {
+            continue;
+        } else if (server.network_settings.saturate_bandwidth) {
+            server_send_duplicate();
+        } else {
+            whist_usleep((uint32_t)(next_frame_time - now));
+        }
+    }
+    simulation_finished = true;
+
+    write_results(fp);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    destroy_congestion_controller(client.congestion_controller);
+    destroy_fec_controller(client.fec_controller);
+    destroy_ring_buffer(client.ring_buffer);
+    egress_scheduler_destroy(server.egress_scheduler);
+    network_throttler_destroy(server.throttler);
+    for (int i = 0; i < VIDEO_NACKBUFFER_SIZE; i++) {
+        free(server.sent_frames[i].segments);
+    }
+    SimNack *nack;
+    while ((nack = linked_list_extract_head(&server.pending_nacks)) != NULL) {
+        free(nack);
+    }
+    SimPacket *packet;
+    while ((packet = linked_list_extract_head(&sim_link.queue)) != NULL) {
+        free(packet);
+    }
+    for (int i = 0; i < num_events; i++) {
+        free(events[i].packet);
+    }
+    free(events);
+    free(sim_link.opportunities_ms);
+    free(stats.frame_latencies);
+    free(stats.bitrate_changes);
+
+    destroy_logger();
+    return 0;
+}
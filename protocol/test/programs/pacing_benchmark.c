@@ -0,0 +1,323 @@
+/**
+ * Copyright 2022 Whist Technologies, Inc.
+ * @file pacing_benchmark.c
+ * @brief Network throttler pacing benchmark.
+============================
+Usage
+============================
+
+WhistPacingBenchmark paces synthetic video frames through the network throttler over a loopback
+UDP socket, the way udp_send_segments_batched does without SO_TXTIME, and measures how evenly the
+segments arrive. For each bitrate, it reports percentiles of the inter-packet jitter, which is how
+far the gap between two consecutive segments of a frame is from their ideal gap at the bitrate,
+and of how late each segment was sent after its departure time, as a table in the log and as JSON:
+
+    WhistPacingBenchmark --frames 600 --json-file pacing_benchmark.json
+
+The JSON is written to stdout when no file is given. Loopback has no bottleneck of its own, so the
+jitter is that of the sender: the timer, the syscalls and the scheduler.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+#include <whist/network/network.h>
+#include <whist/network/throttle.h>
+#include <whist/network/udp.h>
+#include <whist/utils/clock.h>
+#include <whist/utils/command_line.h>
+#include <whist/utils/threads.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// Frames only fill this much of what the bitrate could carry, so that the throttler goes idle
+// between frames, like it does whenever the encoder undershoots
+#define FRAME_LOAD 0.5
+// How long the receiver waits for a segment before it gives up on the rest
+#define RECEIVE_TIMEOUT_MS 500
+// Large enough for the receiver to never drop a burst of late segments
+#define RECEIVE_BUFFER_SIZE (1 << 22)
+
+// The start of every segment, the rest is padding
+typedef struct {
+    int sequence_number;
+    int frame_id;
+} BenchmarkSegmentHeader;
+
+typedef struct {
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} PercentileStats;
+
+typedef struct {
+    int num_segments;
+    int num_received;
+    // In microseconds, between consecutive segments of the same frame
+    PercentileStats jitter;
+    // In microseconds, of every segment
+    PercentileStats send_lateness;
+} BenchmarkResult;
+
+typedef struct {
+    SOCKET socket;
+    int num_segments;
+    timestamp_us *arrival_times;
+} Receiver;
+
+/*
+============================
+Globals
+============================
+*/
+
+static const int bitrates_kbps[] = {5000, 20000, 50000, 100000};
+
+static int num_frames = 600;
+static int fps = 60;
+static int segment_size = 1280;
+static const char *json_file;
+
+COMMAND_LINE_INT_OPTION(num_frames, 'n', "frames", 1, 1000000,
+                        "Number of frames per bitrate (defaults to 600).")
+COMMAND_LINE_INT_OPTION(fps, 0, "fps", 1, 1000, "Frames per second (defaults to 60).")
+COMMAND_LINE_INT_OPTION(segment_size, 0, "segment-size", (int)sizeof(BenchmarkSegmentHeader),
+                        1400, "Size of every segment in bytes (defaults to 1280).")
+COMMAND_LINE_STRING_OPTION(json_file, 0, "json-file", 256,
+                           "File to write the JSON results to (defaults to stdout).")
+
+/*
+============================
+Private Functions
+============================
+*/
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static PercentileStats compute_percentile_stats(double *values, int num_values) {
+    PercentileStats stats = {0};
+    if (num_values == 0) {
+        return stats;
+    }
+
+    qsort(values, num_values, sizeof(double), compare_doubles);
+    stats.p50 = values[(num_values - 1) * 50 / 100];
+    stats.p90 = values[(num_values - 1) * 90 / 100];
+    stats.p99 = values[(num_values - 1) * 99 / 100];
+    stats.max = values[num_values - 1];
+    return stats;
+}
+
+static int receiver_thread(void *opaque) {
+    Receiver *receiver = (Receiver *)opaque;
+    char buffer[1500];
+    while (true) {
+        int len = recv_no_intr(receiver->socket, buffer, sizeof(buffer), 0);
+        timestamp_us arrival_time = current_time_us();
+        if (len < (int)sizeof(BenchmarkSegmentHeader)) {
+            // Timed out, so the sender is done
+            break;
+        }
+        BenchmarkSegmentHeader header;
+        memcpy(&header, buffer, sizeof(header));
+        if (header.sequence_number < 0) {
+            // The sender is done
+            break;
+        }
+        if (header.sequence_number < receiver->num_segments) {
+            receiver->arrival_times[header.sequence_number] = arrival_time;
+        }
+    }
+    return 0;
+}
+
+static bool create_loopback_sockets(SOCKET *send_socket, SOCKET *recv_socket) {
+    *recv_socket = socketp_udp();
+    *send_socket = socketp_udp();
+    if (*recv_socket == INVALID_SOCKET || *send_socket == INVALID_SOCKET) {
+        LOG_ERROR("Failed to create the UDP sockets: %d", get_last_network_error());
+        return false;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+    int buffer_size = RECEIVE_BUFFER_SIZE;
+    if (bind(*recv_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(*recv_socket, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        connect(*send_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        LOG_ERROR("Failed to connect the loopback sockets: %d", get_last_network_error());
+        return false;
+    }
+    if (setsockopt(*recv_socket, SOL_SOCKET, SO_RCVBUF, (const char *)&buffer_size,
+                   sizeof(buffer_size)) != 0) {
+        LOG_WARNING("Failed to grow the receive buffer: %d", get_last_network_error());
+    }
+    set_timeout(*recv_socket, RECEIVE_TIMEOUT_MS);
+    return true;
+}
+
+static BenchmarkResult run_benchmark(int bitrate_kbps) {
+    BenchmarkResult result = {0};
+    int bitrate = bitrate_kbps * 1000;
+    int frame_size = (int)(FRAME_LOAD * bitrate / BITS_IN_BYTE / fps);
+    int segments_per_frame = max(frame_size / segment_size, 1);
+    int num_segments = num_frames * segments_per_frame;
+    result.num_segments = num_segments;
+
+    SOCKET send_socket, recv_socket;
+    if (!create_loopback_sockets(&send_socket, &recv_socket)) {
+        return result;
+    }
+
+    char *segment = safe_zalloc(segment_size);
+    size_t *packet_sizes = safe_malloc(segments_per_frame * sizeof(size_t));
+    timestamp_us *departure_times = safe_malloc(num_segments * sizeof(timestamp_us));
+    timestamp_us *send_times = safe_malloc(num_segments * sizeof(timestamp_us));
+    Receiver receiver = {recv_socket, num_segments,
+                         safe_zalloc(num_segments * sizeof(timestamp_us))};
+    double *jitters = safe_malloc(num_segments * sizeof(double));
+    double *send_lateness = safe_malloc(num_segments * sizeof(double));
+    for (int i = 0; i < segments_per_frame; i++) {
+        packet_sizes[i] = (size_t)segment_size;
+    }
+
+    WhistThread thread = whist_create_thread(receiver_thread, "PacingBenchmarkReceiver", &receiver);
+    NetworkThrottleContext *throttler = network_throttler_create(UDP_NETWORK_THROTTLER_GROUP_MS);
+    network_throttler_set_burst_bitrate(throttler, bitrate);
+
+    timestamp_us frame_interval = US_IN_SECOND / fps;
+    timestamp_us next_frame_time = current_time_us();
+    for (int frame_id = 0; frame_id < num_frames; frame_id++) {
+        network_throttler_wait_until(throttler, next_frame_time);
+        next_frame_time += frame_interval;
+
+        // Pace the frame like udp_send_segments_batched, sending every segment that's due
+        int first = frame_id * segments_per_frame;
+        network_throttler_schedule_batch(throttler, packet_sizes, segments_per_frame,
+                                         &departure_times[first]);
+        for (int i = first; i < first + segments_per_frame; i++) {
+            network_throttler_wait_until(throttler, departure_times[i]);
+            BenchmarkSegmentHeader header = {i, frame_id};
+            memcpy(segment, &header, sizeof(header));
+            send_times[i] = current_time_us();
+            send(send_socket, segment, (size_t)segment_size, 0);
+        }
+    }
+    // Tell the receiver that we're done, in case it's still waiting
+    BenchmarkSegmentHeader done = {-1, -1};
+    memcpy(segment, &done, sizeof(done));
+    send(send_socket, segment, (size_t)segment_size, 0);
+    whist_wait_thread(thread, NULL);
+
+    double ideal_gap_us = (double)segment_size * BITS_IN_BYTE * US_IN_SECOND / bitrate;
+    int num_jitters = 0;
+    for (int i = 0; i < num_segments; i++) {
+        send_lateness[i] = (double)(send_times[i] - departure_times[i]);
+        if (receiver.arrival_times[i] == 0) {
+            continue;
+        }
+        result.num_received++;
+        // The gap to the previous segment only counts within a frame
+        if (i % segments_per_frame != 0 && receiver.arrival_times[i - 1] != 0) {
+            double gap_us = (double)receiver.arrival_times[i] - receiver.arrival_times[i - 1];
+            jitters[num_jitters++] = fabs(gap_us - ideal_gap_us);
+        }
+    }
+    result.jitter = compute_percentile_stats(jitters, num_jitters);
+    result.send_lateness = compute_percentile_stats(send_lateness, num_segments);
+
+    network_throttler_destroy(throttler);
+    closesocket(send_socket);
+    closesocket(recv_socket);
+    free(send_lateness);
+    free(jitters);
+    free(receiver.arrival_times);
+    free(send_times);
+    free(departure_times);
+    free(packet_sizes);
+    free(segment);
+    return result;
+}
+
+static void write_percentile_stats_json(FILE *fp, const char *name, const PercentileStats *stats) {
+    fprintf(fp, "\"%s\": {\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+            name, stats->p50, stats->p90, stats->p99, stats->max);
+}
+
+static void write_result_json(FILE *fp, int bitrate_kbps, const BenchmarkResult *result,
+                              bool first) {
+    fprintf(fp, "%s\n    {", first ? "" : ",");
+    fprintf(fp, "\"bitrate_kbps\": %d, \"segments\": %d, \"received\": %d, ", bitrate_kbps,
+            result->num_segments, result->num_received);
+    write_percentile_stats_json(fp, "jitter", &result->jitter);
+    fprintf(fp, ", ");
+    write_percentile_stats_json(fp, "send_lateness", &result->send_lateness);
+    fprintf(fp, "}");
+}
+
+static void log_result(int bitrate_kbps, const BenchmarkResult *result) {
+    LOG_INFO(
+        "%6dkbps received=%d/%d | jitter p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus | "
+        "send lateness p50=%.1fus p99=%.1fus max=%.1fus",
+        bitrate_kbps, result->num_received, result->num_segments, result->jitter.p50,
+        result->jitter.p90, result->jitter.p99, result->jitter.max, result->send_lateness.p50,
+        result->send_lateness.p99, result->send_lateness.max);
+}
+
+/*
+============================
+Main
+============================
+*/
+
+int main(int argc, const char **argv) {
+    WhistStatus err = whist_parse_command_line(argc, argv, NULL);
+    if (err != WHIST_SUCCESS) {
+        LOG_ERROR("Failed to parse command line: %s.", whist_error_string(err));
+        return 1;
+    }
+
+    whist_init_subsystems();
+    whist_init_networking();
+
+    FILE *fp = stdout;
+    if (json_file) {
+        fp = fopen(json_file, "w");
+        if (!fp) {
+            LOG_ERROR("Failed to open %s for writing.", json_file);
+            return 1;
+        }
+    }
+
+    fprintf(fp, "{\"frames\": %d, \"fps\": %d, \"segment_size\": %d, \"results\": [", num_frames,
+            fps, segment_size);
+    for (size_t i = 0; i < ARRAY_LENGTH(bitrates_kbps); i++) {
+        BenchmarkResult result = run_benchmark(bitrates_kbps[i]);
+        log_result(bitrates_kbps[i], &result);
+        write_result_json(fp, bitrates_kbps[i], &result, i == 0);
+    }
+
+    fprintf(fp, "\n]}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    destroy_logger();
+    return 0;
+}
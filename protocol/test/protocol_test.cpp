@@ -35,6 +35,10 @@ extern "C" {
 #include <whist/core/whist_string.h>
 #include <whist/utils/os_utils.h>
 #include <whist/network/ringbuffer.h>
+#include <whist/network/segment_header.h>
+#include <whist/network/egress_scheduler.h>
+#include <whist/network/transport_feedback.h>
+#include <whist/network/throttle.h>
 #include <client/audio.h>
 #include <client/frontend/frontend.h>
 #include <client/frontend/sdl/common.h>
@@ -59,7 +63,10 @@ extern "C" {
 #include <whist/utils/command_line.h>
 #include <whist/fec/fec.h>
 #include <whist/fec/rs_wrapper.h>
+#include <whist/fec/gf256/gf256_cpuinfo.h>
+#include <whist/fec/gf256/gf256.h>
 #include <whist/fec/fec_controller.h>
+#include <whist/video/ltr.h>
 #include "whist/utils/string_buffer.h"
 #include <whist/fec/wirehair_test.h>
 #include "whist/core/error_codes.h"
@@ -74,6 +81,10 @@ char* get_error_monitor_environment(void);
 char* get_error_monitor_session_id(void);
 }
 
+#if OS_IS(OS_LINUX)
+#include <sys/resource.h>
+#endif
+
 int get_debug_console_listen_port();
 
 class ProtocolTest : public CaptureStdoutFixture {};
@@ -471,6 +482,54 @@ TEST_F(ProtocolTest, RecvNoIntr) {
 }
 #endif
 
+#if OS_IS(OS_LINUX)
+// Test that recvmmsg_no_intr drains every queued datagram in one call.
+TEST_F(ProtocolTest, RecvMMsgBatch) {
+    int ret;
+    int socks[2];
+    ret = socketpair(AF_UNIX, SOCK_DGRAM, 0, socks);
+    EXPECT_EQ(ret, 0);
+
+    // Queue up datagrams of different sizes
+    const int num_sent = 5;
+    char send_buf[num_sent + 1] = {0};
+    for (int i = 0; i < num_sent; i++) {
+        ret = (int)send(socks[1], send_buf, i + 1, 0);
+        EXPECT_EQ(ret, i + 1);
+    }
+
+    char recv_bufs[8][16];
+    struct iovec iovecs[8];
+    struct mmsghdr msgs[8];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < 8; i++) {
+        iovecs[i].iov_base = recv_bufs[i];
+        iovecs[i].iov_len = sizeof(recv_bufs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Every queued datagram should come back in order, with a single call
+    set_timeout(socks[0], 100);
+    ret = recvmmsg_no_intr(socks[0], msgs, 8, MSG_WAITFORONE);
+    EXPECT_EQ(ret, num_sent);
+    for (int i = 0; i < num_sent; i++) {
+        EXPECT_EQ((int)msgs[i].msg_len, i + 1);
+    }
+
+    // With nothing queued, the socket timeout should still be respected
+    WhistTimer timer;
+    start_timer(&timer);
+    ret = recvmmsg_no_intr(socks[0], msgs, 8, MSG_WAITFORONE);
+    EXPECT_EQ(ret, -1);
+    EXPECT_EQ(errno, EAGAIN);
+    EXPECT_GE(get_timer(&timer), 0.1);
+
+    close(socks[0]);
+    close(socks[1]);
+}
+#endif
+
 /*
 ============================
 Whist Library Tests
@@ -802,6 +861,188 @@ TEST_F(ProtocolTest, BadDecrypt) {
     check_stdout_line(::testing::HasSubstr("OpenSSL Error caught"));
 }
 
+// This test encrypts a batch of packets with an AES session, decrypts them with both the
+// session and decrypt_packet, and confirms that a failed decryption doesn't break the session
+TEST_F(ProtocolTest, AESSessionEncryptAndDecrypt) {
+#define NUM_SESSION_PACKETS 8
+    AESSession* session = aes_session_create(DEFAULT_BINARY_PRIVATE_KEY);
+    ASSERT_TRUE(session != NULL);
+
+    char plaintexts[NUM_SESSION_PACKETS][1200];
+    char encrypted[NUM_SESSION_PACKETS][1200 + MAX_ENCRYPTION_SIZE_INCREASE];
+    char decrypted[NUM_SESSION_PACKETS][1200];
+    AESMetadata aes_metadata[NUM_SESSION_PACKETS];
+    AESPacket packets[NUM_SESSION_PACKETS] = {};
+
+    // Encrypt packets of differing sizes in a single batch
+    for (int i = 0; i < NUM_SESSION_PACKETS; i++) {
+        memset(plaintexts[i], 'a' + i, sizeof(plaintexts[i]));
+        packets[i].input = plaintexts[i];
+        packets[i].input_len = 1200 - i * 100;
+        packets[i].output = encrypted[i];
+        packets[i].output_buffer_len = sizeof(encrypted[i]);
+        packets[i].aes_metadata = &aes_metadata[i];
+    }
+    EXPECT_EQ(aes_session_encrypt_packets(session, packets, NUM_SESSION_PACKETS),
+              NUM_SESSION_PACKETS);
+
+    // Every packet gets its own IV
+    EXPECT_NE(memcmp(aes_metadata[0].iv, aes_metadata[1].iv, IV_SIZE), 0);
+
+    // A packet from the session can be decrypted by decrypt_packet, and vice versa
+    int decrypted_len = decrypt_packet(decrypted[0], sizeof(decrypted[0]), aes_metadata[0],
+                                       encrypted[0], packets[0].output_len,
+                                       DEFAULT_BINARY_PRIVATE_KEY);
+    EXPECT_EQ(decrypted_len, 1200);
+    EXPECT_EQ(memcmp(decrypted[0], plaintexts[0], 1200), 0);
+
+    AESMetadata single_metadata;
+    int encrypted_len = encrypt_packet(encrypted[0], &single_metadata, plaintexts[0], 1200,
+                                       DEFAULT_BINARY_PRIVATE_KEY);
+    decrypted_len = aes_session_decrypt_packet(session, decrypted[0], sizeof(decrypted[0]),
+                                               &single_metadata, encrypted[0], encrypted_len);
+    EXPECT_EQ(decrypted_len, 1200);
+    EXPECT_EQ(memcmp(decrypted[0], plaintexts[0], 1200), 0);
+
+    // Corrupt the tag of one packet in the batch, only that packet should fail
+    aes_metadata[3].tag[0] ^= 0xFF;
+    for (int i = 0; i < NUM_SESSION_PACKETS; i++) {
+        packets[i].input = encrypted[i];
+        packets[i].input_len = packets[i].output_len;
+        packets[i].output = decrypted[i];
+        packets[i].output_buffer_len = sizeof(decrypted[i]);
+    }
+    EXPECT_EQ(aes_session_decrypt_packets(session, packets, NUM_SESSION_PACKETS),
+              NUM_SESSION_PACKETS - 1);
+    for (int i = 0; i < NUM_SESSION_PACKETS; i++) {
+        if (i == 3) {
+            EXPECT_EQ(packets[i].output_len, -1);
+        } else {
+            EXPECT_EQ(packets[i].output_len, 1200 - i * 100);
+            EXPECT_EQ(memcmp(decrypted[i], plaintexts[i], packets[i].output_len), 0);
+        }
+    }
+
+    // A prefix is encrypted as if it were contiguous with the input
+    const char* prefix = "prefix";
+    AESPacket prefixed_packet = {};
+    prefixed_packet.prefix = prefix;
+    prefixed_packet.prefix_len = (int)strlen(prefix);
+    prefixed_packet.input = plaintexts[1];
+    prefixed_packet.input_len = 100;
+    prefixed_packet.output = encrypted[0];
+    prefixed_packet.output_buffer_len = sizeof(encrypted[0]);
+    prefixed_packet.aes_metadata = &single_metadata;
+    EXPECT_EQ(aes_session_encrypt_packets(session, &prefixed_packet, 1), 1);
+    decrypted_len = aes_session_decrypt_packet(session, decrypted[0], sizeof(decrypted[0]),
+                                               &single_metadata, encrypted[0],
+                                               prefixed_packet.output_len);
+    EXPECT_EQ(decrypted_len, (int)strlen(prefix) + 100);
+    EXPECT_EQ(memcmp(decrypted[0], prefix, strlen(prefix)), 0);
+    EXPECT_EQ(memcmp(decrypted[0] + strlen(prefix), plaintexts[1], 100), 0);
+
+    aes_session_destroy(session);
+
+    check_stdout_line(::testing::HasSubstr("OpenSSL Error caught"));
+#undef NUM_SESSION_PACKETS
+}
+
+static char split_destination_buffer[1024];
+
+// An AESDestinationFn, that redirects the rest of packets with a non-zero first byte
+static void* test_split_destination(void* opaque, const void* header, int remaining_len) {
+    *(int*)opaque = remaining_len;
+    return ((const char*)header)[0] ? split_destination_buffer : NULL;
+}
+
+// This test decrypts packets in two parts, with and without redirecting the second part
+TEST_F(ProtocolTest, AESSessionDecryptSplit) {
+    AESSession* session = aes_session_create(DEFAULT_BINARY_PRIVATE_KEY);
+    ASSERT_TRUE(session != NULL);
+
+    char plaintext[1000];
+    for (int i = 0; i < (int)sizeof(plaintext); i++) {
+        plaintext[i] = (char)(i % 251 + 1);
+    }
+    char encrypted[sizeof(plaintext) + MAX_ENCRYPTION_SIZE_INCREASE];
+    AESMetadata aes_metadata;
+    int encrypted_len =
+        aes_session_encrypt_packet(session, encrypted, &aes_metadata, plaintext, sizeof(plaintext));
+
+    // The first byte is non-zero, so the rest of the packet is redirected
+    char header[1000];
+    int remaining_len = 0;
+    int decrypted_len = aes_session_decrypt_packet_split(
+        session, header, sizeof(header), 16, test_split_destination, &remaining_len,
+        &aes_metadata, encrypted, encrypted_len);
+    EXPECT_EQ(decrypted_len, 1000);
+    EXPECT_EQ(remaining_len, 1000 - 16);
+    EXPECT_EQ(memcmp(header, plaintext, 16), 0);
+    EXPECT_EQ(memcmp(split_destination_buffer, plaintext + 16, 1000 - 16), 0);
+
+    // Without a destination, the rest lands right after the header
+    plaintext[0] = 0;
+    encrypted_len =
+        aes_session_encrypt_packet(session, encrypted, &aes_metadata, plaintext, sizeof(plaintext));
+    decrypted_len = aes_session_decrypt_packet_split(session, header, sizeof(header), 16,
+                                                     test_split_destination, &remaining_len,
+                                                     &aes_metadata, encrypted, encrypted_len);
+    EXPECT_EQ(decrypted_len, 1000);
+    EXPECT_EQ(memcmp(header, plaintext, sizeof(plaintext)), 0);
+
+    // A bad tag fails the decryption, even though the data was already written
+    aes_metadata.tag[0] ^= 0xFF;
+    decrypted_len = aes_session_decrypt_packet_split(session, header, sizeof(header), 16,
+                                                     test_split_destination, &remaining_len,
+                                                     &aes_metadata, encrypted, encrypted_len);
+    EXPECT_EQ(decrypted_len, -1);
+
+    aes_session_destroy(session);
+
+    check_stdout_line(::testing::HasSubstr("OpenSSL Error caught"));
+}
+
+// This benchmark compares encrypting and decrypting 1200-byte segments
+// with encrypt_packet/decrypt_packet, against using an AES session
+TEST_F(ProtocolTest, AESSessionBenchmark) {
+#define NUM_BENCHMARK_PACKETS 20000
+    char plaintext[1200];
+    char encrypted[1200 + MAX_ENCRYPTION_SIZE_INCREASE];
+    char decrypted[1200];
+    AESMetadata aes_metadata;
+    memset(plaintext, 0x5A, sizeof(plaintext));
+
+    WhistTimer timer;
+    start_timer(&timer);
+    for (int i = 0; i < NUM_BENCHMARK_PACKETS; i++) {
+        int encrypted_len = encrypt_packet(encrypted, &aes_metadata, plaintext, sizeof(plaintext),
+                                           DEFAULT_BINARY_PRIVATE_KEY);
+        int decrypted_len = decrypt_packet(decrypted, sizeof(decrypted), aes_metadata, encrypted,
+                                           encrypted_len, DEFAULT_BINARY_PRIVATE_KEY);
+        ASSERT_EQ(decrypted_len, (int)sizeof(plaintext));
+    }
+    double per_packet_elapsed = get_timer(&timer);
+
+    AESSession* session = aes_session_create(DEFAULT_BINARY_PRIVATE_KEY);
+    ASSERT_TRUE(session != NULL);
+    start_timer(&timer);
+    for (int i = 0; i < NUM_BENCHMARK_PACKETS; i++) {
+        int encrypted_len = aes_session_encrypt_packet(session, encrypted, &aes_metadata,
+                                                       plaintext, sizeof(plaintext));
+        int decrypted_len = aes_session_decrypt_packet(session, decrypted, sizeof(decrypted),
+                                                       &aes_metadata, encrypted, encrypted_len);
+        ASSERT_EQ(decrypted_len, (int)sizeof(plaintext));
+    }
+    double session_elapsed = get_timer(&timer);
+    aes_session_destroy(session);
+
+    EXPECT_EQ(memcmp(decrypted, plaintext, sizeof(plaintext)), 0);
+
+    fprintf(stderr, "Per-packet AES: %.0f packets/sec, AES session: %.0f packets/sec\n",
+            NUM_BENCHMARK_PACKETS / per_packet_elapsed, NUM_BENCHMARK_PACKETS / session_elapsed);
+#undef NUM_BENCHMARK_PACKETS
+}
+
 /**
  * file/file_synchronizer.c
  **/
@@ -1451,11 +1692,55 @@ void dummy_stream_reset(SocketContext* socket_context, WhistPacketType frame_typ
     return;
 }
 
+// Checks that blocks come from the smallest size class that holds them,
+// and that freed blocks are reused
+TEST_F(ProtocolTest, SizeClassAllocatorTest) {
+    SizeClassAllocator* allocator = create_size_class_allocator(1000000, false);
+    SizeClassStats stats[32];
+    int num_stats = get_size_class_stats(allocator, stats, 32);
+    ASSERT_GT(num_stats, 1);
+    EXPECT_GE(stats[num_stats - 1].block_size, (size_t)1000000);
+    EXPECT_LT(stats[num_stats - 2].block_size, (size_t)1000000);
+
+    // The largest block of a size class fills it, and writing all of it is fine
+    size_t small_size = stats[0].block_size;
+    char* small_block = (char*)allocate_sized_block(allocator, small_size);
+    memset(small_block, 'w', small_size);
+    char* large_block = (char*)allocate_sized_block(allocator, 1000000);
+    memset(large_block, 'w', 1000000);
+    get_size_class_stats(allocator, stats, 32);
+    EXPECT_EQ(stats[0].blocks_in_use, 1);
+    EXPECT_EQ(stats[0].bytes_requested, small_size);
+    EXPECT_EQ(stats[1].blocks_in_use, 0);
+    EXPECT_EQ(stats[num_stats - 1].blocks_in_use, 1);
+
+    // One byte more goes to the next size class
+    char* next_block = (char*)allocate_sized_block(allocator, small_size + 1);
+    get_size_class_stats(allocator, stats, 32);
+    EXPECT_EQ(stats[1].blocks_in_use, 1);
+
+    // A freed block is cached, and handed out again
+    free_sized_block(allocator, small_block, small_size);
+    get_size_class_stats(allocator, stats, 32);
+    EXPECT_EQ(stats[0].blocks_in_use, 0);
+    EXPECT_EQ(stats[0].blocks_cached, 1);
+    EXPECT_EQ(allocate_sized_block(allocator, 10), small_block);
+    get_size_class_stats(allocator, stats, 32);
+    EXPECT_EQ(stats[0].blocks_cached, 0);
+    EXPECT_EQ(stats[0].peak_blocks_in_use, 1);
+    EXPECT_EQ(stats[0].num_allocations, 2ULL);
+
+    free_sized_block(allocator, small_block, 10);
+    free_sized_block(allocator, next_block, small_size + 1);
+    free_sized_block(allocator, large_block, 1000000);
+    destroy_size_class_allocator(allocator);
+}
+
 TEST_F(ProtocolTest, RingBufferTest) {
     int size = 275;
     // Initialize a ring buffer
     RingBuffer* video_buffer = init_ring_buffer(PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, size, NULL,
-                                                dummy_nack, dummy_stream_reset);
+                                                dummy_nack, NULL, dummy_stream_reset);
 
     EXPECT_FALSE(video_buffer == NULL);
     EXPECT_EQ(video_buffer->ring_buffer_size, size);
@@ -1478,6 +1763,7 @@ TEST_F(ProtocolTest, RingBufferTest) {
             sample_segment.num_indices = num_indices;
             sample_segment.num_fec_indices = 0;
             sample_segment.segment_size = num_indices;
+            sample_segment.segment_stride = num_indices;
             sample_segment.is_a_nack = false;
             memset(sample_segment.segment_data, index, sample_segment.segment_size);
 
@@ -1505,6 +1791,7 @@ TEST_F(ProtocolTest, RingBufferTest) {
     old_segment.index = 0;
     old_segment.num_indices = 1;
     old_segment.segment_size = 1;
+    old_segment.segment_stride = 1;
     ring_buffer_receive_segment(video_buffer, &old_segment);
 
     EXPECT_EQ(video_buffer->min_id, min_id);
@@ -1534,6 +1821,253 @@ TEST_F(ProtocolTest, RingBufferTest) {
     destroy_ring_buffer(video_buffer);
 }
 
+// Checks that segment data written to ring_buffer_get_segment_destination ends up identical to
+// data given to ring_buffer_receive_segment, and that a discarded write can be recovered from
+TEST_F(ProtocolTest, RingBufferInPlaceTest) {
+    RingBuffer* video_buffer = init_ring_buffer(PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 10, NULL,
+                                                dummy_nack, NULL, dummy_stream_reset);
+
+    WhistSegment segments[3] = {};
+    for (int index = 0; index < 3; index++) {
+        segments[index].whist_type = PACKET_VIDEO;
+        segments[index].id = 1;
+        segments[index].index = index;
+        segments[index].num_indices = 3;
+        segments[index].segment_size = 100;
+        segments[index].segment_stride = 100;
+        memset(segments[index].segment_data, 'a' + index, segments[index].segment_size);
+    }
+
+    // The frame doesn't exist yet, so the first segment must be copied
+    EXPECT_EQ(ring_buffer_get_segment_destination(video_buffer, &segments[0], 100), (char*)NULL);
+    ring_buffer_receive_segment(video_buffer, &segments[0]);
+
+    // Received indices, mismatched sizes and strides, and unknown frames don't get a destination
+    EXPECT_EQ(ring_buffer_get_segment_destination(video_buffer, &segments[0], 100), (char*)NULL);
+    EXPECT_EQ(ring_buffer_get_segment_destination(video_buffer, &segments[1], 99), (char*)NULL);
+    WhistSegment restrided_segment = segments[1];
+    restrided_segment.segment_stride = 200;
+    EXPECT_EQ(ring_buffer_get_segment_destination(video_buffer, &restrided_segment, 100),
+              (char*)NULL);
+    WhistSegment new_frame_segment = segments[1];
+    new_frame_segment.id = 2;
+    EXPECT_EQ(ring_buffer_get_segment_destination(video_buffer, &new_frame_segment, 100),
+              (char*)NULL);
+
+    // Write the second segment in place, one stride into the frame
+    char* destination = ring_buffer_get_segment_destination(video_buffer, &segments[1], 100);
+    ASSERT_NE(destination, (char*)NULL);
+    EXPECT_EQ(destination, get_frame_at_id(video_buffer, 1)->packet_buffer + 100);
+    memcpy(destination, segments[1].segment_data, 100);
+    ring_buffer_receive_segment_in_place(video_buffer, &segments[1]);
+
+    // Write garbage for the third segment, as a failed decryption would, and discard it
+    destination = ring_buffer_get_segment_destination(video_buffer, &segments[2], 100);
+    ASSERT_NE(destination, (char*)NULL);
+    memset(destination, 0xFF, 100);
+    EXPECT_FALSE(is_ready_to_render(video_buffer, 1));
+
+    // The next copy of the third segment overwrites the garbage
+    ring_buffer_receive_segment(video_buffer, &segments[2]);
+    EXPECT_TRUE(is_ready_to_render(video_buffer, 1));
+
+    FrameData* frame_data = get_frame_at_id(video_buffer, 1);
+    EXPECT_EQ(frame_data->frame_buffer_size, 300);
+    for (int index = 0; index < 3; index++) {
+        EXPECT_EQ(memcmp(frame_data->packet_buffer + index * 100, segments[index].segment_data,
+                         100),
+                  0);
+    }
+
+    destroy_ring_buffer(video_buffer);
+}
+
+// The indices that RingBufferNackTest's ring buffer nacks for
+static std::vector<int> recorded_nack_indices;
+
+// The number of bitmap nacks that RingBufferNackTest's ring buffer has sent
+static int num_recorded_nack_bitmaps;
+
+static void record_nack(SocketContext* socket_context, WhistPacketType frame_type, int id,
+                        int index) {
+    recorded_nack_indices.push_back(index);
+}
+
+static void record_nacks(SocketContext* socket_context, WhistPacketType frame_type, int id,
+                         const uint64_t* indices, int start_index, int end_index) {
+    for (int index = start_index; index < end_index; index++) {
+        if ((indices[index / 64] >> (index % 64)) & 1) {
+            recorded_nack_indices.push_back(index);
+        }
+    }
+    num_recorded_nack_bitmaps++;
+}
+
+static void run_ring_buffer_nack_test(bool use_bitmaps) {
+    RingBuffer* video_buffer =
+        init_ring_buffer(PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 10, NULL, record_nack,
+                         use_bitmaps ? record_nacks : NULL, dummy_stream_reset);
+
+    const int num_indices = 200;
+    const std::vector<int> missing_indices = {5, 63, 64, 130, 199};
+    WhistSegment segment = {};
+    segment.whist_type = PACKET_VIDEO;
+    segment.id = 1;
+    segment.num_indices = num_indices;
+    segment.segment_size = 10;
+    segment.segment_stride = 10;
+    for (int index = 0; index < num_indices; index++) {
+        if (std::find(missing_indices.begin(), missing_indices.end(), index) ==
+            missing_indices.end()) {
+            segment.index = index;
+            ring_buffer_receive_segment(video_buffer, &segment);
+        }
+    }
+    // A complete newer frame, so that frame 1 is nacked up to its last index
+    segment.id = 2;
+    segment.index = 0;
+    segment.num_indices = 1;
+    ring_buffer_receive_segment(video_buffer, &segment);
+
+    NetworkSettings network_settings = {};
+    network_settings.video_bitrate = 1000000000;
+    network_settings.burst_bitrate = 1000000000;
+    WhistTimer current_time;
+    start_timer(&current_time);
+    recorded_nack_indices.clear();
+    num_recorded_nack_bitmaps = 0;
+    try_recovering_missing_packets_or_frames(video_buffer, 0.001, 0, &network_settings,
+                                             &current_time);
+    EXPECT_EQ(recorded_nack_indices, missing_indices);
+    EXPECT_EQ(num_recorded_nack_bitmaps, use_bitmaps ? 1 : 0);
+
+    // Within a round trip, they aren't nacked again
+    recorded_nack_indices.clear();
+    try_recovering_missing_packets_or_frames(video_buffer, 0.001, 0, &network_settings,
+                                             &current_time);
+    EXPECT_TRUE(recorded_nack_indices.empty());
+
+    // But they are once it has passed
+    whist_sleep(50);
+    start_timer(&current_time);
+    recorded_nack_indices.clear();
+    num_recorded_nack_bitmaps = 0;
+    try_recovering_missing_packets_or_frames(video_buffer, 0.001, 0, &network_settings,
+                                             &current_time);
+    EXPECT_EQ(recorded_nack_indices, missing_indices);
+    EXPECT_EQ(num_recorded_nack_bitmaps, use_bitmaps ? 1 : 0);
+
+    // The nacked segments complete the frame, and a second copy of one is unnecessary
+    segment.id = 1;
+    segment.num_indices = num_indices;
+    segment.is_a_nack = true;
+    for (int index : missing_indices) {
+        segment.index = index;
+        ring_buffer_receive_segment(video_buffer, &segment);
+    }
+    EXPECT_TRUE(is_ready_to_render(video_buffer, 1));
+    ring_buffer_receive_segment(video_buffer, &segment);
+    FrameData* frame_data = get_frame_at_id(video_buffer, 1);
+    EXPECT_EQ(frame_data->nack_packets_received, (int)missing_indices.size() + 1);
+    EXPECT_EQ(frame_data->unnecessary_nack_packets_received, 1);
+    EXPECT_EQ(frame_data->num_nack_records, (int)missing_indices.size());
+    for (int i = 0; i < frame_data->num_nack_records; i++) {
+        EXPECT_EQ(frame_data->nack_records[i].index, missing_indices[i]);
+        EXPECT_EQ(frame_data->nack_records[i].num_times_nacked, 2);
+    }
+
+    destroy_ring_buffer(video_buffer);
+}
+
+// Checks that missing indices across several bitset words get nacked once per round trip,
+// either one by one or as a single bitmap, and that the nacked segments are accounted for
+// when they arrive
+TEST_F(ProtocolTest, RingBufferNackTest) {
+    for (bool use_bitmaps : {false, true}) {
+        run_ring_buffer_nack_test(use_bitmaps);
+    }
+}
+
+// Round-trips segment headers through the compact wire format
+TEST_F(ProtocolTest, CompactSegmentHeaderTest) {
+    WhistSegment segment = {};
+    segment.whist_type = PACKET_VIDEO;
+    segment.departure_time = 1650000000123456;
+    segment.id = -3;
+    segment.index = 700;
+    segment.num_indices = 1000;
+    segment.num_fec_indices = 50;
+    segment.num_probe_indices = 20;
+    segment.prev_frame_num_duplicates = 2;
+    segment.is_a_nack = true;
+    segment.segment_size = 10;
+    segment.segment_stride = MAX_PACKET_SEGMENT_SIZE;
+    memset(segment.segment_data, 'w', segment.segment_size);
+
+    for (bool has_departure_time : {true, false}) {
+        char wire[COMPACT_SEGMENT_HEADER_MAX_SIZE + MAX_PACKET_SEGMENT_SIZE];
+        CompactSegmentInfo info = {-100, has_departure_time, 42};
+        int header_size = write_compact_segment_header(wire, &segment, &info);
+        ASSERT_GT(header_size, 0);
+        EXPECT_LE(header_size, COMPACT_SEGMENT_HEADER_MAX_SIZE);
+        memcpy(wire + header_size, segment.segment_data, segment.segment_size);
+
+        WhistSegment decoded = {};
+        CompactSegmentInfo decoded_info = {};
+        EXPECT_EQ(read_compact_segment_header(&decoded, &decoded_info, wire,
+                                              header_size + segment.segment_size),
+                  header_size);
+        EXPECT_EQ(decoded_info.group_id, -100);
+        EXPECT_EQ(decoded_info.has_departure_time, has_departure_time);
+        EXPECT_EQ(decoded_info.departure_time_epoch, 42);
+        EXPECT_EQ(decoded.whist_type, PACKET_VIDEO);
+        EXPECT_EQ(decoded.departure_time, has_departure_time ? segment.departure_time : 0);
+        EXPECT_EQ(decoded.id, -3);
+        EXPECT_EQ(decoded.index, 700);
+        EXPECT_EQ(decoded.num_indices, 1000);
+        EXPECT_EQ(decoded.num_fec_indices, 50);
+        EXPECT_EQ(decoded.num_probe_indices, 20);
+        EXPECT_EQ(decoded.prev_frame_num_duplicates, 2);
+        EXPECT_TRUE(decoded.is_a_nack);
+        EXPECT_FALSE(decoded.is_a_duplicate);
+        EXPECT_EQ(decoded.segment_size, 10);
+        EXPECT_EQ(decoded.segment_stride, MAX_PACKET_SEGMENT_SIZE);
+
+        // Truncated headers are rejected
+        for (int len = 0; len < header_size; len++) {
+            EXPECT_EQ(read_compact_segment_header(&decoded, &decoded_info, wire, len), -1);
+        }
+    }
+
+    // Overlong varints and regular UDPPackets are rejected
+    const uint8_t overlong[] = {COMPACT_SEGMENT_HEADER_V1, 0, 0, 0, 0, 0x80, 0x80, 0x80, 0x00};
+    WhistSegment decoded;
+    CompactSegmentInfo decoded_info;
+    EXPECT_EQ(read_compact_segment_header(&decoded, &decoded_info, overlong, sizeof(overlong)),
+              -1);
+    const int regular[] = {0, 1, 2, 3};
+    EXPECT_EQ(read_compact_segment_header(&decoded, &decoded_info, regular, sizeof(regular)), -1);
+
+    // Compare the header bytes of a ~1000 packet frame, where only the first packet of the
+    // frame's batch carries the departure time
+    const int regular_header_size = (int)offsetof(WhistSegment, segment_data) + 2 * sizeof(int);
+    int compact_bytes = 0;
+    segment.is_a_nack = false;
+    segment.num_fec_indices = 0;
+    segment.num_probe_indices = 0;
+    segment.prev_frame_num_duplicates = 0;
+    segment.id = 12345;
+    for (int index = 0; index < 1000; index++) {
+        char header[COMPACT_SEGMENT_HEADER_MAX_SIZE];
+        CompactSegmentInfo info = {678, index == 0, 1};
+        segment.index = index;
+        compact_bytes += write_compact_segment_header(header, &segment, &info);
+    }
+    EXPECT_LT(compact_bytes, 1000 * regular_header_size / 2);
+    fprintf(stderr, "Segment headers of a 1000 packet frame: %d bytes regular, %d bytes compact\n",
+            1000 * regular_header_size, compact_bytes);
+}
+
 TEST_F(ProtocolTest, FECTest) {
 #define NUM_FEC_PACKETS 4
 
@@ -1563,8 +2097,8 @@ TEST_F(ProtocolTest, FECTest) {
 
     // ** ENCODING **
 
-    FECEncoder* fec_encoder =
-        create_fec_encoder(NUM_ORIGINAL_PACKETS, NUM_FEC_PACKETS, MAX_PACKET_SIZE);
+    FECEncoder* fec_encoder = create_fec_encoder(NUM_ORIGINAL_PACKETS, NUM_FEC_PACKETS,
+                                                 MAX_PACKET_SIZE, FEC_CODEC_REED_SOLOMON);
 
     // Register the original buffer
     fec_encoder_register_buffer(fec_encoder, original_buffer, sizeof(original_buffer));
@@ -1586,8 +2120,8 @@ TEST_F(ProtocolTest, FECTest) {
     // ** DECODING **
 
     // Now, we decode
-    FECDecoder* fec_decoder =
-        create_fec_decoder(NUM_ORIGINAL_PACKETS, NUM_FEC_PACKETS, MAX_PACKET_SIZE);
+    FECDecoder* fec_decoder = create_fec_decoder(NUM_ORIGINAL_PACKETS, NUM_FEC_PACKETS,
+                                                 MAX_PACKET_SIZE, FEC_CODEC_REED_SOLOMON);
 
     // Register a not sufficient large subset of the encoded packets
     for (int i = 0; i < (int)remaining_indices.size(); i++) {
@@ -1694,8 +2228,8 @@ TEST_F(ProtocolTest, FECTest2) {
                 }
 
                 // create fec encode
-                FECEncoder* fec_encoder =
-                    create_fec_encoder(num_real_buffers, num_fec_buffers, segment_size);
+                FECEncoder* fec_encoder = create_fec_encoder(
+                    num_real_buffers, num_fec_buffers, segment_size, FEC_CODEC_REED_SOLOMON);
 
                 // feed buf into encoder
                 fec_encoder_register_buffer(fec_encoder, buf, sizeof(buf));
@@ -1714,8 +2248,8 @@ TEST_F(ProtocolTest, FECTest2) {
                 }
 
                 // create fec decoder
-                FECDecoder* fec_decoder =
-                    create_fec_decoder(num_real_buffers, num_fec_buffers, segment_size);
+                FECDecoder* fec_decoder = create_fec_decoder(
+                    num_real_buffers, num_fec_buffers, segment_size, FEC_CODEC_REED_SOLOMON);
                 int decoded_size = -1;
 
                 // a buffer for holding decoded data
@@ -1784,6 +2318,312 @@ TEST_F(ProtocolTest, FECTest2) {
     rs_wrapper_set_max_group_overhead(saved_max_group_overhead);
 }
 
+// Check that encoding the FEC buffers one at a time, as udp.cpp does while sending,
+// gives the same buffers as encoding them all at once
+TEST_F(ProtocolTest, FECIncrementalEncodeTest) {
+    EXPECT_EQ(init_fec(), 0);
+
+    std::mt19937 g(5678);
+    const int segment_size = 1280;
+
+    for (int num_segments : {1, 2, 7, 300}) {
+        const int large_buffer_size = num_segments * (segment_size - FEC_HEADER_SIZE) - 10;
+        std::vector<char> buf(large_buffer_size);
+        for (char& c : buf) {
+            c = (char)g();
+        }
+
+        int num_fec_buffers = get_num_fec_packets(num_segments, 0.3);
+        int num_total_buffers = num_segments + num_fec_buffers;
+
+        FECEncoder* batch_encoder = create_fec_encoder(num_segments, num_fec_buffers, segment_size,
+                                                       FEC_CODEC_REED_SOLOMON);
+        fec_encoder_register_buffer(batch_encoder, buf.data(), large_buffer_size);
+        std::vector<void*> batch_buffers(num_total_buffers);
+        std::vector<int> batch_buffer_sizes(num_total_buffers);
+        fec_get_encoded_buffers(batch_encoder, batch_buffers.data(), batch_buffer_sizes.data());
+
+        FECEncoder* incremental_encoder = create_fec_encoder(num_segments, num_fec_buffers,
+                                                             segment_size, FEC_CODEC_REED_SOLOMON);
+        fec_encoder_register_buffer(incremental_encoder, buf.data(), large_buffer_size);
+        std::vector<void*> buffers(num_total_buffers);
+        std::vector<int> buffer_sizes(num_total_buffers);
+        fec_get_original_buffers(incremental_encoder, buffers.data(), buffer_sizes.data());
+        // Encode the FEC buffers out of order, to check that they don't depend on each other
+        for (int i = num_total_buffers - 1; i >= num_segments; i--) {
+            fec_get_fec_buffer(incremental_encoder, i, &buffers[i], &buffer_sizes[i]);
+        }
+
+        for (int i = 0; i < num_total_buffers; i++) {
+            EXPECT_EQ(buffer_sizes[i], batch_buffer_sizes[i]);
+            EXPECT_EQ(memcmp(buffers[i], batch_buffers[i], buffer_sizes[i]), 0);
+        }
+
+        destroy_fec_encoder(batch_encoder);
+        destroy_fec_encoder(incremental_encoder);
+    }
+}
+
+// Check that progressive decoding recovers the same data as batch decoding,
+// for any order of delivery, and when asked to decode before it can
+TEST_F(ProtocolTest, FECProgressiveTest) {
+    EXPECT_EQ(init_fec(), 0);
+
+    std::mt19937 g(1234);
+    const int segment_size = 1280;
+
+    // save the old value, so that this test doesn't break other tests involving fec
+    bool saved_progressive_decoding = rs_wrapper_set_progressive_decoding(true);
+
+    for (int num_segments : {1, 2, 7, 64, 300}) {
+        for (double fec_ratio : {0.1, 0.3}) {
+            const int large_buffer_size = num_segments * (segment_size - FEC_HEADER_SIZE) - 10;
+            std::vector<char> buf(large_buffer_size);
+            for (char& c : buf) {
+                c = (char)g();
+            }
+
+            int num_fec_buffers = get_num_fec_packets(num_segments, fec_ratio);
+            int num_total_buffers = num_segments + num_fec_buffers;
+            FECEncoder* fec_encoder = create_fec_encoder(num_segments, num_fec_buffers,
+                                                         segment_size, FEC_CODEC_REED_SOLOMON);
+            fec_encoder_register_buffer(fec_encoder, buf.data(), large_buffer_size);
+            std::vector<void*> encoded_buffers(num_total_buffers);
+            std::vector<int> encoded_buffer_sizes(num_total_buffers);
+            fec_get_encoded_buffers(fec_encoder, encoded_buffers.data(),
+                                    encoded_buffer_sizes.data());
+
+            std::vector<int> indices(num_total_buffers);
+            for (int i = 0; i < num_total_buffers; i++) {
+                indices[i] = i;
+            }
+            std::shuffle(indices.begin(), indices.end(), g);
+
+            // the number of buffers each mode needed before it could decode
+            int num_fed[2];
+            for (int progressive = 0; progressive < 2; progressive++) {
+                rs_wrapper_set_progressive_decoding(progressive);
+                FECDecoder* fec_decoder = create_fec_decoder(num_segments, num_fec_buffers,
+                                                             segment_size, FEC_CODEC_REED_SOLOMON);
+                std::vector<char> decoded_buffer(large_buffer_size + segment_size);
+                int decoded_size = -1;
+                num_fed[progressive] = 0;
+                while (decoded_size == -1 && num_fed[progressive] < num_total_buffers) {
+                    int index = indices[num_fed[progressive]++];
+                    fec_decoder_register_buffer(fec_decoder, index, encoded_buffers[index],
+                                                encoded_buffer_sizes[index]);
+                    decoded_size = fec_get_decoded_buffer(fec_decoder, decoded_buffer.data());
+                }
+                EXPECT_EQ(decoded_size, large_buffer_size);
+                EXPECT_EQ(memcmp(decoded_buffer.data(), buf.data(), large_buffer_size), 0);
+                destroy_fec_decoder(fec_decoder);
+            }
+            EXPECT_EQ(num_fed[0], num_fed[1]);
+
+            destroy_fec_encoder(fec_encoder);
+        }
+    }
+
+    // restore the saved value
+    rs_wrapper_set_progressive_decoding(saved_progressive_decoding);
+}
+
+// Check that both FEC codecs recover frames of various sizes, and compare their encode and decode
+// throughput, and their recovery overhead, i.e. how many more buffers than the original ones
+// they needed to decode
+TEST_F(ProtocolTest, FECCodecComparisonTest) {
+    EXPECT_EQ(init_fec(), 0);
+
+    // The codec is picked from the feature mask and the frame size
+    bool saved_wirehair_fec = FEATURE_ENABLED(WIREHAIR_FEC);
+    whist_set_feature(WHIST_FEATURE_WIREHAIR_FEC, true);
+    EXPECT_EQ(fec_get_codec(WIREHAIR_MIN_REAL_BUFFERS - 1), FEC_CODEC_REED_SOLOMON);
+    EXPECT_EQ(fec_get_codec(WIREHAIR_MIN_REAL_BUFFERS), FEC_CODEC_WIREHAIR);
+    whist_set_feature(WHIST_FEATURE_WIREHAIR_FEC, false);
+    EXPECT_EQ(fec_get_codec(WIREHAIR_MIN_REAL_BUFFERS), FEC_CODEC_REED_SOLOMON);
+    whist_set_feature(WHIST_FEATURE_WIREHAIR_FEC, saved_wirehair_fec);
+
+    std::mt19937 g(4321);
+    const int segment_size = 1280;
+    const double fec_ratio = 0.2;
+    const int num_trials = 10;
+
+    for (int num_segments : {2, 32, 128, 512, 1024}) {
+        const int large_buffer_size = num_segments * (segment_size - FEC_HEADER_SIZE) - 10;
+        std::vector<char> buf(large_buffer_size);
+        for (char& c : buf) {
+            c = (char)g();
+        }
+        std::vector<char> decoded_buffer(large_buffer_size + segment_size);
+        int num_fec_buffers = get_num_fec_packets(num_segments, fec_ratio);
+        int num_total_buffers = num_segments + num_fec_buffers;
+
+        for (FECCodec codec : {FEC_CODEC_REED_SOLOMON, FEC_CODEC_WIREHAIR}) {
+            double encode_time = 0.0;
+            double decode_time = 0.0;
+            int num_extra_buffers = 0;
+            for (int trial = 0; trial < num_trials; trial++) {
+                WhistTimer timer;
+                start_timer(&timer);
+                FECEncoder* fec_encoder =
+                    create_fec_encoder(num_segments, num_fec_buffers, segment_size, codec);
+                fec_encoder_register_buffer(fec_encoder, buf.data(), large_buffer_size);
+                std::vector<void*> encoded_buffers(num_total_buffers);
+                std::vector<int> encoded_buffer_sizes(num_total_buffers);
+                fec_get_encoded_buffers(fec_encoder, encoded_buffers.data(),
+                                        encoded_buffer_sizes.data());
+                encode_time += get_timer(&timer);
+
+                // Lose the original buffers first, so that every trial needs recovery
+                std::vector<int> indices(num_total_buffers);
+                for (int i = 0; i < num_total_buffers; i++) {
+                    indices[i] = i;
+                }
+                std::shuffle(indices.begin(), indices.end(), g);
+                std::stable_partition(indices.begin(), indices.end(),
+                                      [&](int index) { return index >= num_segments; });
+
+                // Try to decode after every buffer, like the ring buffer does
+                start_timer(&timer);
+                FECDecoder* fec_decoder =
+                    create_fec_decoder(num_segments, num_fec_buffers, segment_size, codec);
+                int decoded_size = -1;
+                int num_fed = 0;
+                while (decoded_size == -1 && num_fed < num_total_buffers) {
+                    int index = indices[num_fed++];
+                    fec_decoder_register_buffer(fec_decoder, index, encoded_buffers[index],
+                                                encoded_buffer_sizes[index]);
+                    decoded_size = fec_get_decoded_buffer(fec_decoder, decoded_buffer.data());
+                }
+                decode_time += get_timer(&timer);
+
+                EXPECT_EQ(decoded_size, large_buffer_size);
+                EXPECT_EQ(memcmp(decoded_buffer.data(), buf.data(), large_buffer_size), 0);
+                // Reed-Solomon needs extra buffers too, when a frame is split into groups
+                // and a group receives more buffers than it needs
+                num_extra_buffers += num_fed - num_segments;
+
+                destroy_fec_decoder(fec_decoder);
+                destroy_fec_encoder(fec_encoder);
+            }
+
+            double megabytes =
+                (double)large_buffer_size * num_trials / (BYTES_IN_KILOBYTE * BYTES_IN_KILOBYTE);
+            fprintf(stderr,
+                    "%-12s %4d segments: encode %7.1f MB/s, decode %7.1f MB/s, "
+                    "%.2f extra buffers needed\n",
+                    codec == FEC_CODEC_WIREHAIR ? "Wirehair" : "Reed-Solomon", num_segments,
+                    megabytes / encode_time, megabytes / decode_time,
+                    (double)num_extra_buffers / num_trials);
+        }
+    }
+}
+
+// Check that every CPU path that gf256 can be forced to encodes the same FEC buffers,
+// since the client and the server may pick different paths
+TEST_F(ProtocolTest, FECCpuPathTest) {
+    EXPECT_EQ(init_fec(), 0);
+
+    std::mt19937 g(8765);
+    const int segment_size = 1280;
+    const int num_segments = 200;
+    const int large_buffer_size = num_segments * (segment_size - FEC_HEADER_SIZE) - 10;
+    std::vector<char> buf(large_buffer_size);
+    for (char& c : buf) {
+        c = (char)g();
+    }
+    int num_fec_buffers = get_num_fec_packets(num_segments, 0.3);
+    int num_total_buffers = num_segments + num_fec_buffers;
+
+    EXPECT_FALSE(gf256_force_cpu_path((Gf256CpuPath)-1));
+    for (FECCodec codec : {FEC_CODEC_REED_SOLOMON, FEC_CODEC_WIREHAIR}) {
+        std::vector<std::vector<char>> expected_buffers;
+        for (Gf256CpuPath path :
+             {GF256_CPU_PATH_AUTO, GF256_CPU_PATH_GFNI, GF256_CPU_PATH_AVX512, GF256_CPU_PATH_AVX2,
+              GF256_CPU_PATH_SSSE3, GF256_CPU_PATH_NEON, GF256_CPU_PATH_PORTABLE}) {
+            if (!gf256_force_cpu_path(path)) {
+                continue;
+            }
+            FECEncoder* fec_encoder =
+                create_fec_encoder(num_segments, num_fec_buffers, segment_size, codec);
+            fec_encoder_register_buffer(fec_encoder, buf.data(), large_buffer_size);
+            std::vector<void*> buffers(num_total_buffers);
+            std::vector<int> buffer_sizes(num_total_buffers);
+            fec_get_encoded_buffers(fec_encoder, buffers.data(), buffer_sizes.data());
+
+            for (int i = num_segments; i < num_total_buffers; i++) {
+                char* fec_data = (char*)buffers[i];
+                std::vector<char> fec_buffer(fec_data, fec_data + buffer_sizes[i]);
+                if (path == GF256_CPU_PATH_AUTO) {
+                    expected_buffers.push_back(fec_buffer);
+                } else {
+                    EXPECT_EQ(fec_buffer, expected_buffers[i - num_segments]);
+                }
+            }
+            destroy_fec_encoder(fec_encoder);
+        }
+    }
+    EXPECT_TRUE(gf256_force_cpu_path(GF256_CPU_PATH_AUTO));
+}
+
+// Check that the vectorized gf256 operations are bit-exact with the portable ones,
+// for every multiplier, and for lengths and offsets that leave every kind of tail
+TEST_F(ProtocolTest, GF256CpuPathTest) {
+    EXPECT_EQ(init_fec(), 0);
+
+    std::mt19937 g(2468);
+    const int max_size = 300;
+    const int num_sizes = 40;
+    std::vector<uint8_t> x(max_size + 64), y(max_size + 64), z(max_size + 64);
+    for (uint8_t& c : x) c = (uint8_t)g();
+    for (uint8_t& c : y) c = (uint8_t)g();
+    for (uint8_t& c : z) c = (uint8_t)g();
+
+    // Run every operation on every multiplier, and concatenate the results
+    std::vector<int> sizes(num_sizes);
+    std::vector<int> offsets(num_sizes);
+    for (int i = 0; i < num_sizes; i++) {
+        sizes[i] = i < 8 ? 1 << i : (int)(g() % (max_size + 1));
+        offsets[i] = (int)(g() % 64);
+    }
+    auto run_operations = [&]() {
+        std::vector<uint8_t> results;
+        for (int i = 0; i < num_sizes; i++) {
+            int size = sizes[i];
+            const uint8_t* x_data = x.data() + offsets[i];
+            const uint8_t* y_data = y.data() + (63 - offsets[i]);
+            std::vector<uint8_t> out(size);
+            for (int multiplier = 0; multiplier < 256; multiplier++) {
+                gf256_mul_mem(out.data(), x_data, (uint8_t)multiplier, size);
+                results.insert(results.end(), out.begin(), out.end());
+                memcpy(out.data(), z.data() + offsets[i], size);
+                gf256_muladd_mem(out.data(), (uint8_t)multiplier, x_data, size);
+                results.insert(results.end(), out.begin(), out.end());
+            }
+            memcpy(out.data(), z.data(), size);
+            gf256_add_mem(out.data(), x_data, size);
+            gf256_add2_mem(out.data(), x_data, y_data, size);
+            results.insert(results.end(), out.begin(), out.end());
+            gf256_addset_mem(out.data(), x_data, y_data, size);
+            results.insert(results.end(), out.begin(), out.end());
+        }
+        return results;
+    };
+
+    EXPECT_TRUE(gf256_force_cpu_path(GF256_CPU_PATH_PORTABLE));
+    std::vector<uint8_t> expected_results = run_operations();
+    for (Gf256CpuPath path : {GF256_CPU_PATH_GFNI, GF256_CPU_PATH_AVX512, GF256_CPU_PATH_AVX2,
+                              GF256_CPU_PATH_SSSE3, GF256_CPU_PATH_NEON}) {
+        if (!gf256_force_cpu_path(path)) {
+            fprintf(stderr, "gf256 %s path isn't supported, skipping it\n",
+                    gf256_cpu_path_to_str(path));
+            continue;
+        }
+        EXPECT_TRUE(run_operations() == expected_results) << gf256_cpu_path_to_str(path);
+    }
+    EXPECT_TRUE(gf256_force_cpu_path(GF256_CPU_PATH_AUTO));
+}
+
 TEST_F(ProtocolTest, WirehairTest) {
     const int enable_manual_test = 0;
 
@@ -1974,6 +2814,9 @@ TEST_F(ProtocolTest, VirtualEventTest) {
 
 TEST_F(ProtocolTest, WCCTest) {
     void* fec_controller = create_fec_controller(get_timestamp_sec());
+    CongestionController* congestion_controller =
+        create_congestion_controller("wcc", fec_controller);
+    EXPECT_TRUE(congestion_controller != NULL);
 
     const int width = 1920;
     const int height = 1080;
@@ -1988,32 +2831,42 @@ TEST_F(ProtocolTest, WCCTest) {
     double packet_loss_ratio = 0.0;
 
     EXPECT_EQ(network_settings.saturate_bandwidth, true);
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     // No change in bitrates as timers would have just initialized in the first call.
     EXPECT_EQ(network_settings.video_bitrate, expected_video_bitrate);
     EXPECT_EQ(network_settings.saturate_bandwidth, true);
 
     // Wait for little more than NEW_BITRATE_DURATION_IN_SEC, for WCC to react
     whist_sleep((uint32_t)(NEW_BITRATE_DURATION_IN_SEC * 1.1 * MS_IN_SECOND));
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     expected_video_bitrate *= (1.0 + MAX_INCREASE_PERCENTAGE / 100.0);
     EXPECT_EQ(network_settings.video_bitrate, expected_video_bitrate);
     EXPECT_EQ(network_settings.burst_bitrate, network_settings.video_bitrate);
     EXPECT_EQ(network_settings.saturate_bandwidth, true);
+    // The spare bandwidth is probed with FEC parity while the bitrate increases
+    EXPECT_GT(network_settings.video_probe_ratio, 0.0);
 
     // Cause congestion to see if WCC reacts.
     incoming_bitrate = 4000000;
     packet_loss_ratio = 0.11;
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     // No change in bitrate as congestion should be present for atleast
     // OVERUSE_TIME_THRESHOLD_IN_SEC
     EXPECT_EQ(network_settings.video_bitrate, expected_video_bitrate);
     whist_sleep(OVERUSE_TIME_THRESHOLD_IN_SEC * 1.1 * MS_IN_SECOND);
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     // Now bitrate should have dropped to something lesser than incoming_bitrate
     EXPECT_LT(network_settings.video_bitrate, incoming_bitrate);
     EXPECT_EQ(network_settings.saturate_bandwidth, true);
@@ -2023,15 +2876,21 @@ TEST_F(ProtocolTest, WCCTest) {
     incoming_bitrate = 2000000;
     packet_loss_ratio = 0.11;
     expected_video_bitrate = network_settings.video_bitrate;
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     whist_sleep(OVERUSE_TIME_THRESHOLD_IN_SEC * 1.1 * MS_IN_SECOND);
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     EXPECT_EQ(network_settings.video_bitrate, expected_video_bitrate);
     whist_sleep((uint32_t)(NEW_BITRATE_DURATION_IN_SEC * 1.1 * MS_IN_SECOND));
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     EXPECT_LT(network_settings.video_bitrate, incoming_bitrate);
     EXPECT_EQ(network_settings.saturate_bandwidth, true);
 
@@ -2040,8 +2899,10 @@ TEST_F(ProtocolTest, WCCTest) {
     packet_loss_ratio = 0.11;
     expected_video_bitrate = width * height * MINIMUM_BITRATE_PER_PIXEL;
     whist_sleep((uint32_t)(NEW_BITRATE_DURATION_IN_SEC * 1.1 * MS_IN_SECOND));
-    whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+    congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+    congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                            &prev_group_stats, incoming_bitrate,
+                                            &network_settings);
     EXPECT_EQ(network_settings.video_bitrate, expected_video_bitrate);
     EXPECT_EQ(network_settings.burst_bitrate, network_settings.video_bitrate);
     EXPECT_EQ(network_settings.saturate_bandwidth, true);
@@ -2052,8 +2913,10 @@ TEST_F(ProtocolTest, WCCTest) {
         packet_loss_ratio = 0.0;
         expected_video_bitrate = width * height * MINIMUM_BITRATE_PER_PIXEL;
         whist_sleep((uint32_t)(NEW_BITRATE_DURATION_IN_SEC * 1.1 * MS_IN_SECOND));
-        whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                    packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+        congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+        congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                                &prev_group_stats, incoming_bitrate,
+                                                &network_settings);
     }
     expected_video_bitrate = width * height * MAXIMUM_BITRATE_PER_PIXEL;
     EXPECT_EQ(network_settings.video_bitrate, expected_video_bitrate);
@@ -2072,16 +2935,427 @@ TEST_F(ProtocolTest, WCCTest) {
             packet_loss_ratio = 0.0;
         }
         whist_sleep((uint32_t)(NEW_BITRATE_DURATION_IN_SEC * 0.51 * MS_IN_SECOND));
-        whist_congestion_controller(&curr_group_stats, &prev_group_stats, incoming_bitrate,
-                                    packet_loss_ratio, 0.0, 0.0, &network_settings, fec_controller);
+        congestion_controller_on_loss(congestion_controller, packet_loss_ratio);
+        congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                                &prev_group_stats, incoming_bitrate,
+                                                &network_settings);
     }
     EXPECT_LT(network_settings.video_bitrate, available_bandwidth);
     EXPECT_GT(network_settings.video_bitrate, available_bandwidth * CONVERGENCE_THRESHOLD_LOW);
     EXPECT_EQ(network_settings.saturate_bandwidth, false);
 
+    destroy_congestion_controller(congestion_controller);
+    destroy_fec_controller(fec_controller);
+}
+
+TEST_F(ProtocolTest, TrendlineTest) {
+    void* fec_controller = create_fec_controller(get_timestamp_sec());
+    EXPECT_TRUE(create_congestion_controller("invalid", fec_controller) == NULL);
+    CongestionController* congestion_controller =
+        create_congestion_controller("trendline", fec_controller);
+    EXPECT_TRUE(congestion_controller != NULL);
+
+    const int width = 1920;
+    const int height = 1080;
+    network_algo_set_dimensions(width, height);
+    network_algo_set_dpi(192);
+    NetworkSettings network_settings = get_starting_network_settings();
+    const int starting_video_bitrate = width * height * STARTING_BITRATE_PER_PIXEL;
+    EXPECT_EQ(network_settings.video_bitrate, starting_video_bitrate);
+    congestion_controller_on_rtt(congestion_controller, 0.0, 0.0);
+    congestion_controller_on_loss(congestion_controller, 0.0);
+
+    // Groups are sent every 16ms. Each group arrives `queueing_ms` later than it was sent
+    // relative to the previous group, so a positive value builds up a queue.
+    GroupStats prev_group_stats = {0, 0, 0};
+    GroupStats curr_group_stats = {1, 16 * US_IN_MS, 16 * US_IN_MS};
+    auto feed_groups = [&](int num_groups, int queueing_ms, int incoming_bitrate) {
+        for (int i = 0; i < num_groups; i++) {
+            prev_group_stats = curr_group_stats;
+            curr_group_stats.group_id++;
+            curr_group_stats.departure_time += 16 * US_IN_MS;
+            curr_group_stats.arrival_time += (16 + queueing_ms) * US_IN_MS;
+            congestion_controller_on_group_feedback(congestion_controller, &curr_group_stats,
+                                                    &prev_group_stats, incoming_bitrate,
+                                                    &network_settings);
+        }
+    };
+
+    // A steady delay doesn't signal anything, so the bitrate increases by a few percent
+    // per second
+    feed_groups(30, 0, starting_video_bitrate);
+    whist_sleep((uint32_t)(1.1 * MS_IN_SECOND));
+    feed_groups(1, 0, starting_video_bitrate);
+    EXPECT_GT(network_settings.video_bitrate, starting_video_bitrate);
+    EXPECT_LE(network_settings.video_bitrate, starting_video_bitrate * 1.1);
+    EXPECT_EQ(network_settings.saturate_bandwidth, true);
+    EXPECT_GT(network_settings.video_probe_ratio, 0.0);
+    EXPECT_EQ(congestion_controller_get_bitrate(congestion_controller),
+              network_settings.video_bitrate);
+
+    // A growing queue is detected from the delay gradient alone, without any loss,
+    // and the bitrate drops below the incoming bitrate
+    int incoming_bitrate = 4000000;
+    feed_groups(30, 5, incoming_bitrate);
+    EXPECT_LT(network_settings.video_bitrate, incoming_bitrate);
+    // The link capacity is known now, so the bandwidth isn't saturated or probed anymore
+    EXPECT_EQ(network_settings.saturate_bandwidth, false);
+    EXPECT_EQ(network_settings.video_probe_ratio, 0.0);
+
+    // Heavy loss decreases the bitrate too, but never below the minimum
+    congestion_controller_on_loss(congestion_controller, 0.5);
+    for (int i = 0; i < 10; i++) {
+        whist_sleep(200);
+        feed_groups(1, 0, 1000000);
+    }
+    EXPECT_EQ(network_settings.video_bitrate, width * height * MINIMUM_BITRATE_PER_PIXEL);
+
+    // Severe congestion drops to the minimum once, and isn't handled again right away
+    whist_sleep(100);
+    network_settings.video_bitrate = starting_video_bitrate;
+    EXPECT_EQ(
+        congestion_controller_handle_severe_congestion(congestion_controller, &network_settings),
+        true);
+    EXPECT_EQ(network_settings.video_bitrate, width * height * MINIMUM_BITRATE_PER_PIXEL);
+    EXPECT_EQ(
+        congestion_controller_handle_severe_congestion(congestion_controller, &network_settings),
+        false);
+
+    destroy_congestion_controller(congestion_controller);
     destroy_fec_controller(fec_controller);
 }
 
+TEST_F(ProtocolTest, TransportFeedbackTest) {
+    const timestamp_us start_time = 1000 * US_IN_SECOND;
+    TransportFeedbackBuilder builder;
+    TransportFeedback feedback;
+    transport_feedback_builder_init(&builder, start_time);
+    EXPECT_FALSE(transport_feedback_builder_is_due(&builder, start_time));
+
+    // Arrival times are relative to the first packet, at the feedback's resolution
+    EXPECT_FALSE(transport_feedback_builder_add_packet(&builder, 10, 0, start_time + 100));
+    EXPECT_FALSE(transport_feedback_builder_add_packet(&builder, 10, 1, start_time + 1100));
+    EXPECT_FALSE(transport_feedback_builder_add_packet(&builder, 11, 0, start_time + 20000));
+    timestamp_us send_time = start_time + TRANSPORT_FEEDBACK_INTERVAL_MS * US_IN_MS;
+    EXPECT_TRUE(transport_feedback_builder_is_due(&builder, send_time));
+    transport_feedback_builder_finish(&builder, send_time, &feedback);
+    EXPECT_EQ(feedback.num_packets, 3);
+    EXPECT_EQ(feedback.hold_time_us, (int)(send_time - (start_time + 20000)));
+    EXPECT_EQ(feedback.packets[1].id, 10);
+    EXPECT_EQ(feedback.packets[1].index, 1);
+    EXPECT_EQ(feedback.packets[2].id, 11);
+    EXPECT_EQ(transport_feedback_get_arrival_time(&feedback, 0), start_time + 100);
+    EXPECT_EQ(transport_feedback_get_arrival_time(&feedback, 1),
+              start_time + 100 + 4 * TRANSPORT_FEEDBACK_DELTA_US);
+    EXPECT_EQ(transport_feedback_get_arrival_time(&feedback, 2),
+              start_time + 100 + 79 * TRANSPORT_FEEDBACK_DELTA_US);
+
+    // The next feedback starts empty, and is due an interval later
+    EXPECT_FALSE(transport_feedback_builder_is_due(&builder, send_time + 1));
+    transport_feedback_builder_finish(&builder, send_time + 1, &feedback);
+    EXPECT_EQ(feedback.num_packets, 0);
+    EXPECT_EQ(feedback.hold_time_us, 0);
+
+    // A full feedback has to be sent right away
+    for (int i = 0; i < TRANSPORT_FEEDBACK_MAX_PACKETS - 1; i++) {
+        EXPECT_FALSE(transport_feedback_builder_add_packet(&builder, 12, i, send_time + i));
+    }
+    EXPECT_TRUE(transport_feedback_builder_add_packet(&builder, 12,
+                                                      TRANSPORT_FEEDBACK_MAX_PACKETS - 1,
+                                                      send_time + TRANSPORT_FEEDBACK_MAX_PACKETS));
+    transport_feedback_builder_finish(&builder, send_time + TRANSPORT_FEEDBACK_MAX_PACKETS,
+                                      &feedback);
+    EXPECT_EQ(feedback.num_packets, TRANSPORT_FEEDBACK_MAX_PACKETS);
+}
+
+TEST_F(ProtocolTest, EgressSchedulerTest) {
+    const timestamp_us start_time = 1000 * US_IN_SECOND;
+    EgressScheduler* scheduler = egress_scheduler_create(8, 4);
+    EgressPacket packet;
+    EgressClass egress_class;
+    bool is_stale;
+    EXPECT_FALSE(
+        egress_scheduler_dequeue(scheduler, start_time, -1, &packet, &egress_class, &is_stale));
+
+    // Retransmits go before new video and FEC, oldest frame first
+    EgressPacket fec = {12, 5, start_time, 0};
+    EgressPacket video = {12, 0, start_time, 0};
+    EgressPacket probe = {11, 2, start_time, 0};
+    EgressPacket newer_nack = {11, 3, start_time, 0};
+    EgressPacket older_nack = {10, 1, start_time, 0};
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_FEC, &fec));
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_PROBE, &probe));
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_VIDEO, &video));
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_RETRANSMIT, &newer_nack));
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_RETRANSMIT, &older_nack));
+    EXPECT_EQ(egress_scheduler_get_num_queued(scheduler, EGRESS_CLASS_RETRANSMIT), 2);
+    EXPECT_EQ(newer_nack.deadline, start_time + EGRESS_RETRANSMIT_DEADLINE_MS * US_IN_MS);
+    // New video and FEC only go stale once they're late for their scheduled departure
+    EXPECT_EQ(video.deadline, EGRESS_NO_DEADLINE);
+
+    const int expected_ids[] = {10, 11, 12, 12, 11};
+    const EgressClass expected_classes[] = {EGRESS_CLASS_RETRANSMIT, EGRESS_CLASS_RETRANSMIT,
+                                            EGRESS_CLASS_VIDEO, EGRESS_CLASS_FEC,
+                                            EGRESS_CLASS_PROBE};
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(
+            egress_scheduler_dequeue(scheduler, start_time, -1, &packet, &egress_class, &is_stale));
+        EXPECT_EQ(packet.id, expected_ids[i]);
+        EXPECT_EQ(egress_class, expected_classes[i]);
+        EXPECT_FALSE(is_stale);
+    }
+    EXPECT_FALSE(
+        egress_scheduler_dequeue(scheduler, start_time, -1, &packet, &egress_class, &is_stale));
+
+    // Packets are stale past their deadline, or if the client gave up on their frame
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_PROBE, &probe));
+    EXPECT_TRUE(egress_scheduler_dequeue(scheduler,
+                                         start_time + (EGRESS_PROBE_DEADLINE_MS + 1) * US_IN_MS,
+                                         -1, &packet, &egress_class, &is_stale));
+    EXPECT_TRUE(is_stale);
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_VIDEO, &video));
+    EXPECT_TRUE(egress_scheduler_dequeue(scheduler,
+                                         start_time + (EGRESS_VIDEO_DEADLINE_MS + 1) * US_IN_MS,
+                                         -1, &packet, &egress_class, &is_stale));
+    EXPECT_FALSE(is_stale);
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_VIDEO, &video));
+    EXPECT_TRUE(
+        egress_scheduler_dequeue(scheduler, start_time, 12, &packet, &egress_class, &is_stale));
+    EXPECT_TRUE(is_stale);
+
+    // A full class refuses more packets, without affecting the others
+    for (int i = 0; i < 4; i++) {
+        EgressPacket nack = {20 + i, 0, start_time, 0};
+        EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_RETRANSMIT, &nack));
+    }
+    EXPECT_FALSE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_RETRANSMIT, &older_nack));
+    EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_VIDEO, &video));
+    EXPECT_EQ(egress_scheduler_get_num_queued(scheduler, EGRESS_CLASS_RETRANSMIT), 4);
+    // New video holds a whole frame instead
+    for (int i = 1; i < 8; i++) {
+        EXPECT_TRUE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_VIDEO, &video));
+    }
+    EXPECT_FALSE(egress_scheduler_enqueue(scheduler, EGRESS_CLASS_VIDEO, &video));
+
+    egress_scheduler_destroy(scheduler);
+}
+
+TEST_F(ProtocolTest, NetworkThrottlerPacingTest) {
+    // Long groups, and a bitrate at which every 1000-byte packet takes 10ms,
+    // so that nothing here depends on how fast the test runs
+    NetworkThrottleContext* throttler = network_throttler_create(50.0);
+    network_throttler_set_burst_bitrate(throttler, 800000);
+    const int num_packets = 10;
+    size_t packet_sizes[num_packets];
+    timestamp_us departure_times[num_packets];
+    for (int i = 0; i < num_packets; i++) {
+        packet_sizes[i] = 1000;
+    }
+
+    // A batch starts right away, with its packets evenly spaced at the bitrate, in one group
+    timestamp_us start_time = current_time_us();
+    int group_id =
+        network_throttler_schedule_batch(throttler, packet_sizes, num_packets, departure_times);
+    EXPECT_GT(group_id, 0);
+    EXPECT_GE(departure_times[0], start_time);
+    EXPECT_LE(departure_times[0], current_time_us());
+    for (int i = 1; i < num_packets; i++) {
+        EXPECT_EQ(departure_times[i] - departure_times[i - 1], 10000);
+    }
+
+    // The next batch departs after it, in a new group since the first one is long enough
+    timestamp_us next_departure_time;
+    EXPECT_EQ(network_throttler_schedule_batch(throttler, packet_sizes, 1, &next_departure_time),
+              group_id + 1);
+    EXPECT_EQ(next_departure_time, departure_times[num_packets - 1] + 10000);
+
+    // Extra bytes push back what's scheduled next, which stays in the group
+    network_throttler_charge_bytes(throttler, 500);
+    timestamp_us charged_departure_time;
+    EXPECT_EQ(
+        network_throttler_schedule_batch(throttler, packet_sizes, 1, &charged_departure_time),
+        group_id + 1);
+    EXPECT_EQ(charged_departure_time, next_departure_time + 10000 + 5000);
+
+    // Released bytes pull it forward again, as if they had never been scheduled
+    network_throttler_release_bytes(throttler, 1000);
+    timestamp_us released_departure_time;
+    EXPECT_EQ(
+        network_throttler_schedule_batch(throttler, packet_sizes, 1, &released_departure_time),
+        group_id + 1);
+    EXPECT_EQ(released_departure_time, charged_departure_time);
+
+    // But never before the current time
+    network_throttler_release_bytes(throttler, 1000000);
+    timestamp_us release_time = current_time_us();
+    network_throttler_schedule_batch(throttler, packet_sizes, 1, &released_departure_time);
+    EXPECT_GE(released_departure_time, release_time);
+    EXPECT_LE(released_departure_time, current_time_us());
+
+    // Waiting for a departure doesn't end early
+    network_throttler_wait_until(throttler, departure_times[1]);
+    EXPECT_GE(current_time_us(), departure_times[1]);
+
+    // Without a bitrate, nothing waits
+    network_throttler_set_burst_bitrate(throttler, 0);
+    EXPECT_EQ(network_throttler_schedule_batch(throttler, packet_sizes, 1, &next_departure_time),
+              -1);
+    EXPECT_LE(next_departure_time, current_time_us());
+
+    network_throttler_destroy(throttler);
+}
+
+TEST_F(ProtocolTest, FECClassRatiosTest) {
+    const double total_fec_ratio = 0.1;
+    const double total_overhead = total_fec_ratio / (1.0 - total_fec_ratio);
+    double class_bytes[NUM_FEC_PROTECTION_CLASSES] = {0};
+    double class_fec_ratios[NUM_FEC_PROTECTION_CLASSES];
+
+    // With no history, every class gets the total ratio
+    fec_controller_get_class_fec_ratios(total_fec_ratio, class_bytes, class_fec_ratios);
+    for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+        EXPECT_DOUBLE_EQ(class_fec_ratios[i], total_fec_ratio);
+    }
+
+    // A mix of frame sizes, mostly normal frames with a large high frame every so often
+    for (int i = 0; i < 200; i++) {
+        fec_controller_record_class_bytes(class_bytes, FEC_PROTECTION_LOW, 100);
+        fec_controller_record_class_bytes(class_bytes, FEC_PROTECTION_NORMAL, 10000);
+        if (i % 10 == 0) {
+            fec_controller_record_class_bytes(class_bytes, FEC_PROTECTION_HIGH, 100000);
+        }
+    }
+
+    // Higher classes get more, and the fec bytes are the same as with the total ratio
+    fec_controller_get_class_fec_ratios(total_fec_ratio, class_bytes, class_fec_ratios);
+    EXPECT_LT(class_fec_ratios[FEC_PROTECTION_LOW], class_fec_ratios[FEC_PROTECTION_NORMAL]);
+    EXPECT_LT(class_fec_ratios[FEC_PROTECTION_NORMAL], class_fec_ratios[FEC_PROTECTION_HIGH]);
+    double total_bytes = 0;
+    double fec_bytes = 0;
+    for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+        total_bytes += class_bytes[i];
+        fec_bytes += class_bytes[i] * class_fec_ratios[i] / (1.0 - class_fec_ratios[i]);
+    }
+    EXPECT_NEAR(fec_bytes, total_bytes * total_overhead, total_bytes * 1e-9);
+
+    // Near the max ratio, the high class is clipped and the rest goes to the others
+    fec_controller_get_class_fec_ratios(MAX_FEC_RATIO * 0.9, class_bytes, class_fec_ratios);
+    EXPECT_DOUBLE_EQ(class_fec_ratios[FEC_PROTECTION_HIGH], MAX_FEC_RATIO);
+    EXPECT_GT(class_fec_ratios[FEC_PROTECTION_NORMAL], MAX_FEC_RATIO * 0.6);
+
+    // No fec stays no fec
+    fec_controller_get_class_fec_ratios(0.0, class_bytes, class_fec_ratios);
+    for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+        EXPECT_EQ(class_fec_ratios[i], 0.0);
+    }
+}
+
+// Simulates a video stream over a link that randomly loses segments, with the LTR state picking
+// the frame types from the acks and nacks. Returns the number of intra frames that had to be sent
+// to reset the stream, and writes the number of fec segments sent to num_fec_segments. Each
+// frame's fec ratio comes from its protection class if use_classes, else it's total_fec_ratio.
+static int simulate_stream_resets(bool use_classes, double total_fec_ratio, double loss_rate,
+                                  int* num_fec_segments) {
+    const int num_frames = 20000;
+    // The number of frames it takes for a frame's ack or nack to arrive
+    const int feedback_delay = 6;
+    // An intra frame is forced this often, e.g. by a resolution change
+    const int forced_intra_period = 120;
+    std::mt19937 rng(1);
+    std::bernoulli_distribution segment_lost(loss_rate);
+
+    LTRState* ltr = ltr_create();
+    double class_bytes[NUM_FEC_PROTECTION_CLASSES] = {0};
+    std::vector<bool> decoded(num_frames + 1, false);
+    // Whether the client has correctly decoded the frame in each long-term slot
+    bool long_term_decoded[2] = {false, false};
+    int num_resets = 0;
+    *num_fec_segments = 0;
+    for (int id = 1; id <= num_frames; id++) {
+        if (id > feedback_delay) {
+            int feedback_id = id - feedback_delay;
+            if (decoded[feedback_id]) {
+                ltr_mark_frame_received(ltr, feedback_id);
+            } else {
+                ltr_mark_frame_not_received(ltr, feedback_id);
+            }
+        }
+        bool forced_intra = id % forced_intra_period == 1;
+        if (forced_intra) {
+            ltr_force_intra(ltr);
+        }
+        LTRAction action;
+        ltr_get_next_action(ltr, &action, id);
+
+        // Intra frames are much larger than the rest
+        int num_segments = 10;
+        if (action.frame_type == VIDEO_FRAME_TYPE_INTRA) {
+            num_segments = 100;
+        } else if (action.frame_type == VIDEO_FRAME_TYPE_REFER_LONG_TERM) {
+            num_segments = 40;
+        }
+
+        FECProtectionClass protection_class = video_frame_type_protection_class(
+            action.frame_type, action.long_term_recovery_available);
+        fec_controller_record_class_bytes(class_bytes, protection_class, num_segments);
+        double fec_ratio = total_fec_ratio;
+        if (use_classes) {
+            double class_fec_ratios[NUM_FEC_PROTECTION_CLASSES];
+            fec_controller_get_class_fec_ratios(total_fec_ratio, class_bytes, class_fec_ratios);
+            fec_ratio = class_fec_ratios[protection_class];
+        }
+        int num_fec = get_num_fec_packets(num_segments, fec_ratio);
+        *num_fec_segments += num_fec;
+
+        // FEC can recover up to num_fec lost segments
+        int num_lost = 0;
+        for (int i = 0; i < num_segments + num_fec; i++) {
+            num_lost += segment_lost(rng);
+        }
+        bool received = num_lost <= num_fec;
+
+        switch (action.frame_type) {
+            case VIDEO_FRAME_TYPE_INTRA:
+                if (!forced_intra) {
+                    num_resets++;
+                }
+                decoded[id] = received;
+                long_term_decoded[0] = received;
+                long_term_decoded[1] = false;
+                break;
+            case VIDEO_FRAME_TYPE_REFER_LONG_TERM:
+                decoded[id] = received && long_term_decoded[action.long_term_frame_index];
+                break;
+            case VIDEO_FRAME_TYPE_CREATE_LONG_TERM:
+                decoded[id] = received && decoded[id - 1];
+                long_term_decoded[action.long_term_frame_index] = decoded[id];
+                break;
+            default:
+                decoded[id] = received && decoded[id - 1];
+                break;
+        }
+    }
+    ltr_destroy(ltr);
+    return num_resets;
+}
+
+TEST_F(ProtocolTest, FECUnequalProtectionTest) {
+    const double total_fec_ratio = 0.05;
+    const double loss_rate = 0.05;
+    int uniform_fec_segments;
+    int uniform_resets =
+        simulate_stream_resets(false, total_fec_ratio, loss_rate, &uniform_fec_segments);
+    int class_fec_segments;
+    int class_resets =
+        simulate_stream_resets(true, total_fec_ratio, loss_rate, &class_fec_segments);
+
+    // Protecting the frames whose loss forces an intra frame should avoid most stream resets,
+    // for the same fec budget, up to the rounding of each frame's fec segments
+    EXPECT_GT(uniform_resets, 0);
+    EXPECT_LT(class_resets, uniform_resets / 2);
+    EXPECT_LT(class_fec_segments, uniform_fec_segments * 1.1);
+}
+
 TEST_F(ProtocolTest, UnOrderedPacketTest) {
     UnOrderedPacketInfo unordered_info;
     unordered_info.max_unordered_packets = 0.0;
@@ -2579,6 +3853,527 @@ TEST_F(ProtocolTest, TCPSocketPairTest) {
     destroy_socket_context(&client);
 }
 
+static const char* udp_test_aes_key = "9d3ff73c663e13bce0780d1b95c89582";
+
+// Connect a UDP server and client over loopback, creating the server on its own thread since
+// both ends wait for each other
+static void connect_udp_pair(SocketContext* server, SocketContext* client) {
+    WhistThread server_thread = whist_create_thread(
+        [](void* s) {
+            return (int)create_udp_socket_context((SocketContext*)s, NULL, BASE_UDP_PORT, 1, 1000,
+                                                  false, udp_test_aes_key);
+        },
+        "udp_server_thread", server);
+    EXPECT_TRUE(create_udp_socket_context(client, "127.0.0.1", BASE_UDP_PORT, 1, 1000, false,
+                                          udp_test_aes_key));
+    int server_ret;
+    whist_wait_thread(server_thread, &server_ret);
+    EXPECT_EQ(server_ret, 1);
+}
+
+// Use a burst bitrate high enough that the server's throttler isn't what's being measured
+static void set_unthrottled(SocketContext* server) {
+    NetworkSettings network_settings = {0};
+    network_settings.video_bitrate = 1000000000;
+    network_settings.burst_bitrate = 1000000000;
+    udp_handle_network_settings(server->context, network_settings);
+}
+
+// Test that a payload scattered across chunks arrives as one contiguous WhistPacket
+TEST_F(ProtocolTest, UDPSendPacketChunksTest) {
+    whist_init_logger();
+    whist_init_networking();
+    SocketContext server, client;
+    connect_udp_pair(&server, &client);
+
+    const char* first = "This is ";
+    const char* second = "";
+    const char* third = "an unguessable string.";
+    UDPPayloadChunk chunks[] = {{first, (int)strlen(first)},
+                                {second, 0},
+                                {third, (int)strlen(third) + 1}};
+    // The segment must arrive intact with both the regular and the compact segment header
+    for (bool compact_segment_header : {false, true}) {
+        whist_set_feature(WHIST_FEATURE_COMPACT_SEGMENT_HEADER, compact_segment_header);
+        EXPECT_EQ(udp_send_packet_chunks(&server, PACKET_MESSAGE, chunks, 3, -1, false,
+                                         FEC_PROTECTION_NORMAL),
+                  0);
+
+        WhistPacket* packet = NULL;
+        for (int i = 0; i < 100 && !packet; i++) {
+            socket_update(&client);
+            packet = (WhistPacket*)get_packet(&client, PACKET_MESSAGE);
+        }
+        ASSERT_TRUE(packet != NULL);
+        EXPECT_EQ(packet->payload_size, (int)(strlen(first) + strlen(third) + 1));
+        EXPECT_STREQ((char*)packet->data, "This is an unguessable string.");
+        free_packet(&client, packet);
+    }
+    whist_set_feature(WHIST_FEATURE_COMPACT_SEGMENT_HEADER, false);
+
+    destroy_socket_context(&server);
+    destroy_socket_context(&client);
+}
+
+// Test that the server sizes its segments to the path MTU that it discovers
+TEST_F(ProtocolTest, UDPPathMTUDiscoveryTest) {
+    whist_init_logger();
+    whist_init_networking();
+    // The client picks its starting network settings when the frame arrives
+    network_algo_set_dimensions(1920, 1080);
+    network_algo_set_dpi(192);
+
+    // Loopback carries anything, so the client drops what a 1280-byte MTU couldn't carry.
+    // Without a simulated MTU, the segments fill a regular 1500-byte MTU.
+    for (int simulated_mtu : {1280, 0}) {
+        udp_set_simulated_path_mtu(simulated_mtu);
+        SocketContext server, client;
+        connect_udp_pair(&server, &client);
+
+        // 1280 bytes, less the IP/UDP, encryption and segment headers, which the 1500-byte MTU
+        // segment size leaves room for too
+        int expected_segment_size =
+            simulated_mtu == 0 ? MAX_PACKET_SEGMENT_SIZE : MAX_PACKET_SEGMENT_SIZE - (1500 - 1280);
+        EXPECT_EQ(udp_get_segment_size(&server), expected_segment_size);
+
+        // A frame gets split up into segments of that size, and still arrives intact.
+        // It's a recovery point, so that the client's ringbuffer starts rendering at it.
+        udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                                 VIDEO_NACKBUFFER_SIZE);
+        udp_register_ring_buffer(&client, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 16);
+        const int frame_size = 20 * 1000;
+        std::vector<char> frame(frame_size);
+        for (int i = 0; i < frame_size; i++) {
+            frame[i] = (char)(i * 7);
+        }
+        ((VideoFrame*)frame.data())->frame_type = VIDEO_FRAME_TYPE_INTRA;
+        EXPECT_EQ(send_packet(&server, PACKET_VIDEO, frame.data(), frame_size, 1, false), 0);
+        EXPECT_EQ(udp_get_num_indices(&server, PACKET_VIDEO, 1),
+                  int_div_roundup(PACKET_HEADER_SIZE + frame_size, expected_segment_size));
+
+        WhistPacket* packet = NULL;
+        for (int i = 0; i < 100 && !packet; i++) {
+            socket_update(&client);
+            packet = (WhistPacket*)get_packet(&client, PACKET_VIDEO);
+        }
+        ASSERT_TRUE(packet != NULL);
+        EXPECT_EQ(packet->payload_size, frame_size);
+        EXPECT_EQ(memcmp(packet->data, frame.data(), frame_size), 0);
+        free_packet(&client, packet);
+
+        destroy_socket_context(&server);
+        destroy_socket_context(&client);
+    }
+}
+
+// Shared by the threads of UDPNackStormTest
+typedef struct {
+    SocketContext* server;
+    int frame_size;
+    int num_frames;
+    int num_indices;
+    atomic_int last_frame_id;
+    atomic_int done;
+    double send_time;
+} NackStormState;
+
+static void fill_nack_storm_frame(char* frame, int frame_size, int frame_id) {
+    for (int i = 0; i < frame_size; i++) {
+        frame[i] = (char)(i * 7 + frame_id);
+    }
+    ((VideoFrame*)frame)->frame_type = VIDEO_FRAME_TYPE_INTRA;
+}
+
+static int nack_storm_send_thread(void* arg) {
+    NackStormState* state = (NackStormState*)arg;
+    std::vector<char> frame(state->frame_size);
+    for (int frame_id = 1; frame_id <= state->num_frames; frame_id++) {
+        fill_nack_storm_frame(frame.data(), state->frame_size, frame_id);
+        WhistTimer timer;
+        start_timer(&timer);
+        send_packet(state->server, PACKET_VIDEO, frame.data(), state->frame_size, frame_id,
+                    false);
+        state->send_time += get_timer(&timer);
+        atomic_store(&state->last_frame_id, frame_id);
+    }
+    atomic_store(&state->done, 1);
+    return 0;
+}
+
+static int nack_storm_resend_thread(void* arg) {
+    NackStormState* state = (NackStormState*)arg;
+    std::mt19937 rng(std::random_device{}());
+    while (!atomic_load(&state->done)) {
+        // Resend from every frame still in the nack buffer, including the slot that the
+        // sending thread is overwriting right now
+        int frame_id = atomic_load(&state->last_frame_id) - (int)(rng() % VIDEO_NACKBUFFER_SIZE);
+        if (frame_id <= 0) {
+            continue;
+        }
+        udp_resend_packet(state->server, PACKET_VIDEO, frame_id,
+                          (int)(rng() % state->num_indices));
+    }
+    return 0;
+}
+
+// Test that frames stay intact while other threads hammer the nack buffer with resends,
+// and compare the I-frame send time with and without them
+TEST_F(ProtocolTest, UDPNackStormTest) {
+    whist_init_logger();
+    whist_init_networking();
+    const int num_resend_threads = 4;
+
+    for (bool storm : {false, true}) {
+        SocketContext server, client;
+        connect_udp_pair(&server, &client);
+
+        udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                                 VIDEO_NACKBUFFER_SIZE);
+        udp_register_ring_buffer(&client, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 16);
+        set_unthrottled(&server);
+
+        NackStormState state;
+        state.server = &server;
+        state.frame_size = 200 * 1000;
+        state.num_frames = 40;
+        state.num_indices =
+            int_div_roundup(PACKET_HEADER_SIZE + state.frame_size, udp_get_segment_size(&server));
+        atomic_init(&state.last_frame_id, 0);
+        atomic_init(&state.done, 0);
+        state.send_time = 0;
+
+        WhistThread send_thread =
+            whist_create_thread(&nack_storm_send_thread, "Nack Storm Send Thread", &state);
+        WhistThread resend_threads[num_resend_threads];
+        for (int i = 0; i < num_resend_threads && storm; i++) {
+            resend_threads[i] =
+                whist_create_thread(&nack_storm_resend_thread, "Nack Storm Resend Thread", &state);
+        }
+
+        // Every frame that the client completes must be the one that was sent with its ID
+        std::vector<char> expected(state.frame_size);
+        int num_received = 0;
+        int num_idle_updates = 0;
+        while (!atomic_load(&state.done) || num_idle_updates < 100) {
+            socket_update(&client);
+            WhistPacket* packet = (WhistPacket*)get_packet(&client, PACKET_VIDEO);
+            if (packet == NULL) {
+                num_idle_updates++;
+                continue;
+            }
+            num_idle_updates = 0;
+            fill_nack_storm_frame(expected.data(), state.frame_size, packet->id);
+            EXPECT_EQ(packet->payload_size, state.frame_size);
+            EXPECT_EQ(memcmp(packet->data, expected.data(), state.frame_size), 0);
+            free_packet(&client, packet);
+            num_received++;
+        }
+
+        whist_wait_thread(send_thread, NULL);
+        for (int i = 0; i < num_resend_threads && storm; i++) {
+            whist_wait_thread(resend_threads[i], NULL);
+        }
+        EXPECT_GT(num_received, 0);
+        fprintf(stderr, "%s resend threads: %.3f ms per I-frame, %d frames received\n",
+                storm ? "With" : "Without", state.send_time * MS_IN_SECOND / state.num_frames,
+                num_received);
+
+        destroy_socket_context(&server);
+        destroy_socket_context(&client);
+    }
+}
+
+// Test that a frame which takes longer than EGRESS_VIDEO_DEADLINE_MS to pace out still gets sent
+// whole, rather than having its tail dropped as stale after its head was sent
+TEST_F(ProtocolTest, UDPSlowFrameTest) {
+    whist_init_logger();
+    whist_init_networking();
+    // The client picks its starting network settings when the frame arrives
+    network_algo_set_dimensions(1920, 1080);
+    network_algo_set_dpi(192);
+    SocketContext server, client;
+    connect_udp_pair(&server, &client);
+
+    udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                             VIDEO_NACKBUFFER_SIZE);
+    udp_register_ring_buffer(&client, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 16);
+    NetworkSettings network_settings = {0};
+    network_settings.video_bitrate = 2000000;
+    network_settings.burst_bitrate = 2000000;
+    udp_handle_network_settings(server.context, network_settings);
+
+    // ~500ms worth of the burst bitrate, which the server spends pacing it out
+    const int frame_size = 125 * 1000;
+    std::vector<char> frame(frame_size);
+    for (int i = 0; i < frame_size; i++) {
+        frame[i] = (char)(i * 11);
+    }
+    ((VideoFrame*)frame.data())->frame_type = VIDEO_FRAME_TYPE_INTRA;
+    WhistTimer send_timer;
+    start_timer(&send_timer);
+    EXPECT_EQ(send_packet(&server, PACKET_VIDEO, frame.data(), frame_size, 1, false), 0);
+    EXPECT_GT(get_timer(&send_timer) * MS_IN_SECOND, EGRESS_VIDEO_DEADLINE_MS);
+
+    // The server never reads its NACKs, so the frame has to arrive without any retransmits
+    WhistPacket* packet = NULL;
+    for (int i = 0; i < 1000 && !packet; i++) {
+        socket_update(&client);
+        packet = (WhistPacket*)get_packet(&client, PACKET_VIDEO);
+    }
+    ASSERT_TRUE(packet != NULL);
+    EXPECT_EQ(packet->payload_size, frame_size);
+    EXPECT_EQ(memcmp(packet->data, frame.data(), frame_size), 0);
+    free_packet(&client, packet);
+
+    destroy_socket_context(&server);
+    destroy_socket_context(&client);
+}
+
+// Test that only frames with FEC get probe parity, and that both kinds arrive intact
+TEST_F(ProtocolTest, UDPProbeParityTest) {
+    whist_init_logger();
+    whist_init_networking();
+    // The client picks its starting network settings when the frame arrives
+    network_algo_set_dimensions(1920, 1080);
+    network_algo_set_dpi(192);
+    SocketContext server, client;
+    connect_udp_pair(&server, &client);
+
+    udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                             VIDEO_NACKBUFFER_SIZE);
+    udp_register_ring_buffer(&client, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 16);
+    NetworkSettings network_settings = {0};
+    network_settings.video_bitrate = 1000000000;
+    network_settings.burst_bitrate = 1000000000;
+    network_settings.saturate_bandwidth = true;
+    network_settings.video_probe_ratio = 0.2;
+
+    const int frame_size = 20 * 1000;
+    std::vector<char> frame(frame_size);
+    for (int i = 0; i < frame_size; i++) {
+        frame[i] = (char)(i * 13);
+    }
+    ((VideoFrame*)frame.data())->frame_type = VIDEO_FRAME_TYPE_INTRA;
+    for (int frame_id = 1; frame_id <= 2; frame_id++) {
+        // The first frame has no FEC, and the second one does
+        network_settings.video_fec_ratio = frame_id == 1 ? 0.0 : 0.1;
+        udp_handle_network_settings(server.context, network_settings);
+        EXPECT_EQ(send_packet(&server, PACKET_VIDEO, frame.data(), frame_size, frame_id, false),
+                  0);
+        EXPECT_EQ(udp_send_probe_parity(&server, frame_id), frame_id == 2);
+
+        WhistPacket* packet = NULL;
+        for (int i = 0; i < 100 && !packet; i++) {
+            socket_update(&client);
+            packet = (WhistPacket*)get_packet(&client, PACKET_VIDEO);
+        }
+        ASSERT_TRUE(packet != NULL);
+        EXPECT_EQ(packet->id, frame_id);
+        EXPECT_EQ(packet->payload_size, frame_size);
+        EXPECT_EQ(memcmp(packet->data, frame.data(), frame_size), 0);
+        free_packet(&client, packet);
+    }
+
+    destroy_socket_context(&server);
+    destroy_socket_context(&client);
+}
+
+// Report the given video segments to the server, as transport feedback
+static void send_transport_feedback(SocketContext* server, const int (*segments)[2],
+                                    int num_segments) {
+    TransportFeedbackBuilder builder;
+    transport_feedback_builder_init(&builder, current_time_us());
+    for (int i = 0; i < num_segments; i++) {
+        transport_feedback_builder_add_packet(&builder, segments[i][0], segments[i][1],
+                                              current_time_us());
+    }
+    TransportFeedback feedback;
+    transport_feedback_builder_finish(&builder, current_time_us(), &feedback);
+    udp_handle_transport_feedback(server->context, &feedback);
+}
+
+// Test that the server counts the segments that transport feedback skips as lost, but not the
+// reordered ones, and sends the client the network settings that it estimates
+TEST_F(ProtocolTest, UDPTransportFeedbackTest) {
+    whist_init_logger();
+    whist_init_networking();
+    // The client picks its starting network settings when the frames arrive
+    network_algo_set_dimensions(1920, 1080);
+    network_algo_set_dpi(192);
+    SocketContext server, client;
+    connect_udp_pair(&server, &client);
+
+    udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                             VIDEO_NACKBUFFER_SIZE);
+    udp_register_ring_buffer(&client, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 16);
+    set_unthrottled(&server);
+
+    // Frames of 10 segments each
+    const int frame_size = 10 * udp_get_segment_size(&server) - PACKET_HEADER_SIZE;
+    std::vector<char> frame(frame_size);
+    ((VideoFrame*)frame.data())->frame_type = VIDEO_FRAME_TYPE_INTRA;
+    for (int frame_id = 1; frame_id <= 4; frame_id++) {
+        EXPECT_EQ(send_packet(&server, PACKET_VIDEO, frame.data(), frame_size, frame_id, false),
+                  0);
+        EXPECT_EQ(udp_get_num_indices(&server, PACKET_VIDEO, frame_id), 10);
+    }
+
+    // Every segment of frame 1: nothing was lost
+    const int first_feedback[][2] = {{1, 0}, {1, 1}, {1, 2}, {1, 3}, {1, 4},
+                                     {1, 5}, {1, 6}, {1, 7}, {1, 8}, {1, 9}};
+    send_transport_feedback(&server, first_feedback, 10);
+    EXPECT_DOUBLE_EQ(udp_get_transport_packet_loss_ratio(server.context), 0.0);
+
+    // Half of frame 2, with index 1 reordered after index 2: 5 of 10 segments were lost
+    const int second_feedback[][2] = {{2, 0}, {2, 2}, {2, 1}, {2, 5}, {2, 9}};
+    send_transport_feedback(&server, second_feedback, 5);
+    double expected_loss_ratio = 0.2 * 0.5;
+    EXPECT_NEAR(udp_get_transport_packet_loss_ratio(server.context), expected_loss_ratio, 1e-9);
+
+    // Make the server resend its network settings along with the next feedback
+    whist_sleep(1100);
+
+    // The rest of frame 2 and all of frame 3 are missing, but a segment of frame 3 arrives after
+    // frame 4: 20 segments were sent since the last feedback, and 11 were received
+    const int third_feedback[][2] = {{4, 0}, {4, 1}, {4, 2}, {4, 3}, {4, 4}, {4, 5},
+                                     {4, 6}, {4, 7}, {4, 8}, {3, 4}, {4, 9}};
+    send_transport_feedback(&server, third_feedback, 11);
+    expected_loss_ratio = 0.8 * expected_loss_ratio + 0.2 * (1.0 - 11.0 / 20.0);
+    EXPECT_NEAR(udp_get_transport_packet_loss_ratio(server.context), expected_loss_ratio, 1e-9);
+
+    // The client adopts the network settings that the server estimated, once it gets them
+    // after the frames
+    NetworkSettings server_settings = udp_get_network_settings(&server);
+    EXPECT_GT(server_settings.video_bitrate, 0);
+    NetworkSettings client_settings = {0};
+    for (int i = 0; i < 1000 && client_settings.video_bitrate != server_settings.video_bitrate;
+         i++) {
+        socket_update(&client);
+        WhistPacket* packet = (WhistPacket*)get_packet(&client, PACKET_VIDEO);
+        if (packet) {
+            free_packet(&client, packet);
+        }
+        client_settings = udp_get_network_settings(&client);
+    }
+    EXPECT_EQ(client_settings.video_bitrate, server_settings.video_bitrate);
+    EXPECT_EQ(client_settings.burst_bitrate, server_settings.burst_bitrate);
+    EXPECT_EQ(client_settings.video_fec_ratio, server_settings.video_fec_ratio);
+
+    destroy_socket_context(&server);
+    destroy_socket_context(&client);
+}
+
+#if OS_IS(OS_LINUX)
+// Test that messages and frames make it across when both ends use io_uring.
+// On kernels without io_uring, this exercises the fallback to the regular syscalls.
+TEST_F(ProtocolTest, UDPIOUringTest) {
+    whist_init_logger();
+    whist_init_networking();
+    // The client picks its starting network settings when the frame arrives
+    network_algo_set_dimensions(1920, 1080);
+    network_algo_set_dpi(192);
+    udp_set_use_io_uring(true);
+    SocketContext server, client;
+    connect_udp_pair(&server, &client);
+    udp_set_use_io_uring(false);
+
+    // A single-segment message, from the client to the server
+    const char* data = "Hello over io_uring!";
+    send_packet(&client, PACKET_MESSAGE, (uint8_t*)data, (int)strlen(data) + 1, -1, false);
+    WhistPacket* packet = NULL;
+    for (int i = 0; i < 100 && !packet; i++) {
+        socket_update(&server);
+        packet = (WhistPacket*)get_packet(&server, PACKET_MESSAGE);
+    }
+    ASSERT_TRUE(packet != NULL);
+    EXPECT_STREQ((const char*)packet->data, data);
+    free_packet(&server, packet);
+
+    // A frame of several batches of segments, from the server to the client
+    udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                             VIDEO_NACKBUFFER_SIZE);
+    udp_register_ring_buffer(&client, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE, 16);
+    const int frame_size = 200 * 1000;
+    std::vector<char> frame(frame_size);
+    for (int i = 0; i < frame_size; i++) {
+        frame[i] = (char)(i * 13);
+    }
+    ((VideoFrame*)frame.data())->frame_type = VIDEO_FRAME_TYPE_INTRA;
+    EXPECT_EQ(send_packet(&server, PACKET_VIDEO, frame.data(), frame_size, 1, false), 0);
+    packet = NULL;
+    for (int i = 0; i < 1000 && !packet; i++) {
+        socket_update(&client);
+        packet = (WhistPacket*)get_packet(&client, PACKET_VIDEO);
+    }
+    ASSERT_TRUE(packet != NULL);
+    EXPECT_EQ(packet->payload_size, frame_size);
+    EXPECT_EQ(memcmp(packet->data, frame.data(), frame_size), 0);
+    free_packet(&client, packet);
+
+    destroy_socket_context(&server);
+    destroy_socket_context(&client);
+}
+#endif
+
+#if OS_IS(OS_LINUX)
+// Microbenchmark of the per-packet and batched send paths of udp_send_packet,
+// with the regular syscalls and with io_uring.
+// The client never reads, we're only measuring how fast the server can push frames out.
+TEST_F(ProtocolTest, UDPBatchedSendBenchmark) {
+    whist_init_logger();
+    whist_init_networking();
+
+    // An I-frame sized payload, of ~300 packets
+    const int frame_size = 300 * MAX_PACKET_SEGMENT_SIZE - 100;
+    const int num_frames = 100;
+    std::vector<char> frame(frame_size, 'w');
+
+    for (bool io_uring : {false, true}) {
+        udp_set_use_io_uring(io_uring);
+        SocketContext server, client;
+        connect_udp_pair(&server, &client);
+
+        udp_register_nack_buffer(&server, PACKET_VIDEO, LARGEST_VIDEOFRAME_SIZE,
+                                 VIDEO_NACKBUFFER_SIZE);
+        set_unthrottled(&server);
+
+        int frame_id = 1;
+        // io_uring only replaces the syscalls of the batched path
+        for (bool batched_send : {false, true}) {
+            if (io_uring && !batched_send) {
+                continue;
+            }
+            udp_set_batched_send(&server, batched_send);
+            struct rusage usage_start, usage_end;
+            getrusage(RUSAGE_THREAD, &usage_start);
+            WhistTimer timer;
+            start_timer(&timer);
+            for (int i = 0; i < num_frames; i++) {
+                EXPECT_EQ(send_packet(&server, PACKET_VIDEO, frame.data(), frame_size,
+                                      frame_id++, false),
+                          0);
+            }
+            double elapsed = get_timer(&timer);
+            getrusage(RUSAGE_THREAD, &usage_end);
+            double cpu_time =
+                (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+                (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+                ((usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) +
+                 (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec)) /
+                    (double)US_IN_SECOND;
+            int num_packets = num_frames * udp_get_num_indices(&server, PACKET_VIDEO, frame_id - 1);
+            fprintf(stderr, "%s send: %.0f packets/sec, %.3f ms of CPU per frame\n",
+                    io_uring ? "io_uring batched" : batched_send ? "Batched" : "Per-packet",
+                    num_packets / elapsed, cpu_time * MS_IN_SECOND / num_frames);
+        }
+
+        destroy_socket_context(&server);
+        destroy_socket_context(&client);
+    }
+    udp_set_use_io_uring(false);
+}
+#endif
+
 /*
 ============================
 Run Tests
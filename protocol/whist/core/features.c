@@ -39,6 +39,16 @@ static WhistFeatureDescriptor feature_list[] = {
         .enabled = LTR_DEFAULT_SETTING,
         .name = "long-term reference frames",
     },
+    {
+        .feature = WHIST_FEATURE_COMPACT_SEGMENT_HEADER,
+        .enabled = false,
+        .name = "compact segment header",
+    },
+    {
+        .feature = WHIST_FEATURE_WIREHAIR_FEC,
+        .enabled = false,
+        .name = "wirehair fec",
+    },
 };
 
 static const WhistFeatureDescriptor *get_feature_descriptor(WhistFeature feature) {
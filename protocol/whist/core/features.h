@@ -34,6 +34,24 @@ typedef enum {
      * side.
      */
     WHIST_FEATURE_LONG_TERM_REFERENCE_FRAMES,
+    /**
+     * Send video and audio segments with a compact header.
+     *
+     * This replaces the fixed-size header of each UDP segment with a
+     * variable-length one, see whist/network/segment_header.h.  Both
+     * header formats can always be received, so this only changes
+     * what the sender uses.
+     */
+    WHIST_FEATURE_COMPACT_SEGMENT_HEADER,
+    /**
+     * FEC encode large frames with the Wirehair fountain code.
+     *
+     * Frames of at least WIREHAIR_MIN_REAL_BUFFERS segments use
+     * Wirehair rather than Reed-Solomon for their FEC segments, see
+     * whist/fec/fec.h.  Both sides pick the codec from the frame's
+     * size, so the feature must be enabled on both.
+     */
+    WHIST_FEATURE_WIREHAIR_FEC,
     /**
      * Number of supported feature flags.
      *
@@ -196,9 +196,18 @@ void free_dynamic_buffer(DynamicBuffer* db) {
 #define MAX_FREES 1024
 #endif
 
+// The size of a transparent huge page
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Huge pages stay resident while they're cached, since marking them as unused would split them,
+// so only a few of them are kept on standby
+#define MAX_HUGE_PAGE_FREES 4
+
 // The internal block allocator struct,
 struct BlockAllocator {
     size_t block_size;
+    // Whether the blocks are allocated with allocate_huge_page_region
+    bool use_huge_pages;
 
     int num_allocated_blocks;
 
@@ -207,6 +216,8 @@ struct BlockAllocator {
     char* free_blocks[MAX_FREES];
 };
 
+static void* allocate_huge_page_region(size_t region_size);
+
 /*
 ============================
 Public Function Implementations
@@ -232,6 +243,7 @@ BlockAllocator* create_block_allocator(size_t block_size) {
     // Set block allocator values
     blk_allocator->num_allocated_blocks = 0;
     blk_allocator->block_size = block_size;
+    blk_allocator->use_huge_pages = false;
     blk_allocator->num_free_blocks = 0;
 
     return blk_allocator;
@@ -251,13 +263,17 @@ void* allocate_block(BlockAllocator* blk_allocator) {
     // If a free block already exists, just use that one instead
     if (blk_allocator->num_free_blocks > 0) {
         char* block = blk_allocator->free_blocks[--blk_allocator->num_free_blocks];
-        mark_used_region(block);
+        if (!blk_allocator->use_huge_pages) {
+            mark_used_region(block);
+        }
         return block;
     }
 
     // Otherwise, create a new block
     blk_allocator->num_allocated_blocks++;
-    char* block = allocate_region(blk_allocator->block_size);
+    char* block = blk_allocator->use_huge_pages
+                      ? allocate_huge_page_region(blk_allocator->block_size)
+                      : allocate_region(blk_allocator->block_size);
     // Return the newly allocated block
     return block;
 }
@@ -272,7 +288,14 @@ void free_block(BlockAllocator* blk_allocator, void* block) {
     */
 
     // If there's room in the free block list, just store the free block there instead
-    if (blk_allocator->num_free_blocks < MAX_FREES) {
+    if (blk_allocator->use_huge_pages) {
+        if (blk_allocator->num_free_blocks < MAX_HUGE_PAGE_FREES) {
+            blk_allocator->free_blocks[blk_allocator->num_free_blocks++] = block;
+        } else {
+            deallocate_region(block);
+            blk_allocator->num_allocated_blocks--;
+        }
+    } else if (blk_allocator->num_free_blocks < MAX_FREES) {
         mark_unused_region(block);
         blk_allocator->free_blocks[blk_allocator->num_free_blocks++] = block;
     } else {
@@ -520,3 +543,206 @@ void deallocate_region(void* region) {
     }
 #endif
 }
+
+// Like allocate_region, but the region starts on a huge page boundary,
+// and the OS is asked to back it with transparent huge pages
+static void* allocate_huge_page_region(size_t region_size) {
+#if OS_IS(OS_LINUX) && defined(MADV_HUGEPAGE)
+    size_t page_size = get_page_size();
+    region_size += sizeof(RegionHeader);
+    region_size = region_size + (page_size - (region_size % page_size)) % page_size;
+
+    // Over-allocate by a huge page, and give back the unaligned head and tail
+    size_t mapping_size = region_size + HUGE_PAGE_SIZE;
+    char* mapping =
+        mmap(0, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        LOG_FATAL("mmap failed!");
+    }
+    char* p = (char*)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+    if (p > mapping) {
+        munmap(mapping, p - mapping);
+    }
+    size_t tail_size = (mapping + mapping_size) - (p + region_size);
+    if (tail_size > 0) {
+        munmap(p + region_size, tail_size);
+    }
+    // This is only advice, so a kernel with transparent huge pages disabled just ignores it
+    madvise(p, region_size, MADV_HUGEPAGE);
+    ((RegionHeader*)p)->size = region_size;
+    return TO_REGION_DATA(p);
+#else
+    return allocate_region(region_size);
+#endif
+}
+
+// ------------------------------------
+// Implementation of a size class allocator
+// that rounds sizes up to a power-of-two size class,
+// and keeps a block allocator for each size class
+// ------------------------------------
+
+// The most size classes that an allocator can have, which is plenty for any address space
+#define MAX_SIZE_CLASSES 48
+
+// The internal size class allocator struct
+struct SizeClassAllocator {
+    int num_size_classes;
+    // The block allocators of each size class, created on first use
+    BlockAllocator* block_allocators[MAX_SIZE_CLASSES];
+    SizeClassStats stats[MAX_SIZE_CLASSES];
+};
+
+/*
+============================
+Private Function Implementations
+============================
+*/
+
+static int get_size_class(SizeClassAllocator* size_class_allocator, size_t size) {
+    /*
+        Get the smallest size class that can hold a block of the given size
+
+        Arguments:
+            size_class_allocator (SizeClassAllocator*): The size class allocator
+            size (size_t): The size of the block
+
+        Returns:
+            (int): The index of the size class
+    */
+
+    for (int i = 0; i < size_class_allocator->num_size_classes; i++) {
+        if (size <= size_class_allocator->stats[i].block_size) {
+            return i;
+        }
+    }
+    LOG_FATAL("Size class allocator can't allocate a block of size %zu", size);
+    return -1;
+}
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+SizeClassAllocator* create_size_class_allocator(size_t max_block_size, bool use_huge_pages) {
+    /*
+        Creates a size class allocator that will create and free blocks of up to max_block_size.
+        The smallest size class is a page, and every size class is twice as large as the
+        previous one. Each block's region is exactly as large as its size class.
+
+        Arguments:
+            max_block_size (size_t): The largest size that will be allocated
+            use_huge_pages (bool): Whether size classes of at least a huge page
+                are backed by transparent huge pages
+
+        Returns:
+            (SizeClassAllocator*): The created size class allocator
+    */
+
+    SizeClassAllocator* size_class_allocator = safe_zalloc(sizeof(SizeClassAllocator));
+
+    size_t region_size = get_page_size();
+    SizeClassStats* stats;
+    do {
+        FATAL_ASSERT(size_class_allocator->num_size_classes < MAX_SIZE_CLASSES);
+        stats = &size_class_allocator->stats[size_class_allocator->num_size_classes++];
+        stats->block_size = region_size - sizeof(RegionHeader);
+#if OS_IS(OS_LINUX) && defined(MADV_HUGEPAGE)
+        stats->huge_pages = use_huge_pages && region_size >= HUGE_PAGE_SIZE;
+#endif
+        region_size *= 2;
+    } while (stats->block_size < max_block_size);
+
+    return size_class_allocator;
+}
+
+void* allocate_sized_block(SizeClassAllocator* size_class_allocator, size_t size) {
+    /*
+        Allocates a block from the smallest size class that can hold the given size
+
+        Arguments:
+            size_class_allocator (SizeClassAllocator*): The size class allocator to use
+            size (size_t): The size of the block
+
+        Returns:
+            (void*): The new block
+    */
+
+    int size_class = get_size_class(size_class_allocator, size);
+    SizeClassStats* stats = &size_class_allocator->stats[size_class];
+    BlockAllocator** blk_allocator = &size_class_allocator->block_allocators[size_class];
+    if (*blk_allocator == NULL) {
+        *blk_allocator = create_block_allocator(stats->block_size);
+        (*blk_allocator)->use_huge_pages = stats->huge_pages;
+    }
+
+    void* block = allocate_block(*blk_allocator);
+
+    stats->blocks_in_use++;
+    stats->peak_blocks_in_use = max(stats->peak_blocks_in_use, stats->blocks_in_use);
+    stats->blocks_cached = (*blk_allocator)->num_free_blocks;
+    stats->bytes_requested += size;
+    stats->num_allocations++;
+    return block;
+}
+
+void free_sized_block(SizeClassAllocator* size_class_allocator, void* block, size_t size) {
+    /*
+        Frees a block allocated by allocate_sized_block
+
+        Arguments:
+            size_class_allocator (SizeClassAllocator*): The size class allocator that the block
+                was allocated from
+            block (void*): The block to free
+            size (size_t): The size that the block was allocated with
+    */
+
+    int size_class = get_size_class(size_class_allocator, size);
+    SizeClassStats* stats = &size_class_allocator->stats[size_class];
+    BlockAllocator* blk_allocator = size_class_allocator->block_allocators[size_class];
+    FATAL_ASSERT(blk_allocator != NULL && stats->blocks_in_use > 0);
+
+    free_block(blk_allocator, block);
+
+    stats->blocks_in_use--;
+    stats->blocks_cached = blk_allocator->num_free_blocks;
+    stats->bytes_requested -= size;
+}
+
+int get_size_class_stats(SizeClassAllocator* size_class_allocator, SizeClassStats* stats,
+                         int max_stats) {
+    /*
+        Gets the statistics of each size class, from the smallest
+
+        Arguments:
+            size_class_allocator (SizeClassAllocator*): The size class allocator
+            stats (SizeClassStats*): The array to write the statistics to
+            max_stats (int): The length of stats
+
+        Returns:
+            (int): The number of size classes written to stats
+    */
+
+    int num_stats = min(size_class_allocator->num_size_classes, max_stats);
+    memcpy(stats, size_class_allocator->stats, num_stats * sizeof(SizeClassStats));
+    return num_stats;
+}
+
+void destroy_size_class_allocator(SizeClassAllocator* size_class_allocator) {
+    /*
+        Destroy a size class allocator.
+        All blocks allocated from it must have been freed before this is called!
+
+        Arguments:
+            size_class_allocator (SizeClassAllocator*): The size class allocator to destroy
+    */
+
+    for (int i = 0; i < size_class_allocator->num_size_classes; i++) {
+        if (size_class_allocator->block_allocators[i] != NULL) {
+            destroy_block_allocator(size_class_allocator->block_allocators[i]);
+        }
+    }
+    free(size_class_allocator);
+}
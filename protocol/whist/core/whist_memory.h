@@ -137,6 +137,94 @@ void destroy_block_allocator(BlockAllocator* block_allocator);
 
 /** @} */
 
+/**
+ * @defgroup size_class_allocator Size Class Allocator
+ *
+ * Allocator for blocks of varying sizes. Each size is rounded up to a power-of-two size class,
+ * and each size class keeps a block allocator of its own.
+ *
+ * @{
+ */
+typedef struct SizeClassAllocator SizeClassAllocator;
+
+/**
+ * @brief                          The statistics of a single size class
+ */
+typedef struct {
+    // The largest size that a block of this class can hold
+    size_t block_size;
+    // Whether the blocks of this class are backed by transparent huge pages
+    bool huge_pages;
+    int blocks_in_use;
+    int peak_blocks_in_use;
+    // The number of freed blocks that are kept for reuse
+    int blocks_cached;
+    // The sum of the sizes that the blocks in use were allocated with
+    size_t bytes_requested;
+    unsigned long long num_allocations;
+} SizeClassStats;
+
+/**
+ * @brief                          Creates a size class allocator that will create and free
+ *                                 blocks of up to max_block_size. Like the block allocator, it
+ *                                 will _not_ interfere with the malloc heap.
+ *
+ * @param max_block_size           The largest size that will be allocated
+ *
+ * @param use_huge_pages           If true, the size classes of at least a huge page will be
+ *                                 backed by transparent huge pages, where the OS supports them
+ *
+ * @returns                        The size class allocator
+ */
+SizeClassAllocator* create_size_class_allocator(size_t max_block_size, bool use_huge_pages);
+
+/**
+ * @brief                          Allocates a block of at least the given size,
+ *                                 from the smallest size class that can hold it
+ *
+ * @param size_class_allocator     The size class allocator to use for allocating the block
+ *
+ * @param size                     The size of the block, at most max_block_size
+ *
+ * @returns                        The new block
+ */
+void* allocate_sized_block(SizeClassAllocator* size_class_allocator, size_t size);
+
+/**
+ * @brief                          Frees a block allocated by allocate_sized_block
+ *
+ * @param size_class_allocator     The size class allocator that the block was allocated from
+ *
+ * @param block                    The block to free
+ *
+ * @param size                     The size that the block was allocated with
+ */
+void free_sized_block(SizeClassAllocator* size_class_allocator, void* block, size_t size);
+
+/**
+ * @brief                          Gets the statistics of each size class, from the smallest
+ *
+ * @param size_class_allocator     The size class allocator to get the statistics of
+ *
+ * @param stats                    The array to write the statistics to
+ *
+ * @param max_stats                The length of stats
+ *
+ * @returns                        The number of size classes written to stats
+ */
+int get_size_class_stats(SizeClassAllocator* size_class_allocator, SizeClassStats* stats,
+                         int max_stats);
+
+/**
+ * @brief                          Destroys a size class allocator. All blocks allocated from this
+ *                                 instance must have been freed before calling this!
+ *
+ * @param size_class_allocator     The size class allocator to destroy
+ */
+void destroy_size_class_allocator(SizeClassAllocator* size_class_allocator);
+
+/** @} */
+
 /**
  * @defgroup region_allocator Region Allocator
  *
@@ -251,6 +251,17 @@ static string handle_report(vector<string> cmd) {
     }
 }
 
+// function to handle the report_frame_buffers command
+static string handle_report_frame_buffers(vector<string> cmd) {
+    FATAL_ASSERT(cmd[0] == "report_frame_buffers");
+    string s = whist_analyzer_get_frame_buffer_report();
+
+    if (s.empty()) {
+        return wrap_with_color("protocol analyzer not running, or no frame buffers yet", RED);
+    }
+    return s;
+}
+
 static string handle_info(vector<string> cmd) {
     FATAL_ASSERT(cmd[0] == "info");
     stringstream ss;
@@ -303,6 +314,8 @@ static int debug_console_thread(void *) {
         } else if (cmd[0] == "report_audio" || cmd[0] == "report_video" ||
                    cmd[0] == "report_audio_moreformat" || cmd[0] == "report_video_moreformat") {
             reply2 = handle_report(cmd);
+        } else if (cmd[0] == "report_frame_buffers") {
+            reply2 = handle_report_frame_buffers(cmd);
         } else if (cmd[0] == "info") {
             reply2 = handle_info(cmd);
         } else if (cmd[0] == "insert_atexit_handler" || cmd[0] == "insert") {
@@ -204,6 +204,8 @@ struct TypeLevelInfo {
     // temply stores the 2 info at TypeLevel, and pass through to frame level
     FECInfo current_fec_info;  // current FEC info
     CCInfo current_cc_info;    // current congestion control info
+
+    vector<SizeClassStats> frame_buffer_stats;  // stats of the ringbuffer's frame buffers
 };
 
 // we put a duplicate forward declaration before ProtocolAnalyzer, so that we don't need
@@ -440,6 +442,27 @@ struct ProtocolAnalyzer {
         }
     }
 
+    void record_frame_buffer_stats(int type, const SizeClassStats *stats, int num_stats) {
+        type_level_infos[type].frame_buffer_stats.assign(stats, stats + num_stats);
+    }
+
+    // get a table of the frame buffer stats of each type, one line per size class
+    string get_frame_buffer_report() {
+        stringstream ss;
+        for (auto &it : type_level_infos) {
+            if (it.second.frame_buffer_stats.empty()) continue;
+            ss << (it.first == PACKET_VIDEO ? "video" : "audio") << " frame buffers:" << endl;
+            ss << "block_size in_use peak cached allocations requested_bytes huge_pages" << endl;
+            for (auto &stats : it.second.frame_buffer_stats) {
+                ss << stats.block_size << " " << stats.blocks_in_use << " "
+                   << stats.peak_blocks_in_use << " " << stats.blocks_cached << " "
+                   << stats.num_allocations << " " << stats.bytes_requested << " "
+                   << stats.huge_pages << endl;
+            }
+        }
+        return ss.str();
+    }
+
     void record_audio_action(const char *action) {
         int type = PACKET_AUDIO;
         int id = type_level_infos[type].pending_rending_id;
@@ -652,6 +675,11 @@ void whist_analyzer_record_audio_action(const char *action) {
     FUNC_WRAPPER(record_audio_action, action);
 }
 
+void whist_analyzer_record_frame_buffer_stats(int type, const SizeClassStats *stats,
+                                              int num_stats) {
+    FUNC_WRAPPER(record_frame_buffer_stats, type, stats, num_stats);
+}
+
 string whist_analyzer_get_report(int type, int num, int skip, bool more_format) {
     if (g_analyzer == NULL) {
         return "";
@@ -666,6 +694,16 @@ string whist_analyzer_get_report(int type, int num, int skip, bool more_format)
     return s;
 }
 
+string whist_analyzer_get_frame_buffer_report(void) {
+    if (g_analyzer == NULL) {
+        return "";
+    }
+    whist_lock_mutex(g_analyzer->m_mutex);
+    string s = g_analyzer->get_frame_buffer_report();
+    whist_unlock_mutex(g_analyzer->m_mutex);
+    return s;
+}
+
 /*
 ============================
 Private Function Implementations
@@ -89,11 +89,16 @@ void whist_analyzer_record_current_audio_queue_info(double scale_factor, double
 // record actions by audio algorithm
 void whist_analyzer_record_audio_action(const char *action);
 
+// record the per-size-class statistics of a ringbuffer's frame buffer allocator
+void whist_analyzer_record_frame_buffer_stats(int type, const SizeClassStats *stats,
+                                              int num_stats);
+
 // only expose this function to c++
 #ifdef __cplusplus
 extern "C++" {
 #include <string>
 std::string whist_analyzer_get_report(int type, int num, int skip, bool more_format);
+std::string whist_analyzer_get_frame_buffer_report(void);
 }
 #endif
 
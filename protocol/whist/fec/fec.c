@@ -3,7 +3,9 @@
 
 #include "fec.h"
 #include "whist/core/whist.h"
+#include "whist/core/features.h"
 #include "whist/fec/rs_wrapper.h"
+#include "whist/fec/wirehair/wirehair.h"
 
 // lugi's original library, Vandermonde Maxtrix, O(N^3+ N*X*L) decode
 // N is number of original packets, X is num of lost packets, L is max packet length
@@ -50,8 +52,14 @@ struct FECEncoder {
     void** buffers;
     int max_packet_size;  // max (original) buffer size fed into encoder so far.
                           // TODO: rename into max_accepted_buffer_size
-    RSWrapper* rs_code;
-    bool encode_performed;
+    FECCodec codec;
+    RSWrapper* rs_code;  // only used by FEC_CODEC_REED_SOLOMON
+    bool originals_prepared;  // whether buffers holds the padded copies of the originals
+    int fec_payload_size;     // the size of the padded originals, and of the fec buffers
+
+    // only used by FEC_CODEC_WIREHAIR, once the originals are prepared
+    WirehairCodec wirehair_codec;
+    char* wirehair_message;  // the padded originals, one after another, that buffers point into
 };
 
 struct FECDecoder {
@@ -64,8 +72,16 @@ struct FECDecoder {
     void** buffers;
     int max_packet_size;  // max buffer size fed into decoder so far.
                           // TODO: rename into max_accepted_buffer_size
-    RSWrapper* rs_code;
+    FECCodec codec;
+    RSWrapper* rs_code;  // only used by FEC_CODEC_REED_SOLOMON
     bool recovery_performed;
+
+    // only used by FEC_CODEC_WIREHAIR, once the first fec buffer is registered
+    WirehairCodec wirehair_codec;
+    int wirehair_block_size;  // the size of the fec buffers, that originals are padded to
+    bool wirehair_decodable;  // whether wirehair has been given enough buffers to decode
+    char* wirehair_padding_buffer;  // holds an original buffer, while it's padded
+    char* wirehair_message;         // the recovered originals, one after another
 };
 
 /*
@@ -86,13 +102,30 @@ void write_u16_to_buffer(char* p, uint16_t w);
 // read a 16bit uint from buffer
 uint16_t read_u16_from_buffer(char* p);
 
+// copy the original buffers registered into the encoder, behind the small header that holds
+// their size, and zero-padded to equal length, which the rs encoder requires.
+// does nothing if it's been done already
+static void prepare_original_buffers(FECEncoder* fec_encoder);
+
+// pass a registered buffer to the wirehair decoder, creating it when the first fec buffer comes
+static void wirehair_decoder_register_buffer(FECDecoder* fec_decoder, int index);
+
+// feed a registered buffer into the wirehair decoder, zero-padded to the block size
+static void wirehair_decoder_feed_buffer(FECDecoder* fec_decoder, int index);
+
 /*
 ============================
 Public Function Implementations
 ============================
 */
 
-int init_fec(void) { return init_rs_wrapper(); }
+int init_fec(void) {
+    if (wirehair_init() != Wirehair_Success) {
+        LOG_ERROR("Failed to initialize wirehair");
+        return -1;
+    }
+    return init_rs_wrapper();
+}
 
 double fec_ratio_to_fec_factor(double fec_ratio) { return 1.0 / (1.0 - fec_ratio); }
 
@@ -109,9 +142,19 @@ int get_num_fec_packets(int num_real_packets, double fec_packet_ratio) {
     return ceil(num_real_packets * ratio);
 }
 
-FECEncoder* create_fec_encoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size) {
+FECCodec fec_get_codec(int num_real_buffers) {
+    if (FEATURE_ENABLED(WIREHAIR_FEC) && num_real_buffers >= WIREHAIR_MIN_REAL_BUFFERS) {
+        return FEC_CODEC_WIREHAIR;
+    }
+    return FEC_CODEC_REED_SOLOMON;
+}
+
+FECEncoder* create_fec_encoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size,
+                               FECCodec codec) {
     FATAL_ASSERT(max_buffer_size <= MAX_BUFFER_SIZE);
     FATAL_ASSERT(max_buffer_size >= FEC_HEADER_SIZE);
+    // wirehair can't encode a single block
+    FATAL_ASSERT(codec != FEC_CODEC_WIREHAIR || num_real_buffers >= 2);
 
     FECEncoder* fec_encoder = safe_malloc(sizeof(*fec_encoder));
 
@@ -124,9 +167,16 @@ FECEncoder* create_fec_encoder(int num_real_buffers, int num_fec_buffers, int ma
     memset(fec_encoder->buffers, 0, sizeof(void*) * num_total_buffers);
     fec_encoder->buffer_sizes = safe_malloc(sizeof(int) * num_total_buffers);
     fec_encoder->max_packet_size = -1;
-    fec_encoder->encode_performed = false;
+    fec_encoder->originals_prepared = false;
 
-    fec_encoder->rs_code = rs_wrapper_create(num_real_buffers, num_real_buffers + num_fec_buffers);
+    fec_encoder->codec = codec;
+    fec_encoder->rs_code = NULL;
+    if (codec == FEC_CODEC_REED_SOLOMON) {
+        fec_encoder->rs_code =
+            rs_wrapper_create(num_real_buffers, num_real_buffers + num_fec_buffers);
+    }
+    fec_encoder->wirehair_codec = NULL;
+    fec_encoder->wirehair_message = NULL;
 
     return fec_encoder;
 }
@@ -189,73 +239,77 @@ void fec_encoder_register_buffer(FECEncoder* fec_encoder, void* buffer, int buff
     FATAL_ASSERT(remaining_buffer_size == 0);
 }
 
-void fec_get_encoded_buffers(FECEncoder* fec_encoder, void** buffers, int* buffer_sizes) {
-    FATAL_ASSERT(fec_encoder->num_accepted_buffers == fec_encoder->num_real_buffers);
-    if (!fec_encoder->encode_performed) {
-        // the size of actual data feed into fec_encoder
-        int fec_payload_size = sizeof(uint16_t) + fec_encoder->max_packet_size;
-
-        // rs encoder requires packets to have equal length, so we pad packets to max_buffer_size
-        for (int i = 0; i < fec_encoder->num_real_buffers; i++) {
-            // save a copy of the original buffer pointer and size
-            char* original_buffer = fec_encoder->buffers[i];
-            int original_size = fec_encoder->buffer_sizes[i];
-
-            FATAL_ASSERT(fec_encoder->buffers[i] != NULL);
-
-            // malloc buffers for feeding into the encoder
-            fec_encoder->buffers[i] = safe_malloc(fec_payload_size);
-            fec_encoder->buffer_sizes[i] = sizeof(uint16_t) + original_size;
-
-            write_u16_to_buffer(fec_encoder->buffers[i], (uint16_t)original_size);
+void fec_get_original_buffers(FECEncoder* fec_encoder, void** buffers, int* buffer_sizes) {
+    prepare_original_buffers(fec_encoder);
 
-            // write a small header infront of buffer, which is protected by FEC.
-            // so that even if this buffer got loss, we can recover the buffer length.
-            memcpy((char*)fec_encoder->buffers[i] + sizeof(uint16_t), original_buffer,
-                   original_size);
-            memset((char*)fec_encoder->buffers[i] + fec_encoder->buffer_sizes[i], 0,
-                   fec_payload_size - fec_encoder->buffer_sizes[i]);
-            // TODO, protential optimization
-            // if it's the assumption that all packet has same length excpet the last one, and the
-            // last one is shorter then only the last one needs padding
+    // Populate buffers and buffer_sizes
+    for (int i = 0; i < fec_encoder->num_real_buffers; i++) {
+        buffers[i] = fec_encoder->buffers[i];
+        buffer_sizes[i] = fec_encoder->buffer_sizes[i];
+    }
+}
 
-            // TODO we can optimize special case of fec_packet num equal to 1  (using XOR)
+void fec_get_fec_buffer(FECEncoder* fec_encoder, int index, void** buffer, int* buffer_size) {
+    FATAL_ASSERT(fec_encoder->num_real_buffers <= index && index < fec_encoder->num_buffers);
+    prepare_original_buffers(fec_encoder);
+
+    // a fec buffer is encoded the first time it's asked for
+    if (fec_encoder->buffers[index] == NULL) {
+        fec_encoder->buffers[index] = safe_malloc(fec_encoder->fec_payload_size);
+        fec_encoder->buffer_sizes[index] = fec_encoder->fec_payload_size;
+        if (fec_encoder->codec == FEC_CODEC_WIREHAIR) {
+            // wirehair's block ids past the original blocks are its recovery blocks
+            uint32_t bytes_written;
+            WirehairResult result = wirehair_encode(
+                fec_encoder->wirehair_codec, (unsigned)index, fec_encoder->buffers[index],
+                (uint32_t)fec_encoder->fec_payload_size, &bytes_written);
+            FATAL_ASSERT(result == Wirehair_Success);
+            FATAL_ASSERT((int)bytes_written == fec_encoder->fec_payload_size);
+        } else {
+            rs_wrapper_encode_one(fec_encoder->rs_code, fec_encoder->buffers, index,
+                                  fec_encoder->buffers[index], fec_encoder->fec_payload_size);
         }
+    }
 
-        // call rs encoder to generate new packets
-        for (int i = fec_encoder->num_real_buffers; i < fec_encoder->num_buffers; i++) {
-            fec_encoder->buffers[i] = safe_malloc(fec_payload_size);
-            fec_encoder->buffer_sizes[i] = fec_payload_size;
-        }
-        rs_wrapper_encode(fec_encoder->rs_code, (void**)fec_encoder->buffers,
-                          fec_encoder->buffers + fec_encoder->num_real_buffers, fec_payload_size);
-        fec_encoder->encode_performed = true;
+    *buffer = fec_encoder->buffers[index];
+    *buffer_size = fec_encoder->buffer_sizes[index];
+}
 
-    }  // currently we allow fec_get_encoded_buffers to be called multiple times,
+void fec_get_encoded_buffers(FECEncoder* fec_encoder, void** buffers, int* buffer_sizes) {
+    // currently we allow fec_get_encoded_buffers to be called multiple times,
     // the code can be simplified a bit if only allow once
-
-    // Populate buffers and buffer_sizes
-    for (int i = 0; i < fec_encoder->num_buffers; i++) {
-        buffers[i] = fec_encoder->buffers[i];
-        buffer_sizes[i] = fec_encoder->buffer_sizes[i];
+    fec_get_original_buffers(fec_encoder, buffers, buffer_sizes);
+    for (int i = fec_encoder->num_real_buffers; i < fec_encoder->num_buffers; i++) {
+        fec_get_fec_buffer(fec_encoder, i, &buffers[i], &buffer_sizes[i]);
     }
 }
 
 void destroy_fec_encoder(FECEncoder* fec_encoder) {
     int num_total_buffers = fec_encoder->num_buffers;
-    if (fec_encoder->encode_performed) {
-        for (int i = 0; i < num_total_buffers; i++) {
+    if (fec_encoder->originals_prepared) {
+        // with wirehair, the original buffers all live in wirehair_message
+        int first_allocated_buffer =
+            fec_encoder->codec == FEC_CODEC_WIREHAIR ? fec_encoder->num_real_buffers : 0;
+        for (int i = first_allocated_buffer; i < num_total_buffers; i++) {
             if (fec_encoder->buffers[i] != NULL) free(fec_encoder->buffers[i]);
         }
     }
     free(fec_encoder->buffers);
     free(fec_encoder->buffer_sizes);
-    rs_wrapper_destroy(fec_encoder->rs_code);
+    if (fec_encoder->rs_code != NULL) {
+        rs_wrapper_destroy(fec_encoder->rs_code);
+    }
+    if (fec_encoder->wirehair_codec != NULL) {
+        wirehair_free(fec_encoder->wirehair_codec);
+    }
+    free(fec_encoder->wirehair_message);
     free(fec_encoder);
 }
 
-FECDecoder* create_fec_decoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size) {
+FECDecoder* create_fec_decoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size,
+                               FECCodec codec) {
     FATAL_ASSERT(max_buffer_size <= MAX_BUFFER_SIZE);
+    FATAL_ASSERT(codec != FEC_CODEC_WIREHAIR || num_real_buffers >= 2);
 
     FECDecoder* fec_decoder = safe_malloc(sizeof(*fec_decoder));
 
@@ -272,8 +326,18 @@ FECDecoder* create_fec_decoder(int num_real_buffers, int num_fec_buffers, int ma
     fec_decoder->num_accepted_buffers = 0;
     fec_decoder->num_accepted_real_buffers = 0;
     fec_decoder->max_packet_size = -1;
-    fec_decoder->rs_code = rs_wrapper_create(num_real_buffers, num_real_buffers + num_fec_buffers);
+    fec_decoder->codec = codec;
+    fec_decoder->rs_code = NULL;
+    if (codec == FEC_CODEC_REED_SOLOMON) {
+        fec_decoder->rs_code =
+            rs_wrapper_create(num_real_buffers, num_real_buffers + num_fec_buffers);
+    }
     fec_decoder->recovery_performed = false;
+    fec_decoder->wirehair_codec = NULL;
+    fec_decoder->wirehair_block_size = 0;
+    fec_decoder->wirehair_decodable = false;
+    fec_decoder->wirehair_padding_buffer = NULL;
+    fec_decoder->wirehair_message = NULL;
     return fec_decoder;
 }
 
@@ -295,20 +359,54 @@ void fec_decoder_register_buffer(FECDecoder* fec_decoder, int index, void* buffe
     }
 
     fec_decoder->max_packet_size = max(fec_decoder->max_packet_size, buffer_size);
+    if (fec_decoder->codec == FEC_CODEC_WIREHAIR) {
+        wirehair_decoder_register_buffer(fec_decoder, index);
+        return;
+    }
     rs_wrapper_decode_helper_register_index(fec_decoder->rs_code, index);
+    // do the decoding work for this buffer now, rather than all at once in fec_get_decoded_buffer
+    if (rs_wrapper_is_progressive(fec_decoder->rs_code)) {
+        rs_wrapper_progressive_decode_register_buffer(fec_decoder->rs_code, index, buffer,
+                                                      buffer_size);
+    }
 }
 
 int fec_get_decoded_buffer(FECDecoder* fec_decoder, void* buffer) {
-    if (rs_wrapper_decode_helper_can_decode(fec_decoder->rs_code) == false) {
-        return -1;
-    }
     bool need_recovery = false;
     // For optimization, we only need recovery, if we need to reconstruct a real packet
     if (fec_decoder->num_accepted_real_buffers != fec_decoder->num_real_buffers) {
         need_recovery = true;
     }
 
-    if (need_recovery && !fec_decoder->recovery_performed) {
+    // wirehair can't tell whether it can decode from the number of buffers alone
+    if (fec_decoder->codec == FEC_CODEC_WIREHAIR) {
+        if (need_recovery && !fec_decoder->wirehair_decodable) {
+            return -1;
+        }
+    } else if (rs_wrapper_decode_helper_can_decode(fec_decoder->rs_code) == false) {
+        return -1;
+    }
+
+    if (need_recovery && !fec_decoder->recovery_performed &&
+        fec_decoder->codec == FEC_CODEC_WIREHAIR) {
+        // recover the whole frame at once, which is much faster than each missing buffer
+        int message_size = fec_decoder->num_real_buffers * fec_decoder->wirehair_block_size;
+        fec_decoder->wirehair_message = safe_malloc(message_size);
+        WirehairResult result = wirehair_recover(fec_decoder->wirehair_codec,
+                                                 fec_decoder->wirehair_message, message_size);
+        FATAL_ASSERT(result == Wirehair_Success);
+        for (int i = 0; i < fec_decoder->num_real_buffers; i++) {
+            fec_decoder->buffers[i] =
+                fec_decoder->wirehair_message + i * fec_decoder->wirehair_block_size;
+        }
+        fec_decoder->recovery_performed = true;
+    } else if (need_recovery && !fec_decoder->recovery_performed &&
+               rs_wrapper_is_progressive(fec_decoder->rs_code)) {
+        // only the missing original buffers are left to solve for,
+        // and the buffers recovered belong to the rs_wrapper
+        rs_wrapper_progressive_decode(fec_decoder->rs_code, fec_decoder->buffers);
+        fec_decoder->recovery_performed = true;
+    } else if (need_recovery && !fec_decoder->recovery_performed) {
         int cnt = 0;
         int* index = safe_malloc(fec_decoder->num_accepted_buffers * sizeof(int));
 
@@ -364,14 +462,22 @@ int fec_get_decoded_buffer(FECDecoder* fec_decoder, void* buffer) {
 }
 
 void destroy_fec_decoder(FECDecoder* fec_decoder) {
-    if (fec_decoder->recovery_performed) {
-        for (int i = 0; i < fec_decoder->num_buffers; i++) {
-            free(fec_decoder->buffers[i]);
+    if (fec_decoder->codec == FEC_CODEC_WIREHAIR) {
+        if (fec_decoder->wirehair_codec != NULL) {
+            wirehair_free(fec_decoder->wirehair_codec);
         }
+        free(fec_decoder->wirehair_padding_buffer);
+        free(fec_decoder->wirehair_message);
+    } else {
+        if (fec_decoder->recovery_performed && !rs_wrapper_is_progressive(fec_decoder->rs_code)) {
+            for (int i = 0; i < fec_decoder->num_buffers; i++) {
+                free(fec_decoder->buffers[i]);
+            }
+        }
+        rs_wrapper_destroy(fec_decoder->rs_code);
     }
     free(fec_decoder->buffers);
     free(fec_decoder->buffer_sizes);
-    rs_wrapper_destroy(fec_decoder->rs_code);
     free(fec_decoder);
 }
 
@@ -389,3 +495,113 @@ void write_u16_to_buffer(char* p, uint16_t w) { *(uint16_t*)p = w; }
 
 // reads a 16bit int from buffer
 uint16_t read_u16_from_buffer(char* p) { return *(uint16_t*)p; }
+
+static void prepare_original_buffers(FECEncoder* fec_encoder) {
+    FATAL_ASSERT(fec_encoder->num_accepted_buffers == fec_encoder->num_real_buffers);
+    if (fec_encoder->originals_prepared) {
+        return;
+    }
+
+    // the size of actual data feed into fec_encoder
+    int fec_payload_size = sizeof(uint16_t) + fec_encoder->max_packet_size;
+
+    // wirehair encodes a single message, so the originals are laid out one after another
+    if (fec_encoder->codec == FEC_CODEC_WIREHAIR) {
+        fec_encoder->wirehair_message =
+            safe_malloc((size_t)fec_payload_size * fec_encoder->num_real_buffers);
+    }
+
+    // rs encoder requires packets to have equal length, so we pad packets to max_buffer_size
+    for (int i = 0; i < fec_encoder->num_real_buffers; i++) {
+        // save a copy of the original buffer pointer and size
+        char* original_buffer = fec_encoder->buffers[i];
+        int original_size = fec_encoder->buffer_sizes[i];
+
+        FATAL_ASSERT(fec_encoder->buffers[i] != NULL);
+
+        // malloc buffers for feeding into the encoder
+        if (fec_encoder->codec == FEC_CODEC_WIREHAIR) {
+            fec_encoder->buffers[i] = fec_encoder->wirehair_message + i * fec_payload_size;
+        } else {
+            fec_encoder->buffers[i] = safe_malloc(fec_payload_size);
+        }
+        fec_encoder->buffer_sizes[i] = sizeof(uint16_t) + original_size;
+
+        write_u16_to_buffer(fec_encoder->buffers[i], (uint16_t)original_size);
+
+        // write a small header infront of buffer, which is protected by FEC.
+        // so that even if this buffer got loss, we can recover the buffer length.
+        memcpy((char*)fec_encoder->buffers[i] + sizeof(uint16_t), original_buffer, original_size);
+        memset((char*)fec_encoder->buffers[i] + fec_encoder->buffer_sizes[i], 0,
+               fec_payload_size - fec_encoder->buffer_sizes[i]);
+        // TODO, protential optimization
+        // if it's the assumption that all packet has same length excpet the last one, and the
+        // last one is shorter then only the last one needs padding
+
+        // TODO we can optimize special case of fec_packet num equal to 1  (using XOR)
+    }
+
+    if (fec_encoder->codec == FEC_CODEC_WIREHAIR) {
+        fec_encoder->wirehair_codec = wirehair_encoder_create(
+            NULL, fec_encoder->wirehair_message,
+            (uint64_t)fec_payload_size * fec_encoder->num_real_buffers, (uint32_t)fec_payload_size);
+        FATAL_ASSERT(fec_encoder->wirehair_codec != NULL);
+    }
+
+    // the fec buffers are allocated and encoded as they're asked for
+    fec_encoder->fec_payload_size = fec_payload_size;
+    fec_encoder->originals_prepared = true;
+}
+
+static void wirehair_decoder_register_buffer(FECDecoder* fec_decoder, int index) {
+    if (fec_decoder->wirehair_codec == NULL) {
+        // the block size is only known from the fec buffers, since the original buffers may be
+        // shorter. there's nothing to recover until a fec buffer arrives anyway
+        if (index < fec_decoder->num_real_buffers) {
+            return;
+        }
+        int block_size = fec_decoder->buffer_sizes[index];
+        if (block_size <= 0) {
+            LOG_ERROR("Received an empty wirehair FEC buffer");
+            return;
+        }
+        fec_decoder->wirehair_block_size = block_size;
+        fec_decoder->wirehair_codec = wirehair_decoder_create(
+            NULL, (uint64_t)block_size * fec_decoder->num_real_buffers, (uint32_t)block_size);
+        FATAL_ASSERT(fec_decoder->wirehair_codec != NULL);
+        fec_decoder->wirehair_padding_buffer = safe_malloc(block_size);
+
+        // catch up on the original buffers registered so far
+        for (int i = 0; i < fec_decoder->num_real_buffers; i++) {
+            if (fec_decoder->buffer_sizes[i] != -1) {
+                wirehair_decoder_feed_buffer(fec_decoder, i);
+            }
+        }
+    }
+    wirehair_decoder_feed_buffer(fec_decoder, index);
+}
+
+static void wirehair_decoder_feed_buffer(FECDecoder* fec_decoder, int index) {
+    // wirehair doesn't need any more buffers once it can decode
+    if (fec_decoder->wirehair_decodable) {
+        return;
+    }
+
+    // pad the buffer with zeros, just like the encoder did
+    int block_size = fec_decoder->wirehair_block_size;
+    int size = min(fec_decoder->buffer_sizes[index], block_size);
+    const void* block = fec_decoder->buffers[index];
+    if (size < block_size) {
+        memcpy(fec_decoder->wirehair_padding_buffer, block, size);
+        memset(fec_decoder->wirehair_padding_buffer + size, 0, block_size - size);
+        block = fec_decoder->wirehair_padding_buffer;
+    }
+
+    WirehairResult result =
+        wirehair_decode(fec_decoder->wirehair_codec, (unsigned)index, block, (uint32_t)block_size);
+    if (result == Wirehair_Success) {
+        fec_decoder->wirehair_decodable = true;
+    } else if (result != Wirehair_NeedMore) {
+        LOG_ERROR("wirehair_decode failed: %s", wirehair_result_string(result));
+    }
+}
@@ -16,9 +16,41 @@ Defines
 // This is unused at the moment
 #define FEC_HEADER_SIZE 2
 
+// Frames of at least this many original buffers are encoded with Wirehair,
+// when the wirehair FEC feature is enabled
+#define WIREHAIR_MIN_REAL_BUFFERS 128
+
 typedef struct FECEncoder FECEncoder;
 typedef struct FECDecoder FECDecoder;
 
+/**
+ * @brief                          The codecs that an FEC encoder and decoder can use.
+ *                                 The original buffers are sent identically with either codec,
+ *                                 only the FEC buffers differ.
+ */
+typedef enum {
+    // Reed-Solomon through rs_wrapper, in groups of at most 256 buffers,
+    // which always decodes from any num_real_buffers buffers of a group
+    FEC_CODEC_REED_SOLOMON,
+    // The Wirehair fountain code over the whole frame, which needs at least 2 original buffers,
+    // and occasionally a buffer or two more than num_real_buffers to decode
+    FEC_CODEC_WIREHAIR,
+} FECCodec;
+
+/**
+ * @brief                          How strongly a frame should be protected by FEC, relative to
+ *                                 the other frames of the stream.
+ */
+typedef enum {
+    // Nothing depends on the frame, e.g. an empty video frame
+    FEC_PROTECTION_LOW,
+    // The default, e.g. a frame whose loss can be fixed by referring to a long-term reference
+    FEC_PROTECTION_NORMAL,
+    // Losing the frame is expensive, e.g. it is a recovery point, or its loss forces an intra frame
+    FEC_PROTECTION_HIGH,
+    NUM_FEC_PROTECTION_CLASSES,
+} FECProtectionClass;
+
 /*
 ============================
 Public Functions
@@ -44,6 +76,19 @@ int init_fec(void);
  */
 int get_num_fec_packets(int num_real_packets, double fec_packet_ratio);
 
+/**
+ * @brief                          Gets the codec that a frame is FEC encoded with.
+ *                                 The sender and the receiver agree on it, as long as
+ *                                 they agree on the feature mask.
+ *
+ * @param num_real_buffers         The numbers of buffers used in the original frame
+ *
+ * @returns                        Wirehair if the wirehair FEC feature is enabled and the frame
+ *                                 has at least WIREHAIR_MIN_REAL_BUFFERS original buffers,
+ *                                 Reed-Solomon otherwise
+ */
+FECCodec fec_get_codec(int num_real_buffers);
+
 /**
  * @brief                          Creates an FEC Encoder
  *
@@ -54,9 +99,12 @@ int get_num_fec_packets(int num_real_packets, double fec_packet_ratio);
  *
  * @param max_buffer_size          The largest valid size of a buffer
  *
+ * @param codec                    The codec to encode with
+ *
  * @returns                        The initialized FEC Encoder
  */
-FECEncoder* create_fec_encoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size);
+FECEncoder* create_fec_encoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size,
+                               FECCodec codec);
 
 /**
  * @brief                          Calculate the num of real buffers needed, to hold the
@@ -105,6 +153,38 @@ void fec_encoder_register_buffer(FECEncoder* fec_encoder, void* buffer, int buff
  */
 void fec_get_encoded_buffers(FECEncoder* fec_encoder, void** buffers, int* buffer_sizes);
 
+/**
+ * @brief                          Gets the original buffers, without encoding any FEC buffer.
+ *                                 This is cheap, so that the original buffers can be sent
+ *                                 while the FEC buffers are still being encoded.
+ *
+ * @param fec_encoder              The FEC encoder to use
+ *
+ * @param buffers                  The array of `void*` buffers for the original packets
+ *
+ * @param buffer_sizes             The array of `int` buffer sizes of the original packets
+ *
+ * @note                           The two arrays given should be allocated to be of size
+ *                                 `num_real_buffers`. The buffers are the same as the first
+ *                                 `num_real_buffers` that `fec_get_encoded_buffers` gives.
+ */
+void fec_get_original_buffers(FECEncoder* fec_encoder, void** buffers, int* buffer_sizes);
+
+/**
+ * @brief                          Gets a single FEC buffer, encoding it if it hasn't been yet
+ *
+ * @param fec_encoder              The FEC encoder to use
+ *
+ * @param index                    The index of the FEC buffer, from `num_real_buffers`
+ *                                 up to `num_real_buffers` + `num_fec_buffers`
+ *
+ * @param buffer                   Receives the FEC buffer, which will be alive for as long
+ *                                 as the FEC encoder is alive
+ *
+ * @param buffer_size              Receives the size of the FEC buffer
+ */
+void fec_get_fec_buffer(FECEncoder* fec_encoder, int index, void** buffer, int* buffer_size);
+
 /**
  * @brief                          Destroys an FEC Encoder
  *
@@ -123,12 +203,15 @@ void destroy_fec_encoder(FECEncoder* fec_encoder);
  *
  * @param max_buffer_size          The largest valid size of a buffer
  *
+ * @param codec                    The codec to decode with
+ *
  * @returns                        The initialized FEC Decoder
  *
- * @note                           When decoding, these these three parameters MUST match
- *                                 the three parameters passed into `create_fec_encoder`
+ * @note                           When decoding, these these four parameters MUST match
+ *                                 the four parameters passed into `create_fec_encoder`
  */
-FECDecoder* create_fec_decoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size);
+FECDecoder* create_fec_decoder(int num_real_buffers, int num_fec_buffers, int max_buffer_size,
+                               FECCodec codec);
 
 /**
  * @brief                          Registers a buffer into the decoder.
@@ -162,7 +245,9 @@ void fec_decoder_register_buffer(FECDecoder* fec_decoder, int index, void* buffe
  *                                 or `NULL` if you only want the return value of this function.
  *
  * @returns                        The size of the decoded buffer,
- *                                 or -1 if it was not possible to decode it
+ *                                 or -1 if it was not possible to decode it yet.
+ *                                 With Wirehair, that may be the case even once
+ *                                 `num_real_buffers` buffers have been registered.
  *
  * @note                           This refers to some buffer returned by `fec_get_encoded_buffers`,
  *                                 with `index` indexing into the arrays returned by that function.
@@ -529,3 +529,68 @@ double fec_controller_get_total_fec_ratio(void *controller, double current_time,
 
     return total_fec_ratio;
 }
+
+void fec_controller_record_class_bytes(double class_bytes[NUM_FEC_PROTECTION_CLASSES],
+                                       FECProtectionClass protection_class, int bytes) {
+    FATAL_ASSERT(0 <= protection_class && protection_class < NUM_FEC_PROTECTION_CLASSES);
+    // decay factor per recorded frame, so that roughly the last hundred frames are considered
+    const double CLASS_BYTES_DECAY = 0.98;  // NOLINT
+    for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+        class_bytes[i] *= CLASS_BYTES_DECAY;
+    }
+    class_bytes[protection_class] += bytes;
+}
+
+void fec_controller_get_class_fec_ratios(double total_fec_ratio,
+                                         const double class_bytes[NUM_FEC_PROTECTION_CLASSES],
+                                         double class_fec_ratios[NUM_FEC_PROTECTION_CLASSES]) {
+    // how much fec overhead each class gets, relative to FEC_PROTECTION_NORMAL
+    const double class_weights[NUM_FEC_PROTECTION_CLASSES] = {0.5, 1.0, 2.0};
+
+    // The budget is spread as overhead, i.e. fec bytes per original byte, since that is what
+    // adds up across classes. A ratio r corresponds to an overhead of r / (1 - r).
+    total_fec_ratio = min(total_fec_ratio, MAX_FEC_RATIO);
+    const double max_overhead = MAX_FEC_RATIO / (1.0 - MAX_FEC_RATIO);
+    double total_bytes = 0;
+    for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+        total_bytes += class_bytes[i];
+    }
+    if (total_fec_ratio <= 0 || total_bytes <= 0) {
+        for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+            class_fec_ratios[i] = total_fec_ratio;
+        }
+        return;
+    }
+    double budget = total_bytes * total_fec_ratio / (1.0 - total_fec_ratio);
+
+    // Give each class overhead in proportion to its weight. If a class would exceed the max
+    // overhead, clip it there and share what's left among the others, until none exceed it.
+    bool clipped[NUM_FEC_PROTECTION_CLASSES] = {false};
+    double scale = 0;
+    bool clipped_any;
+    do {
+        clipped_any = false;
+        double weighted_bytes = 0;
+        double remaining_budget = budget;
+        for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+            if (clipped[i]) {
+                remaining_budget -= class_bytes[i] * max_overhead;
+            } else {
+                weighted_bytes += class_bytes[i] * class_weights[i];
+            }
+        }
+        // With no bytes left to spread over, the unclipped classes can have any scale
+        scale = weighted_bytes > 0 ? remaining_budget / weighted_bytes : max_overhead;
+        for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+            if (!clipped[i] && scale * class_weights[i] > max_overhead) {
+                clipped[i] = true;
+                clipped_any = true;
+            }
+        }
+    } while (clipped_any);
+
+    for (int i = 0; i < NUM_FEC_PROTECTION_CLASSES; i++) {
+        double overhead = clipped[i] ? max_overhead : min(scale * class_weights[i], max_overhead);
+        class_fec_ratios[i] = overhead / (1.0 + overhead);
+    }
+}
@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <whist/fec/fec.h>
+
 #define ENABLE_FEC false
 #define INITIAL_FEC_RATIO 0.05
 
@@ -69,3 +71,33 @@ void fec_controller_feed_info(void* fec_controller, double current_time, WccOp o
  */
 double fec_controller_get_total_fec_ratio(void* fec_controller, double current_time,
                                           double old_value);
+
+/**
+ * @brief                          Record that a frame of the given protection class was sent,
+ *                                 into a decaying history of bytes sent per class
+ *
+ * @param class_bytes              The history to update, zero-initialized before first use
+ * @param protection_class         The protection class of the frame
+ * @param bytes                    The size of the frame, before FEC
+ */
+void fec_controller_record_class_bytes(double class_bytes[NUM_FEC_PROTECTION_CLASSES],
+                                       FECProtectionClass protection_class, int bytes);
+
+/**
+ * @brief                          Split a total fec ratio into a fec ratio per protection
+ *                                 class, weighted towards the higher classes
+ *
+ * @param total_fec_ratio          The total fec ratio, e.g. from
+ *                                 fec_controller_get_total_fec_ratio
+ * @param class_bytes              The bytes sent per class, from
+ *                                 fec_controller_record_class_bytes
+ * @param class_fec_ratios         Receives the fec ratio to use for each class
+ *
+ * @note                           The ratios are chosen so that, for the traffic mix in
+ *                                 class_bytes, the fec bytes sent are the same as when
+ *                                 total_fec_ratio is used for every frame. So the total bitrate
+ *                                 stays within what WCC allows. No ratio exceeds MAX_FEC_RATIO.
+ */
+void fec_controller_get_class_fec_ratios(double total_fec_ratio,
+                                         const double class_bytes[NUM_FEC_PROTECTION_CLASSES],
+                                         double class_fec_ratios[NUM_FEC_PROTECTION_CLASSES]);
@@ -0,0 +1,161 @@
+#include "../gf256_common.h"
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * file gf256_avx512.cpp
+ * @brief Seperate out all avx512bw instructions of gf256 into a single file, in order to make the simd fallback work correctly.
+ *        These are the avx2 functions widened to 64 bytes. The 16-byte partial product tables
+ *        are broadcast to every lane, so that no 64-byte tables are needed.
+ */
+
+// Vectorized partial products of 64 bytes of x, see the avx2 functions for details
+static inline __m512i gf256_mul_64_avx512(const __m512i &x, const __m512i &table_lo_y,
+                                          const __m512i &table_hi_y, const __m512i &clr_mask)
+{
+        const __m512i l = _mm512_shuffle_epi8(table_lo_y, _mm512_and_si512(x, clr_mask));
+        const __m512i h = _mm512_shuffle_epi8(table_hi_y,
+                                              _mm512_and_si512(_mm512_srli_epi64(x, 4), clr_mask));
+        return _mm512_xor_si512(l, h);
+}
+
+void gf256_add_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &x16,
+                                const GF256_M128 * GF256_RESTRICT &y16, int &bytes)
+{
+        __m512i * GF256_RESTRICT x64 = reinterpret_cast<__m512i *>(x16);
+        const __m512i * GF256_RESTRICT y64 = reinterpret_cast<const __m512i *>(y16);
+
+        while (bytes >= 256)
+        {
+            __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(x64), _mm512_loadu_si512(y64));
+            __m512i x1 = _mm512_xor_si512(_mm512_loadu_si512(x64 + 1), _mm512_loadu_si512(y64 + 1));
+            __m512i x2 = _mm512_xor_si512(_mm512_loadu_si512(x64 + 2), _mm512_loadu_si512(y64 + 2));
+            __m512i x3 = _mm512_xor_si512(_mm512_loadu_si512(x64 + 3), _mm512_loadu_si512(y64 + 3));
+
+            _mm512_storeu_si512(x64, x0);
+            _mm512_storeu_si512(x64 + 1, x1);
+            _mm512_storeu_si512(x64 + 2, x2);
+            _mm512_storeu_si512(x64 + 3, x3);
+
+            bytes -= 256, x64 += 4, y64 += 4;
+        }
+
+        // Handle multiples of 64 bytes
+        while (bytes >= 64)
+        {
+            // x[i] = x[i] xor y[i]
+            _mm512_storeu_si512(x64, _mm512_xor_si512(_mm512_loadu_si512(x64), _mm512_loadu_si512(y64)));
+
+            bytes -= 64, ++x64, ++y64;
+        }
+
+        x16 = reinterpret_cast<GF256_M128 *>(x64);
+        y16 = reinterpret_cast<const GF256_M128 *>(y64);
+}
+
+void gf256_add2_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16, const GF256_M128 * GF256_RESTRICT &y16, int &bytes)
+{
+        __m512i * GF256_RESTRICT z64 = reinterpret_cast<__m512i *>(z16);
+        const __m512i * GF256_RESTRICT x64 = reinterpret_cast<const __m512i *>(x16);
+        const __m512i * GF256_RESTRICT y64 = reinterpret_cast<const __m512i *>(y16);
+
+        const unsigned count = bytes / 64;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            // z[i] = z[i] xor x[i] xor y[i], as a single ternary logic op
+            _mm512_storeu_si512(z64 + i,
+                _mm512_ternarylogic_epi32(
+                    _mm512_loadu_si512(z64 + i),
+                    _mm512_loadu_si512(x64 + i),
+                    _mm512_loadu_si512(y64 + i), 0x96));
+        }
+
+        bytes -= count * 64;
+        z16 = reinterpret_cast<GF256_M128 *>(z64 + count);
+        x16 = reinterpret_cast<const GF256_M128 *>(x64 + count);
+        y16 = reinterpret_cast<const GF256_M128 *>(y64 + count);
+}
+
+void gf256_addset_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16, const GF256_M128 * GF256_RESTRICT &y16, int &bytes)
+{
+        __m512i * GF256_RESTRICT z64 = reinterpret_cast<__m512i *>(z16);
+        const __m512i * GF256_RESTRICT x64 = reinterpret_cast<const __m512i *>(x16);
+        const __m512i * GF256_RESTRICT y64 = reinterpret_cast<const __m512i *>(y16);
+
+        const unsigned count = bytes / 64;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            // z[i] = x[i] xor y[i]
+            _mm512_storeu_si512(z64 + i,
+                _mm512_xor_si512(
+                    _mm512_loadu_si512(x64 + i),
+                    _mm512_loadu_si512(y64 + i)));
+        }
+
+        bytes -= count * 64;
+        z16 = reinterpret_cast<GF256_M128 *>(z64 + count);
+        x16 = reinterpret_cast<const GF256_M128 *>(x64 + count);
+        y16 = reinterpret_cast<const GF256_M128 *>(y64 + count);
+}
+
+void gf256_mul_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16,
+                                uint8_t &y, int &bytes)
+{
+        // Partial product tables, broadcast to the four lanes
+        const __m512i table_lo_y = _mm512_broadcast_i32x4(_mm_loadu_si128(GF256Ctx.MM128.TABLE_LO_Y + y));
+        const __m512i table_hi_y = _mm512_broadcast_i32x4(_mm_loadu_si128(GF256Ctx.MM128.TABLE_HI_Y + y));
+
+        const __m512i clr_mask = _mm512_set1_epi8(0x0f);
+
+        __m512i * GF256_RESTRICT z64 = reinterpret_cast<__m512i *>(z16);
+        const __m512i * GF256_RESTRICT x64 = reinterpret_cast<const __m512i *>(x16);
+
+        // Handle multiples of 64 bytes
+        do
+        {
+            const __m512i p0 = gf256_mul_64_avx512(_mm512_loadu_si512(x64), table_lo_y, table_hi_y, clr_mask);
+            _mm512_storeu_si512(z64, p0);
+
+            bytes -= 64, ++x64, ++z64;
+        } while (bytes >= 64);
+
+        z16 = reinterpret_cast<GF256_M128 *>(z64);
+        x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
+
+void gf256_muladd_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16,
+                                   uint8_t &y, int &bytes)
+{
+        // Partial product tables, broadcast to the four lanes
+        const __m512i table_lo_y = _mm512_broadcast_i32x4(_mm_loadu_si128(GF256Ctx.MM128.TABLE_LO_Y + y));
+        const __m512i table_hi_y = _mm512_broadcast_i32x4(_mm_loadu_si128(GF256Ctx.MM128.TABLE_HI_Y + y));
+
+        const __m512i clr_mask = _mm512_set1_epi8(0x0f);
+
+        __m512i * GF256_RESTRICT z64 = reinterpret_cast<__m512i *>(z16);
+        const __m512i * GF256_RESTRICT x64 = reinterpret_cast<const __m512i *>(x16);
+
+        // Two independent blocks per iteration, as the avx2 function does
+        const unsigned count = bytes / 128;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            const __m512i p0 = gf256_mul_64_avx512(_mm512_loadu_si512(x64 + i * 2), table_lo_y, table_hi_y, clr_mask);
+            const __m512i p1 = gf256_mul_64_avx512(_mm512_loadu_si512(x64 + i * 2 + 1), table_lo_y, table_hi_y, clr_mask);
+            _mm512_storeu_si512(z64 + i * 2, _mm512_xor_si512(p0, _mm512_loadu_si512(z64 + i * 2)));
+            _mm512_storeu_si512(z64 + i * 2 + 1, _mm512_xor_si512(p1, _mm512_loadu_si512(z64 + i * 2 + 1)));
+        }
+        bytes -= count * 128;
+        z64 += count * 2;
+        x64 += count * 2;
+
+        if (bytes >= 64)
+        {
+            const __m512i p0 = gf256_mul_64_avx512(_mm512_loadu_si512(x64), table_lo_y, table_hi_y, clr_mask);
+            _mm512_storeu_si512(z64, _mm512_xor_si512(p0, _mm512_loadu_si512(z64)));
+
+            bytes -= 64;
+            z64++;
+            x64++;
+        }
+
+        z16 = reinterpret_cast<GF256_M128 *>(z64);
+        x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
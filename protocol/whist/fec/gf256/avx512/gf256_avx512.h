@@ -0,0 +1,21 @@
+#pragma once
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * file gf256_avx512.h
+ * @brief Seperate out all avx512bw instructions of gf256 into a single file, in order to make the simd fallback work correctly.
+ */
+
+#include "../gf256_common.h"
+
+void gf256_add_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &x16,
+                                const GF256_M128 * GF256_RESTRICT &y16, int &bytes);
+
+void gf256_add2_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16, const GF256_M128 * GF256_RESTRICT &y16, int &bytes);
+
+void gf256_addset_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16, const GF256_M128 * GF256_RESTRICT &y16, int &bytes);
+
+void gf256_mul_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16,
+                                uint8_t &y, int &bytes);
+
+void gf256_muladd_mem_inner_avx512(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16,
+                                   uint8_t &y, int &bytes);
@@ -28,6 +28,8 @@
 */
 
 #include "gf256.h"
+#include "gfni/gf256_gfni.h"
+#include "avx512/gf256_avx512.h"
 #include "avx2/gf256_avx2.h"
 #include "ssse3/gf256_ssse3.h"
 #include "gf256_cpuinfo.h"
@@ -236,6 +238,27 @@ static bool CpuHasSSSE3 = false;
 #define CPUID_EDX_SSE2    0x04000000
 static bool CpuHasSSE2 = false;
 
+// WHIST_CHANGE: ADD
+// AVX-512 is only used if the OS saves the opmask and zmm registers, and GFNI only with AVX-512
+#define CPUID_ECX_OSXSAVE     0x08000000
+#define CPUID_EBX_AVX512F     0x00010000
+#define CPUID_EBX_AVX512BW    0x40000000
+#define CPUID_ECX_GFNI        0x00000100
+#define XCR0_AVX512_STATE     0x000000E6
+static bool CpuHasAVX512BW = false;
+static bool CpuHasGFNI = false;
+
+static uint64_t _xgetbv0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0U));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
 static void _cpuid(unsigned int cpu_info[4U], const unsigned int cpu_info_type)
 {
 #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64) || defined(_M_IX86))
@@ -300,6 +323,11 @@ static void checkLinuxARMNeonCapabilities( bool& cpuHasNeon )
 #endif
 #endif // defined(GF256_TARGET_MOBILE)
 
+// WHIST_CHANGE: ADD
+// the code path that gf256_force_cpu_path() restricts the detected cpu features to
+static Gf256CpuPath ForcedCpuPath = GF256_CPU_PATH_AUTO;
+static void gf256_apply_forced_cpu_path();
+
 static void gf256_architecture_init()
 {
     // Check for NEON support on Android platform
@@ -331,8 +359,17 @@ static void gf256_architecture_init()
     // WHIST_CHANGE: ADD
     CpuHasSSE2 = ((cpu_info[3] & CPUID_EDX_SSE2) != 0);
 
+    // WHIST_CHANGE: ADD
+    const bool os_saves_avx512_state =
+        (cpu_info[2] & CPUID_ECX_OSXSAVE) != 0 &&
+        (_xgetbv0() & XCR0_AVX512_STATE) == XCR0_AVX512_STATE;
+
     _cpuid(cpu_info, 7);
     CpuHasAVX2 = ((cpu_info[1] & CPUID_EBX_AVX2) != 0);
+    // WHIST_CHANGE: ADD
+    CpuHasAVX512BW = os_saves_avx512_state &&
+        (cpu_info[1] & (CPUID_EBX_AVX512F | CPUID_EBX_AVX512BW)) == (CPUID_EBX_AVX512F | CPUID_EBX_AVX512BW);
+    CpuHasGFNI = CpuHasAVX512BW && ((cpu_info[2] & CPUID_ECX_GFNI) != 0);
 
     // When AVX2 and SSSE3 are unavailable, Siamese takes 4x longer to decode
     // and 2.6x longer to encode.  Encoding requires a lot more simple XOR ops
@@ -341,6 +378,9 @@ static void gf256_architecture_init()
     // GF multiplies requiring table lookups which is slower.
 
 #endif // GF256_TARGET_MOBILE
+
+    // WHIST_CHANGE: ADD
+    gf256_apply_forced_cpu_path();
 }
 
 
@@ -589,6 +629,22 @@ static void gf256_mul_mem_init()
         {
             gf256_mul_mem_init_inner_avx2(table_lo,table_hi,y);
         }
+
+        // WHIST_CHANGE: ADD
+        // Row i of the matrix selects the bits of x whose products with y have bit i set,
+        // and the GFNI affine transform takes the row of bit i from byte 7 - i
+        uint64_t matrix = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            uint8_t row = 0;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                if ((gf256_mul(static_cast<uint8_t>(1 << bit), static_cast<uint8_t>(y)) >> i) & 1)
+                    row |= static_cast<uint8_t>(1 << bit);
+            }
+            matrix |= (uint64_t)row << (8 * (7 - i));
+        }
+        GF256Ctx.GFNI_MATRIX_Y[y] = matrix;
 #endif // GF256_TARGET_MOBILE
     }
 }
@@ -703,6 +759,11 @@ extern "C" void gf256_add_mem(void * GF256_RESTRICT vx,
         bytes -= (count * 8);
     }
 #else // GF256_TARGET_MOBILE
+    // WHIST_CHANGE: ADD
+    if (CpuHasAVX512BW)
+    {
+        gf256_add_mem_inner_avx512(x16,y16,bytes);
+    }
     if (CpuHasAVX2)
     {
         gf256_add_mem_inner_avx2(x16,y16,bytes);
@@ -823,6 +884,11 @@ extern "C" void gf256_add2_mem(void * GF256_RESTRICT vz, const void * GF256_REST
         bytes -= (count * 8);
     }
 #else // GF256_TARGET_MOBILE
+    // WHIST_CHANGE: ADD
+    if (CpuHasAVX512BW)
+    {
+        gf256_add2_mem_inner_avx512(z16,x16,y16,bytes);
+    }
     if (CpuHasAVX2)
     {
         gf256_add2_mem_inner_avx2(z16,x16,y16,bytes);
@@ -938,6 +1004,11 @@ extern "C" void gf256_addset_mem(void * GF256_RESTRICT vz, const void * GF256_RE
         bytes -= (count * 8);
     }
 #else // GF256_TARGET_MOBILE
+    // WHIST_CHANGE: ADD
+    if (CpuHasAVX512BW)
+    {
+        gf256_addset_mem_inner_avx512(z16,x16,y16,bytes);
+    }
     if (CpuHasAVX2)
     {
         gf256_addset_mem_inner_avx2(z16,x16,y16,bytes);
@@ -1055,8 +1126,20 @@ extern "C" void gf256_mul_mem(void * GF256_RESTRICT vz, const void * GF256_RESTR
         } while (bytes >= 16);
     }
 #else
+    // WHIST_CHANGE: ADD
+    if (bytes >= 64 && CpuHasGFNI)
+    {
+        gf256_mul_mem_inner_gfni(z16,x16,y,bytes);
+    }
+    else if (bytes >= 64 && CpuHasAVX512BW)
+    {
+        gf256_mul_mem_inner_avx512(z16,x16,y,bytes);
+    }
     if (bytes >= 32 && CpuHasAVX2)
     {
+        // WHIST_CHANGE: continue from where the avx512 functions stopped
+        vz = z16;
+        vx = x16;
         gf256_mul_mem_inner_avx2(vz,vx,z16,x16,y,bytes);
     }
     if (bytes >= 16 && CpuHasSSSE3)
@@ -1177,6 +1260,15 @@ extern "C" void gf256_muladd_mem(void * GF256_RESTRICT vz, uint8_t y,
         } while (bytes >= 16);
     }
 #else // GF256_TARGET_MOBILE
+    // WHIST_CHANGE: ADD
+    if (bytes >= 64 && CpuHasGFNI)
+    {
+        gf256_muladd_mem_inner_gfni(z16,x16,y,bytes);
+    }
+    else if (bytes >= 64 && CpuHasAVX512BW)
+    {
+        gf256_muladd_mem_inner_avx512(z16,x16,y,bytes);
+    }
     if (bytes >= 32 && CpuHasAVX2)
     {
         gf256_muladd_mem_inner_avx2(z16,x16,y,bytes);
@@ -1343,6 +1435,8 @@ CpuInfo gf256_get_cpuinfo(void)
         info.cpu_type =CPU_TYPE_X86;
     #endif
     info.has_avx2 = CpuHasAVX2;
+    info.has_avx512bw = CpuHasAVX512BW;
+    info.has_gfni = CpuHasGFNI;
     info.has_ssse3 = CpuHasSSSE3;
     info.has_sse2 = CpuHasSSE2;
 #elif defined(ANDROID) || defined(IOS) || defined(LINUX_ARM) || defined(MACOS_ARM)
@@ -1358,6 +1452,108 @@ CpuInfo gf256_get_cpuinfo(void)
     return info;
 }
 
+// turn off the detected features that the forced cpu path doesn't use
+static void gf256_apply_forced_cpu_path()
+{
+#if !defined(GF256_TARGET_MOBILE)
+    if (ForcedCpuPath != GF256_CPU_PATH_AUTO && ForcedCpuPath != GF256_CPU_PATH_GFNI)
+        CpuHasGFNI = false;
+    if (ForcedCpuPath != GF256_CPU_PATH_AUTO && ForcedCpuPath != GF256_CPU_PATH_GFNI &&
+        ForcedCpuPath != GF256_CPU_PATH_AVX512)
+        CpuHasAVX512BW = false;
+    if (ForcedCpuPath == GF256_CPU_PATH_SSSE3 || ForcedCpuPath == GF256_CPU_PATH_PORTABLE)
+        CpuHasAVX2 = false;
+    if (ForcedCpuPath == GF256_CPU_PATH_PORTABLE)
+        CpuHasSSSE3 = false;
+#elif !defined(IOS)
+    if (ForcedCpuPath == GF256_CPU_PATH_PORTABLE)
+        CpuHasNeon = false;
+#endif
+}
+
+// force the vectorized code path that the gf256 operations use
+bool gf256_force_cpu_path(Gf256CpuPath path)
+{
+    Gf256CpuPath previous_path = ForcedCpuPath;
+    ForcedCpuPath = GF256_CPU_PATH_AUTO;
+    CpuInfo info = gf256_get_cpuinfo();
+
+    bool supported;
+    switch (path) {
+        case GF256_CPU_PATH_AUTO:
+        case GF256_CPU_PATH_PORTABLE: {
+#if defined(IOS)
+            // the neon flag is a compile-time constant on iOS
+            supported = path == GF256_CPU_PATH_AUTO;
+#else
+            supported = true;
+#endif
+            break;
+        }
+        case GF256_CPU_PATH_GFNI: {
+            supported = info.has_gfni;
+            break;
+        }
+        case GF256_CPU_PATH_AVX512: {
+            supported = info.has_avx512bw;
+            break;
+        }
+        case GF256_CPU_PATH_AVX2: {
+            supported = info.has_avx2;
+            break;
+        }
+        case GF256_CPU_PATH_SSSE3: {
+            supported = info.has_ssse3;
+            break;
+        }
+        case GF256_CPU_PATH_NEON: {
+            supported = info.has_neon;
+            break;
+        }
+        default: {
+            supported = false;
+            break;
+        }
+    }
+
+    ForcedCpuPath = supported ? path : previous_path;
+    gf256_architecture_init();
+    // the multiplication tables only hold the entries of the paths that were enabled
+    if (Initialized)
+        gf256_mul_mem_init();
+    return supported;
+}
+
+// convert Gf256CpuPath to str
+const char * gf256_cpu_path_to_str(Gf256CpuPath path) {
+    switch (path) {
+        case GF256_CPU_PATH_AUTO: {
+            return "auto";
+        }
+        case GF256_CPU_PATH_GFNI: {
+            return "gfni";
+        }
+        case GF256_CPU_PATH_AVX512: {
+            return "avx512";
+        }
+        case GF256_CPU_PATH_AVX2: {
+            return "avx2";
+        }
+        case GF256_CPU_PATH_SSSE3: {
+            return "ssse3";
+        }
+        case GF256_CPU_PATH_NEON: {
+            return "neon";
+        }
+        case GF256_CPU_PATH_PORTABLE: {
+            return "portable";
+        }
+        default: {
+            return "invalid";
+        }
+    }
+}
+
 // convert CpuType to str
 const char * cpu_type_to_str(CpuType cpu_type) {
     switch (cpu_type) {
@@ -146,6 +146,10 @@ typedef struct
         GF256_ALIGNED GF256_M256 TABLE_LO_Y[256];
         GF256_ALIGNED GF256_M256 TABLE_HI_Y[256];
     } MM256;
+
+    // WHIST_CHANGE: ADD
+    /// The bit matrices of multiplying by each y, for the GFNI affine transform
+    GF256_ALIGNED uint64_t GFNI_MATRIX_Y[256];
 #endif
 
     /// Mul/Div/Inv/Sqr tables
@@ -26,9 +26,25 @@ typedef struct
     bool has_sse2;
     bool has_ssse3;
     bool has_avx2;
+    // only set if the OS supports AVX-512 too
+    bool has_avx512bw;
+    // only set if AVX-512BW is supported too, since gf256 uses GFNI on 64-byte vectors
+    bool has_gfni;
     bool has_neon;
 } CpuInfo;
 
+// the vectorized code paths that the gf256 operations can be forced to use
+typedef enum
+{
+    GF256_CPU_PATH_AUTO,
+    GF256_CPU_PATH_GFNI,
+    GF256_CPU_PATH_AVX512,
+    GF256_CPU_PATH_AVX2,
+    GF256_CPU_PATH_SSSE3,
+    GF256_CPU_PATH_NEON,
+    GF256_CPU_PATH_PORTABLE,
+} Gf256CpuPath;
+
 /**
  * @brief                          get the cpu type and intruction support info
  * @returns                        the detected infos
@@ -42,6 +58,27 @@ CpuInfo gf256_get_cpuinfo(void);
  */
 const char * cpu_type_to_str(CpuType cpu_type);
 
+/**
+ * @brief                          force the gf256 operations to use a code path,
+ *                                 for benchmarks and tests.
+ *                                 Forcing a path other than auto leaves the faster
+ *                                 paths unused, even when the cpu supports them.
+ * @param path                     the path, or GF256_CPU_PATH_AUTO for the fastest
+ *                                 path the cpu supports
+ * @returns                        false if the cpu doesn't support the path,
+ *                                 in which case the current path is kept
+ * @note                           this must not be called while gf256 operations
+ *                                 are running on other threads
+ */
+bool gf256_force_cpu_path(Gf256CpuPath path);
+
+/**
+ * @brief                          convert Gf256CpuPath to str
+ * @param path                     the path
+ * @returns                        the pointer to str
+ */
+const char * gf256_cpu_path_to_str(Gf256CpuPath path);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,66 @@
+#include "../gf256_common.h"
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * file gf256_gfni.cpp
+ * @brief Seperate out all gfni instructions of gf256 into a single file, in order to make the simd fallback work correctly.
+ *        Multiplying by a constant y is linear over GF(2), so it's an 8x8 bit matrix, and
+ *        a single affine transform multiplies 64 bytes at once. The matrices are built by
+ *        gf256_mul_mem_init(), for the polynomial that gf256 uses, which isn't the one that
+ *        the gf2p8mulb instruction hardcodes.
+ */
+
+void gf256_mul_mem_inner_gfni(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16,
+                              uint8_t &y, int &bytes)
+{
+        const __m512i matrix_y = _mm512_set1_epi64((long long)GF256Ctx.GFNI_MATRIX_Y[y]);
+
+        __m512i * GF256_RESTRICT z64 = reinterpret_cast<__m512i *>(z16);
+        const __m512i * GF256_RESTRICT x64 = reinterpret_cast<const __m512i *>(x16);
+
+        // Handle multiples of 64 bytes
+        do
+        {
+            const __m512i p0 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64), matrix_y, 0);
+            _mm512_storeu_si512(z64, p0);
+
+            bytes -= 64, ++x64, ++z64;
+        } while (bytes >= 64);
+
+        z16 = reinterpret_cast<GF256_M128 *>(z64);
+        x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
+
+void gf256_muladd_mem_inner_gfni(GF256_M128 * GF256_RESTRICT &z16, const GF256_M128 * GF256_RESTRICT &x16,
+                                 uint8_t &y, int &bytes)
+{
+        const __m512i matrix_y = _mm512_set1_epi64((long long)GF256Ctx.GFNI_MATRIX_Y[y]);
+
+        __m512i * GF256_RESTRICT z64 = reinterpret_cast<__m512i *>(z16);
+        const __m512i * GF256_RESTRICT x64 = reinterpret_cast<const __m512i *>(x16);
+
+        // Two independent blocks per iteration, to hide the latency of the affine transform
+        const unsigned count = bytes / 128;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            const __m512i p0 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64 + i * 2), matrix_y, 0);
+            const __m512i p1 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64 + i * 2 + 1), matrix_y, 0);
+            _mm512_storeu_si512(z64 + i * 2, _mm512_xor_si512(p0, _mm512_loadu_si512(z64 + i * 2)));
+            _mm512_storeu_si512(z64 + i * 2 + 1, _mm512_xor_si512(p1, _mm512_loadu_si512(z64 + i * 2 + 1)));
+        }
+        bytes -= count * 128;
+        z64 += count * 2;
+        x64 += count * 2;
+
+        if (bytes >= 64)
+        {
+            const __m512i p0 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64), matrix_y, 0);
+            _mm512_storeu_si512(z64, _mm512_xor_si512(p0, _mm512_loadu_si512(z64)));
+
+            bytes -= 64;
+            z64++;
+            x64++;
+        }
+
+        z16 = reinterpret_cast<GF256_M128 *>(z64);
+        x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
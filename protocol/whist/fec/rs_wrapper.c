@@ -2,6 +2,7 @@
 
 #include <whist/core/whist.h>
 #include "gf256/gf256_cpuinfo.h"
+#include "gf256/gf256.h"
 #include "cm256/cm256.h"
 #include "rs_common.h"
 #include "lugi_rs_extra.h"
@@ -13,9 +14,6 @@ Defines
 ============================
 */
 
-// a list of RS Implementations
-typedef enum { LUGI_RS = 0, CM256 = 1, NUM_RS_IMPLEMENTATIONS = 2 } RSImplementation;
-
 // the info of position of where a buffer locates in the groups
 typedef struct {
     int group_id;   // id of group
@@ -28,6 +26,14 @@ typedef struct {
     int num_fec_buffers;         // num of fec buffers of the group
     int num_buffers_registered;  // stores how many buffers we have "received" for this group, to
                                  // help detect if decoding can happen, in O(1) time
+
+    // the state of progressive decoding, only allocated if it's enabled
+    void **originals;       // the original buffers received so far, by sub index
+    int *original_sizes;    // the sizes of the original buffers received so far
+    int num_originals;      // num of original buffers received so far
+    unsigned char **rows;   // the fec buffers held, with the originals received subtracted out
+    int *row_sub_indices;   // the sub index of each fec buffer held
+    int num_rows;           // num of fec buffers held
 } GroupInfo;
 
 // the main struct of RSWrapper
@@ -39,6 +45,8 @@ struct RSWrapper {
     int group_max_num_real_buffers;  // the max num of real_buffers of all groups
     int group_max_num_fec_buffers;   // the max num of fec_buffers of all groups
     GroupInfo *group_infos;          // an array of GroupInfo
+    bool progressive;                // whether the buffers are decoded as they're registered
+    int row_size;                    // the size of every fec buffer, when decoding progressively
 };
 
 /*
@@ -61,6 +69,9 @@ static int rs_wrapper_max_group_size = 256;
 // with 20.0, each group's size will roughly at original + fec of 100+25 / 40+40.
 static double rs_wrapper_max_group_overhead = 20.0;
 
+// whether new rs_wrappers decode progressively, when the implementation supports it
+static bool progressive_decoding = true;
+
 // only for debug and testing
 static int verbose_log = 0;
 
@@ -71,7 +82,7 @@ Private Function Declarations
 */
 
 /*
-two function below are interfaces to talk with the RS libs. In addition they handle special case
+the functions below are interfaces to talk with the RS libs. In addition they handle special case
 with dup and dedup
 */
 
@@ -89,6 +100,21 @@ with dup and dedup
  */
 static void rs_encode_or_dup(int k, int n, void *src[], void *dst[], int sz);
 
+/**
+ * @brief                          do RS encode of a single redundant buffer, handle k=1 with dup
+ *
+ * @param k                        num of original buffers
+ * @param n                        num of total buffers (original+redundant)
+ * @param src                      an arrary of original buffers
+ * @param sub_index                the index of the redundant buffer, in [k, n)
+ * @param dst                      the redundant buffer, the memeroy should be already
+ *                                 allocated before passing here
+ * @param sz                       size of buffers
+ *
+ * @note                           when k is 1, n can be arbitrary large, otherwise k<=n<=256
+ */
+static void rs_encode_one_or_dup(int k, int n, void *src[], int sub_index, void *dst, int sz);
+
 /**
  * @brief                          do RS decode with the RS wrapper
  *
@@ -187,6 +213,30 @@ static double overhead_of_group(int num_real_buffers, int num_fec_buffers);
  */
 static int int_partition_helper(int integer_to_partition, int group_id, int group_num);
 
+/**
+ * @brief                          get the element of the encoding matrix of cm256, that the
+ *                                 original buffer at column is multiplied by, to make the fec
+ *                                 buffer at row_sub_index
+ *
+ * @param k                        num of original buffers of the group
+ * @param row_sub_index            sub index of the fec buffer, in [k, n)
+ * @param column                   sub index of the original buffer, in [0, k)
+ *
+ * @returns                        the matrix element
+ *
+ * @note                           this must match GetMatrixElement() of cm256.cpp, with x_0 = k
+ */
+static uint8_t cm256_matrix_element(int k, int row_sub_index, int column);
+
+/**
+ * @brief                          finish the progressive decoding of a group, by solving for
+ *                                 the original buffers that are still missing
+ *
+ * @param rs_wrapper               RSwrapper object created by rs_wrapper_create()
+ * @param group                    the group to finish, which must have enough buffers
+ */
+static void progressive_decode_group(RSWrapper *rs_wrapper, GroupInfo *group);
+
 /*
 ============================
 Public Function Implementations
@@ -194,15 +244,19 @@ Public Function Implementations
 */
 
 int init_rs_wrapper(void) {
-    static int initialized = 0;
-    if (initialized == 1) return 0;
+    // each implementation is initialized the first time it's used
+    static int initialized[NUM_RS_IMPLEMENTATIONS] = {0};
+    if (initialized[rs_implementation_to_use] == 1) return 0;
 
     switch (rs_implementation_to_use) {
         case CM256: {
             CpuInfo cpu_info = gf256_get_cpuinfo();
             LOG_INFO("gf256 detected CPU type is %s", cpu_type_to_str(cpu_info.cpu_type));
-            LOG_INFO("cpu_info: has_avx2=%d has_ssse3=%d has_sse2=%d has_neon=%d",
-                     cpu_info.has_avx2, cpu_info.has_ssse3, cpu_info.has_sse2, cpu_info.has_neon);
+            LOG_INFO(
+                "cpu_info: has_gfni=%d has_avx512bw=%d has_avx2=%d has_ssse3=%d has_sse2=%d "
+                "has_neon=%d",
+                cpu_info.has_gfni, cpu_info.has_avx512bw, cpu_info.has_avx2, cpu_info.has_ssse3,
+                cpu_info.has_sse2, cpu_info.has_neon);
 
             if (cpu_info.cpu_type == CPU_TYPE_X86 || cpu_info.cpu_type == CPU_TYPE_X64) {
                 // cpu without avx2 is not rare.
@@ -242,7 +296,7 @@ int init_rs_wrapper(void) {
         }
     }
 
-    initialized = 1;
+    initialized[rs_implementation_to_use] = 1;
     return 0;
 }
 
@@ -326,6 +380,21 @@ void rs_wrapper_encode(RSWrapper *rs_wrapper, void **src, void **dst, int sz) {
     free(dst_sub);
 }
 
+void rs_wrapper_encode_one(RSWrapper *rs_wrapper, void **src, int index, void *dst, int sz) {
+    SubIndexInfo info = index_full_to_sub(rs_wrapper, index);
+    GroupInfo *group = &rs_wrapper->group_infos[info.group_id];
+    int k = group->num_real_buffers;
+    FATAL_ASSERT(info.sub_index >= k);
+
+    // find the subset of src for the group of the redundant buffer
+    void *src_sub[RS_FIELD_SIZE];
+    for (int j = 0; j < k; j++) {
+        src_sub[j] = src[index_sub_to_full(rs_wrapper, info.group_id, j)];
+    }
+
+    rs_encode_one_or_dup(k, k + group->num_fec_buffers, src_sub, info.sub_index, dst, sz);
+}
+
 int rs_wrapper_decode(RSWrapper *rs_wrapper, void **pkt, int *index, int num_pkt, int sz) {
     FATAL_ASSERT(rs_wrapper->num_groups > 0);
 
@@ -417,7 +486,83 @@ int rs_wrapper_decode(RSWrapper *rs_wrapper, void **pkt, int *index, int num_pkt
     return 0;
 }
 
+bool rs_wrapper_is_progressive(RSWrapper *rs_wrapper) { return rs_wrapper->progressive; }
+
+void rs_wrapper_progressive_decode_register_buffer(RSWrapper *rs_wrapper, int index, void *buffer,
+                                                   int size) {
+    FATAL_ASSERT(rs_wrapper->progressive);
+    SubIndexInfo info = index_full_to_sub(rs_wrapper, index);
+    GroupInfo *group = &rs_wrapper->group_infos[info.group_id];
+    int k = group->num_real_buffers;
+
+    if (info.sub_index < k) {
+        FATAL_ASSERT(group->originals[info.sub_index] == NULL);
+        group->originals[info.sub_index] = buffer;
+        group->original_sizes[info.sub_index] = size;
+        group->num_originals++;
+        // subtract the original out of every fec buffer held
+        for (int i = 0; i < group->num_rows && k > 1; i++) {
+            uint8_t element = cm256_matrix_element(k, group->row_sub_indices[i], info.sub_index);
+            gf256_muladd_mem(group->rows[i], element, buffer, min(size, rs_wrapper->row_size));
+        }
+        return;
+    }
+
+    // a fec buffer is only worth holding, if the group doesn't have enough buffers yet
+    if (group->num_originals + group->num_rows >= k) {
+        return;
+    }
+    if (rs_wrapper->row_size == 0) {
+        rs_wrapper->row_size = size;
+    }
+    unsigned char *row = safe_malloc(rs_wrapper->row_size);
+    int copy_size = min(size, rs_wrapper->row_size);
+    memcpy(row, buffer, copy_size);
+    memset(row + copy_size, 0, rs_wrapper->row_size - copy_size);
+    group->rows[group->num_rows] = row;
+    group->row_sub_indices[group->num_rows] = info.sub_index;
+    group->num_rows++;
+
+    // a group of one original buffer is encoded by duplication, so there's nothing to subtract
+    if (k == 1) {
+        return;
+    }
+    // subtract every original received so far out of the fec buffer
+    for (int j = 0; j < k; j++) {
+        if (group->originals[j] != NULL) {
+            uint8_t element = cm256_matrix_element(k, info.sub_index, j);
+            gf256_muladd_mem(row, element, group->originals[j],
+                             min(group->original_sizes[j], rs_wrapper->row_size));
+        }
+    }
+}
+
+void rs_wrapper_progressive_decode(RSWrapper *rs_wrapper, void **pkt) {
+    FATAL_ASSERT(rs_wrapper->progressive);
+    FATAL_ASSERT(rs_wrapper_decode_helper_can_decode(rs_wrapper));
+
+    for (int i = 0; i < rs_wrapper->num_groups; i++) {
+        progressive_decode_group(rs_wrapper, &rs_wrapper->group_infos[i]);
+    }
+    for (int i = 0; i < rs_wrapper->num_real_buffers; i++) {
+        SubIndexInfo info = index_full_to_sub(rs_wrapper, i);
+        pkt[i] = rs_wrapper->group_infos[info.group_id].originals[info.sub_index];
+    }
+}
+
 void rs_wrapper_destroy(RSWrapper *rs_wrapper) {
+    if (rs_wrapper->progressive) {
+        for (int i = 0; i < rs_wrapper->num_groups; i++) {
+            GroupInfo *group = &rs_wrapper->group_infos[i];
+            for (int j = 0; j < group->num_rows; j++) {
+                free(group->rows[j]);
+            }
+            free(group->originals);
+            free(group->original_sizes);
+            free(group->rows);
+            free(group->row_sub_indices);
+        }
+    }
     free(rs_wrapper->group_infos);
     free(rs_wrapper);
 }
@@ -468,6 +613,20 @@ double rs_wrapper_set_max_group_overhead(double a) {
     return save;
 }
 
+RSImplementation rs_wrapper_set_implementation(RSImplementation value) {
+    FATAL_ASSERT(value >= 0 && value < NUM_RS_IMPLEMENTATIONS);
+    RSImplementation save = rs_implementation_to_use;
+    rs_implementation_to_use = value;
+    init_rs_wrapper();
+    return save;
+}
+
+bool rs_wrapper_set_progressive_decoding(bool value) {
+    bool save = progressive_decoding;
+    progressive_decoding = value;
+    return save;
+}
+
 void rs_wrapper_set_verbose_log(int value) { verbose_log = value; }
 
 /*
@@ -529,6 +688,46 @@ static void rs_encode_or_dup(int k, int n, void *src[], void *dst[], int sz) {
     }
 }
 
+static void rs_encode_one_or_dup(int k, int n, void *src[], int sub_index, void *dst, int sz) {
+    FATAL_ASSERT(k >= 0 && k < RS_FIELD_SIZE);
+    FATAL_ASSERT(k <= sub_index && sub_index < n);
+
+    // handle k==1 case with duplication
+    if (k == 1) {
+        memcpy(dst, src[0], sz);
+        return;
+    }
+
+    FATAL_ASSERT(n <= RS_FIELD_SIZE);
+
+    // call the underlying lib according to rs_implementation_to_use
+    switch (rs_implementation_to_use) {
+        case CM256: {
+            cm256_encoder_params params;
+            params.OriginalCount = k;
+            params.RecoveryCount = n - k;
+            params.BlockBytes = sz;
+
+            cm256_block blocks[RS_FIELD_SIZE];
+            for (int i = 0; i < params.OriginalCount; i++) {
+                blocks[i].Block = src[i];
+                blocks[i].Index = i;
+            }
+
+            cm256_encode_block(params, blocks, sub_index, dst);
+            break;
+        }
+        case LUGI_RS: {
+            RSCode *rs_code = lugi_rs_extra_get_rs_code(k, n);
+            rs_encode(rs_code, src, dst, sub_index, sz);
+            break;
+        }
+        default: {
+            LOG_FATAL("unknown RS implentation value %d\n", (int)rs_implementation_to_use);
+        }
+    }
+}
+
 static int rs_decode_or_dedup(int k, int n, void *pkt[], int index[], int sz) {
     FATAL_ASSERT(k >= 0 && k < RS_FIELD_SIZE);
     FATAL_ASSERT(n >= 0);
@@ -576,6 +775,74 @@ static int rs_decode_or_dedup(int k, int n, void *pkt[], int index[], int sz) {
     }
 }
 
+static uint8_t cm256_matrix_element(int k, int row_sub_index, int column) {
+    return gf256_div(gf256_add((uint8_t)column, (uint8_t)k),
+                     gf256_add((uint8_t)row_sub_index, (uint8_t)column));
+}
+
+static void progressive_decode_group(RSWrapper *rs_wrapper, GroupInfo *group) {
+    int k = group->num_real_buffers;
+    int num_missing = k - group->num_originals;
+    if (num_missing <= 0) {
+        return;
+    }
+    FATAL_ASSERT(group->num_rows >= num_missing);
+
+    // a group of one original buffer is encoded by duplication
+    if (k == 1) {
+        group->originals[0] = group->rows[0];
+        group->num_originals++;
+        return;
+    }
+
+    // the sub indices of the missing original buffers
+    int missing[RS_FIELD_SIZE];
+    int num_found = 0;
+    for (int j = 0; j < k; j++) {
+        if (group->originals[j] == NULL) {
+            missing[num_found++] = j;
+        }
+    }
+    FATAL_ASSERT(num_found == num_missing);
+
+    // the first num_missing fec buffers held now only depend on the missing original buffers,
+    // through a square submatrix of the encoding matrix. Any such submatrix of a Cauchy matrix is
+    // invertible, and so are its leading submatrices, so Gauss-Jordan elimination without
+    // pivoting solves for the missing original buffers, with O(num_missing^2) row operations.
+    uint8_t *matrix = safe_malloc(num_missing * num_missing);
+    for (int r = 0; r < num_missing; r++) {
+        for (int c = 0; c < num_missing; c++) {
+            matrix[r * num_missing + c] =
+                cm256_matrix_element(k, group->row_sub_indices[r], missing[c]);
+        }
+    }
+    for (int p = 0; p < num_missing; p++) {
+        uint8_t *pivot_row = &matrix[p * num_missing];
+        FATAL_ASSERT(pivot_row[p] != 0);
+        uint8_t pivot_inverse = gf256_inv(pivot_row[p]);
+        for (int c = p; c < num_missing; c++) {
+            pivot_row[c] = gf256_mul(pivot_row[c], pivot_inverse);
+        }
+        gf256_mul_mem(group->rows[p], group->rows[p], pivot_inverse, rs_wrapper->row_size);
+        for (int r = 0; r < num_missing; r++) {
+            uint8_t factor = matrix[r * num_missing + p];
+            if (r == p || factor == 0) continue;
+            for (int c = p; c < num_missing; c++) {
+                matrix[r * num_missing + c] ^= gf256_mul(pivot_row[c], factor);
+            }
+            gf256_muladd_mem(group->rows[r], factor, group->rows[p], rs_wrapper->row_size);
+        }
+    }
+    free(matrix);
+
+    // the fec buffers held have become the missing original buffers
+    for (int p = 0; p < num_missing; p++) {
+        group->originals[missing[p]] = group->rows[p];
+        group->original_sizes[missing[p]] = rs_wrapper->row_size;
+    }
+    group->num_originals = k;
+}
+
 static int int_partition_helper(int total, int group_id, int group_num) {
     if (group_id >= total) {
         return 0;
@@ -640,7 +907,7 @@ static RSWrapper *rs_wrapper_create_inner(int num_real_buffers, int num_total_bu
     rs_wrapper->num_groups = num_groups;
     rs_wrapper->num_real_buffers = num_real_buffers;
     rs_wrapper->num_fec_buffers = num_fec_buffers;
-    rs_wrapper->group_infos = safe_malloc(sizeof(GroupInfo) * num_groups);
+    rs_wrapper->group_infos = safe_zalloc(sizeof(GroupInfo) * num_groups);
 
     // get the partition plan, based on the elementary data
     fill_partition_plan(rs_wrapper);
@@ -670,6 +937,20 @@ static RSWrapper *rs_wrapper_create_inner(int num_real_buffers, int num_total_bu
         */
     }
 
+    // allocate the state of progressive decoding, which only cm256 supports
+    rs_wrapper->progressive = progressive_decoding && rs_implementation_to_use == CM256;
+    if (rs_wrapper->progressive) {
+        for (int i = 0; i < num_groups; i++) {
+            GroupInfo *group = &rs_wrapper->group_infos[i];
+            group->originals = safe_zalloc(sizeof(void *) * group->num_real_buffers);
+            group->original_sizes = safe_zalloc(sizeof(int) * group->num_real_buffers);
+            group->num_originals = 0;
+            group->rows = safe_zalloc(sizeof(unsigned char *) * max(group->num_fec_buffers, 1));
+            group->row_sub_indices = safe_zalloc(sizeof(int) * max(group->num_fec_buffers, 1));
+            group->num_rows = 0;
+        }
+    }
+
     // set the decode helper counters to zero
     rs_wrapper_decode_helper_reset(rs_wrapper);
     return rs_wrapper;
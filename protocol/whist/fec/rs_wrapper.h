@@ -14,6 +14,9 @@ Defines
 // the RSwrapper object
 typedef struct RSWrapper RSWrapper;
 
+// a list of RS Implementations
+typedef enum { LUGI_RS = 0, CM256 = 1, NUM_RS_IMPLEMENTATIONS = 2 } RSImplementation;
+
 /*
 ============================
 Public Functions
@@ -61,6 +64,20 @@ RSWrapper *rs_wrapper_create(int num_real_buffers, int num_total_buffers);
  */
 void rs_wrapper_encode(RSWrapper *rs_wrapper, void **src, void **dst, int sz);
 
+/**
+ * @brief                          do RS encode of a single redundant buffer with the RS wrapper,
+ *                                 so that redundant buffers can be encoded one at a time
+ *
+ * @param rs_wrapper               RSwrapper object created by rs_wrapper_create()
+ * @param src                      an arrary of original buffers
+ * @param index                    the index of the redundant buffer to encode, in
+ *                                 [num_real_buffers, num_total_buffers)
+ * @param dst                      the redundant buffer, the memeroy should be already
+ *                                 allocated before passing here
+ * @param sz                       size of buffers
+ */
+void rs_wrapper_encode_one(RSWrapper *rs_wrapper, void **src, int index, void *dst, int sz);
+
 /**
  * @brief                          do RS decode with the RS wrapper
  *
@@ -114,12 +131,60 @@ bool rs_wrapper_decode_helper_can_decode(RSWrapper *rs_wrapper);
  */
 void rs_wrapper_decode_helper_reset(RSWrapper *rs_wrapper);
 
+/*
+the below 3 functions decode progressively, by doing the work of decoding as each buffer is
+registered, so that little is left to do once enough buffers have been registered. only cm256
+supports it, and it's used when rs_wrapper_is_progressive() says so
+*/
+
+/**
+ * @brief                          whether the rs_wrapper decodes progressively
+ *
+ * @param  rs_wrapper              RSwrapper object created by rs_wrapper_create()
+ */
+bool rs_wrapper_is_progressive(RSWrapper *rs_wrapper);
+
+/**
+ * @brief                          register a received buffer for progressive decoding, and
+ *                                 subtract the original buffers received so far out of the fec
+ *                                 buffers received so far
+ *
+ * @param  rs_wrapper              RSwrapper object created by rs_wrapper_create()
+ * @param  index                   the index of the buffer
+ * @param  buffer                  the buffer, which must stay alive until decoding is done.
+ *                                 fec buffers are copied, and original buffers aren't
+ * @param  size                    the size of the buffer. all fec buffers must be the same size,
+ *                                 and original buffers are considered to be zero-padded to it
+ */
+void rs_wrapper_progressive_decode_register_buffer(RSWrapper *rs_wrapper, int index, void *buffer,
+                                                   int size);
+
+/**
+ * @brief                          finish progressive decoding, by solving for the original
+ *                                 buffers that are still missing
+ *
+ * @param  rs_wrapper              RSwrapper object created by rs_wrapper_create(), for which
+ *                                 rs_wrapper_decode_helper_can_decode() is true
+ * @param  pkt                     filled with the num_real_buffers original buffers, in order.
+ *                                 recovered buffers are the size of the fec buffers, and are
+ *                                 owned by the rs_wrapper
+ */
+void rs_wrapper_progressive_decode(RSWrapper *rs_wrapper, void **pkt);
+
 /*
 ============================
 Public Functions, only for testing
 ============================
 */
 
+// set the implementation that rs_wrappers use, and init it if needed. it must not be changed
+// while any rs_wrapper exists. returns the old value
+RSImplementation rs_wrapper_set_implementation(RSImplementation value);
+
+// set whether rs_wrappers created from now on decode progressively, when the implementation
+// supports it. returns the old value
+bool rs_wrapper_set_progressive_decoding(bool value);
+
 // set the inner rs_wrapper_max_group_size to the given value
 // returns the old value
 int rs_wrapper_set_max_group_size(int value);
@@ -63,6 +63,9 @@ static StatisticInfo statistic_info[NUM_METRICS] = {
     [VIDEO_FRAME_SATD] = {"VIDEO_FRAME_SATD", true, false, AVERAGE},
     [VIDEO_NUM_RECOVERY_FRAMES] = {"VIDEO_NUM_RECOVERY_FRAMES", false, false, SUM},
     [VIDEO_SEND_TIME] = {"VIDEO_SEND_TIME", true, false, AVERAGE},
+    [VIDEO_NACK_RETRANSMIT_LATENCY] = {"VIDEO_NACK_RETRANSMIT_LATENCY", true, false, AVERAGE},
+    [VIDEO_EGRESS_STALE_PACKETS] = {"VIDEO_EGRESS_STALE_PACKETS", false, false, SUM},
+    [VIDEO_SEND_THREAD_WAKEUPS] = {"VIDEO_SEND_THREAD_WAKEUPS", false, false, SUM},
     [DBUS_MSGS_RECEIVED] = {"DBUS_MSGS_RECEIVED", false, false, SUM},
     [SERVER_CPU_USAGE] = {"SERVER_CPU_USAGE", false, false, AVERAGE},
 
@@ -68,6 +68,9 @@ typedef enum {
     VIDEO_FRAME_SATD,
     VIDEO_NUM_RECOVERY_FRAMES,
     VIDEO_SEND_TIME,
+    VIDEO_NACK_RETRANSMIT_LATENCY,
+    VIDEO_EGRESS_STALE_PACKETS,
+    VIDEO_SEND_THREAD_WAKEUPS,
     DBUS_MSGS_RECEIVED,
     SERVER_CPU_USAGE,
 
@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file congestion_feedback.c
+ * @brief This file contains the client-side bookkeeping that congestion control is fed from.
+============================
+Usage
+============================
+
+See congestion_feedback.h. The theory behind the group stats and the incoming bitrate is
+documented in WCC.md.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include "congestion_feedback.h"
+
+/*
+============================
+Defines
+============================
+*/
+
+// The amount to weigh a older pings' latency,
+// on the ewma latency value
+#define PING_LAMBDA_SHORT_TERM 0.9
+#define PING_LAMBDA_LONG_TERM 0.999
+
+#define get_bucket_id(time) (((time) / US_IN_MS) / DURATION_PER_BUCKET)
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+void congestion_feedback_init(CongestionFeedback* feedback) {
+    memset(feedback, 0, sizeof(CongestionFeedback));
+}
+
+void congestion_feedback_add_incoming_bits(CongestionFeedback* feedback,
+                                           timestamp_us arrival_time, int num_bits) {
+    uint64_t bucket_id = get_bucket_id(arrival_time);
+    IncomingBitrate* bucket =
+        &feedback->incoming_bitrate_buckets[bucket_id % INCOMING_BITRATE_NUM_BUCKETS];
+    if (bucket_id > bucket->bucket_id) {
+        bucket->bucket_id = bucket_id;
+        bucket->num_bits = num_bits;
+    } else {
+        bucket->num_bits += num_bits;
+    }
+}
+
+int congestion_feedback_get_incoming_bitrate(CongestionFeedback* feedback,
+                                             timestamp_us current_time) {
+    uint64_t current_bucket_id = get_bucket_id(current_time);
+    int total_bits = 0;
+    int num_buckets = 0;
+    for (uint64_t i = current_bucket_id - INCOMING_BITRATE_NUM_BUCKETS + 1; i <= current_bucket_id;
+         i++) {
+        IncomingBitrate* bucket =
+            &feedback->incoming_bitrate_buckets[i % INCOMING_BITRATE_NUM_BUCKETS];
+        if (i == bucket->bucket_id) {
+            // If the bucket's bitrate is less than IDLE_VIDEO_MAX_BITRATE, then it must have
+            // contained idle frames, where video frames would be still. We ignore such idle-video
+            // buckets to avoid skewing the average bitrate calculation
+            if (bucket->num_bits < (IDLE_VIDEO_MAX_BITRATE * DURATION_PER_BUCKET) / MS_IN_SECOND) {
+                continue;
+            }
+            total_bits += bucket->num_bits;
+            num_buckets++;
+        }
+    }
+    // Atleast MIN_VALID_BUCKETS of the buckets should have actual video data
+    if (num_buckets >= MIN_VALID_BUCKETS)
+        return (int)(((uint64_t)total_bits * MS_IN_SECOND) / (num_buckets * DURATION_PER_BUCKET));
+    else
+        return -1;
+}
+
+bool congestion_feedback_add_group_sample(CongestionFeedback* feedback,
+                                          timestamp_us departure_time, timestamp_us arrival_time,
+                                          int group_id, GroupStats* curr_group_stats,
+                                          GroupStats* prev_group_stats) {
+    if (group_id < feedback->curr_group_id) {
+        return false;
+    }
+    GroupStats* group_stats = &feedback->group_stats[group_id % MAX_GROUP_STATS];
+    // As per WCC.md,
+    // An inter-departure time is computed between consecutive groups as T(i) - T(i-1),
+    // where T(i) is the departure timestamp of the last packet in the current packet
+    // group being processed.  Any packets received out of order are ignored by the
+    // arrival-time model.
+    if (departure_time > group_stats->departure_time) {
+        group_stats->departure_time = departure_time;
+        group_stats->arrival_time = arrival_time;
+    }
+
+    bool group_ended = false;
+    if (group_id > feedback->curr_group_id) {
+        if (feedback->prev_group_id != 0) {
+            *curr_group_stats = feedback->group_stats[feedback->curr_group_id % MAX_GROUP_STATS];
+            *prev_group_stats = feedback->group_stats[feedback->prev_group_id % MAX_GROUP_STATS];
+            group_ended = true;
+        }
+        feedback->prev_group_id = feedback->curr_group_id;
+        feedback->curr_group_id = group_id;
+    }
+    return group_ended;
+}
+
+void congestion_feedback_add_rtt(CongestionFeedback* feedback, double rtt,
+                                 bool congestion_detected) {
+    // Initialize the latency
+    if (!feedback->has_latency) {
+        feedback->short_term_latency = feedback->long_term_latency = rtt;
+        feedback->has_latency = true;
+    }
+
+    feedback->short_term_latency =
+        PING_LAMBDA_SHORT_TERM * feedback->short_term_latency + (1 - PING_LAMBDA_SHORT_TERM) * rtt;
+    // Don't update long term latency during congestion
+    if (!congestion_detected) {
+        feedback->long_term_latency =
+            PING_LAMBDA_LONG_TERM * feedback->long_term_latency + (1 - PING_LAMBDA_LONG_TERM) * rtt;
+    }
+}
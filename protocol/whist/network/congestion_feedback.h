@@ -0,0 +1,140 @@
+#ifndef WHIST_NETWORK_CONGESTION_FEEDBACK_H
+#define WHIST_NETWORK_CONGESTION_FEEDBACK_H
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file congestion_feedback.h
+ * @brief This file contains the client-side bookkeeping that congestion control is fed from:
+ *        the incoming bitrate, the departure and arrival times of packet groups,
+ *        and the averages of the round trip latency.
+============================
+Usage
+============================
+Call congestion_feedback_add_incoming_bits for every received video segment, and
+congestion_feedback_add_group_sample for every original video segment. When the latter returns
+true, a group of packets just ended, and the two groups that it filled in can be given to
+congestion_controller_on_group_feedback, along with congestion_feedback_get_incoming_bitrate.
+Feed the round trip time of every pong to congestion_feedback_add_rtt.
+
+Both udp.cpp and the network simulator use this, so that they run the same congestion path.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+#include <whist/network/udp.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+#define MAX_GROUP_STATS 8
+// Incoming bitrate related constants. Choose power-of-two only for an efficient computations
+#define INCOMING_BITRATE_WINDOW_MS 1024
+#define INCOMING_BITRATE_NUM_BUCKETS 8
+#define DURATION_PER_BUCKET (INCOMING_BITRATE_WINDOW_MS / INCOMING_BITRATE_NUM_BUCKETS)
+// If video bitrate received over a timeperiod(100ms or more) is less than this value than it will
+// be considered as idle video. Actual video stream will consume much more than 500Kbps.
+#define IDLE_VIDEO_MAX_BITRATE 500000
+// Atleast 75% of the buckets should contain actual video data.
+#define MIN_VALID_BUCKETS ((INCOMING_BITRATE_NUM_BUCKETS * 3) / 4)
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct IncomingBitrate {
+    uint64_t bucket_id;
+    int num_bits;
+} IncomingBitrate;
+
+typedef struct CongestionFeedback {
+    // Group related stats and variables required for congestion control
+    GroupStats group_stats[MAX_GROUP_STATS];
+    int prev_group_id;
+    int curr_group_id;
+    IncomingBitrate incoming_bitrate_buckets[INCOMING_BITRATE_NUM_BUCKETS];
+    // Averages of the round trip time, which are 0 until the first sample
+    bool has_latency;
+    double short_term_latency;
+    double long_term_latency;
+} CongestionFeedback;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Initialize the congestion feedback, before any samples
+ *
+ * @param feedback                 The congestion feedback to initialize
+ */
+void congestion_feedback_init(CongestionFeedback* feedback);
+
+/**
+ * @brief                          Count the bits of a received video segment towards the
+ *                                 incoming bitrate
+ *
+ * @param feedback                 The congestion feedback
+ * @param arrival_time             When the segment was received
+ * @param num_bits                 The size of the segment on the network, in bits
+ */
+void congestion_feedback_add_incoming_bits(CongestionFeedback* feedback,
+                                           timestamp_us arrival_time, int num_bits);
+
+/**
+ * @brief                          Get the bitrate that was received over the last
+ *                                 INCOMING_BITRATE_WINDOW_MS, ignoring idle video
+ *
+ * @param feedback                 The congestion feedback
+ * @param current_time             The current time, as returned by current_time_us()
+ *
+ * @returns                        The incoming bitrate in bits per second, or -1 if too little
+ *                                 of the window held actual video data
+ */
+int congestion_feedback_get_incoming_bitrate(CongestionFeedback* feedback,
+                                             timestamp_us current_time);
+
+/**
+ * @brief                          Record the departure and arrival time of an original video
+ *                                 segment, in the group of packets that it was sent in
+ *
+ * @param feedback                 The congestion feedback
+ * @param departure_time           When the server sent the segment, in the server's clock
+ * @param arrival_time             When the segment was received, in the client's clock
+ * @param group_id                 The segment's group id. Segments of groups older than the
+ *                                 current group are ignored.
+ * @param curr_group_stats         Filled with the stats of the group that just ended,
+ *                                 if this returns true
+ * @param prev_group_stats         Filled with the stats of the group before it,
+ *                                 if this returns true
+ *
+ * @returns                        True if this segment started a new group, and there are two
+ *                                 complete groups to compare
+ */
+bool congestion_feedback_add_group_sample(CongestionFeedback* feedback,
+                                          timestamp_us departure_time, timestamp_us arrival_time,
+                                          int group_id, GroupStats* curr_group_stats,
+                                          GroupStats* prev_group_stats);
+
+/**
+ * @brief                          Update the latency averages with a round trip time
+ *
+ * @param feedback                 The congestion feedback
+ * @param rtt                      The round trip time, in seconds
+ * @param congestion_detected      Whether congestion control currently detects congestion,
+ *                                 in which case the long term latency is left alone
+ */
+void congestion_feedback_add_rtt(CongestionFeedback* feedback, double rtt,
+                                 bool congestion_detected);
+
+#endif  // WHIST_NETWORK_CONGESTION_FEEDBACK_H
@@ -0,0 +1,136 @@
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file egress_scheduler.c
+ * @brief This file contains the scheduler that decides which video segment the server sends next.
+============================
+Usage
+============================
+
+See egress_scheduler.h.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include "egress_scheduler.h"
+
+/*
+============================
+Custom Types
+============================
+*/
+
+// A ring of queued packets
+typedef struct {
+    EgressPacket* packets;
+    int start;
+    int size;
+    int max_size;
+} EgressQueue;
+
+struct EgressScheduler {
+    EgressQueue queues[NUM_EGRESS_CLASSES];
+};
+
+/*
+============================
+Globals
+============================
+*/
+
+// New video and FEC are only stale once they're late for their departure, which the caller checks
+static const int egress_deadlines_ms[NUM_EGRESS_CLASSES] = {
+    [EGRESS_CLASS_RETRANSMIT] = EGRESS_RETRANSMIT_DEADLINE_MS,
+    [EGRESS_CLASS_VIDEO] = EGRESS_NO_DEADLINE,
+    [EGRESS_CLASS_FEC] = EGRESS_NO_DEADLINE,
+    [EGRESS_CLASS_PROBE] = EGRESS_PROBE_DEADLINE_MS,
+};
+
+/*
+============================
+Private Functions
+============================
+*/
+
+static EgressPacket* egress_queue_at(EgressQueue* queue, int i) {
+    return &queue->packets[(queue->start + i) % queue->max_size];
+}
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+EgressScheduler* egress_scheduler_create(int max_frame_packets, int max_queued_packets) {
+    FATAL_ASSERT(max_frame_packets > 0 && max_queued_packets > 0);
+    EgressScheduler* scheduler = safe_zalloc(sizeof(EgressScheduler));
+    for (int i = 0; i < NUM_EGRESS_CLASSES; i++) {
+        EgressQueue* queue = &scheduler->queues[i];
+        bool holds_frame = i == EGRESS_CLASS_VIDEO || i == EGRESS_CLASS_FEC;
+        queue->max_size = holds_frame ? max_frame_packets : max_queued_packets;
+        queue->packets = safe_malloc(sizeof(EgressPacket) * queue->max_size);
+    }
+    return scheduler;
+}
+
+void egress_scheduler_destroy(EgressScheduler* scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+    for (int i = 0; i < NUM_EGRESS_CLASSES; i++) {
+        free(scheduler->queues[i].packets);
+    }
+    free(scheduler);
+}
+
+bool egress_scheduler_enqueue(EgressScheduler* scheduler, EgressClass egress_class,
+                              EgressPacket* packet) {
+    FATAL_ASSERT(egress_class < NUM_EGRESS_CLASSES);
+    EgressQueue* queue = &scheduler->queues[egress_class];
+    if (queue->size == queue->max_size) {
+        return false;
+    }
+    int deadline_ms = egress_deadlines_ms[egress_class];
+    packet->deadline = deadline_ms == EGRESS_NO_DEADLINE
+                           ? EGRESS_NO_DEADLINE
+                           : packet->queued_time + deadline_ms * US_IN_MS;
+
+    // NACKs mostly arrive in frame order, so this rarely moves anything
+    int position = queue->size;
+    if (egress_class == EGRESS_CLASS_RETRANSMIT) {
+        while (position > 0 && egress_queue_at(queue, position - 1)->id > packet->id) {
+            *egress_queue_at(queue, position) = *egress_queue_at(queue, position - 1);
+            position--;
+        }
+    }
+    *egress_queue_at(queue, position) = *packet;
+    queue->size++;
+    return true;
+}
+
+bool egress_scheduler_dequeue(EgressScheduler* scheduler, timestamp_us current_time, int failed_id,
+                              EgressPacket* packet, EgressClass* egress_class, bool* is_stale) {
+    for (int i = 0; i < NUM_EGRESS_CLASSES; i++) {
+        EgressQueue* queue = &scheduler->queues[i];
+        if (queue->size == 0) {
+            continue;
+        }
+        *packet = *egress_queue_at(queue, 0);
+        queue->start = (queue->start + 1) % queue->max_size;
+        queue->size--;
+        *egress_class = (EgressClass)i;
+        *is_stale = (packet->deadline != EGRESS_NO_DEADLINE && current_time > packet->deadline) ||
+                    packet->id <= failed_id;
+        return true;
+    }
+    return false;
+}
+
+int egress_scheduler_get_num_queued(EgressScheduler* scheduler, EgressClass egress_class) {
+    FATAL_ASSERT(egress_class < NUM_EGRESS_CLASSES);
+    return scheduler->queues[egress_class].size;
+}
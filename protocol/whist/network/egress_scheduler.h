@@ -0,0 +1,146 @@
+#ifndef WHIST_NETWORK_EGRESS_SCHEDULER_H
+#define WHIST_NETWORK_EGRESS_SCHEDULER_H
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file egress_scheduler.h
+ * @brief This file contains the scheduler that decides which video segment the server sends next,
+ *        between retransmits, new video, FEC and probes.
+============================
+Usage
+============================
+Control messages, pings and audio go before everything else, but they're sent right away by their
+own threads, and only take their share of the network throttler's budget, so they're never queued
+here. The video send thread's traffic is split into classes, from the highest priority to the
+lowest: retransmits, new video, FEC and probes.
+
+The video send thread queues everything else with egress_scheduler_enqueue, and sends whatever
+egress_scheduler_dequeue gives it next, paced by the network throttler. A packet is only dequeued
+once every class above it is empty, so that retransmits cut in front of a frame that is still
+being sent. Retransmits go oldest frame first, since the client can't render anything
+until it gets the oldest frame that it's missing.
+
+Retransmits and probes have a deadline, after which they're dequeued as stale, and so are the
+packets of frames that the client gave up on. The caller drops those, instead of spending the
+bandwidth on them. New video and FEC have no deadline here, since a frame can take longer than
+EGRESS_VIDEO_DEADLINE_MS to pace out: the caller counts it from each segment's scheduled departure.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// How late new video and FEC segments may be for their scheduled departure before they're stale.
+// This is the longest that the client waits for a frame before it asks for a recovery frame, see
+// ringbuffer.c.
+#define EGRESS_VIDEO_DEADLINE_MS 300
+// How long a retransmit may be queued, from when its NACK arrived. The client NACKs again by then
+// if it's still missing the segment.
+#define EGRESS_RETRANSMIT_DEADLINE_MS 100
+// How long a probe may be queued. Any longer, and it would only delay the next frame.
+#define EGRESS_PROBE_DEADLINE_MS 10
+// The deadline of packets that never go stale in the queue
+#define EGRESS_NO_DEADLINE 0
+
+/*
+============================
+Custom Types
+============================
+*/
+
+// From the highest priority to the lowest
+typedef enum {
+    EGRESS_CLASS_RETRANSMIT,
+    EGRESS_CLASS_VIDEO,
+    EGRESS_CLASS_FEC,
+    EGRESS_CLASS_PROBE,
+    NUM_EGRESS_CLASSES,
+} EgressClass;
+
+typedef struct {
+    // The segment's frame id and index
+    int id;
+    int index;
+    // When the packet was queued, or when its NACK arrived for a retransmit
+    timestamp_us queued_time;
+    // When the packet becomes stale, which egress_scheduler_enqueue sets from its class,
+    // or EGRESS_NO_DEADLINE
+    timestamp_us deadline;
+} EgressPacket;
+
+typedef struct EgressScheduler EgressScheduler;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Create an egress scheduler, with empty queues
+ *
+ * @param max_frame_packets        How many packets the new video and FEC classes may each hold,
+ *                                 which only ever hold one frame
+ * @param max_queued_packets       How many packets the retransmit and probe classes may each hold
+ *
+ * @returns                        The egress scheduler
+ */
+EgressScheduler* egress_scheduler_create(int max_frame_packets, int max_queued_packets);
+
+/**
+ * @brief                          Destroy an egress scheduler
+ *
+ * @param scheduler                The egress scheduler to destroy
+ */
+void egress_scheduler_destroy(EgressScheduler* scheduler);
+
+/**
+ * @brief                          Queue a packet behind the others of its class. Retransmits are
+ *                                 kept sorted by frame id instead.
+ *
+ * @param scheduler                The egress scheduler
+ * @param egress_class             The packet's class
+ * @param packet                   The packet, whose deadline gets set
+ *
+ * @returns                        False if the class is full, in which case the packet isn't queued
+ */
+bool egress_scheduler_enqueue(EgressScheduler* scheduler, EgressClass egress_class,
+                              EgressPacket* packet);
+
+/**
+ * @brief                          Take the next packet out of the highest priority class that
+ *                                 isn't empty
+ *
+ * @param scheduler                The egress scheduler
+ * @param current_time             The current time, which stale deadlines are checked against
+ * @param failed_id                The greatest frame id that the client gave up on, or -1
+ * @param packet                   Filled with the packet
+ * @param egress_class             Filled with the packet's class
+ * @param is_stale                 Set to whether the packet is past its deadline or part of a
+ *                                 failed frame, in which case it must be dropped
+ *
+ * @returns                        False if every class is empty
+ */
+bool egress_scheduler_dequeue(EgressScheduler* scheduler, timestamp_us current_time, int failed_id,
+                              EgressPacket* packet, EgressClass* egress_class, bool* is_stale);
+
+/**
+ * @brief                          Get how many packets of a class are queued
+ *
+ * @param scheduler                The egress scheduler
+ * @param egress_class             The class
+ *
+ * @returns                        The number of queued packets
+ */
+int egress_scheduler_get_num_queued(EgressScheduler* scheduler, EgressClass egress_class);
+
+#endif  // WHIST_NETWORK_EGRESS_SCHEDULER_H
@@ -547,6 +547,70 @@ int recvfrom_no_intr(SOCKET sockfd, void* buf, size_t len, int flags, struct soc
 #endif
 }
 
+#if OS_IS(OS_LINUX)
+// This is identical to the previous function except for the recvmmsg() call.
+// Any changes should be kept in sync between them.
+int recvmmsg_no_intr(SOCKET sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags) {
+    int ret;
+    bool got_timeout = false;
+    int original_timeout, current_timeout;
+    WhistTimer timer;
+    // For timeouts we only care about how long has elapsed since this call started.
+    start_timer(&timer);
+    while (1) {
+        // A NULL timeout makes recvmmsg() respect the socket's SO_RCVTIMEO for the first
+        // datagram, exactly like recvfrom() would.
+        ret = recvmmsg(sockfd, msgvec, vlen, flags, NULL);
+        if (ret >= 0 || errno != EINTR) {
+            // If we didn't hit an EINTR case, return immediately.
+            return ret;
+        }
+        if (!got_timeout) {
+            // Only fetch the timeout the first time around.
+            current_timeout = original_timeout = get_timeout(sockfd);
+            got_timeout = true;
+        }
+        // cppcheck-suppress uninitvar
+        if (current_timeout <= 0) {
+            // If either the socket is non-blocking (0) or there wasn't a
+            // timeout set (-1) then we just call again.
+            continue;
+        }
+        while (1) {
+            // If there was a timeout set we need compare against how long
+            // has actually elapsed.
+            int elapsed = (int)(get_timer(&timer) * MS_IN_SECOND);
+            if (elapsed >= original_timeout) {
+                // If the full time has already elapsed we should return.
+                // Set errno to the expected value for a timeout case.
+                errno = EAGAIN;
+                return -1;
+            }
+            // Now wait for the remaining timeout for anything to happen.
+            current_timeout = original_timeout - elapsed;
+            struct pollfd pfd = {
+                .fd = sockfd,
+                .events = POLLIN,
+            };
+            ret = poll(&pfd, 1, current_timeout);
+            if (ret == 0) {
+                // We timed out, so return that.
+                errno = EAGAIN;
+                return -1;
+            }
+            if (ret >= 0 || errno != EINTR) {
+                // Either something is now there so we can recvmmsg() it, or
+                // it is an external error and we want to return whatever
+                // recvmmsg() says the error is.
+                break;
+            }
+            // We got EINTR again in poll(), so recalculate the timeout
+            // and go around again.
+        }
+    }
+}
+#endif
+
 /*
 ============================
 Private Function Implementations
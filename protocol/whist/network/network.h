@@ -187,6 +187,9 @@ typedef struct {
     CodecType desired_codec;
     bool saturate_bandwidth;
     bool congestion_detected;
+    // How much the video FEC ratio is raised by while saturating the bandwidth, for parity that's
+    // only sent as probes, to fill the spare bandwidth
+    double video_probe_ratio;
 } NetworkSettings;
 
 /**
@@ -446,6 +449,21 @@ int recv_no_intr(SOCKET sockfd, void* buf, size_t len, int flags);
 int recvfrom_no_intr(SOCKET sockfd, void* buf, size_t len, int flags, struct sockaddr* src_addr,
                      socklen_t* addrlen);
 
+#if OS_IS(OS_LINUX)
+// Only declared by <sys/socket.h> when _GNU_SOURCE was set before its first inclusion
+struct mmsghdr;
+
+/**
+ * @brief Call recvmmsg() while ignoring EINTR returns.
+ *
+ * The function signature is identical to the host recvmmsg() call, except that
+ * there is no timeout argument: the socket's receive timeout applies to the
+ * first datagram, as it would for recv(). Pass MSG_WAITFORONE to return as soon
+ * as at least one datagram has been received.
+ */
+int recvmmsg_no_intr(SOCKET sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags);
+#endif
+
 /**
  * @brief                          Get length queued in the socket
  * @returns                        num of bytes queued in the socket
@@ -6,14 +6,13 @@
 ============================
 Usage
 ============================
-Place to put any predictive/adaptive bitrate algorithms. In the current setup, each algorithm is a
-function that takes in inputs through a NetworkStatistics struct. The function is responsible for
-maintaining any internal state necessary for the algorithm (possibly through the use of custom types
-or helpers), and should update client_max_bitrate when necessary.
+Place to put any predictive/adaptive bitrate algorithms. Each algorithm is a congestion controller,
+which implements a CongestionControllerFunctionTable and keeps its state in its own context, so that
+a CongestionController can run any of them.
 
-To change the algorithm the client uses, set `calculate_new_bitrate` to the desired algorithm.
-The function assigned to `calculate_new_bitrate` should have signature such that it takes
-one argument of type `NetworkStatistics` and returns type `NetworkSettings`.
+The client picks the algorithm with `--congestion-control`. WCC, which is documented in WCC.md, is
+the default. The trendline controller is a delay-gradient estimator in the style of Google
+Congestion Control, with an adaptive threshold.
 
 For more details about the individual algorithms, please visit
 https://www.notion.so/whisthq/Adaptive-Bitrate-Algorithms-a6ea0987adc04e8d84792fc9dcbc7fc7
@@ -31,6 +30,7 @@ Includes
 #include <whist/fec/fec_controller.h>
 #include <whist/fec/fec.h>
 #include <whist/debug/protocol_analyzer.h>
+#include <whist/utils/command_line.h>
 
 /*
 ============================
@@ -42,6 +42,10 @@ static volatile int network_algo_width;
 static volatile int network_algo_height;
 static volatile bool network_algo_insufficient_bandwidth;
 
+static const char *congestion_control_type;
+COMMAND_LINE_STRING_OPTION(congestion_control_type, 0, "congestion-control", 16,
+                           "Congestion control algorithm to use: wcc (the default) or trendline.")
+
 /*
 ============================
 Defines
@@ -82,7 +86,69 @@ static NetworkSettings default_network_settings = {
 #define STARTING_BURST_BITRATE (STARTING_BITRATE * BURST_BITRATE_RATIO)
 
 static int dpi = -1;
-static WhistTimer last_update_timer;
+
+#define MIN_UPDATE_INTERVAL_SEVERE_CONGESTION_SEC 0.025  // 25ms
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef enum {
+    UNDERUSE_SIGNAL,
+    NORMAL_SIGNAL,
+    OVERUSE_SIGNAL,
+} OveruseSignal;
+
+typedef enum {
+    DELAY_CONTROLLER_INCREASE,
+    DELAY_CONTROLLER_HOLD,
+    DELAY_CONTROLLER_DECREASE
+} DelayControllerState;
+
+// The functions that a congestion control algorithm implements. The latest packet loss ratio and
+// latencies are given to the algorithm before each group feedback.
+typedef struct CongestionControllerFunctionTable {
+    // Allocate the algorithm's context
+    void *(*init)(void);
+    void (*destroy)(void *context);
+    void (*on_rtt)(void *context, double short_term_latency, double long_term_latency);
+    void (*on_loss)(void *context, double packet_loss_ratio);
+    // Update network_settings for a group of packets that just ended, returning whether they
+    // changed. wcc_op is set to how the bitrate changed, for the FEC controller.
+    bool (*on_group_feedback)(void *context, GroupStats *curr_group_stats,
+                              GroupStats *prev_group_stats, int incoming_bitrate,
+                              NetworkSettings *network_settings, WccOp *wcc_op);
+    bool (*on_severe_congestion)(void *context, NetworkSettings *network_settings);
+    int (*get_bitrate)(void *context);
+} CongestionControllerFunctionTable;
+
+struct CongestionController {
+    void *context;
+    const CongestionControllerFunctionTable *call;
+    void *fec_controller;
+    double packet_loss_ratio;
+    double short_term_latency;
+};
+
+typedef struct {
+    WhistTimer overuse_timer;
+    WhistTimer last_decrease_timer;
+    WhistTimer last_update_timer;
+    bool delay_controller_initialized;
+    double filtered_delay_variation;
+    double increase_percentage;
+    bool burst_mode;
+    int max_bitrate_available;
+    int last_successful_bitrate;
+    bool maybe_overuse;
+    DelayControllerState delay_controller_state;
+    double packet_loss_ratio;
+    double short_term_latency;
+    double long_term_latency;
+    int bitrate;
+} WccContext;
 
 /*
 ============================
@@ -131,13 +197,38 @@ void network_algo_set_dimensions(int width, int height) {
 
 bool network_algo_is_insufficient_bandwidth(void) { return network_algo_insufficient_bandwidth; }
 
+/*
+============================
+Whist Congestion Control
+============================
+*/
+
+static void *wcc_init(void) {
+    WccContext *ctx = safe_zalloc(sizeof(WccContext));
+    ctx->increase_percentage = MAX_INCREASE_PERCENTAGE;
+    ctx->delay_controller_state = DELAY_CONTROLLER_HOLD;
+    return ctx;
+}
+
+static void wcc_destroy(void *context) { free(context); }
+
+static void wcc_on_rtt(void *context, double short_term_latency, double long_term_latency) {
+    WccContext *ctx = (WccContext *)context;
+    ctx->short_term_latency = short_term_latency;
+    ctx->long_term_latency = long_term_latency;
+}
+
+static void wcc_on_loss(void *context, double packet_loss_ratio) {
+    WccContext *ctx = (WccContext *)context;
+    ctx->packet_loss_ratio = packet_loss_ratio;
+}
+
 // The theory behind all the code in this function is documented in WCC.md file. Please go thru that
 // document before reviewing this file. Also if you make any modifications to this algo, remember to
 // update the WCC.md file as well so that the documentation remains upto date.
-bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_group_stats,
-                                 int incoming_bitrate, double packet_loss_ratio,
-                                 double short_term_latency, double long_term_latency,
-                                 NetworkSettings *network_settings, void *fec_controller) {
+static bool wcc_on_group_feedback(void *context, GroupStats *curr_group_stats,
+                                  GroupStats *prev_group_stats, int incoming_bitrate,
+                                  NetworkSettings *network_settings, WccOp *wcc_op) {
 // Latest delay variation gets this weightage. Older value gets a weightage of (1 - EWMA_FACTOR)
 #define EWMA_FACTOR 0.3
 // Latest max bitrate gets this weightage.
@@ -150,40 +241,26 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
 // congestion. Right now set to 50ms based on tradeoff between acceptable E2E latency vs false
 // positives.
 #define MIN_LATENCY_THRESHOLD_SEC 0.05  // 50ms
+    WccContext *ctx = (WccContext *)context;
+    *wcc_op = WCC_NO_OP;
     if (incoming_bitrate <= 0) {
         // Not enough data to take any decision. Let the bits start flowing.
         return false;
     }
-    static WhistTimer overuse_timer;
-    static WhistTimer last_decrease_timer;
-    static bool delay_controller_initialized = false;
-
-    static double filtered_delay_variation;
-    static double increase_percentage = MAX_INCREASE_PERCENTAGE;
-    static bool burst_mode = false;
-    static int max_bitrate_available = 0;
-    static int last_successful_bitrate = 0;
+    double packet_loss_ratio = ctx->packet_loss_ratio;
+    double short_term_latency = ctx->short_term_latency;
+    double long_term_latency = ctx->long_term_latency;
 
-    if (!delay_controller_initialized) {
-        start_timer(&overuse_timer);
-        start_timer(&last_update_timer);
-        start_timer(&last_decrease_timer);
+    if (!ctx->delay_controller_initialized) {
+        start_timer(&ctx->overuse_timer);
+        start_timer(&ctx->last_update_timer);
+        start_timer(&ctx->last_decrease_timer);
     }
     int max_bitrate = MAXIMUM_BITRATE;
     int new_bitrate = network_settings->video_bitrate;
     bool send_network_settings = false;
 
-    enum {
-        UNDERUSE_SIGNAL,
-        NORMAL_SIGNAL,
-        OVERUSE_SIGNAL,
-    } overuse_detector_signal = NORMAL_SIGNAL;
-
-    static enum {
-        DELAY_CONTROLLER_INCREASE,
-        DELAY_CONTROLLER_HOLD,
-        DELAY_CONTROLLER_DECREASE
-    } delay_controller_state = DELAY_CONTROLLER_HOLD;
+    OveruseSignal overuse_detector_signal = NORMAL_SIGNAL;
 
     double inter_departure_time =
         (double)(curr_group_stats->departure_time - prev_group_stats->departure_time) /
@@ -192,26 +269,25 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
         (double)(curr_group_stats->arrival_time - prev_group_stats->arrival_time) / US_IN_SECOND;
     double delay_variation = inter_arrival_time - inter_departure_time;
 
-    if (!delay_controller_initialized) {
-        filtered_delay_variation = delay_variation;
+    if (!ctx->delay_controller_initialized) {
+        ctx->filtered_delay_variation = delay_variation;
     } else {
-        filtered_delay_variation =
-            filtered_delay_variation * (1.0 - EWMA_FACTOR) + delay_variation * EWMA_FACTOR;
+        ctx->filtered_delay_variation =
+            ctx->filtered_delay_variation * (1.0 - EWMA_FACTOR) + delay_variation * EWMA_FACTOR;
     }
 
-    delay_controller_initialized = true;
+    ctx->delay_controller_initialized = true;
 
-    static bool maybe_overuse = false;
     // Detect over/under use using state machine outlined in spec
     // In burst mode delay gradient might increase, but it doesn't mean congestion. In burst
     // mode we will rely for packet loss ratio for overuse detection
-    if ((DELAY_VARIATION_THRESHOLD_IN_SEC < filtered_delay_variation && !burst_mode) ||
+    if ((DELAY_VARIATION_THRESHOLD_IN_SEC < ctx->filtered_delay_variation && !ctx->burst_mode) ||
         packet_loss_ratio > 0.1) {
-        if (!maybe_overuse) {
-            start_timer(&overuse_timer);
-            maybe_overuse = true;
+        if (!ctx->maybe_overuse) {
+            start_timer(&ctx->overuse_timer);
+            ctx->maybe_overuse = true;
             LOG_INFO("Maybe overuse!, filtered_delay_variation = %0.3f, packet_loss_ratio = %.2f",
-                     filtered_delay_variation, packet_loss_ratio);
+                     ctx->filtered_delay_variation, packet_loss_ratio);
         }
         double overuse_time_threshold;
         if (network_settings->saturate_bandwidth) {
@@ -226,19 +302,19 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
         // detected for at least overuse_time_th milliseconds.  However, if m(i)
         // < m(i-1), over-use will not be signaled even if all the above
         // conditions are met.
-        if (get_timer(&overuse_timer) > overuse_time_threshold) {
+        if (get_timer(&ctx->overuse_timer) > overuse_time_threshold) {
             overuse_detector_signal = OVERUSE_SIGNAL;
         } else {
             // If neither over-use nor under-use is detected, the detector will be in the normal
             // state.
             overuse_detector_signal = NORMAL_SIGNAL;
         }
-    } else if (-DELAY_VARIATION_THRESHOLD_IN_SEC > filtered_delay_variation) {
+    } else if (-DELAY_VARIATION_THRESHOLD_IN_SEC > ctx->filtered_delay_variation) {
         overuse_detector_signal = UNDERUSE_SIGNAL;
-        maybe_overuse = false;
+        ctx->maybe_overuse = false;
     } else {
         overuse_detector_signal = NORMAL_SIGNAL;
-        maybe_overuse = false;
+        ctx->maybe_overuse = false;
     }
 
     // The state transitions (with blank fields meaning "remain in state")
@@ -255,15 +331,15 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
     // |  Under-use  |           |   Hold     |  Hold  |
     // +-------------+-----------+------------+--------+
     if (overuse_detector_signal == OVERUSE_SIGNAL) {
-        delay_controller_state = DELAY_CONTROLLER_DECREASE;
+        ctx->delay_controller_state = DELAY_CONTROLLER_DECREASE;
     } else if (overuse_detector_signal == NORMAL_SIGNAL) {
-        if (delay_controller_state == DELAY_CONTROLLER_HOLD) {
-            delay_controller_state = DELAY_CONTROLLER_INCREASE;
-        } else if (delay_controller_state == DELAY_CONTROLLER_DECREASE) {
-            delay_controller_state = DELAY_CONTROLLER_HOLD;
+        if (ctx->delay_controller_state == DELAY_CONTROLLER_HOLD) {
+            ctx->delay_controller_state = DELAY_CONTROLLER_INCREASE;
+        } else if (ctx->delay_controller_state == DELAY_CONTROLLER_DECREASE) {
+            ctx->delay_controller_state = DELAY_CONTROLLER_HOLD;
         }
     } else if (overuse_detector_signal == UNDERUSE_SIGNAL) {
-        delay_controller_state = DELAY_CONTROLLER_HOLD;
+        ctx->delay_controller_state = DELAY_CONTROLLER_HOLD;
     }
 
     // If the latency suddenly increases, then it might mean congestion due to longer queue length.
@@ -276,7 +352,7 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
 #define LATENCY_MULTIPLIER_HOLD_STATE 1.1
     // Using a higher latency threshold for burst mode, as sending packets in a burst can
     // momentarily cause congestion that will get cleared up immediately.
-    if (burst_mode)
+    if (ctx->burst_mode)
         latency_threshold_decrease_state = long_term_latency * LATENCY_MULTIPLIER_BURST_MODE;
     else
         latency_threshold_decrease_state = long_term_latency * LATENCY_MULTIPLIER_NORMAL_MODE;
@@ -288,61 +364,63 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
     latency_threshold_hold_state = max(latency_threshold_hold_state, MIN_LATENCY_THRESHOLD_SEC);
 
     if (short_term_latency > latency_threshold_decrease_state) {
-        delay_controller_state = DELAY_CONTROLLER_DECREASE;
+        ctx->delay_controller_state = DELAY_CONTROLLER_DECREASE;
     } else if (short_term_latency > latency_threshold_hold_state &&
-               delay_controller_state == DELAY_CONTROLLER_INCREASE) {
-        delay_controller_state = DELAY_CONTROLLER_HOLD;
+               ctx->delay_controller_state == DELAY_CONTROLLER_INCREASE) {
+        ctx->delay_controller_state = DELAY_CONTROLLER_HOLD;
     }
 
     WccOp op = WCC_NO_OP;
-    int old_bitrate = network_settings->video_bitrate;
 
     // Delay-based controller selects based on overuse signal
     // It is RECOMMENDED to send the REMB message as soon
     // as congestion is detected, and otherwise at least once every second.
     // It is RECOMMENDED that the routine to update A_hat(i) is run at least
     // once every response_time interval.
-    if (delay_controller_state == DELAY_CONTROLLER_INCREASE &&
-        get_timer(&last_update_timer) > NEW_BITRATE_DURATION_IN_SEC &&
+    if (ctx->delay_controller_state == DELAY_CONTROLLER_INCREASE &&
+        get_timer(&ctx->last_update_timer) > NEW_BITRATE_DURATION_IN_SEC &&
         incoming_bitrate > (network_settings->video_bitrate * BANDWITH_USED_THRESHOLD)) {
-        last_successful_bitrate = network_settings->video_bitrate;
+        ctx->last_successful_bitrate = network_settings->video_bitrate;
         // Looks like the network has found a new max bitrate. Let find the new max bandwidth.
-        if (last_successful_bitrate > max_bitrate_available) {
-            max_bitrate_available = last_successful_bitrate;
+        if (ctx->last_successful_bitrate > ctx->max_bitrate_available) {
+            ctx->max_bitrate_available = ctx->last_successful_bitrate;
             network_settings->saturate_bandwidth = true;
-            increase_percentage = MAX_INCREASE_PERCENTAGE;
+            ctx->increase_percentage = MAX_INCREASE_PERCENTAGE;
         }
         // If in saturate bandwidth mode and no congestion is detected, then increase percentage
         // should be made higher to quickly find the new max bitrate
         if (network_settings->saturate_bandwidth == true) {
-            increase_percentage = MAX_INCREASE_PERCENTAGE;
+            ctx->increase_percentage = MAX_INCREASE_PERCENTAGE;
         }
-        LOG_INFO("Increase bitrate by %.3f percent", increase_percentage);
-        new_bitrate = network_settings->video_bitrate * (1.0 + increase_percentage / 100.0);
+        LOG_INFO("Increase bitrate by %.3f percent", ctx->increase_percentage);
+        new_bitrate = network_settings->video_bitrate * (1.0 + ctx->increase_percentage / 100.0);
         op = WCC_INCREASE_BWD;
-    } else if ((delay_controller_state == DELAY_CONTROLLER_DECREASE) &&
-               get_timer(&last_decrease_timer) > NEW_BITRATE_DURATION_IN_SEC) {
+    } else if ((ctx->delay_controller_state == DELAY_CONTROLLER_DECREASE) &&
+               get_timer(&ctx->last_decrease_timer) > NEW_BITRATE_DURATION_IN_SEC) {
         LOG_INFO(
             "Decrease bitrate filtered_delay_variation = %.3f packet_loss_ratio = %.2f, "
             "short_term_latency = %0.3f, long_term_latency = %.3f",
-            filtered_delay_variation, packet_loss_ratio, short_term_latency * MS_IN_SECOND,
+            ctx->filtered_delay_variation, packet_loss_ratio, short_term_latency * MS_IN_SECOND,
             long_term_latency * MS_IN_SECOND);
         // Decrease the max_bitrate_available gradually, if congestion is detected at a lower
         // bitrate
-        if (last_successful_bitrate < max_bitrate_available) {
-            max_bitrate_available = max_bitrate_available * (1.0 - MAX_BITRATE_EWMA_FACTOR) +
-                                    last_successful_bitrate * MAX_BITRATE_EWMA_FACTOR;
+        if (ctx->last_successful_bitrate < ctx->max_bitrate_available) {
+            ctx->max_bitrate_available =
+                ctx->max_bitrate_available * (1.0 - MAX_BITRATE_EWMA_FACTOR) +
+                ctx->last_successful_bitrate * MAX_BITRATE_EWMA_FACTOR;
         }
         // Use incoming bitrate only when saturate_bandwidth is on OR if it is within the
         // convergence range
         if (network_settings->saturate_bandwidth ||
-            incoming_bitrate * DECREASE_RATIO > max_bitrate_available * CONVERGENCE_THRESHOLD_LOW) {
+            incoming_bitrate * DECREASE_RATIO >
+                ctx->max_bitrate_available * CONVERGENCE_THRESHOLD_LOW) {
             new_bitrate = incoming_bitrate * DECREASE_RATIO;
             // If we are reaching convergence than reduce the increase percentage and switch off
             // saturate bandwidth
-            if (new_bitrate >= max_bitrate_available * CONVERGENCE_THRESHOLD_LOW) {
+            if (new_bitrate >= ctx->max_bitrate_available * CONVERGENCE_THRESHOLD_LOW) {
                 network_settings->saturate_bandwidth = false;
-                increase_percentage = max(increase_percentage / 2.0, MIN_INCREASE_PERCENTAGE);
+                ctx->increase_percentage =
+                    max(ctx->increase_percentage / 2.0, MIN_INCREASE_PERCENTAGE);
             }
         } else {
             // When saturate bandwidth is OFF, then incoming_bitrate is not reliable. So just reduce
@@ -354,19 +432,19 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
             network_settings->saturate_bandwidth = true;
         }
         network_settings->congestion_detected = true;
-        start_timer(&last_decrease_timer);
+        start_timer(&ctx->last_decrease_timer);
         op = WCC_DECREASE_BWD;
     }
 
     if (op != WCC_NO_OP) {
         // Till we reach CONVERGENCE_THRESHOLD_LOW of max bitrate in session, bitrate
         // increases will be aggressive
-        if (new_bitrate < max_bitrate_available * CONVERGENCE_THRESHOLD_LOW ||
-            max_bitrate_available == 0) {
+        if (new_bitrate < ctx->max_bitrate_available * CONVERGENCE_THRESHOLD_LOW ||
+            ctx->max_bitrate_available == 0) {
             network_settings->saturate_bandwidth = true;
-            increase_percentage = MAX_INCREASE_PERCENTAGE;
+            ctx->increase_percentage = MAX_INCREASE_PERCENTAGE;
         }
-        start_timer(&last_update_timer);
+        start_timer(&ctx->last_update_timer);
         int min_bitrate = MINIMUM_BITRATE;
         if (new_bitrate < min_bitrate) {
             LOG_WARNING("Requested bitrate %d bps is lesser than minimum acceptable bitrate %d bps",
@@ -380,7 +458,7 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
         } else {
             network_algo_insufficient_bandwidth = false;
         }
-        burst_mode = false;
+        ctx->burst_mode = false;
 
         if (new_bitrate >= max_bitrate) {
             network_settings->saturate_bandwidth = false;
@@ -388,20 +466,20 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
             new_bitrate = max_bitrate;
             // More bandwidth than max_bitrate could be available. Switch to burst mode for reduced
             // latency
-            burst_mode = true;
+            ctx->burst_mode = true;
         }
 
         int burst_bitrate = new_bitrate;
-        if (burst_mode) burst_bitrate *= BURST_BITRATE_RATIO;
+        if (ctx->burst_mode) burst_bitrate *= BURST_BITRATE_RATIO;
         network_settings->burst_bitrate = burst_bitrate;
         network_settings->video_bitrate = new_bitrate;
         LOG_INFO(
             "New bitrate = %d, burst_bitrate = %d, saturate bandwidth = %d, "
             "max_bitrate_available = %d",
             network_settings->video_bitrate, network_settings->burst_bitrate,
-            network_settings->saturate_bandwidth, max_bitrate_available);
+            network_settings->saturate_bandwidth, ctx->max_bitrate_available);
         send_network_settings = true;
-    } else if (network_settings->saturate_bandwidth && get_timer(&last_update_timer) > 5.0) {
+    } else if (network_settings->saturate_bandwidth && get_timer(&ctx->last_update_timer) > 5.0) {
         // Prevent being stuck in saturate_bandwidth loop, without any bitrate update. This can
         // happen when the network bandwidth on this session worsens lesser than
         // (max_bitrate_available  * CONVERGENCE_THRESHOLD_LOW) for a long period of time. In such
@@ -412,16 +490,518 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
         send_network_settings = true;
     }
 
+    ctx->bitrate = network_settings->video_bitrate;
+    *wcc_op = op;
+    return send_network_settings;
+}
+
+static void set_severe_congestion_settings(NetworkSettings *network_settings) {
+    network_settings->burst_bitrate = network_settings->video_bitrate = MINIMUM_BITRATE;
+    network_settings->congestion_detected = true;
+    network_settings->saturate_bandwidth = true;
+    LOG_INFO_RATE_LIMITED(5, 1, "Severe congestion detected. New bitrate = %d",
+                          network_settings->video_bitrate);
+}
+
+// Should be called in times of severe congestion. Right now we are just setting the bitrate to
+// MINIMUM_BITRATE to handle severe congestion.
+static bool wcc_on_severe_congestion(void *context, NetworkSettings *network_settings) {
+    WccContext *ctx = (WccContext *)context;
+    if (get_timer(&ctx->last_update_timer) < MIN_UPDATE_INTERVAL_SEVERE_CONGESTION_SEC) {
+        return false;
+    }
+    set_severe_congestion_settings(network_settings);
+    start_timer(&ctx->last_update_timer);
+    ctx->bitrate = network_settings->video_bitrate;
+    return true;
+}
+
+static int wcc_get_bitrate(void *context) { return ((WccContext *)context)->bitrate; }
+
+static const CongestionControllerFunctionTable wcc_function_table = {
+    .init = wcc_init,
+    .destroy = wcc_destroy,
+    .on_rtt = wcc_on_rtt,
+    .on_loss = wcc_on_loss,
+    .on_group_feedback = wcc_on_group_feedback,
+    .on_severe_congestion = wcc_on_severe_congestion,
+    .get_bitrate = wcc_get_bitrate,
+};
+
+/*
+============================
+Trendline Congestion Control
+============================
+*/
+
+// A delay-based controller in the style of Google Congestion Control. Instead of WCC's fixed
+// threshold on an EWMA of the delay variation, it fits a line through the accumulated delay of the
+// last few groups, and compares its slope against a threshold that adapts to the network's jitter.
+// A growing queue shows up in the slope well before it causes loss. The bitrate follows an AIMD
+// controller, that increases multiplicatively until a decrease reveals the link capacity, and then
+// additively around it.
+
+// Number of groups that the trend is fitted over
+#define TRENDLINE_WINDOW_SIZE 20
+// Weight of the previous smoothed delay, when adding a new accumulated delay
+#define TRENDLINE_SMOOTHING_COEF 0.9
+// The trend is scaled by this and by the number of samples, before being compared to the threshold
+#define TRENDLINE_THRESHOLD_GAIN 4.0
+#define TRENDLINE_MAX_NUM_DELTAS 60
+// The adaptive threshold, which follows the modified trend slowly upwards and quickly downwards
+#define TRENDLINE_INITIAL_THRESHOLD_MS 12.5
+#define TRENDLINE_MIN_THRESHOLD_MS 6.0
+#define TRENDLINE_MAX_THRESHOLD_MS 600.0
+#define TRENDLINE_THRESHOLD_K_UP 0.0087
+#define TRENDLINE_THRESHOLD_K_DOWN 0.039
+// Trends further than this above the threshold, like route changes, don't adapt it
+#define TRENDLINE_MAX_ADAPT_OFFSET_MS 15.0
+#define TRENDLINE_MAX_THRESHOLD_TIME_DELTA_MS 100.0
+#define TRENDLINE_OVERUSE_TIME_THRESHOLD_MS 10.0
+// The rate controller
+#define TRENDLINE_DECREASE_RATIO 0.85
+#define TRENDLINE_INCREASE_RATIO_PER_SEC 1.08
+#define TRENDLINE_BANDWIDTH_USED_THRESHOLD 0.95
+// The incoming bitrate doesn't allow increasing beyond this ratio of itself
+#define TRENDLINE_INCOMING_BITRATE_HEADROOM 1.5
+// Loss above the high ratio decreases the bitrate, and loss above the low ratio holds it
+#define TRENDLINE_HIGH_LOSS_RATIO 0.1
+#define TRENDLINE_LOW_LOSS_RATIO 0.02
+// Time for a bitrate change to show in the feedback, on top of the round trip time
+#define TRENDLINE_RESPONSE_TIME_OFFSET_SEC 0.1
+// Smaller increases aren't sent to the server, so that the encoder isn't reconfigured constantly
+#define TRENDLINE_MIN_CHANGE_RATIO 0.025
+#define TRENDLINE_MAX_BITRATE_EWMA_FACTOR 0.05
+#define TRENDLINE_MIN_MAX_BITRATE_VARIANCE 0.4
+#define TRENDLINE_MAX_MAX_BITRATE_VARIANCE 2.5
+
+typedef struct {
+    // The window of (arrival time, smoothed accumulated delay) samples that the trend is fitted to
+    double arrival_times_ms[TRENDLINE_WINDOW_SIZE];
+    double smoothed_delays_ms[TRENDLINE_WINDOW_SIZE];
+    int num_samples;
+    int next_sample;
+    int num_deltas;
+    timestamp_us first_arrival_time;
+    double accumulated_delay_ms;
+    double smoothed_delay_ms;
+    double prev_trend;
+    // The overuse detector
+    double threshold_ms;
+    double last_threshold_update_ms;
+    double time_over_using_ms;
+    int overuse_counter;
+    OveruseSignal signal;
+    // The rate controller. The bitrate is 0 until the first feedback.
+    DelayControllerState state;
+    double bitrate;
+    WhistTimer last_feedback_timer;
+    WhistTimer last_decrease_timer;
+    WhistTimer last_update_timer;
+    // Average and normalized variance of the incoming bitrate at decreases, in kbps.
+    // The average is -1 while the link capacity is unknown.
+    double avg_max_bitrate_kbps;
+    double var_max_bitrate_kbps;
+    double packet_loss_ratio;
+    double short_term_latency;
+} TrendlineContext;
+
+static void *trendline_init(void) {
+    TrendlineContext *ctx = safe_zalloc(sizeof(TrendlineContext));
+    ctx->threshold_ms = TRENDLINE_INITIAL_THRESHOLD_MS;
+    ctx->last_threshold_update_ms = -1.0;
+    ctx->time_over_using_ms = -1.0;
+    ctx->signal = NORMAL_SIGNAL;
+    ctx->state = DELAY_CONTROLLER_HOLD;
+    ctx->avg_max_bitrate_kbps = -1.0;
+    ctx->var_max_bitrate_kbps = TRENDLINE_MIN_MAX_BITRATE_VARIANCE;
+    return ctx;
+}
+
+static void trendline_destroy(void *context) { free(context); }
+
+static void trendline_on_rtt(void *context, double short_term_latency, double long_term_latency) {
+    TrendlineContext *ctx = (TrendlineContext *)context;
+    ctx->short_term_latency = short_term_latency;
+}
+
+static void trendline_on_loss(void *context, double packet_loss_ratio) {
+    TrendlineContext *ctx = (TrendlineContext *)context;
+    ctx->packet_loss_ratio = packet_loss_ratio;
+}
+
+// The slope of the least squares line through the samples of the window
+static double trendline_get_slope(TrendlineContext *ctx) {
+    double sum_x = 0.0;
+    double sum_y = 0.0;
+    for (int i = 0; i < ctx->num_samples; i++) {
+        sum_x += ctx->arrival_times_ms[i];
+        sum_y += ctx->smoothed_delays_ms[i];
+    }
+    double avg_x = sum_x / ctx->num_samples;
+    double avg_y = sum_y / ctx->num_samples;
+    double numerator = 0.0;
+    double denominator = 0.0;
+    for (int i = 0; i < ctx->num_samples; i++) {
+        double x = ctx->arrival_times_ms[i] - avg_x;
+        numerator += x * (ctx->smoothed_delays_ms[i] - avg_y);
+        denominator += x * x;
+    }
+    if (denominator == 0.0) {
+        return ctx->prev_trend;
+    }
+    return numerator / denominator;
+}
+
+static void trendline_update_threshold(TrendlineContext *ctx, double modified_trend,
+                                       double now_ms) {
+    if (ctx->last_threshold_update_ms < 0.0) {
+        ctx->last_threshold_update_ms = now_ms;
+    }
+    if (fabs(modified_trend) > ctx->threshold_ms + TRENDLINE_MAX_ADAPT_OFFSET_MS) {
+        ctx->last_threshold_update_ms = now_ms;
+        return;
+    }
+    double k = fabs(modified_trend) < ctx->threshold_ms ? TRENDLINE_THRESHOLD_K_DOWN
+                                                        : TRENDLINE_THRESHOLD_K_UP;
+    double time_delta_ms =
+        min(now_ms - ctx->last_threshold_update_ms, TRENDLINE_MAX_THRESHOLD_TIME_DELTA_MS);
+    ctx->threshold_ms += k * (fabs(modified_trend) - ctx->threshold_ms) * time_delta_ms;
+    ctx->threshold_ms =
+        max(min(ctx->threshold_ms, TRENDLINE_MAX_THRESHOLD_MS), TRENDLINE_MIN_THRESHOLD_MS);
+    ctx->last_threshold_update_ms = now_ms;
+}
+
+// Add a group to the trendline filter, and update the overuse signal
+static void trendline_add_group(TrendlineContext *ctx, GroupStats *curr_group_stats,
+                                GroupStats *prev_group_stats) {
+    double inter_departure_ms =
+        (double)(curr_group_stats->departure_time - prev_group_stats->departure_time) / US_IN_MS;
+    double inter_arrival_ms =
+        (double)(curr_group_stats->arrival_time - prev_group_stats->arrival_time) / US_IN_MS;
+    if (ctx->num_deltas == 0) {
+        ctx->first_arrival_time = curr_group_stats->arrival_time;
+    }
+    ctx->num_deltas = min(ctx->num_deltas + 1, TRENDLINE_MAX_NUM_DELTAS);
+    ctx->accumulated_delay_ms += inter_arrival_ms - inter_departure_ms;
+    ctx->smoothed_delay_ms = TRENDLINE_SMOOTHING_COEF * ctx->smoothed_delay_ms +
+                             (1.0 - TRENDLINE_SMOOTHING_COEF) * ctx->accumulated_delay_ms;
+
+    double now_ms = (double)(curr_group_stats->arrival_time - ctx->first_arrival_time) / US_IN_MS;
+    ctx->arrival_times_ms[ctx->next_sample] = now_ms;
+    ctx->smoothed_delays_ms[ctx->next_sample] = ctx->smoothed_delay_ms;
+    ctx->next_sample = (ctx->next_sample + 1) % TRENDLINE_WINDOW_SIZE;
+    ctx->num_samples = min(ctx->num_samples + 1, TRENDLINE_WINDOW_SIZE);
+    if (ctx->num_samples < TRENDLINE_WINDOW_SIZE) {
+        return;
+    }
+
+    double trend = trendline_get_slope(ctx);
+    double modified_trend = ctx->num_deltas * trend * TRENDLINE_THRESHOLD_GAIN;
+    if (modified_trend > ctx->threshold_ms) {
+        // Overuse is only signaled once the trend stayed above the threshold for a while, and
+        // isn't already going back down
+        if (ctx->time_over_using_ms < 0.0) {
+            ctx->time_over_using_ms = inter_departure_ms / 2.0;
+        } else {
+            ctx->time_over_using_ms += inter_departure_ms;
+        }
+        ctx->overuse_counter++;
+        if (ctx->time_over_using_ms > TRENDLINE_OVERUSE_TIME_THRESHOLD_MS &&
+            ctx->overuse_counter > 1 && trend >= ctx->prev_trend) {
+            ctx->time_over_using_ms = 0.0;
+            ctx->overuse_counter = 0;
+            ctx->signal = OVERUSE_SIGNAL;
+        }
+    } else if (modified_trend < -ctx->threshold_ms) {
+        ctx->time_over_using_ms = -1.0;
+        ctx->overuse_counter = 0;
+        ctx->signal = UNDERUSE_SIGNAL;
+    } else {
+        ctx->time_over_using_ms = -1.0;
+        ctx->overuse_counter = 0;
+        ctx->signal = NORMAL_SIGNAL;
+    }
+    ctx->prev_trend = trend;
+    trendline_update_threshold(ctx, modified_trend, now_ms);
+}
+
+static void trendline_update_max_bitrate(TrendlineContext *ctx, double incoming_kbps) {
+    if (ctx->avg_max_bitrate_kbps >= 0.0 &&
+        incoming_kbps < ctx->avg_max_bitrate_kbps -
+                            3.0 * sqrt(ctx->var_max_bitrate_kbps * ctx->avg_max_bitrate_kbps)) {
+        // The link capacity went down, so start the average over
+        ctx->avg_max_bitrate_kbps = -1.0;
+    }
+    if (ctx->avg_max_bitrate_kbps < 0.0) {
+        ctx->avg_max_bitrate_kbps = incoming_kbps;
+    } else {
+        ctx->avg_max_bitrate_kbps =
+            (1.0 - TRENDLINE_MAX_BITRATE_EWMA_FACTOR) * ctx->avg_max_bitrate_kbps +
+            TRENDLINE_MAX_BITRATE_EWMA_FACTOR * incoming_kbps;
+    }
+    // The variance is normalized by the average, so that it doesn't depend on the bitrate
+    double error = ctx->avg_max_bitrate_kbps - incoming_kbps;
+    ctx->var_max_bitrate_kbps = (1.0 - TRENDLINE_MAX_BITRATE_EWMA_FACTOR) *
+                                    ctx->var_max_bitrate_kbps +
+                                TRENDLINE_MAX_BITRATE_EWMA_FACTOR * error * error /
+                                    max(ctx->avg_max_bitrate_kbps, 1.0);
+    ctx->var_max_bitrate_kbps =
+        max(min(ctx->var_max_bitrate_kbps, TRENDLINE_MAX_MAX_BITRATE_VARIANCE),
+            TRENDLINE_MIN_MAX_BITRATE_VARIANCE);
+}
+
+static bool trendline_on_group_feedback(void *context, GroupStats *curr_group_stats,
+                                        GroupStats *prev_group_stats, int incoming_bitrate,
+                                        NetworkSettings *network_settings, WccOp *wcc_op) {
+    TrendlineContext *ctx = (TrendlineContext *)context;
+    *wcc_op = WCC_NO_OP;
+    trendline_add_group(ctx, curr_group_stats, prev_group_stats);
+    if (incoming_bitrate <= 0) {
+        // Not enough data to take any decision. Let the bits start flowing.
+        return false;
+    }
+    if (ctx->bitrate == 0.0) {
+        ctx->bitrate = network_settings->video_bitrate;
+        start_timer(&ctx->last_feedback_timer);
+        start_timer(&ctx->last_decrease_timer);
+        start_timer(&ctx->last_update_timer);
+    }
+    double elapsed_time = get_timer(&ctx->last_feedback_timer);
+    start_timer(&ctx->last_feedback_timer);
+
+    // The same state transitions as WCC's
+    if (ctx->signal == OVERUSE_SIGNAL) {
+        ctx->state = DELAY_CONTROLLER_DECREASE;
+    } else if (ctx->signal == NORMAL_SIGNAL) {
+        if (ctx->state == DELAY_CONTROLLER_HOLD) {
+            ctx->state = DELAY_CONTROLLER_INCREASE;
+        }
+    } else {
+        ctx->state = DELAY_CONTROLLER_HOLD;
+    }
+    if (ctx->packet_loss_ratio > TRENDLINE_HIGH_LOSS_RATIO) {
+        ctx->state = DELAY_CONTROLLER_DECREASE;
+    } else if (ctx->packet_loss_ratio > TRENDLINE_LOW_LOSS_RATIO &&
+               ctx->state == DELAY_CONTROLLER_INCREASE) {
+        ctx->state = DELAY_CONTROLLER_HOLD;
+    }
+
+    double incoming_kbps = incoming_bitrate / 1000.0;
+    double max_bitrate_std_kbps = sqrt(ctx->var_max_bitrate_kbps * ctx->avg_max_bitrate_kbps);
+    if (ctx->state == DELAY_CONTROLLER_INCREASE && ctx->avg_max_bitrate_kbps >= 0.0 &&
+        max(incoming_kbps, ctx->bitrate / 1000.0) >
+            ctx->avg_max_bitrate_kbps + 3.0 * max_bitrate_std_kbps) {
+        // The link capacity went up, so look for it again. The incoming bitrate lags behind
+        // decreases, so this is only checked while increasing.
+        ctx->avg_max_bitrate_kbps = -1.0;
+    }
+
+    double response_time = ctx->short_term_latency + TRENDLINE_RESPONSE_TIME_OFFSET_SEC;
+    double new_bitrate = ctx->bitrate;
+    if (ctx->state == DELAY_CONTROLLER_INCREASE &&
+        incoming_bitrate > ctx->bitrate * TRENDLINE_BANDWIDTH_USED_THRESHOLD) {
+        if (ctx->avg_max_bitrate_kbps >= 0.0) {
+            // Close to the link capacity, increase by about a segment per response time
+            new_bitrate += elapsed_time * MAX_PACKET_SEGMENT_SIZE * BITS_IN_BYTE / response_time;
+        } else {
+            new_bitrate *= pow(TRENDLINE_INCREASE_RATIO_PER_SEC, min(elapsed_time, 1.0));
+        }
+        // Only while saturating the bandwidth is the incoming bitrate limited by the link, rather
+        // than by the encoder
+        if (network_settings->saturate_bandwidth) {
+            new_bitrate = max(
+                min(new_bitrate, incoming_bitrate * TRENDLINE_INCOMING_BITRATE_HEADROOM),
+                ctx->bitrate);
+        }
+    } else if (ctx->state == DELAY_CONTROLLER_DECREASE &&
+               get_timer(&ctx->last_decrease_timer) > response_time) {
+        // A queue is building up, so the link is full and the incoming bitrate is its capacity.
+        // Drain the queue by going below it.
+        new_bitrate = TRENDLINE_DECREASE_RATIO * min(incoming_bitrate, ctx->bitrate);
+        trendline_update_max_bitrate(ctx, incoming_kbps);
+        if (ctx->packet_loss_ratio > TRENDLINE_HIGH_LOSS_RATIO) {
+            new_bitrate = min(new_bitrate, ctx->bitrate * (1.0 - 0.5 * ctx->packet_loss_ratio));
+        }
+        LOG_INFO("Decrease bitrate trend threshold = %.2fms, packet_loss_ratio = %.2f",
+                 ctx->threshold_ms, ctx->packet_loss_ratio);
+        ctx->state = DELAY_CONTROLLER_HOLD;
+        network_settings->congestion_detected = true;
+        start_timer(&ctx->last_decrease_timer);
+        *wcc_op = WCC_DECREASE_BWD;
+    }
+
+    int min_bitrate = MINIMUM_BITRATE;
+    int max_bitrate = MAXIMUM_BITRATE;
+    if (new_bitrate < min_bitrate) {
+        // If we have reached the min_bitrate for two consecutive times, then signal
+        // insufficient bandwidth
+        if (network_settings->video_bitrate == min_bitrate) {
+            network_algo_insufficient_bandwidth = true;
+        }
+        new_bitrate = min_bitrate;
+    } else {
+        network_algo_insufficient_bandwidth = false;
+    }
+    new_bitrate = min(new_bitrate, max_bitrate);
+    ctx->bitrate = new_bitrate;
+
+    // Saturate the bandwidth while searching for the link capacity, since only then can the
+    // incoming bitrate find it
+    bool saturate_bandwidth = ctx->avg_max_bitrate_kbps < 0.0 && new_bitrate < max_bitrate;
+    int video_bitrate = (int)new_bitrate;
+    if (*wcc_op != WCC_DECREASE_BWD && saturate_bandwidth == network_settings->saturate_bandwidth &&
+        (video_bitrate == network_settings->video_bitrate ||
+         (video_bitrate < max_bitrate &&
+          fabs(new_bitrate - network_settings->video_bitrate) <
+              network_settings->video_bitrate * TRENDLINE_MIN_CHANGE_RATIO))) {
+        return false;
+    }
+    if (*wcc_op == WCC_NO_OP && video_bitrate > network_settings->video_bitrate) {
+        *wcc_op = WCC_INCREASE_BWD;
+    }
+    network_settings->video_bitrate = video_bitrate;
+    // Like WCC, burst once there's more bandwidth than the video needs
+    network_settings->burst_bitrate =
+        video_bitrate == max_bitrate ? video_bitrate * BURST_BITRATE_RATIO : video_bitrate;
+    network_settings->saturate_bandwidth = saturate_bandwidth;
+    start_timer(&ctx->last_update_timer);
+    LOG_INFO("New bitrate = %d, burst_bitrate = %d, saturate bandwidth = %d, capacity = %.0fkbps",
+             network_settings->video_bitrate, network_settings->burst_bitrate,
+             network_settings->saturate_bandwidth, ctx->avg_max_bitrate_kbps);
+    return true;
+}
+
+static bool trendline_on_severe_congestion(void *context, NetworkSettings *network_settings) {
+    TrendlineContext *ctx = (TrendlineContext *)context;
+    if (get_timer(&ctx->last_update_timer) < MIN_UPDATE_INTERVAL_SEVERE_CONGESTION_SEC) {
+        return false;
+    }
+    set_severe_congestion_settings(network_settings);
+    start_timer(&ctx->last_update_timer);
+    ctx->bitrate = network_settings->video_bitrate;
+    ctx->state = DELAY_CONTROLLER_HOLD;
+    ctx->avg_max_bitrate_kbps = -1.0;
+    return true;
+}
+
+static int trendline_get_bitrate(void *context) {
+    return (int)((TrendlineContext *)context)->bitrate;
+}
+
+static const CongestionControllerFunctionTable trendline_function_table = {
+    .init = trendline_init,
+    .destroy = trendline_destroy,
+    .on_rtt = trendline_on_rtt,
+    .on_loss = trendline_on_loss,
+    .on_group_feedback = trendline_on_group_feedback,
+    .on_severe_congestion = trendline_on_severe_congestion,
+    .get_bitrate = trendline_get_bitrate,
+};
+
+/*
+============================
+Probe Rate Control
+============================
+*/
+
+// While the bandwidth is saturated, the server fills the spare bandwidth with probe parity, see
+// udp_send_probe_parity. Probing starts gently, grows while the bitrate keeps increasing, and
+// holds while it settles. It stops as soon as the bitrate decreases or congestion is detected,
+// so that probes never add to a queue that's building up. The ratio raises the video FEC ratio
+// of frames that have FEC, up to MAX_FEC_RATIO.
+#define MIN_PROBE_RATIO 0.05
+#define PROBE_RATIO_GROWTH 1.5
+
+static double get_probe_ratio(double probe_ratio, WccOp op, NetworkSettings *network_settings) {
+    if (!network_settings->saturate_bandwidth || network_settings->congestion_detected ||
+        op == WCC_DECREASE_BWD) {
+        return 0.0;
+    }
+    if (probe_ratio == 0.0) {
+        return MIN_PROBE_RATIO;
+    }
+    if (op == WCC_INCREASE_BWD) {
+        return min(probe_ratio * PROBE_RATIO_GROWTH, MAX_FEC_RATIO);
+    }
+    return probe_ratio;
+}
+
+/*
+============================
+Congestion Controller
+============================
+*/
+
+CongestionController *create_congestion_controller(const char *type, void *fec_controller) {
+    if (type == NULL) {
+        type = congestion_control_type ? congestion_control_type : "wcc";
+    }
+    const CongestionControllerFunctionTable *table;
+    if (strcmp(type, "wcc") == 0) {
+        table = &wcc_function_table;
+    } else if (strcmp(type, "trendline") == 0) {
+        table = &trendline_function_table;
+    } else {
+        LOG_ERROR("Invalid congestion controller type: %s", type);
+        return NULL;
+    }
+
+    CongestionController *congestion_controller = safe_malloc(sizeof(CongestionController));
+    congestion_controller->context = table->init();
+    congestion_controller->call = table;
+    congestion_controller->fec_controller = fec_controller;
+    congestion_controller->packet_loss_ratio = 0.0;
+    congestion_controller->short_term_latency = 0.0;
+    LOG_INFO("Using the %s congestion controller", type);
+    return congestion_controller;
+}
+
+void destroy_congestion_controller(CongestionController *congestion_controller) {
+    if (congestion_controller == NULL) return;
+    congestion_controller->call->destroy(congestion_controller->context);
+    free(congestion_controller);
+}
+
+void congestion_controller_on_rtt(CongestionController *congestion_controller,
+                                  double short_term_latency, double long_term_latency) {
+    congestion_controller->short_term_latency = short_term_latency;
+    congestion_controller->call->on_rtt(congestion_controller->context, short_term_latency,
+                                        long_term_latency);
+}
+
+void congestion_controller_on_loss(CongestionController *congestion_controller,
+                                   double packet_loss_ratio) {
+    congestion_controller->packet_loss_ratio = packet_loss_ratio;
+    congestion_controller->call->on_loss(congestion_controller->context, packet_loss_ratio);
+}
+
+bool congestion_controller_on_group_feedback(CongestionController *congestion_controller,
+                                             GroupStats *curr_group_stats,
+                                             GroupStats *prev_group_stats, int incoming_bitrate,
+                                             NetworkSettings *network_settings) {
+    int old_bitrate = network_settings->video_bitrate;
+    WccOp op;
+    bool send_network_settings = congestion_controller->call->on_group_feedback(
+        congestion_controller->context, curr_group_stats, prev_group_stats, incoming_bitrate,
+        network_settings, &op);
+    if (incoming_bitrate <= 0) {
+        // Not enough data for any decision, not even for FEC
+        return send_network_settings;
+    }
+    double packet_loss_ratio = congestion_controller->packet_loss_ratio;
+
     if (ENABLE_FEC) {
         // get current time
         double current_time = get_timestamp_sec();
         // feed info to fec controller
-        fec_controller_feed_info(fec_controller, current_time, op, packet_loss_ratio, old_bitrate,
-                                 network_settings->video_bitrate, MINIMUM_BITRATE,
-                                 network_settings->saturate_bandwidth);
+        fec_controller_feed_info(congestion_controller->fec_controller, current_time, op,
+                                 packet_loss_ratio, old_bitrate, network_settings->video_bitrate,
+                                 MINIMUM_BITRATE, network_settings->saturate_bandwidth);
         // get fec result from fec controller
         double total_fec_ratio = fec_controller_get_total_fec_ratio(
-            fec_controller, current_time, network_settings->video_fec_ratio);
+            congestion_controller->fec_controller, current_time,
+            network_settings->video_fec_ratio);
 
         // see if there is a value change
         if (total_fec_ratio != network_settings->video_fec_ratio) {
@@ -429,28 +1009,33 @@ bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_
             send_network_settings = true;
         }
     }
-    whist_analyzer_record_current_cc_info(PACKET_VIDEO, packet_loss_ratio, short_term_latency,
+    whist_analyzer_record_current_cc_info(PACKET_VIDEO, packet_loss_ratio,
+                                          congestion_controller->short_term_latency,
                                           network_settings->video_bitrate, incoming_bitrate);
 
     if (!network_settings->saturate_bandwidth) {
         network_settings->congestion_detected = false;
     }
 
+    double probe_ratio = get_probe_ratio(network_settings->video_probe_ratio, op, network_settings);
+    if (probe_ratio != network_settings->video_probe_ratio) {
+        network_settings->video_probe_ratio = probe_ratio;
+        send_network_settings = true;
+    }
+
     return send_network_settings;
 }
 
-// Should be called in times of severe congestion. Right now we are just setting the bitrate to
-// MINIMUM_BITRATE to handle severe congestion.
-bool whist_congestion_controller_handle_severe_congestion(NetworkSettings *network_settings) {
-#define MIN_UPDATE_INTERVAL_SEVERE_CONGESTION_SEC 0.025  // 25ms
-    if (get_timer(&last_update_timer) < MIN_UPDATE_INTERVAL_SEVERE_CONGESTION_SEC) {
+bool congestion_controller_handle_severe_congestion(CongestionController *congestion_controller,
+                                                    NetworkSettings *network_settings) {
+    if (!congestion_controller->call->on_severe_congestion(congestion_controller->context,
+                                                           network_settings)) {
         return false;
     }
-    network_settings->burst_bitrate = network_settings->video_bitrate = MINIMUM_BITRATE;
-    network_settings->congestion_detected = true;
-    network_settings->saturate_bandwidth = true;
-    LOG_INFO_RATE_LIMITED(5, 1, "Severe congestion detected. New bitrate = %d",
-                          network_settings->video_bitrate);
-    start_timer(&last_update_timer);
+    network_settings->video_probe_ratio = 0.0;
     return true;
 }
+
+int congestion_controller_get_bitrate(CongestionController *congestion_controller) {
+    return congestion_controller->call->get_bitrate(congestion_controller->context);
+}
@@ -9,8 +9,10 @@
 ============================
 Usage
 ============================
-The client should periodically call calculate_new_bitrate with any new network statistics, such as
-throughput or number of nacks. This will return a new network settings as needed
+The client creates a CongestionController with create_congestion_controller, gives it the
+latencies and the packet loss as they are measured, and calls
+congestion_controller_on_group_feedback at the end of every group of packets. This updates the
+network settings as needed.
 */
 
 /*
@@ -66,6 +68,8 @@ typedef struct {
     int throughput_per_second;
 } NetworkStatistics;
 
+typedef struct CongestionController CongestionController;
+
 /*
 ============================
 Public Functions
@@ -73,8 +77,53 @@ Public Functions
 */
 
 /**
- * @brief               This function will estimate the new bitrate based on whist congestion
- *                      control algo
+ * @brief               Create a congestion controller, which estimates the bitrate that the
+ *                      network can carry
+ *
+ * @param type          The algorithm to use: "wcc" or "trendline". If NULL, the
+ *                      `--congestion-control` option is used, which defaults to "wcc".
+ *
+ * @param fec_controller The fec controller that will work together with fec to calculate the fec
+ *                       ratios
+ *
+ * @returns             The congestion controller, or NULL if the type is invalid
+ */
+CongestionController *create_congestion_controller(const char *type, void *fec_controller);
+
+/**
+ * @brief               Destroy a congestion controller
+ *
+ * @param congestion_controller The congestion controller to destroy. May be NULL.
+ */
+void destroy_congestion_controller(CongestionController *congestion_controller);
+
+/**
+ * @brief               Give the latest round trip latencies to the congestion controller
+ *
+ * @param congestion_controller The congestion controller
+ *
+ * @param short_term_latency Short term average of round trip latency
+ *
+ * @param long_term_latency Long term average of round trip latency
+ */
+void congestion_controller_on_rtt(CongestionController *congestion_controller,
+                                  double short_term_latency, double long_term_latency);
+
+/**
+ * @brief               Give the latest packet loss ratio to the congestion controller
+ *
+ * @param congestion_controller The congestion controller
+ *
+ * @param packet_loss_ratio Packet loss ratio over last 250ms or so
+ */
+void congestion_controller_on_loss(CongestionController *congestion_controller,
+                                   double packet_loss_ratio);
+
+/**
+ * @brief               This function will estimate the new bitrate when a group of packets ends,
+ *                      and update the FEC ratio with the fec controller
+ *
+ * @param congestion_controller The congestion controller
  *
  * @param curr_group_stats Pointer to struct containing any current group of packets' departure time
  *                         and arrival time
@@ -85,31 +134,37 @@ Public Functions
  * @param incoming_bitrate Bitrate received over the last few hundred milliseconds. Exact duration
  *                         is specified in WCC.md
  *
- * @param packet_loss_ratio Packet loss ratio over last 250ms or so
- *
- * @param short_term_latency Short term average of round trip latency
- *
- * @param long_term_latency Long term average of round trip latency
- *
  * @param network_settings Pointer to the struct containing previous network_settings. Also the new
  *                         network settings will be updated in this struct.
- * @param fec_controller The fec controller that will work together with fec to calculate the fec
- * ratios
  *
  * @returns             Whether network_settings struct was updated with new values or not
  */
-bool whist_congestion_controller(GroupStats *curr_group_stats, GroupStats *prev_group_stats,
-                                 int incoming_bitrate, double packet_loss_ratio,
-                                 double short_term_latency, double long_term_latency,
-                                 NetworkSettings *network_settings, void *fec_controller);
+bool congestion_controller_on_group_feedback(CongestionController *congestion_controller,
+                                             GroupStats *curr_group_stats,
+                                             GroupStats *prev_group_stats, int incoming_bitrate,
+                                             NetworkSettings *network_settings);
 
 /**
+ * @brief               Drop the bitrate to the minimum, in times of severe congestion
+ *
+ * @param congestion_controller The congestion controller
+ *
  * @param network_settings Pointer to the struct containing previous network_settings. Also the new
  *                         network settings will be updated in this struct.
  *
  * @returns             Whether network_settings struct was updated with new values or not
  */
-bool whist_congestion_controller_handle_severe_congestion(NetworkSettings *network_settings);
+bool congestion_controller_handle_severe_congestion(CongestionController *congestion_controller,
+                                                    NetworkSettings *network_settings);
+
+/**
+ * @brief               Get the bitrate that the congestion controller currently estimates
+ *
+ * @param congestion_controller The congestion controller
+ *
+ * @returns             The estimated bitrate, or 0 before the first estimate
+ */
+int congestion_controller_get_bitrate(CongestionController *congestion_controller);
 
 /**
  * @brief               This function will return the default network settings for a given video
@@ -11,6 +11,7 @@ Includes
 #include <whist/debug/protocol_analyzer.h>
 #include <whist/debug/debug_console.h>
 #include "whist/logging/logging.h"
+#include "whist/utils/command_line.h"
 #include "whist/utils/string_buffer.h"
 
 /*
@@ -35,6 +36,21 @@ Defines
 // The max number of times we can NACK for a packet
 #define MAX_PACKET_NACKS 2
 
+// The most size classes that the frame buffer statistics are recorded for
+#define MAX_FRAME_BUFFER_SIZE_CLASSES 16
+
+/*
+============================
+Globals
+============================
+*/
+
+// Whether the largest frame buffers are backed by transparent huge pages
+static bool use_huge_frame_buffers = false;
+COMMAND_LINE_BOOL_OPTION(use_huge_frame_buffers, 0, "huge-frame-buffers",
+                         "Back the largest frame buffers with transparent huge pages, where the "
+                         "OS supports them.")
+
 /*
 ============================
 Private Function Declarations
@@ -48,11 +64,27 @@ Private Function Declarations
  * @param id                       The ID of the frame to initialize
  * @param num_original_indices     The number of original indices
  * @param num_fec_indices          The number of FEC indices
+ * @param num_probe_indices        How many of the FEC indices are probe parity
+ * @param segment_stride           The size that the frame was split into segments with
  * @param prev_frame_num_duplicates The number of duplicate filler packets that were sent for
  *                                  previous frame
  */
 void init_frame(RingBuffer* ring_buffer, int id, int num_original_indices, int num_fec_indices,
-                int prev_frame_num_duplicates);
+                int num_probe_indices, int segment_stride, int prev_frame_num_duplicates);
+
+/**
+ * @brief                          Add a segment to the ring buffer,
+ *                                 see ring_buffer_receive_segment
+ *
+ * @param ring_buffer              Ring buffer to place the segment into
+ * @param segment                  The segment of an audio or video WhistPacket
+ * @param segment_data             The segment's data, or NULL if it has already been written
+ *                                 to ring_buffer_get_segment_destination(segment)
+ *
+ * @returns                        False if the ringbuffer overflowed
+ */
+static bool receive_segment(RingBuffer* ring_buffer, WhistSegment* segment,
+                            const char* segment_data);
 
 /**
  * @brief                          Reset the given frame, freeing all of its data,
@@ -117,11 +149,69 @@ static bool try_nacking(RingBuffer* ring_buffer, double latency, int max_unorder
 // TODO: document this
 char* get_framebuffer(RingBuffer* ring_buffer, FrameData* current_frame);
 
+/**
+ * @brief                         Zero the frame's metadata, but keep the per-index storage
+ *                                that belongs to its ring buffer slot
+ *
+ * @param frame_data              The frame to clear
+ */
+static void clear_frame_data(FrameData* frame_data);
+
+/**
+ * @brief                         Mark every index of the frame as neither received nor nacked,
+ *                                growing the slot's per-index storage if the frame needs more
+ *
+ * @param frame_data              The frame being initialized
+ * @param num_indices             The frame's number of original and FEC indices
+ */
+static void init_frame_indices(FrameData* frame_data, int num_indices);
+
+/**
+ * @brief                         Free the per-index storage of a ring buffer slot
+ *
+ * @param frame_data              The FrameData of the slot
+ */
+static void free_frame_indices(FrameData* frame_data);
+
+static bool is_index_received(const FrameData* frame_data, int index);
+static void mark_index_received(FrameData* frame_data, int index);
+
+/**
+ * @brief                         Get the NACK record of an index
+ *
+ * @param frame_data              The frame of the index
+ * @param index                   The index
+ * @param create                  Whether to add a record, if the index has never been nacked
+ *
+ * @returns                       The index's record, or NULL if it has never been nacked
+ *                                and create is false
+ */
+static IndexNackRecord* get_index_nack_record(FrameData* frame_data, int index, bool create);
+
+static int get_num_times_index_nacked(FrameData* frame_data, int index);
+
+/**
+ * @brief                         Get the sizes that a frame's buffers are allocated with
+ *
+ * @param ring_buffer             The ring buffer of the frame
+ * @param frame_data              The frame, whose indices and segment_stride are set
+ */
+static size_t get_packet_buffer_size(RingBuffer* ring_buffer, const FrameData* frame_data);
+static size_t get_fec_frame_buffer_size(const FrameData* frame_data);
+
+/**
+ * @brief                         Record the frame buffer allocator's statistics
+ *                                with the protocol analyzer
+ *
+ * @param ring_buffer             The ring buffer whose allocator to record
+ */
+static void record_frame_buffer_stats(RingBuffer* ring_buffer);
+
 static double latency_plus_jitter(double latency) {
     // In addition to network latency and jitter, throttler could also add a latency of
-    // UDP_NETWORK_THROTTLER_BUCKET_MS
+    // about a group of packets, UDP_NETWORK_THROTTLER_GROUP_MS
     return ((1.0 + ESTIMATED_JITTER_LATENCY_RATIO) * latency) +
-           (UDP_NETWORK_THROTTLER_BUCKET_MS / MS_IN_SECOND);
+           (UDP_NETWORK_THROTTLER_GROUP_MS / MS_IN_SECOND);
 }
 
 /*
@@ -132,7 +222,7 @@ Public Function Implementations
 
 RingBuffer* init_ring_buffer(WhistPacketType type, int max_frame_size, int ring_buffer_size,
                              SocketContext* socket_context, NackPacketFn nack_packet,
-                             StreamResetFn request_stream_reset) {
+                             NackPacketsFn nack_packets, StreamResetFn request_stream_reset) {
     /*
         Initialize the ring buffer; malloc space for all the frames and set their IDs to -1.
 
@@ -151,8 +241,10 @@ RingBuffer* init_ring_buffer(WhistPacketType type, int max_frame_size, int ring_
     ring_buffer->type = type;
     ring_buffer->ring_buffer_size = ring_buffer_size;
     ring_buffer->receiving_frames = safe_malloc(ring_buffer_size * sizeof(FrameData));
+    memset(ring_buffer->receiving_frames, 0, ring_buffer_size * sizeof(FrameData));
     ring_buffer->socket_context = socket_context;
     ring_buffer->nack_packet = nack_packet;
+    ring_buffer->nack_packets = nack_packets;
     ring_buffer->request_stream_reset = request_stream_reset;
 
     // Mark all the frames as uninitialized
@@ -165,7 +257,11 @@ RingBuffer* init_ring_buffer(WhistPacketType type, int max_frame_size, int ring_
     // determine largest frame size, including the WhistPacket header
     ring_buffer->largest_frame_size = sizeof(WhistPacket) - MAX_PAYLOAD_SIZE + max_frame_size;
 
-    ring_buffer->packet_buffer_allocator = create_block_allocator(ring_buffer->largest_frame_size);
+    // A frame's buffers are sized to its segments, which are bounded by the largest frame size
+    // and by the largest number of segments
+    ring_buffer->frame_buffer_allocator = create_size_class_allocator(
+        max(ring_buffer->largest_frame_size, MAX_PACKETS * MAX_PACKET_SEGMENT_SIZE),
+        use_huge_frame_buffers);
     ring_buffer->currently_rendering_id = -1;
     ring_buffer->last_rendered_id = -1;
 
@@ -198,319 +294,108 @@ RingBuffer* init_ring_buffer(WhistPacketType type, int max_frame_size, int ring_
 }
 
 bool ring_buffer_receive_segment(RingBuffer* ring_buffer, WhistSegment* segment) {
-    whist_analyzer_record_segment(segment);
-    // Sanity check the packet's metadata
-    WhistPacketType type = segment->whist_type;
-    int segment_id = segment->id;
-    unsigned short segment_index = segment->index;
-    unsigned short num_indices = segment->num_indices;
-    unsigned short num_fec_indices = segment->num_fec_indices;
-    unsigned short segment_size = segment->segment_size;
-    FATAL_ASSERT(segment_index < num_indices);
-    FATAL_ASSERT(num_indices <= MAX_PACKETS);
-    FATAL_ASSERT(num_fec_indices < num_indices);
-    FATAL_ASSERT(segment_size <= MAX_PACKET_SEGMENT_SIZE);
-
-    FrameData* frame_data = get_frame_at_id(ring_buffer, segment_id);
-
-    // Whether or not the ringbuffer overflowed, which controls the return value
-    bool ringbuffer_overflowed = false;
-
-    // If segment_id != frame_data->id, handle the situation
-    if (segment_id < frame_data->id) {
-        // This packet must be from a very stale frame,
-        // because the current ringbuffer occupant already contains packets with a newer ID in it
-        LOG_WARNING("Very stale packet (ID %d) received, current ringbuffer occupant's ID %d",
-                    segment_id, frame_data->id);
-        ring_buffer->num_unnecessary_original_packets_received++;
-        return !ringbuffer_overflowed;
-    } else if (segment_id > frame_data->id) {
-        // This packet is newer than the resident,
-        // so it's time to overwrite the resident if such a resident exists
-        if (frame_data->packet_buffer != NULL) {
-            if (frame_data->id > ring_buffer->currently_rendering_id) {
-                whist_analyzer_record_reset_ringbuffer(
-                    ring_buffer->type, ring_buffer->currently_rendering_id, segment_id);
-                // We have received a packet, which will overwrite a frame that needs to be rendered
-                // in the future. This means that stream-reset failed to recover within the
-                // size of the ringbuffer, and this failure will be logged accordingly.
-                LOG_WARNING(
-                    "We received a %s packet with Frame ID %d, that is trying to overwrite Frame "
-                    "ID %d.\n"
-                    "But we can't overwrite that frame, since our renderer has only rendered up to "
-                    "ID %d.\n"
-                    "Resetting the entire ringbuffer...",
-                    type == PACKET_VIDEO ? "video" : "audio", segment_id, frame_data->id,
-                    ring_buffer->currently_rendering_id);
-                // Log out the contents of the entire ringbuffer
-                for (int i = 0; i < ring_buffer->ring_buffer_size; i++) {
-                    FrameData* dropped_frame_data = get_frame_at_id(ring_buffer, i);
-                    if (dropped_frame_data->id != -1) {
-                        // Get whether or not the stream could have recovered at that point
-                        bool is_recovery_point = false;
-                        if (is_ready_to_render(ring_buffer, dropped_frame_data->id)) {
-                            if (type == PACKET_VIDEO) {
-                                // Grab whether or not the video is a recovery point
-                                WhistPacket* whist_packet =
-                                    (WhistPacket*)dropped_frame_data->frame_buffer;
-                                VideoFrame* video_frame = (VideoFrame*)whist_packet->data;
-                                if (VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(video_frame->frame_type)) {
-                                    is_recovery_point = true;
-                                }
-                            } else {
-                                // All audio frames are valid recovery points
-                                is_recovery_point = true;
-                            }
-                        }
-                        // Log the dropped frame, along with missing indices and NACKing info on
-                        // those indices
-                        LOG_WARNING("Frame[%d] dropped with ID %d: %d/%d %s", i,
-                                    dropped_frame_data->id,
-                                    dropped_frame_data->original_packets_received,
-                                    dropped_frame_data->num_original_packets,
-                                    is_recovery_point ? "(Recovery Frame)" : "");
-                        for (int j = 0; j < dropped_frame_data->num_original_packets; j++) {
-                            if (!dropped_frame_data->received_indices[j]) {
-                                LOG_WARNING("Did not receive ID %d, Index %d. Nacked %d times.", i,
-                                            j, dropped_frame_data->num_times_index_nacked[j]);
-                            }
-                        }
-                    } else {
-                        LOG_WARNING("Frame[%d] is empty", i);
-                    }
-                }
-                // Wipe the ringbuffer, and mark as overflowed
-                reset_ring_buffer(ring_buffer);
-                ringbuffer_overflowed = true;
-            } else {
-                // Here, the frame is older than where our renderer is,
-                // So we can just reset the undesired frame
-                LOG_ERROR(
-                    "Trying to allocate %s Frame ID %d, but Frame ID %d has not been destroyed "
-                    "yet! Destroying it now...",
-                    type == PACKET_VIDEO ? "video" : "audio", segment_id, frame_data->id);
-                reset_frame(ring_buffer, frame_data);
-            }
-        }
+    return receive_segment(ring_buffer, segment, segment->segment_data);
+}
 
-        // Sometimes a older packet could be received after catching up to a I/LTR frame.
-        // In such cases, ignore that packet.
-        if (segment_id <= ring_buffer->last_rendered_id) {
-            return !ringbuffer_overflowed;
-        }
+char* ring_buffer_get_segment_destination(RingBuffer* ring_buffer, const WhistSegment* segment,
+                                          int segment_size) {
+    // The segment hasn't been authenticated yet, so nothing about it can be asserted.
+    // Only segments that receive_segment is guaranteed to copy into an already initialized
+    // frame get a destination, so that a forged segment can't change the ringbuffer's state.
+    if (segment->whist_type != ring_buffer->type || segment->segment_size != segment_size ||
+        segment->segment_stride > MAX_PACKET_SEGMENT_SIZE ||
+        segment_size > segment->segment_stride || segment->index >= segment->num_indices ||
+        segment->num_indices > MAX_PACKETS || segment->num_fec_indices >= segment->num_indices ||
+        segment->num_probe_indices > segment->num_fec_indices ||
+        segment->id <= ring_buffer->currently_rendering_id || segment->id < 0) {
+        return NULL;
+    }
 
-        // Initialize the frame now, so that it can hold the packet we just received
-        int num_original_packets = num_indices - num_fec_indices;
-        init_frame(ring_buffer, segment_id, num_original_packets, num_fec_indices,
-                   segment->prev_frame_num_duplicates);
+    FrameData* frame_data = get_frame_at_id(ring_buffer, segment->id);
+    if (frame_data->id != segment->id || frame_data->packet_buffer == NULL ||
+        frame_data->num_fec_packets != segment->num_fec_indices ||
+        frame_data->num_probe_packets != segment->num_probe_indices ||
+        frame_data->num_original_packets + frame_data->num_fec_packets != segment->num_indices ||
+        frame_data->segment_stride != segment->segment_stride ||
+        is_index_received(frame_data, segment->index)) {
+        return NULL;
+    }
 
-        // Update the ringbuffer's min/max id, with this new frame's ID
-        ring_buffer->max_id = max(ring_buffer->max_id, frame_data->id);
-        if (ring_buffer->min_id == -1) {
-            // Initialize min_id
-            ring_buffer->min_id = frame_data->id;
-        } else {
-            // Update min_id
-            ring_buffer->min_id = min(ring_buffer->min_id, frame_data->id);
-        }
+    int buffer_offset = segment->index * frame_data->segment_stride;
+    if (buffer_offset + segment_size >= ring_buffer->largest_frame_size) {
+        return NULL;
     }
+    return frame_data->packet_buffer + buffer_offset;
+}
 
-    // Now, the frame_data should be ready to accept the packet
-    FATAL_ASSERT(segment_id == frame_data->id);
+bool ring_buffer_receive_segment_in_place(RingBuffer* ring_buffer, WhistSegment* segment) {
+    return receive_segment(ring_buffer, segment, NULL);
+}
 
-    // Verify that the packet metadata matches frame_data metadata
-    FATAL_ASSERT(frame_data->num_fec_packets == num_fec_indices);
-    FATAL_ASSERT(frame_data->num_original_packets + frame_data->num_fec_packets == num_indices);
+FrameData* get_frame_at_id(RingBuffer* ring_buffer, int id) {
+    return &ring_buffer->receiving_frames[id % ring_buffer->ring_buffer_size];
+}
 
-    // LOG the the nacking situation
-    if (segment->is_a_nack) {
-        frame_data->nack_packets_received++;
-        ring_buffer->num_nacks_received++;
-        // Server simulates a nack for audio all the time. Hence log only for video.
-        if (type == PACKET_VIDEO) {
-            if (!frame_data->received_indices[segment_index]) {
-                if (LOG_NACKING) {
-                    LOG_INFO("NACK for video ID %d, Index %d received!", segment_id, segment_index);
-                }
-            } else {
-                frame_data->unnecessary_nack_packets_received++;
-                ring_buffer->num_unnecessary_nacks_received++;
-                if (LOG_NACKING) {
-                    LOG_INFO("NACK for video ID %d, Index %d received, but didn't need it.",
-                             segment_id, segment_index);
-                }
-            }
+double get_packet_loss_ratio(RingBuffer* ring_buffer, double latency) {
+    int num_packets_received = 0;
+    int num_packets_sent = 0;
+    WhistTimer end_time;
+    start_timer(&end_time);
+    // Don't include max_id frame for computing packet loss as it could be in progress
+    for (int id = max(max(ring_buffer->max_id - MAX_FPS, ring_buffer->min_id), 0);
+         id < ring_buffer->max_id; id++) {
+        FrameData* frame = get_frame_at_id(ring_buffer, id);
+        if (id != frame->id || diff_timer(&frame->frame_creation_timer, &end_time) >
+                                   (double)PACKET_LOSS_DURATION_IN_SEC) {
+            continue;
         }
-    } else {
-        ring_buffer->num_original_packets_received++;
-        // Reset timer since the last time we received a non-nack packet
-        start_timer(&frame_data->last_nonnack_packet_timer);
-        if (frame_data->num_times_index_nacked[segment_index] > 0) {
-            ring_buffer->num_unnecessary_original_packets_received++;
-            if (LOG_NACKING) {
-                LOG_INFO("Received original %s ID %d, Index %d, but we had NACK'ed for it.",
-                         type == PACKET_VIDEO ? "video" : "audio", segment_id, segment_index);
+        num_packets_sent += frame->num_original_packets;
+        // Probe parity is counted with the duplicates, as it's only sent in their place
+        num_packets_sent += frame->num_fec_packets - frame->num_probe_packets;
+        num_packets_received += frame->original_packets_received;
+        num_packets_received += frame->fec_packets_received;
+
+        int nacks_sent = 0;
+        for (int i = 0; i < frame->num_nack_records; i++) {
+            IndexNackRecord* nack_record = &frame->nack_records[i];
+            nacks_sent += nack_record->num_times_nacked;
+            // Don't consider the NACKs in flight
+            if (diff_timer(&nack_record->last_nacked_timer, &end_time) <
+                latency_plus_jitter(latency)) {
+                nacks_sent--;
             }
         }
-    }
+        // Whatever we considered as "NACKs in flight" could have arrived earlier. So if the actual
+        // nack_packets_received is greater our estimate of NACK requests sent, then just
+        // approximate nack_requests_sent = nack_packets_received.
+        nacks_sent = max(nacks_sent, frame->nack_packets_received);
 
-    // If we have already received this packet anyway, just drop this packet
-    if (frame_data->received_indices[segment_index]) {
-        if (!segment->is_a_nack) {
-            frame_data->duplicate_packets_received++;
-        }
-        // The only way it should possible to receive a packet twice, is if nacking got involved
-        if (type == PACKET_VIDEO && frame_data->num_times_index_nacked[segment_index] == 0 &&
-            !segment->is_a_duplicate && segment->is_a_nack) {
-            LOG_ERROR(
-                "We received a video packet (ID %d / index %d) twice, but we had never nacked for "
-                "it? num_entire_frame_nacked = %d, currently_rendering_id = %d",
-                segment_id, segment_index, frame_data->num_entire_frame_nacked,
-                ring_buffer->currently_rendering_id);
-            return !ringbuffer_overflowed;
+        // Currently we don't have any way of knowing in the NACK request packet from client to
+        // server got lost OR if the NACK response packet from server to client got lost. As a
+        // reasonable approximation we are considering both cases as NACK packet loss from server to
+        // client
+        num_packets_sent += nacks_sent;
+        num_packets_received += frame->unnecessary_nack_packets_received;
+
+        FrameData* next_frame = get_frame_at_id(ring_buffer, id + 1);
+        if (id + 1 == next_frame->id) {
+            num_packets_sent += next_frame->prev_frame_num_duplicate_packets;
+            num_packets_received += frame->duplicate_packets_received;
         }
-        return !ringbuffer_overflowed;
     }
+    double packet_loss_ratio = 0.0;
+    if (num_packets_sent > 0 && num_packets_received > 0) {
+        packet_loss_ratio =
+            (double)(num_packets_sent - num_packets_received) / (double)num_packets_sent;
+    }
+    return packet_loss_ratio;
+}
 
-    // Remember whether or not this frame was ready to render
-    bool was_already_ready = is_ready_to_render(ring_buffer, segment_id);
-
-    // Track whether the index we received is one of the N original packets,
-    // or one of the M FEC packets
-    frame_data->received_indices[segment_index] = true;
-    if (segment_index < frame_data->num_original_packets) {
-        frame_data->original_packets_received++;
-        FATAL_ASSERT(frame_data->original_packets_received <= frame_data->num_original_packets);
-    } else {
-        frame_data->fec_packets_received++;
-    }
-
-    if (segment_id <= ring_buffer->currently_rendering_id) {
-        // This packet won't help us render any new packets,
-        // So don't proceed further
-        ring_buffer->num_unnecessary_original_packets_received++;
-        return !ringbuffer_overflowed;
-    }
-
-    // Copy the packet's payload into the correct location in frame_data's frame buffer
-    int buffer_offset = segment_index * MAX_PACKET_SEGMENT_SIZE;
-    if (buffer_offset + segment_size >= ring_buffer->largest_frame_size) {
-        LOG_ERROR("Packet payload too large for frame buffer! Dropping the packet...");
-        return !ringbuffer_overflowed;
-    }
-    FATAL_ASSERT(frame_data->packet_buffer != NULL);
-    memcpy(frame_data->packet_buffer + buffer_offset, segment->segment_data, segment_size);
-
-    // If this frame isn't an fec frame, the frame_buffer_size is just the sum of the payload sizes
-    if (frame_data->num_fec_packets == 0) {
-        frame_data->frame_buffer_size += segment_size;
-    }
-
-    // If this is an FEC frame, and we haven't yet decoded the frame successfully,
-    // Try decoding the FEC frame
-    if (frame_data->num_fec_packets > 0 && !frame_data->successful_fec_recovery) {
-        // Register this packet into the FEC decoder
-        fec_decoder_register_buffer(frame_data->fec_decoder, segment_index,
-                                    frame_data->packet_buffer + buffer_offset, segment_size);
-
-        WhistTimer decode_timer;
-        start_timer(&decode_timer);
-        // Using the newly registered packet, try to decode the frame using FEC
-        int frame_size =
-            fec_get_decoded_buffer(frame_data->fec_decoder, frame_data->fec_frame_buffer);
-        double decode_time = get_timer(&decode_timer) * MS_IN_SECOND;
-
-        // If we were able to successfully decode the frame, mark it as such!
-        if (frame_size >= 0) {
-            if (frame_data->original_packets_received < frame_data->num_original_packets) {
-                if (LOG_FEC_DECODE) {
-                    LOG_INFO(
-                        "[FEC] Successfully recovered %d/%d Packet %d, using %d FEC packets, in "
-                        "%fms",
-                        frame_data->original_packets_received, frame_data->num_original_packets,
-                        frame_data->id, frame_data->fec_packets_received, decode_time);
-                }
-                whist_analyzer_record_fec_used(type, segment_id);
-            }
-            // Save the frame buffer size of the fec frame,
-            // And mark the fec recovery as succeeded
-            frame_data->frame_buffer_size = frame_size;
-            frame_data->successful_fec_recovery = true;
-        }
-    }
-
-    if (is_ready_to_render(ring_buffer, segment_id) && !was_already_ready) {
-        ring_buffer->frames_received++;
-        ring_buffer->num_pending_ready_frames++;
-    }
-
-    return !ringbuffer_overflowed;
-}
-
-FrameData* get_frame_at_id(RingBuffer* ring_buffer, int id) {
-    return &ring_buffer->receiving_frames[id % ring_buffer->ring_buffer_size];
-}
-
-double get_packet_loss_ratio(RingBuffer* ring_buffer, double latency) {
-    int num_packets_received = 0;
-    int num_packets_sent = 0;
-    WhistTimer end_time;
-    start_timer(&end_time);
-    // Don't include max_id frame for computing packet loss as it could be in progress
-    for (int id = max(max(ring_buffer->max_id - MAX_FPS, ring_buffer->min_id), 0);
-         id < ring_buffer->max_id; id++) {
-        FrameData* frame = get_frame_at_id(ring_buffer, id);
-        if (id != frame->id || diff_timer(&frame->frame_creation_timer, &end_time) >
-                                   (double)PACKET_LOSS_DURATION_IN_SEC) {
-            continue;
-        }
-        num_packets_sent += frame->num_original_packets;
-        num_packets_sent += frame->num_fec_packets;
-        num_packets_received += frame->original_packets_received;
-        num_packets_received += frame->fec_packets_received;
-
-        int nacks_sent = 0;
-        for (int i = 0; i < frame->num_original_packets + frame->num_fec_packets; i++) {
-            if (frame->num_times_index_nacked[i]) {
-                nacks_sent += frame->num_times_index_nacked[i];
-                // Don't consider the NACKs in flight
-                if (diff_timer(&frame->last_nacked_timer[i], &end_time) <
-                    latency_plus_jitter(latency)) {
-                    nacks_sent--;
-                }
-            }
-        }
-        // Whatever we considered as "NACKs in flight" could have arrived earlier. So if the actual
-        // nack_packets_received is greater our estimate of NACK requests sent, then just
-        // approximate nack_requests_sent = nack_packets_received.
-        nacks_sent = max(nacks_sent, frame->nack_packets_received);
-
-        // Currently we don't have any way of knowing in the NACK request packet from client to
-        // server got lost OR if the NACK response packet from server to client got lost. As a
-        // reasonable approximation we are considering both cases as NACK packet loss from server to
-        // client
-        num_packets_sent += nacks_sent;
-        num_packets_received += frame->unnecessary_nack_packets_received;
-
-        FrameData* next_frame = get_frame_at_id(ring_buffer, id + 1);
-        if (id + 1 == next_frame->id) {
-            num_packets_sent += next_frame->prev_frame_num_duplicate_packets;
-            num_packets_received += frame->duplicate_packets_received;
-        }
-    }
-    double packet_loss_ratio = 0.0;
-    if (num_packets_sent > 0 && num_packets_received > 0) {
-        packet_loss_ratio =
-            (double)(num_packets_sent - num_packets_received) / (double)num_packets_sent;
-    }
-    return packet_loss_ratio;
-}
-
-bool is_ready_to_render(RingBuffer* ring_buffer, int id) {
-    FrameData* current_frame = get_frame_at_id(ring_buffer, id);
-    // A frame ID ready to render, if the ID exists in the ringbuffer,
-    if (current_frame->id != id) {
-        return false;
+bool is_ready_to_render(RingBuffer* ring_buffer, int id) {
+    FrameData* current_frame = get_frame_at_id(ring_buffer, id);
+    // A frame ID ready to render, if the ID exists in the ringbuffer,
+    if (current_frame->id != id) {
+        return false;
     }
 
     if (id <= ring_buffer->currently_rendering_id) {
@@ -563,6 +448,12 @@ FrameData* set_rendering(RingBuffer* ring_buffer, int id) {
     FATAL_ASSERT(current_frame->id == id);
     ring_buffer->currently_rendering_id = id;
     ring_buffer->currently_rendering_frame = *current_frame;
+    // The per-index storage stays with the slot, for the packet loss calculation
+    ring_buffer->currently_rendering_frame.index_bitsets = NULL;
+    ring_buffer->currently_rendering_frame.index_bitsets_capacity = 0;
+    ring_buffer->currently_rendering_frame.nack_records = NULL;
+    ring_buffer->currently_rendering_frame.num_nack_records = 0;
+    ring_buffer->currently_rendering_frame.nack_records_capacity = 0;
 
     // Invalidate the current_frame, without deallocating its data with reset_frame,
     // Since currently_rendering_frame now owns that data
@@ -616,9 +507,9 @@ void reset_stream(RingBuffer* ring_buffer, int id) {
                                     frame_data->original_packets_received,
                                     frame_data->num_original_packets);
                         for (int j = 0; j < frame_data->num_original_packets; j++) {
-                            if (!frame_data->received_indices[j]) {
+                            if (!is_index_received(frame_data, j)) {
                                 LOG_INFO("Did not receive ID %d, Index %d. Nacked %d times.", i, j,
-                                         frame_data->num_times_index_nacked[j]);
+                                         get_num_times_index_nacked(frame_data, j));
                             }
                         }
                     }
@@ -719,9 +610,10 @@ void try_recovering_missing_packets_or_frames(RingBuffer* ring_buffer, double la
 
         if (ctx->id == id) {
             double frame_staleness = diff_timer(&ctx->frame_creation_timer, current_time);
-            double time_to_transmit = ((ctx->num_original_packets + ctx->num_fec_packets) *
-                                       MAX_PAYLOAD_SIZE * BITS_IN_BYTE) /
-                                      (double)network_settings->burst_bitrate;
+            double time_to_transmit =
+                ((ctx->num_original_packets + ctx->num_fec_packets - ctx->num_probe_packets) *
+                 MAX_PAYLOAD_SIZE * BITS_IN_BYTE) /
+                (double)network_settings->burst_bitrate;
             // Adding Network Jitter + One round-trip latency to account for nack response time
             double acceptable_staleness_ms =
                 (time_to_transmit + (latency_plus_jitter(latency) * MAX_PACKET_NACKS)) *
@@ -794,10 +686,13 @@ void destroy_ring_buffer(RingBuffer* ring_buffer) {
     if (ring_buffer->currently_rendering_id != -1) {
         reset_frame(ring_buffer, &ring_buffer->currently_rendering_frame);
     }
-    // free received_frames
+    // free received_frames, along with the per-index storage of each slot
+    for (int i = 0; i < ring_buffer->ring_buffer_size; i++) {
+        free_frame_indices(&ring_buffer->receiving_frames[i]);
+    }
     free(ring_buffer->receiving_frames);
-    // destroy the block allocator
-    destroy_block_allocator(ring_buffer->packet_buffer_allocator);
+    // destroy the frame buffer allocator
+    destroy_size_class_allocator(ring_buffer->frame_buffer_allocator);
     // free the ring_buffer
     free(ring_buffer);
 }
@@ -808,8 +703,267 @@ Private Function Implementations
 ============================
 */
 
+static bool receive_segment(RingBuffer* ring_buffer, WhistSegment* segment,
+                            const char* segment_data) {
+    whist_analyzer_record_segment(segment);
+    // Sanity check the packet's metadata
+    WhistPacketType type = segment->whist_type;
+    int segment_id = segment->id;
+    unsigned short segment_index = segment->index;
+    unsigned short num_indices = segment->num_indices;
+    unsigned short num_fec_indices = segment->num_fec_indices;
+    unsigned short num_probe_indices = segment->num_probe_indices;
+    unsigned short segment_size = segment->segment_size;
+    unsigned short segment_stride = segment->segment_stride;
+    FATAL_ASSERT(segment_index < num_indices);
+    FATAL_ASSERT(num_indices <= MAX_PACKETS);
+    FATAL_ASSERT(num_fec_indices < num_indices);
+    FATAL_ASSERT(num_probe_indices <= num_fec_indices);
+    FATAL_ASSERT(segment_size <= segment_stride);
+    FATAL_ASSERT(segment_stride <= MAX_PACKET_SEGMENT_SIZE);
+
+    FrameData* frame_data = get_frame_at_id(ring_buffer, segment_id);
+
+    // Whether or not the ringbuffer overflowed, which controls the return value
+    bool ringbuffer_overflowed = false;
+
+    // If segment_id != frame_data->id, handle the situation
+    if (segment_id < frame_data->id) {
+        // This packet must be from a very stale frame,
+        // because the current ringbuffer occupant already contains packets with a newer ID in it
+        LOG_WARNING("Very stale packet (ID %d) received, current ringbuffer occupant's ID %d",
+                    segment_id, frame_data->id);
+        ring_buffer->num_unnecessary_original_packets_received++;
+        return !ringbuffer_overflowed;
+    } else if (segment_id > frame_data->id) {
+        // This packet is newer than the resident,
+        // so it's time to overwrite the resident if such a resident exists
+        if (frame_data->packet_buffer != NULL) {
+            if (frame_data->id > ring_buffer->currently_rendering_id) {
+                whist_analyzer_record_reset_ringbuffer(
+                    ring_buffer->type, ring_buffer->currently_rendering_id, segment_id);
+                // We have received a packet, which will overwrite a frame that needs to be rendered
+                // in the future. This means that stream-reset failed to recover within the
+                // size of the ringbuffer, and this failure will be logged accordingly.
+                LOG_WARNING(
+                    "We received a %s packet with Frame ID %d, that is trying to overwrite Frame "
+                    "ID %d.\n"
+                    "But we can't overwrite that frame, since our renderer has only rendered up to "
+                    "ID %d.\n"
+                    "Resetting the entire ringbuffer...",
+                    type == PACKET_VIDEO ? "video" : "audio", segment_id, frame_data->id,
+                    ring_buffer->currently_rendering_id);
+                // Log out the contents of the entire ringbuffer
+                for (int i = 0; i < ring_buffer->ring_buffer_size; i++) {
+                    FrameData* dropped_frame_data = get_frame_at_id(ring_buffer, i);
+                    if (dropped_frame_data->id != -1) {
+                        // Get whether or not the stream could have recovered at that point
+                        bool is_recovery_point = false;
+                        if (is_ready_to_render(ring_buffer, dropped_frame_data->id)) {
+                            if (type == PACKET_VIDEO) {
+                                // Grab whether or not the video is a recovery point
+                                WhistPacket* whist_packet =
+                                    (WhistPacket*)dropped_frame_data->frame_buffer;
+                                VideoFrame* video_frame = (VideoFrame*)whist_packet->data;
+                                if (VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(video_frame->frame_type)) {
+                                    is_recovery_point = true;
+                                }
+                            } else {
+                                // All audio frames are valid recovery points
+                                is_recovery_point = true;
+                            }
+                        }
+                        // Log the dropped frame, along with missing indices and NACKing info on
+                        // those indices
+                        LOG_WARNING("Frame[%d] dropped with ID %d: %d/%d %s", i,
+                                    dropped_frame_data->id,
+                                    dropped_frame_data->original_packets_received,
+                                    dropped_frame_data->num_original_packets,
+                                    is_recovery_point ? "(Recovery Frame)" : "");
+                        for (int j = 0; j < dropped_frame_data->num_original_packets; j++) {
+                            if (!is_index_received(dropped_frame_data, j)) {
+                                LOG_WARNING("Did not receive ID %d, Index %d. Nacked %d times.", i,
+                                            j, get_num_times_index_nacked(dropped_frame_data, j));
+                            }
+                        }
+                    } else {
+                        LOG_WARNING("Frame[%d] is empty", i);
+                    }
+                }
+                // Wipe the ringbuffer, and mark as overflowed
+                reset_ring_buffer(ring_buffer);
+                ringbuffer_overflowed = true;
+            } else {
+                // Here, the frame is older than where our renderer is,
+                // So we can just reset the undesired frame
+                LOG_ERROR(
+                    "Trying to allocate %s Frame ID %d, but Frame ID %d has not been destroyed "
+                    "yet! Destroying it now...",
+                    type == PACKET_VIDEO ? "video" : "audio", segment_id, frame_data->id);
+                reset_frame(ring_buffer, frame_data);
+            }
+        }
+
+        // Sometimes a older packet could be received after catching up to a I/LTR frame.
+        // In such cases, ignore that packet.
+        if (segment_id <= ring_buffer->last_rendered_id) {
+            return !ringbuffer_overflowed;
+        }
+
+        // Initialize the frame now, so that it can hold the packet we just received
+        int num_original_packets = num_indices - num_fec_indices;
+        init_frame(ring_buffer, segment_id, num_original_packets, num_fec_indices,
+                   num_probe_indices, segment_stride, segment->prev_frame_num_duplicates);
+
+        // Update the ringbuffer's min/max id, with this new frame's ID
+        ring_buffer->max_id = max(ring_buffer->max_id, frame_data->id);
+        if (ring_buffer->min_id == -1) {
+            // Initialize min_id
+            ring_buffer->min_id = frame_data->id;
+        } else {
+            // Update min_id
+            ring_buffer->min_id = min(ring_buffer->min_id, frame_data->id);
+        }
+    }
+
+    // Now, the frame_data should be ready to accept the packet
+    FATAL_ASSERT(segment_id == frame_data->id);
+
+    // Verify that the packet metadata matches frame_data metadata
+    FATAL_ASSERT(frame_data->num_fec_packets == num_fec_indices);
+    FATAL_ASSERT(frame_data->num_probe_packets == num_probe_indices);
+    FATAL_ASSERT(frame_data->num_original_packets + frame_data->num_fec_packets == num_indices);
+    FATAL_ASSERT(frame_data->segment_stride == segment_stride);
+
+    // LOG the the nacking situation
+    if (segment->is_a_nack) {
+        frame_data->nack_packets_received++;
+        ring_buffer->num_nacks_received++;
+        // Server simulates a nack for audio all the time. Hence log only for video.
+        if (type == PACKET_VIDEO) {
+            if (!is_index_received(frame_data, segment_index)) {
+                if (LOG_NACKING) {
+                    LOG_INFO("NACK for video ID %d, Index %d received!", segment_id, segment_index);
+                }
+            } else {
+                frame_data->unnecessary_nack_packets_received++;
+                ring_buffer->num_unnecessary_nacks_received++;
+                if (LOG_NACKING) {
+                    LOG_INFO("NACK for video ID %d, Index %d received, but didn't need it.",
+                             segment_id, segment_index);
+                }
+            }
+        }
+    } else {
+        ring_buffer->num_original_packets_received++;
+        // Reset timer since the last time we received a non-nack packet
+        start_timer(&frame_data->last_nonnack_packet_timer);
+        if (get_num_times_index_nacked(frame_data, segment_index) > 0) {
+            ring_buffer->num_unnecessary_original_packets_received++;
+            if (LOG_NACKING) {
+                LOG_INFO("Received original %s ID %d, Index %d, but we had NACK'ed for it.",
+                         type == PACKET_VIDEO ? "video" : "audio", segment_id, segment_index);
+            }
+        }
+    }
+
+    // If we have already received this packet anyway, just drop this packet
+    if (is_index_received(frame_data, segment_index)) {
+        if (!segment->is_a_nack) {
+            frame_data->duplicate_packets_received++;
+        }
+        // The only way it should possible to receive a packet twice, is if nacking got involved
+        if (type == PACKET_VIDEO && get_num_times_index_nacked(frame_data, segment_index) == 0 &&
+            !segment->is_a_duplicate && segment->is_a_nack) {
+            LOG_ERROR(
+                "We received a video packet (ID %d / index %d) twice, but we had never nacked for "
+                "it? num_entire_frame_nacked = %d, currently_rendering_id = %d",
+                segment_id, segment_index, frame_data->num_entire_frame_nacked,
+                ring_buffer->currently_rendering_id);
+            return !ringbuffer_overflowed;
+        }
+        return !ringbuffer_overflowed;
+    }
+
+    // Remember whether or not this frame was ready to render
+    bool was_already_ready = is_ready_to_render(ring_buffer, segment_id);
+
+    // Track whether the index we received is one of the N original packets,
+    // or one of the M FEC packets
+    mark_index_received(frame_data, segment_index);
+    if (segment_index < frame_data->num_original_packets) {
+        frame_data->original_packets_received++;
+        FATAL_ASSERT(frame_data->original_packets_received <= frame_data->num_original_packets);
+    } else {
+        frame_data->fec_packets_received++;
+    }
+
+    if (segment_id <= ring_buffer->currently_rendering_id) {
+        // This packet won't help us render any new packets,
+        // So don't proceed further
+        ring_buffer->num_unnecessary_original_packets_received++;
+        return !ringbuffer_overflowed;
+    }
+
+    // Copy the packet's payload into the correct location in frame_data's frame buffer
+    int buffer_offset = segment_index * frame_data->segment_stride;
+    if (buffer_offset + segment_size >= ring_buffer->largest_frame_size) {
+        LOG_ERROR("Packet payload too large for frame buffer! Dropping the packet...");
+        return !ringbuffer_overflowed;
+    }
+    FATAL_ASSERT(frame_data->packet_buffer != NULL);
+    if (segment_data != NULL) {
+        memcpy(frame_data->packet_buffer + buffer_offset, segment_data, segment_size);
+    }
+
+    // If this frame isn't an fec frame, the frame_buffer_size is just the sum of the payload sizes
+    if (frame_data->num_fec_packets == 0) {
+        frame_data->frame_buffer_size += segment_size;
+    }
+
+    // If this is an FEC frame, and we haven't yet decoded the frame successfully,
+    // Try decoding the FEC frame
+    if (frame_data->num_fec_packets > 0 && !frame_data->successful_fec_recovery) {
+        // Register this packet into the FEC decoder
+        fec_decoder_register_buffer(frame_data->fec_decoder, segment_index,
+                                    frame_data->packet_buffer + buffer_offset, segment_size);
+
+        WhistTimer decode_timer;
+        start_timer(&decode_timer);
+        // Using the newly registered packet, try to decode the frame using FEC
+        int frame_size =
+            fec_get_decoded_buffer(frame_data->fec_decoder, frame_data->fec_frame_buffer);
+        double decode_time = get_timer(&decode_timer) * MS_IN_SECOND;
+
+        // If we were able to successfully decode the frame, mark it as such!
+        if (frame_size >= 0) {
+            if (frame_data->original_packets_received < frame_data->num_original_packets) {
+                if (LOG_FEC_DECODE) {
+                    LOG_INFO(
+                        "[FEC] Successfully recovered %d/%d Packet %d, using %d FEC packets, in "
+                        "%fms",
+                        frame_data->original_packets_received, frame_data->num_original_packets,
+                        frame_data->id, frame_data->fec_packets_received, decode_time);
+                }
+                whist_analyzer_record_fec_used(type, segment_id);
+            }
+            // Save the frame buffer size of the fec frame,
+            // And mark the fec recovery as succeeded
+            frame_data->frame_buffer_size = frame_size;
+            frame_data->successful_fec_recovery = true;
+        }
+    }
+
+    if (is_ready_to_render(ring_buffer, segment_id) && !was_already_ready) {
+        ring_buffer->frames_received++;
+        ring_buffer->num_pending_ready_frames++;
+    }
+
+    return !ringbuffer_overflowed;
+}
+
 void init_frame(RingBuffer* ring_buffer, int id, int num_original_indices, int num_fec_indices,
-                int prev_frame_num_duplicates) {
+                int num_probe_indices, int segment_stride, int prev_frame_num_duplicates) {
     FrameData* frame_data = get_frame_at_id(ring_buffer, id);
 
     // Confirm that the frame is uninitialized
@@ -821,20 +975,24 @@ void init_frame(RingBuffer* ring_buffer, int id, int num_original_indices, int n
         last_frame_nack_timer = frame_data->last_frame_nack_timer;
     }
     // Initialize new framedata
-    memset(frame_data, 0, sizeof(*frame_data));
+    clear_frame_data(frame_data);
+    init_frame_indices(frame_data, num_original_indices + num_fec_indices);
     frame_data->id = id;
-    frame_data->packet_buffer = allocate_block(ring_buffer->packet_buffer_allocator);
     frame_data->num_original_packets = num_original_indices;
     frame_data->num_fec_packets = num_fec_indices;
+    frame_data->num_probe_packets = num_probe_indices;
+    frame_data->segment_stride = segment_stride;
     frame_data->prev_frame_num_duplicate_packets = prev_frame_num_duplicates;
+    frame_data->packet_buffer = allocate_sized_block(
+        ring_buffer->frame_buffer_allocator, get_packet_buffer_size(ring_buffer, frame_data));
     // If the entire frame was nacked already, then set the packet nack counters and timers
     // appropriately
     if (num_entire_frame_nacked) {
         frame_data->num_entire_frame_nacked = num_entire_frame_nacked;
-        memset(frame_data->num_times_index_nacked, num_entire_frame_nacked,
-               num_original_indices + num_fec_indices);
         for (int i = 0; i < num_original_indices + num_fec_indices; i++) {
-            frame_data->last_nacked_timer[i] = last_frame_nack_timer;
+            IndexNackRecord* nack_record = get_index_nack_record(frame_data, i, true);
+            nack_record->num_times_nacked = num_entire_frame_nacked;
+            nack_record->last_nacked_timer = last_frame_nack_timer;
         }
     }
     start_timer(&frame_data->frame_creation_timer);
@@ -842,10 +1000,13 @@ void init_frame(RingBuffer* ring_buffer, int id, int num_original_indices, int n
     // Initialize FEC-related things, if we need to
     if (num_fec_indices > 0) {
         frame_data->fec_decoder =
-            create_fec_decoder(num_original_indices, num_fec_indices, MAX_PACKET_SEGMENT_SIZE);
-        frame_data->fec_frame_buffer = allocate_block(ring_buffer->packet_buffer_allocator);
+            create_fec_decoder(num_original_indices, num_fec_indices, segment_stride,
+                               fec_get_codec(num_original_indices));
+        frame_data->fec_frame_buffer = allocate_sized_block(
+            ring_buffer->frame_buffer_allocator, get_fec_frame_buffer_size(frame_data));
         frame_data->successful_fec_recovery = false;
     }
+    record_frame_buffer_stats(ring_buffer);
 }
 
 void reset_frame(RingBuffer* ring_buffer, FrameData* frame_data) {
@@ -862,7 +1023,8 @@ void reset_frame(RingBuffer* ring_buffer, FrameData* frame_data) {
         }
     }
     // Free the frame's data
-    free_block(ring_buffer->packet_buffer_allocator, frame_data->packet_buffer);
+    free_sized_block(ring_buffer->frame_buffer_allocator, frame_data->packet_buffer,
+                     get_packet_buffer_size(ring_buffer, frame_data));
     frame_data->packet_buffer = NULL;
     // Free FEC-related data, if any exists
     if (frame_data->fec_decoder) {
@@ -870,9 +1032,11 @@ void reset_frame(RingBuffer* ring_buffer, FrameData* frame_data) {
         frame_data->fec_decoder = NULL;
     }
     if (frame_data->fec_frame_buffer) {
-        free_block(ring_buffer->packet_buffer_allocator, frame_data->fec_frame_buffer);
+        free_sized_block(ring_buffer->frame_buffer_allocator, frame_data->fec_frame_buffer,
+                         get_fec_frame_buffer_size(frame_data));
         frame_data->fec_frame_buffer = NULL;
     }
+    record_frame_buffer_stats(ring_buffer);
 }
 
 void reset_ring_buffer(RingBuffer* ring_buffer) {
@@ -883,7 +1047,7 @@ void reset_ring_buffer(RingBuffer* ring_buffer) {
         if (frame_data->packet_buffer != NULL) {
             reset_frame(ring_buffer, frame_data);
         }
-        memset(frame_data, 0, sizeof(*frame_data));
+        clear_frame_data(frame_data);
     }
     ring_buffer->max_id = -1;
     ring_buffer->min_id = -1;
@@ -914,6 +1078,155 @@ char* get_framebuffer(RingBuffer* ring_buffer, FrameData* current_frame) {
     }
 }
 
+size_t get_packet_buffer_size(RingBuffer* ring_buffer, const FrameData* frame_data) {
+    // Segments that would reach past largest_frame_size are dropped, see receive_segment
+    int num_indices = frame_data->num_original_packets + frame_data->num_fec_packets;
+    return min(num_indices * frame_data->segment_stride, ring_buffer->largest_frame_size);
+}
+
+size_t get_fec_frame_buffer_size(const FrameData* frame_data) {
+    // The FEC decoder writes at most a segment_stride for each original segment
+    return frame_data->num_original_packets * frame_data->segment_stride;
+}
+
+void record_frame_buffer_stats(RingBuffer* ring_buffer) {
+    SizeClassStats stats[MAX_FRAME_BUFFER_SIZE_CLASSES];
+    int num_stats = get_size_class_stats(ring_buffer->frame_buffer_allocator, stats,
+                                         MAX_FRAME_BUFFER_SIZE_CLASSES);
+    whist_analyzer_record_frame_buffer_stats(ring_buffer->type, stats, num_stats);
+}
+
+// The number of indices held by each IndexBitsetWord
+#define INDICES_PER_BITSET_WORD 64
+
+// The number of IndexBitsetWords that the largest frame needs
+#define MAX_INDEX_BITSET_WORDS \
+    ((MAX_PACKETS + INDICES_PER_BITSET_WORD - 1) / INDICES_PER_BITSET_WORD)
+
+static int count_bits(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// The position of the lowest set bit of a non-zero word
+static int lowest_bit(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    return count_bits((word & (~word + 1)) - 1);
+#endif
+}
+
+// The position of the highest set bit of a non-zero word
+static int highest_bit(uint64_t word) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(word);
+#else
+    int position = 0;
+    while (word >>= 1) {
+        position++;
+    }
+    return position;
+#endif
+}
+
+// A mask of the bits of word word_index that hold indices in [0, end_index]
+static uint64_t bitset_word_mask(int word_index, int end_index) {
+    int last_bit = end_index - word_index * INDICES_PER_BITSET_WORD;
+    return last_bit >= INDICES_PER_BITSET_WORD - 1 ? ~0ULL : (2ULL << last_bit) - 1;
+}
+
+void clear_frame_data(FrameData* frame_data) {
+    IndexBitsetWord* index_bitsets = frame_data->index_bitsets;
+    int index_bitsets_capacity = frame_data->index_bitsets_capacity;
+    IndexNackRecord* nack_records = frame_data->nack_records;
+    int nack_records_capacity = frame_data->nack_records_capacity;
+    memset(frame_data, 0, sizeof(*frame_data));
+    frame_data->index_bitsets = index_bitsets;
+    frame_data->index_bitsets_capacity = index_bitsets_capacity;
+    frame_data->nack_records = nack_records;
+    frame_data->nack_records_capacity = nack_records_capacity;
+}
+
+void init_frame_indices(FrameData* frame_data, int num_indices) {
+    int num_words = (num_indices + INDICES_PER_BITSET_WORD - 1) / INDICES_PER_BITSET_WORD;
+    if (num_words > frame_data->index_bitsets_capacity) {
+        free(frame_data->index_bitsets);
+        frame_data->index_bitsets = safe_malloc(num_words * sizeof(IndexBitsetWord));
+        frame_data->index_bitsets_capacity = num_words;
+    }
+    memset(frame_data->index_bitsets, 0, num_words * sizeof(IndexBitsetWord));
+    frame_data->num_nack_records = 0;
+}
+
+void free_frame_indices(FrameData* frame_data) {
+    free(frame_data->index_bitsets);
+    free(frame_data->nack_records);
+    frame_data->index_bitsets = NULL;
+    frame_data->index_bitsets_capacity = 0;
+    frame_data->nack_records = NULL;
+    frame_data->nack_records_capacity = 0;
+    frame_data->num_nack_records = 0;
+}
+
+bool is_index_received(const FrameData* frame_data, int index) {
+    return (frame_data->index_bitsets[index / INDICES_PER_BITSET_WORD].received >>
+            (index % INDICES_PER_BITSET_WORD)) &
+           1;
+}
+
+void mark_index_received(FrameData* frame_data, int index) {
+    frame_data->index_bitsets[index / INDICES_PER_BITSET_WORD].received |=
+        1ULL << (index % INDICES_PER_BITSET_WORD);
+}
+
+IndexNackRecord* get_index_nack_record(FrameData* frame_data, int index, bool create) {
+    int word_index = index / INDICES_PER_BITSET_WORD;
+    uint64_t bit = 1ULL << (index % INDICES_PER_BITSET_WORD);
+    IndexBitsetWord* word = &frame_data->index_bitsets[word_index];
+    if (!(word->nacked & bit) && !create) {
+        return NULL;
+    }
+
+    // The records are sorted by index, so the record's position is the number of
+    // nacked indices below it
+    int position = count_bits(word->nacked & (bit - 1));
+    for (int i = 0; i < word_index; i++) {
+        position += count_bits(frame_data->index_bitsets[i].nacked);
+    }
+    if (word->nacked & bit) {
+        return &frame_data->nack_records[position];
+    }
+
+    // Insert a new record. Indices are usually nacked in increasing order, so this is
+    // almost always an append.
+    if (frame_data->num_nack_records == frame_data->nack_records_capacity) {
+        frame_data->nack_records_capacity = max(2 * frame_data->nack_records_capacity, 16);
+        frame_data->nack_records =
+            safe_realloc(frame_data->nack_records,
+                         frame_data->nack_records_capacity * sizeof(IndexNackRecord));
+    }
+    memmove(&frame_data->nack_records[position + 1], &frame_data->nack_records[position],
+            (frame_data->num_nack_records - position) * sizeof(IndexNackRecord));
+    frame_data->num_nack_records++;
+    word->nacked |= bit;
+    IndexNackRecord* nack_record = &frame_data->nack_records[position];
+    memset(nack_record, 0, sizeof(*nack_record));
+    nack_record->index = (unsigned short)index;
+    return nack_record;
+}
+
+int get_num_times_index_nacked(FrameData* frame_data, int index) {
+    IndexNackRecord* nack_record = get_index_nack_record(frame_data, index, false);
+    return nack_record == NULL ? 0 : nack_record->num_times_nacked;
+}
+
 void nack_single_packet(RingBuffer* ring_buffer, int id, int index) {
     ring_buffer->num_packets_nacked++;
     // If a nacking function was passed in, use it
@@ -929,6 +1242,56 @@ void nack_single_packet(RingBuffer* ring_buffer, int id, int index) {
 int nack_missing_packets_up_to_index(RingBuffer* ring_buffer, FrameData* frame_data, int end_index,
                                      int max_packets_to_nack, double latency,
                                      WhistTimer* current_time) {
+    if (end_index < 0 || max_packets_to_nack <= 0) {
+        return 0;
+    }
+
+    // Find the indices to nack for a word of the bitsets at a time:
+    // the missing ones that were never nacked for, and those whose NACK is a round trip old
+    uint64_t indices_to_nack[MAX_INDEX_BITSET_WORDS] = {0};
+    int num_words = end_index / INDICES_PER_BITSET_WORD + 1;
+    int num_packets_nacked = 0;
+    int first_index = -1;
+    int last_index = -1;
+    // The position in nack_records of the first record of the current word
+    int record_position = 0;
+    for (int w = 0; w < num_words && num_packets_nacked < max_packets_to_nack; w++) {
+        IndexBitsetWord* word = &frame_data->index_bitsets[w];
+        uint64_t missing = ~word->received & bitset_word_mask(w, end_index);
+        uint64_t renackable = missing & word->nacked;
+        missing &= ~word->nacked;
+        // Previously nacked indices each have a record, in the same order as their bits
+        uint64_t nacked = word->nacked;
+        for (int position = record_position; renackable != 0; position++) {
+            uint64_t bit = nacked & (~nacked + 1);
+            nacked &= ~bit;
+            if (renackable & bit) {
+                renackable &= ~bit;
+                if (diff_timer(&frame_data->nack_records[position].last_nacked_timer,
+                               current_time) > latency_plus_jitter(latency)) {
+                    missing |= bit;
+                }
+            }
+        }
+        record_position += count_bits(word->nacked);
+
+        // Take the lowest indices, up to max_packets_to_nack
+        while (missing != 0 && num_packets_nacked < max_packets_to_nack) {
+            int index = w * INDICES_PER_BITSET_WORD + lowest_bit(missing);
+            missing &= missing - 1;
+            indices_to_nack[w] |= 1ULL << (index % INDICES_PER_BITSET_WORD);
+            if (first_index == -1) {
+                first_index = index;
+            }
+            last_index = index;
+            num_packets_nacked++;
+        }
+    }
+
+    if (num_packets_nacked == 0) {
+        return 0;
+    }
+
     // Something really large, static because this only gets called from one thread
     static char nack_log_buffer[1024 * 32];
     StringBuffer buf;
@@ -937,24 +1300,33 @@ int nack_missing_packets_up_to_index(RingBuffer* ring_buffer, FrameData* frame_d
         string_buffer_printf(&buf, "NACKing Frame ID %d, Indices ", frame_data->id);
     }
 
-    int num_packets_nacked = 0;
-    for (int i = 0; i <= end_index && num_packets_nacked < max_packets_to_nack; i++) {
-        // If we can NACK for i, NACK for i
-        if (!frame_data->received_indices[i] &&
-            (frame_data->num_times_index_nacked[i] == 0 ||
-             diff_timer(&frame_data->last_nacked_timer[i], current_time) >
-                 latency_plus_jitter(latency))) {
-            nack_single_packet(ring_buffer, frame_data->id, i);
+    // Record the NACKs, and send them all at once if we can.
+    // A NULL nack_packet disables nacking, which nack_single_packet takes care of.
+    bool nack_individually = ring_buffer->nack_packet == NULL ||
+                             ring_buffer->nack_packets == NULL || num_packets_nacked == 1;
+    for (int w = first_index / INDICES_PER_BITSET_WORD; w < num_words; w++) {
+        for (uint64_t bits = indices_to_nack[w]; bits != 0; bits &= bits - 1) {
+            int index = w * INDICES_PER_BITSET_WORD + lowest_bit(bits);
+            IndexNackRecord* nack_record = get_index_nack_record(frame_data, index, true);
+            nack_record->num_times_nacked++;
+            start_timer(&nack_record->last_nacked_timer);
+            if (nack_individually) {
+                nack_single_packet(ring_buffer, frame_data->id, index);
+            } else {
+                ring_buffer->num_packets_nacked++;
+                whist_analyzer_record_nack(ring_buffer->type, frame_data->id, index);
+            }
             if (LOG_NACKING) {
-                string_buffer_printf(&buf, "%s%d", num_packets_nacked == 0 ? "" : ", ", i);
+                string_buffer_printf(&buf, "%s%d", index == first_index ? "" : ", ", index);
             }
-            frame_data->num_times_index_nacked[i]++;
-            start_timer(&frame_data->last_nacked_timer[i]);
-            num_packets_nacked++;
         }
     }
+    if (!nack_individually) {
+        ring_buffer->nack_packets(ring_buffer->socket_context, ring_buffer->type, frame_data->id,
+                                  indices_to_nack, first_index, last_index + 1);
+    }
 
-    if (LOG_NACKING && num_packets_nacked > 0) {
+    if (LOG_NACKING) {
         LOG_INFO("%s", nack_log_buffer);
     }
 
@@ -1086,9 +1458,13 @@ bool try_nacking(RingBuffer* ring_buffer, double latency, int max_unordered_pack
         if (id < ring_buffer->max_id) {
             nack_upto_index = frame_data->num_original_packets - 1;
         } else {
-            for (int i = frame_data->num_original_packets - 1; i >= 0; i--) {
-                if (frame_data->received_indices[i]) {
-                    nack_upto_index = i;
+            // Scan the received bitset a word at a time, from the last original index down
+            int last_original_index = frame_data->num_original_packets - 1;
+            for (int w = last_original_index / INDICES_PER_BITSET_WORD; w >= 0; w--) {
+                uint64_t received = frame_data->index_bitsets[w].received &
+                                    bitset_word_mask(w, last_original_index);
+                if (received != 0) {
+                    nack_upto_index = w * INDICES_PER_BITSET_WORD + highest_bit(received);
                     break;
                 }
             }
@@ -32,6 +32,25 @@ Defines
 
 #define PACKET_LOSS_DURATION_IN_SEC 1
 
+/**
+ * @brief The received and nacked state of 64 consecutive indices of a frame.
+ * @details Bit i of each word is the state of index 64 * n + i, where n is the word's position.
+ * Both bitsets are kept together, since every scan for missing packets reads the two.
+ */
+typedef struct {
+    uint64_t received;
+    uint64_t nacked;
+} IndexBitsetWord;
+
+/**
+ * @brief The NACK count and time of one index that has been nacked for
+ */
+typedef struct {
+    unsigned short index;
+    uint8_t num_times_nacked;
+    WhistTimer last_nacked_timer;
+} IndexNackRecord;
+
 /**
  * @brief FrameData struct containing content and metadata of encoded frames.
  * @details This is used to handle reconstruction of encoded frames from UDP packets. It contains
@@ -43,6 +62,10 @@ Defines
 typedef struct FrameData {
     int num_original_packets;
     int num_fec_packets;
+    // How many of the FEC packets are probe parity, see WhistSegment
+    int num_probe_packets;
+    // The size that the frame was split into segments with, see WhistSegment
+    int segment_stride;
     int prev_frame_num_duplicate_packets;
     int id;
     int original_packets_received;
@@ -50,8 +73,6 @@ typedef struct FrameData {
     int duplicate_packets_received;
     int nack_packets_received;
     int unnecessary_nack_packets_received;
-    bool received_indices[MAX_PACKETS];
-    WhistTimer last_nacked_timer[MAX_PACKETS];
     char* packet_buffer;
 
     // When the FrameData is being rendered,
@@ -68,14 +89,28 @@ typedef struct FrameData {
     uint8_t num_entire_frame_nacked;
     int entire_frame_nacked_id;
     WhistTimer last_frame_nack_timer;
-    uint8_t num_times_index_nacked[MAX_PACKETS];
     WhistTimer last_nonnack_packet_timer;
     WhistTimer frame_creation_timer;
+
+    // Per-index state, sized to the frame's num_original_packets + num_fec_packets.
+    // This storage belongs to the ring buffer slot rather than to the frame, and it's only
+    // ever grown, so that it's reused by every frame that the slot holds.
+    IndexBitsetWord* index_bitsets;
+    int index_bitsets_capacity;
+    // The indices that have been nacked for, sorted by index
+    IndexNackRecord* nack_records;
+    int num_nack_records;
+    int nack_records_capacity;
 } FrameData;
 
 // Handler that gets called when the ring buffer wants to nack for a packet
 typedef void (*NackPacketFn)(SocketContext* socket_context, WhistPacketType frame_type, int id,
                              int index);
+// Handler that gets called when the ring buffer wants to nack for several packets of a frame at
+// once. Bit i % 64 of word i / 64 of indices is set for each index i to nack for, all of which
+// lie in [start_index, end_index).
+typedef void (*NackPacketsFn)(SocketContext* socket_context, WhistPacketType frame_type, int id,
+                              const uint64_t* indices, int start_index, int end_index);
 typedef void (*StreamResetFn)(SocketContext* socket_context, WhistPacketType frame_type,
                               int last_failed_id);
 
@@ -94,9 +129,11 @@ typedef struct RingBuffer {
     // networking interface
     SocketContext* socket_context;
     NackPacketFn nack_packet;
+    NackPacketsFn nack_packets;
     StreamResetFn request_stream_reset;
 
-    BlockAllocator* packet_buffer_allocator;  // unused if audio
+    // Allocates each frame's buffers from the size class that fits its segments
+    SizeClassAllocator* frame_buffer_allocator;
 
     int currently_rendering_id;
     FrameData currently_rendering_frame;
@@ -159,6 +196,10 @@ Public Functions
  * @param nack_packet               A lambda function that will be called when the ring buffer
  *                                  wants to nack for something. NULL will disable nacking.
  *
+ * @param nack_packets              A lambda function that will be called instead of nack_packet
+ *                                  when the ring buffer wants to nack for several packets of
+ *                                  a frame. NULL will call nack_packet for each of them.
+ *
  * @param request_stream_reset      A temporary lambda function to make the refactor work
  *                                  NULL to disable
  *                                  TODO: Remove
@@ -167,7 +208,7 @@ Public Functions
  */
 RingBuffer* init_ring_buffer(WhistPacketType type, int max_frame_size, int ring_buffer_size,
                              SocketContext* socket_context, NackPacketFn nack_packet,
-                             StreamResetFn request_stream_reset);
+                             NackPacketsFn nack_packets, StreamResetFn request_stream_reset);
 
 /**
  * @brief Add a packet to the ring buffer, and initialize the corresponding frame if necessary. Also
@@ -181,6 +222,41 @@ RingBuffer* init_ring_buffer(WhistPacketType type, int max_frame_size, int ring_
  */
 bool ring_buffer_receive_segment(RingBuffer* ring_buffer, WhistSegment* segment);
 
+/**
+ * @brief Finds where the segment's data would be stored in its frame's packet buffer, so that it
+ * can be written there directly and then given to ring_buffer_receive_segment_in_place.
+ *
+ * @param ring_buffer Ring buffer the segment is for
+ *
+ * @param segment The segment's metadata. Its segment_data is not read, and none of its
+ *                fields need to have been validated yet
+ *
+ * @param segment_size The number of bytes of segment data that will be written
+ *
+ * @returns A pointer to segment_size bytes of the frame's packet buffer, or NULL if the segment
+ *          must go through ring_buffer_receive_segment instead. That's the case whenever the
+ *          segment doesn't belong to an already initialized frame, or its index was already
+ *          received.
+ *
+ * @note If the data written to the destination then turns out to be invalid,
+ *       simply don't call ring_buffer_receive_segment_in_place: the index remains unreceived,
+ *       so its bytes of the packet buffer will be overwritten by the next copy of the segment.
+ */
+char* ring_buffer_get_segment_destination(RingBuffer* ring_buffer, const WhistSegment* segment,
+                                          int segment_size);
+
+/**
+ * @brief Identical to ring_buffer_receive_segment, for a segment whose data has already been
+ * written to ring_buffer_get_segment_destination(ring_buffer, segment, segment_size).
+ *
+ * @param ring_buffer Ring buffer to place packet into
+ *
+ * @param segment The segment's metadata. Its segment_data is not read
+ *
+ * @returns True on success, False on failure. False implies that the ringbuffer overflowed.
+ */
+bool ring_buffer_receive_segment_in_place(RingBuffer* ring_buffer, WhistSegment* segment);
+
 /**
  * @brief Retrives the frame at the given ID in the ring buffer.
  *
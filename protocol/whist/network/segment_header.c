@@ -0,0 +1,239 @@
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file segment_header.c
+ * @brief This file contains the compact wire encoding of WhistSegment headers.
+============================
+Usage
+============================
+
+See segment_header.h. Version 1 of the compact header is laid out as follows:
+
+  COMPACT_SEGMENT_HEADER_V1
+  flags (see the COMPACT_SEGMENT_FLAG_* defines)
+  departure_time_epoch
+  zigzag varint group_id
+  zigzag varint id
+  varint index
+  varint num_indices
+  varint segment_stride
+  varint num_fec_indices            (if COMPACT_SEGMENT_FLAG_FEC)
+  varint num_probe_indices          (if COMPACT_SEGMENT_FLAG_PROBES)
+  varint prev_frame_num_duplicates  (if COMPACT_SEGMENT_FLAG_PREV_DUPLICATES)
+  little-endian departure_time      (if COMPACT_SEGMENT_FLAG_DEPARTURE_TIME)
+  segment data, up to the end of the packet
+
+Frame and group ids are not delta-coded against an earlier packet, since that
+packet may be lost, which would make every later packet of the frame unusable.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <limits.h>
+#include "segment_header.h"
+
+/*
+============================
+Defines
+============================
+*/
+
+#define COMPACT_SEGMENT_FLAG_TYPE_MASK 0x03
+#define COMPACT_SEGMENT_FLAG_NACK 0x04
+#define COMPACT_SEGMENT_FLAG_DUPLICATE 0x08
+#define COMPACT_SEGMENT_FLAG_DEPARTURE_TIME 0x10
+#define COMPACT_SEGMENT_FLAG_FEC 0x20
+#define COMPACT_SEGMENT_FLAG_PREV_DUPLICATES 0x40
+#define COMPACT_SEGMENT_FLAG_PROBES 0x80
+
+/*
+============================
+Private Function Declarations
+============================
+*/
+
+/**
+ * @brief                          Writes a LEB128 varint
+ *
+ * @param dst                      The buffer to write to, advanced past the varint
+ * @param value                    The value to write
+ */
+static void write_varint(uint8_t** dst, uint32_t value);
+
+/**
+ * @brief                          Reads a LEB128 varint
+ *
+ * @param src                      The buffer to read from, advanced past the varint
+ * @param end                      The end of the buffer
+ * @param max_value                The largest value that's accepted
+ * @param value                    Receives the value
+ *
+ * @returns                        False if the varint overruns the buffer, exceeds max_value,
+ *                                 or is longer than max_value's encoding
+ */
+static bool read_varint(const uint8_t** src, const uint8_t* end, uint32_t max_value,
+                        uint32_t* value);
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+int write_compact_segment_header(void* dst, const WhistSegment* segment,
+                                 const CompactSegmentInfo* info) {
+    FATAL_ASSERT(0 <= (int)segment->whist_type && (int)segment->whist_type < NUM_PACKET_TYPES);
+    uint8_t* start = (uint8_t*)dst;
+    uint8_t* p = start;
+
+    uint8_t flags = (uint8_t)segment->whist_type;
+    if (segment->is_a_nack) flags |= COMPACT_SEGMENT_FLAG_NACK;
+    if (segment->is_a_duplicate) flags |= COMPACT_SEGMENT_FLAG_DUPLICATE;
+    if (info->has_departure_time) flags |= COMPACT_SEGMENT_FLAG_DEPARTURE_TIME;
+    if (segment->num_fec_indices != 0) flags |= COMPACT_SEGMENT_FLAG_FEC;
+    if (segment->prev_frame_num_duplicates != 0) flags |= COMPACT_SEGMENT_FLAG_PREV_DUPLICATES;
+    if (segment->num_probe_indices != 0) flags |= COMPACT_SEGMENT_FLAG_PROBES;
+
+    *p++ = COMPACT_SEGMENT_HEADER_V1;
+    *p++ = flags;
+    *p++ = info->departure_time_epoch;
+    // Zigzag-encode the signed ids, so that small negative ids stay small
+    write_varint(&p, ((uint32_t)info->group_id << 1) ^ (uint32_t)(info->group_id >> 31));
+    write_varint(&p, ((uint32_t)segment->id << 1) ^ (uint32_t)(segment->id >> 31));
+    write_varint(&p, segment->index);
+    write_varint(&p, segment->num_indices);
+    write_varint(&p, segment->segment_stride);
+    if (flags & COMPACT_SEGMENT_FLAG_FEC) {
+        write_varint(&p, segment->num_fec_indices);
+    }
+    if (flags & COMPACT_SEGMENT_FLAG_PROBES) {
+        write_varint(&p, segment->num_probe_indices);
+    }
+    if (flags & COMPACT_SEGMENT_FLAG_PREV_DUPLICATES) {
+        write_varint(&p, segment->prev_frame_num_duplicates);
+    }
+    if (flags & COMPACT_SEGMENT_FLAG_DEPARTURE_TIME) {
+        uint64_t departure_time = (uint64_t)segment->departure_time;
+        for (int i = 0; i < (int)sizeof(departure_time); i++) {
+            *p++ = (uint8_t)(departure_time >> (i * 8));
+        }
+    }
+
+    FATAL_ASSERT(p - start <= COMPACT_SEGMENT_HEADER_MAX_SIZE);
+    return (int)(p - start);
+}
+
+int read_compact_segment_header(WhistSegment* segment, CompactSegmentInfo* info, const void* src,
+                                int src_len) {
+    const uint8_t* p = (const uint8_t*)src;
+    const uint8_t* end = p + src_len;
+
+    if (src_len < 3 || p[0] != COMPACT_SEGMENT_HEADER_V1) {
+        return -1;
+    }
+    uint8_t flags = p[1];
+    info->departure_time_epoch = p[2];
+    info->has_departure_time = (flags & COMPACT_SEGMENT_FLAG_DEPARTURE_TIME) != 0;
+    p += 3;
+
+    uint32_t group_id, id, index, num_indices, segment_stride;
+    uint32_t num_fec_indices = 0;
+    uint32_t num_probe_indices = 0;
+    uint32_t prev_frame_num_duplicates = 0;
+    if (!read_varint(&p, end, UINT32_MAX, &group_id) || !read_varint(&p, end, UINT32_MAX, &id) ||
+        !read_varint(&p, end, USHRT_MAX, &index) ||
+        !read_varint(&p, end, USHRT_MAX, &num_indices) ||
+        !read_varint(&p, end, USHRT_MAX, &segment_stride)) {
+        return -1;
+    }
+    if ((flags & COMPACT_SEGMENT_FLAG_FEC) &&
+        !read_varint(&p, end, USHRT_MAX, &num_fec_indices)) {
+        return -1;
+    }
+    if ((flags & COMPACT_SEGMENT_FLAG_PROBES) &&
+        !read_varint(&p, end, USHRT_MAX, &num_probe_indices)) {
+        return -1;
+    }
+    if ((flags & COMPACT_SEGMENT_FLAG_PREV_DUPLICATES) &&
+        !read_varint(&p, end, USHRT_MAX, &prev_frame_num_duplicates)) {
+        return -1;
+    }
+    uint64_t departure_time = 0;
+    if (info->has_departure_time) {
+        if (end - p < (int)sizeof(departure_time)) {
+            return -1;
+        }
+        for (int i = 0; i < (int)sizeof(departure_time); i++) {
+            departure_time |= (uint64_t)*p++ << (i * 8);
+        }
+    }
+
+    // Whatever is left is the segment data
+    int header_size = (int)(p - (const uint8_t*)src);
+    int segment_size = src_len - header_size;
+    if (segment_size > MAX_PACKET_SEGMENT_SIZE) {
+        return -1;
+    }
+
+    info->group_id = (int)(group_id >> 1) ^ -(int)(group_id & 1);
+    segment->whist_type = (WhistPacketType)(flags & COMPACT_SEGMENT_FLAG_TYPE_MASK);
+    segment->departure_time = (timestamp_us)departure_time;
+    segment->id = (int)(id >> 1) ^ -(int)(id & 1);
+    segment->index = (unsigned short)index;
+    segment->num_indices = (unsigned short)num_indices;
+    segment->num_fec_indices = (unsigned short)num_fec_indices;
+    segment->num_probe_indices = (unsigned short)num_probe_indices;
+    segment->segment_size = (unsigned short)segment_size;
+    segment->segment_stride = (unsigned short)segment_stride;
+    segment->prev_frame_num_duplicates = (unsigned short)prev_frame_num_duplicates;
+    segment->is_a_nack = (flags & COMPACT_SEGMENT_FLAG_NACK) != 0;
+    segment->is_a_duplicate = (flags & COMPACT_SEGMENT_FLAG_DUPLICATE) != 0;
+
+    return header_size;
+}
+
+/*
+============================
+Private Function Implementations
+============================
+*/
+
+static void write_varint(uint8_t** dst, uint32_t value) {
+    uint8_t* p = *dst;
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    *dst = p;
+}
+
+static bool read_varint(const uint8_t** src, const uint8_t* end, uint32_t max_value,
+                        uint32_t* value) {
+    // Reject overlong varints, so that a header never exceeds COMPACT_SEGMENT_HEADER_MAX_SIZE
+    int max_bytes = 1;
+    for (uint32_t v = max_value; v >= 0x80; v >>= 7) {
+        max_bytes++;
+    }
+    const uint8_t* p = *src;
+    uint64_t result = 0;
+    for (int shift = 0; shift < 7 * max_bytes; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+        uint8_t byte = *p++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            if (result > max_value) {
+                return false;
+            }
+            *value = (uint32_t)result;
+            *src = p;
+            return true;
+        }
+    }
+    return false;
+}
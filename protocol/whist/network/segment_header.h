@@ -0,0 +1,98 @@
+#ifndef WHIST_NETWORK_SEGMENT_HEADER_H
+#define WHIST_NETWORK_SEGMENT_HEADER_H
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file segment_header.h
+ * @brief This file contains the compact wire encoding of WhistSegment headers.
+============================
+Usage
+============================
+
+When the compact segment header feature is enabled, udp.cpp sends a
+UDP_WHIST_SEGMENT as a compact header followed by the segment data, rather than
+as a fixed-size UDPPacket. write_compact_segment_header encodes the header on
+the sending side, and read_compact_segment_header decodes it on the receiving
+side, recovering the segment_size from the datagram's length.
+
+The compact header starts with COMPACT_SEGMENT_HEADER_V1, which can't be the
+first byte of a regular UDPPacket, so both encodings can be received at any
+time. The integer fields are varints, the flags are bit-packed, and the
+departure time is only sent when it differs from that of the previous segment.
+Segments that omit it carry the epoch of the last departure time that was sent,
+so that the receiver can tell whether it still has that departure time.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+#include "udp.h"
+
+/*
+============================
+Defines
+============================
+*/
+
+// The first byte of a version 1 compact segment header.
+// A regular UDPPacket starts with a little-endian UDPPacketType, whose first byte is below 0x80.
+#define COMPACT_SEGMENT_HEADER_V1 0xC1
+
+// Version, flags and departure time epoch bytes, two 32-bit varints, six 16-bit varints,
+// and the departure time
+#define COMPACT_SEGMENT_HEADER_MAX_SIZE (3 + 2 * 5 + 6 * 3 + (int)sizeof(timestamp_us))
+
+/**
+ * @brief                          The parts of a compact segment header that aren't
+ *                                 in the WhistSegment
+ */
+typedef struct {
+    // The id of the group of packets that the segment was sent in
+    int group_id;
+    // Whether the departure time is on the wire. When it isn't, the segment left at the
+    // departure time of the last segment that had one, if that segment had the same epoch.
+    bool has_departure_time;
+    uint8_t departure_time_epoch;
+} CompactSegmentInfo;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Encodes the header of a segment in the compact format
+ *
+ * @param dst                      The buffer to write to, of at least
+ *                                 COMPACT_SEGMENT_HEADER_MAX_SIZE bytes
+ * @param segment                  The segment whose header to encode.
+ *                                 Its segment_size and segment_data are not encoded
+ * @param info                     The rest of the header
+ *
+ * @returns                        The number of bytes written to dst
+ */
+int write_compact_segment_header(void* dst, const WhistSegment* segment,
+                                 const CompactSegmentInfo* info);
+
+/**
+ * @brief                          Decodes a compact segment header
+ *
+ * @param segment                  The segment to write the header fields to. Its segment_size
+ *                                 is set to the number of bytes that follow the header, and its
+ *                                 departure_time to 0 if it isn't on the wire.
+ *                                 segment_data isn't written to
+ * @param info                     Receives the rest of the header
+ * @param src                      The compact header, followed by the segment data
+ * @param src_len                  The size of src, which may be untrusted
+ *
+ * @returns                        The size of the compact header,
+ *                                 or -1 if src isn't a valid compact segment
+ */
+int read_compact_segment_header(WhistSegment* segment, CompactSegmentInfo* info, const void* src,
+                                int src_len);
+
+#endif  // WHIST_NETWORK_SEGMENT_HEADER_H
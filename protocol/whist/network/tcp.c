@@ -80,6 +80,7 @@ typedef struct {
     struct sockaddr_in addr;
     WhistMutex mutex;
     char binary_aes_private_key[16];
+    AESSession* aes_session;
     // Used for ting TCP packets
     int reading_packet_len;
     DynamicBuffer* encrypted_tcp_packet_buffer;
@@ -438,10 +439,10 @@ static void* tcp_get_packet(void* raw_context, WhistPacketType packet_type) {
 
             if (FEATURE_ENABLED(PACKET_ENCRYPTION)) {
                 // Decrypt into whist_packet
-                int decrypted_len = decrypt_packet(
-                    tcp_packet, tcp_network_packet->payload_size, tcp_network_packet->aes_metadata,
-                    tcp_network_packet->payload, tcp_network_packet->payload_size,
-                    context->binary_aes_private_key);
+                int decrypted_len = aes_session_decrypt_packet(
+                    context->aes_session, tcp_packet, tcp_network_packet->payload_size,
+                    &tcp_network_packet->aes_metadata, tcp_network_packet->payload,
+                    tcp_network_packet->payload_size);
                 if (decrypted_len == -1) {
                     // Deallocate and prepare to return NULL on decryption failure
                     LOG_WARNING("Could not decrypt TCP message!");
@@ -536,6 +537,7 @@ static void tcp_destroy_socket_context(void* raw_context) {
     closesocket(context->listen_socket);
     whist_destroy_mutex(context->mutex);
     free_dynamic_buffer(context->encrypted_tcp_packet_buffer);
+    aes_session_destroy(context->aes_session);
     free(context);
 }
 
@@ -592,6 +594,8 @@ bool create_tcp_socket_context(SocketContext* network_context, const char* desti
     context->mutex = whist_create_mutex();
     memcpy(context->binary_aes_private_key, binary_aes_private_key,
            sizeof(context->binary_aes_private_key));
+    context->aes_session = aes_session_create(context->binary_aes_private_key);
+    FATAL_ASSERT(context->aes_session != NULL);
     context->reading_packet_len = 0;
     context->encrypted_tcp_packet_buffer = init_dynamic_buffer(true);
     resize_dynamic_buffer(context->encrypted_tcp_packet_buffer, 0);
@@ -616,6 +620,7 @@ bool create_tcp_socket_context(SocketContext* network_context, const char* desti
     }
 
     if (ret == -1) {
+        aes_session_destroy(context->aes_session);
         free(context);
         network_context->context = NULL;
         return false;
@@ -632,6 +637,7 @@ bool create_tcp_socket_context(SocketContext* network_context, const char* desti
         //     return false
         if (context->send_queue) fifo_queue_destroy(context->send_queue);
         if (context->send_semaphore) whist_destroy_semaphore(context->send_semaphore);
+        aes_session_destroy(context->aes_session);
         free(context);
         network_context->context = NULL;
         return false;
@@ -813,8 +819,9 @@ int tcp_send_constructed_packet(TCPContext* context, TCPPacket* packet) {
 
     if (FEATURE_ENABLED(PACKET_ENCRYPTION)) {
         // If we're encrypting packets, encrypt the packet into tcp_packet
-        int encrypted_len = encrypt_packet(network_packet->payload, &network_packet->aes_metadata,
-                                           packet, packet_size, context->binary_aes_private_key);
+        int encrypted_len =
+            aes_session_encrypt_packet(context->aes_session, network_packet->payload,
+                                       &network_packet->aes_metadata, packet, packet_size);
         network_packet->payload_size = encrypted_len;
     } else {
         // Otherwise, just write it to tcp_packet directly
@@ -4,54 +4,50 @@
 #include <whist/utils/threads.h>
 #include <whist/logging/log_statistic.h>
 #include "throttle.h"
-#include <whist/network/network_algorithm.h>
 
 // Set this to something very low. Throttler will work as expected only if
 // network_throttler_set_burst_bitrate() is called with the required bitrate
 #define STARTING_THROTTLER_BITRATE 1000000
 
+// How long before a departure network_throttler_wait_until stops sleeping and starts spinning.
+// It must cover how much a sleep usually overshoots, which is about a timer tick on Windows, and
+// the default 50us timer slack on Linux. Spinning any longer burns a lot more CPU for little gain.
+#if OS_IS(OS_WIN32)
+#define THROTTLER_SPIN_US 2000
+#else
+#define THROTTLER_SPIN_US 50
+#endif
+
 struct NetworkThrottleContext {
-    double coin_bucket_ms;   //<<< The size of the coin bucket in milliseconds.
-    size_t coin_bucket_max;  //<<< The maximum size of the coin bucket for the current burst bitrate
-                             // and coin_bucket_ms.
-    size_t coin_bucket;      //<<< The coin bucket for the current burst bitrate.
+    timestamp_us group_us;   //<<< The minimum length of a group of packets in microseconds.
     int burst_bitrate;       //<<< The current burst bitrate.
-    WhistMutex queue_lock;   //<<< The lock to protect the queue.
-    WhistCondition queue_cond;         //<<< The condition variable which regulates the queue.
-    WhistTimer coin_bucket_last_fill;  //<<< The timer for the coin bucket's last fill.
-    atomic_int next_queue_id;          //<<< The next queue id to use.
-    atomic_int current_queue_id;       //<<< The currently-processed queue id.
-    unsigned int group_id;       //<<< id of the group of packets being sent in the current burst.
-    bool destroying;             //<<< Whether the context is being destroyed.
-    bool fill_bucket_initially;  //<<< Whether the coin bucket should be filled up initially
+    WhistMutex queue_lock;   //<<< The lock to protect the timeline.
+    timestamp_us next_departure_time;  //<<< When the next scheduled packet may depart.
+    timestamp_us group_start_time;     //<<< The departure time of the current group's first packet.
+    int group_id;                      //<<< id of the group of packets being sent.
+    atomic_int num_waiting;            //<<< The number of threads in network_throttler_wait_until.
+    bool destroying;                   //<<< Whether the context is being destroyed.
 };
 
-NetworkThrottleContext* network_throttler_create(double coin_bucket_ms,
-                                                 bool fill_bucket_initially) {
+NetworkThrottleContext* network_throttler_create(double group_ms) {
     /*
         Initialize a new network throttler.
 
+        Arguments:
+            group_ms (double): The minimum length of a group of packets in milliseconds.
+
         Returns:
             (NetworkThrottleContext*): The created network throttler context.
     */
     NetworkThrottleContext* ctx = safe_malloc(sizeof(NetworkThrottleContext));
-    ctx->coin_bucket_ms = coin_bucket_ms;
-    ctx->coin_bucket_max = (size_t)((ctx->coin_bucket_ms / MS_IN_SECOND) *
-                                    (STARTING_THROTTLER_BITRATE / BITS_IN_BYTE));
-    if (fill_bucket_initially) {
-        ctx->coin_bucket = ctx->coin_bucket_max;
-    } else {
-        ctx->coin_bucket = 0;
-    }
+    ctx->group_us = (timestamp_us)(group_ms * US_IN_MS);
     ctx->burst_bitrate = STARTING_THROTTLER_BITRATE;
     ctx->queue_lock = whist_create_mutex();
-    ctx->queue_cond = whist_create_cond();
-    atomic_init(&ctx->next_queue_id, 0);
-    atomic_init(&ctx->current_queue_id, 0);
+    ctx->next_departure_time = 0;
+    ctx->group_start_time = 0;
     ctx->group_id = 0;
+    atomic_init(&ctx->num_waiting, 0);
     ctx->destroying = false;
-    ctx->fill_bucket_initially = fill_bucket_initially;
-    start_timer(&ctx->coin_bucket_last_fill);
 
     return ctx;
 }
@@ -65,27 +61,22 @@ void network_throttler_destroy(NetworkThrottleContext* ctx) {
     */
     if (!ctx) return;
 
-    LOG_INFO("Flushing queue for network throttler %p", ctx);
+    LOG_INFO("Waking up the waiters of network throttler %p", ctx);
 
     ctx->destroying = true;
 
-    while (atomic_load(&ctx->current_queue_id) != atomic_load(&ctx->next_queue_id)) {
-        // Wait until the packet queue is empty
-        whist_sleep(10);
+    while (atomic_load(&ctx->num_waiting) != 0) {
+        // Waiters notice that the context is being destroyed within THROTTLER_SPIN_US
+        whist_sleep(1);
     }
 
     LOG_INFO("Destroying and freeing network throttler %p", ctx);
 
-    // At this point, we have guaranteed that no thread is waiting
-    // on the condition variable and that no thread is currently
-    // in charge of processing the queue. So we can safely destroy
-    // everything. Note that technically, we should also ensure
-    // that no thread is trying to set the burst bitrate at this
-    // moment, but for now we just assume that the caller is
-    // smart about that.
+    // Note that technically, we should also ensure that no thread is
+    // scheduling a batch or setting the burst bitrate at this moment,
+    // but for now we just assume that the caller is smart about that.
 
     whist_destroy_mutex(ctx->queue_lock);
-    whist_destroy_cond(ctx->queue_cond);
     free(ctx);
 }
 
@@ -99,70 +90,143 @@ void network_throttler_set_burst_bitrate(NetworkThrottleContext* ctx, int burst_
     */
     if (!ctx) return;
 
-    size_t coin_bucket_max =
-        (size_t)((ctx->coin_bucket_ms / MS_IN_SECOND) * (burst_bitrate / BITS_IN_BYTE));
-
-    // Add difference between previous max value and current max value to account for change in
-    // bitrate
-    if (ctx->fill_bucket_initially) {
-        ctx->coin_bucket = max(ctx->coin_bucket + coin_bucket_max - ctx->coin_bucket_max, 0);
-    }
-    // We assume that only one thread is writing this at a time.
-    // Multiple threads may read this concurrently. If we want
-    // to support multiple threads, we need to lock a mutex around
-    // accesses to `burst_bitrate`.
+    whist_lock_mutex(ctx->queue_lock);
     ctx->burst_bitrate = burst_bitrate;
-    ctx->coin_bucket_max = coin_bucket_max;
+    whist_unlock_mutex(ctx->queue_lock);
 }
 
-int network_throttler_wait_byte_allocation(NetworkThrottleContext* ctx, size_t bytes) {
+int network_throttler_schedule_batch(NetworkThrottleContext* ctx, const size_t* packet_sizes,
+                                     int num_packets, timestamp_us* departure_times) {
     /*
-        Block the current thread until the network throttler can accept more data.
+        Reserve a departure time for every packet of a batch, back to back at the burst
+        bitrate, after every previously scheduled packet.
 
         Arguments:
             ctx (NetworkThrottlerContext*): The network throttler context.
-            bytes (size_t): The number of bytes that will be sent.
+            packet_sizes (const size_t*): The size of each packet of the batch, in bytes.
+            num_packets (int): The number of packets in the batch. Must be positive.
+            departure_times (timestamp_us*): Filled with the departure time of each packet.
+
+        Returns:
+            (int): The group id of the batch, or -1 if nothing is throttled.
     */
-    if (!ctx || ctx->burst_bitrate <= 0 || ctx->destroying) return -1;
+    FATAL_ASSERT(num_packets > 0);
+    timestamp_us current_time = current_time_us();
+    if (!ctx || ctx->burst_bitrate <= 0 || ctx->destroying) {
+        for (int i = 0; i < num_packets; i++) {
+            departure_times[i] = current_time;
+        }
+        return -1;
+    }
 
-    int queue_id = atomic_fetch_add(&ctx->next_queue_id, 1);
     whist_lock_mutex(ctx->queue_lock);
-    while (queue_id > atomic_load(&ctx->current_queue_id)) {
-        whist_wait_cond(ctx->queue_cond, ctx->queue_lock);
+    // An idle throttler doesn't save up for a burst, the batch just starts now
+    timestamp_us start_time = max(ctx->next_departure_time, current_time);
+    if (start_time >= ctx->group_start_time + ctx->group_us) {
+        ctx->group_id++;
+        ctx->group_start_time = start_time;
     }
+    double us_per_byte = (double)(BITS_IN_BYTE * US_IN_SECOND) / ctx->burst_bitrate;
+    size_t total_bytes = 0;
+    for (int i = 0; i < num_packets; i++) {
+        departure_times[i] = start_time + (timestamp_us)(total_bytes * us_per_byte);
+        total_bytes += packet_sizes[i];
+    }
+    ctx->next_departure_time = start_time + (timestamp_us)(total_bytes * us_per_byte);
+    int group_id = ctx->group_id;
     whist_unlock_mutex(ctx->queue_lock);
 
-    // Now we have the guarantee that this is the next quued packet.
-    // This thread now assumes the responsiblity of adding to the
-    // coin bucket at a rate of `burst_bitrate` bytes per second.
-    // Once there are enough coins in the bucket, we can actually
-    // send the packet.
-    WhistTimer start;
-    start_timer(&start);
-    do {
-        if ((get_timer(&ctx->coin_bucket_last_fill) * MS_IN_SECOND) > ctx->coin_bucket_ms) {
-            // If the previous bucket is almost consumed(less than one UDP packet available), then
-            // add remaining coins to the next bucket. Otherwise ignore the remaining coins.
-            if (ctx->coin_bucket < udp_packet_max_size())
-                ctx->coin_bucket += ctx->coin_bucket_max;
-            else
-                ctx->coin_bucket = ctx->coin_bucket_max;
-            ctx->group_id++;
-            start_timer(&ctx->coin_bucket_last_fill);
-        } else if (bytes > ctx->coin_bucket) {
-            whist_usleep((ctx->coin_bucket_ms * US_IN_MS) -
-                         (get_timer(&ctx->coin_bucket_last_fill) * US_IN_SECOND));
-        }
-    } while (bytes > ctx->coin_bucket);
-    ctx->coin_bucket -= bytes;
+    double delay_ms = (double)(departure_times[num_packets - 1] - current_time) / US_IN_MS;
+    log_double_statistic(NETWORK_THROTTLED_PACKET_DELAY,
+                         (double)(departure_times[0] - current_time) / US_IN_MS);
+    log_double_statistic(NETWORK_THROTTLED_PACKET_DELAY_RATE, delay_ms / (double)total_bytes);
+    return group_id;
+}
+
+void network_throttler_charge_bytes(NetworkThrottleContext* ctx, size_t bytes) {
+    /*
+        Push back the packets that are scheduled next by the time it takes to send some extra
+        bytes at the burst bitrate.
+
+        Arguments:
+            ctx (NetworkThrottlerContext*): The network throttler context.
+            bytes (size_t): The number of extra bytes that were sent.
+    */
+    if (!ctx || ctx->burst_bitrate <= 0 || ctx->destroying) return;
 
-    // Wake up the next waiter in the queue.
-    double time = get_timer(&start);
-    log_double_statistic(NETWORK_THROTTLED_PACKET_DELAY, time * MS_IN_SECOND);
-    log_double_statistic(NETWORK_THROTTLED_PACKET_DELAY_RATE, time * MS_IN_SECOND / (double)bytes);
     whist_lock_mutex(ctx->queue_lock);
-    atomic_fetch_add(&ctx->current_queue_id, 1);
-    whist_broadcast_cond(ctx->queue_cond);
+    timestamp_us start_time = max(ctx->next_departure_time, current_time_us());
+    ctx->next_departure_time =
+        start_time + (timestamp_us)((double)(bytes * BITS_IN_BYTE * US_IN_SECOND) /
+                                    ctx->burst_bitrate);
     whist_unlock_mutex(ctx->queue_lock);
-    return ctx->group_id;
+}
+
+void network_throttler_release_bytes(NetworkThrottleContext* ctx, size_t bytes) {
+    /*
+        Pull the packets that are scheduled next forward by the time it takes to send some
+        scheduled bytes at the burst bitrate, since they won't depart at their departure times.
+        The timeline never goes back before the current time.
+
+        Arguments:
+            ctx (NetworkThrottlerContext*): The network throttler context.
+            bytes (size_t): The number of scheduled bytes that won't be sent as scheduled.
+    */
+    if (!ctx || ctx->burst_bitrate <= 0 || ctx->destroying) return;
+
+    whist_lock_mutex(ctx->queue_lock);
+    timestamp_us current_time = current_time_us();
+    timestamp_us released_us =
+        (timestamp_us)((double)(bytes * BITS_IN_BYTE * US_IN_SECOND) / ctx->burst_bitrate);
+    if (ctx->next_departure_time > current_time + released_us) {
+        ctx->next_departure_time -= released_us;
+    } else {
+        ctx->next_departure_time = min(ctx->next_departure_time, current_time);
+    }
+    whist_unlock_mutex(ctx->queue_lock);
+}
+
+void network_throttler_wait_until(NetworkThrottleContext* ctx, timestamp_us departure_time) {
+    /*
+        Block the current thread until a departure time, sleeping while it's far
+        and spinning for the last THROTTLER_SPIN_US.
+
+        Arguments:
+            ctx (NetworkThrottlerContext*): The network throttler context.
+            departure_time (timestamp_us): The departure time.
+    */
+    if (!ctx) return;
+
+    atomic_fetch_add(&ctx->num_waiting, 1);
+    while (!ctx->destroying) {
+        timestamp_us current_time = current_time_us();
+        if (current_time >= departure_time) {
+            break;
+        }
+        timestamp_us remaining_time = departure_time - current_time;
+        if (is_clock_simulated()) {
+            // A simulated sleep always ends exactly on time, and a spin would never end
+            whist_usleep((uint32_t)remaining_time);
+        } else if (remaining_time > THROTTLER_SPIN_US) {
+            whist_usleep((uint32_t)(remaining_time - THROTTLER_SPIN_US));
+        }
+    }
+    atomic_fetch_sub(&ctx->num_waiting, 1);
+}
+
+int network_throttler_wait_byte_allocation(NetworkThrottleContext* ctx, size_t bytes) {
+    /*
+        Block the current thread until the network throttler can accept more data.
+
+        Arguments:
+            ctx (NetworkThrottlerContext*): The network throttler context.
+            bytes (size_t): The number of bytes that will be sent.
+
+        Returns:
+            (int): The group id of the packet, or -1 if nothing is throttled.
+    */
+    timestamp_us departure_time;
+    int group_id = network_throttler_schedule_batch(ctx, &bytes, 1, &departure_time);
+    network_throttler_wait_until(ctx, departure_time);
+    return group_id;
 }
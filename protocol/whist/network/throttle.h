@@ -2,22 +2,32 @@
 #define WHIST_NETWORK_THROTTLE_H
 
 #include <stdbool.h>
+#include <whist/utils/clock.h>
 
 #if !OS_IS(OS_WIN32)
 #include <sys/types.h>
 #endif  // Not Windows
 
+/*
+The network throttler paces packets at the burst bitrate. Senders schedule a whole batch at once,
+which reserves a departure time for each of its packets on a shared timeline, and then either wait
+for each departure with network_throttler_wait_until, or hand the departure times to the kernel
+(see SO_TXTIME in udp.cpp). Consecutive batches are grouped, so that congestion control can measure
+delay gradients between groups of packets rather than between single packets.
+*/
+
 typedef struct NetworkThrottleContext NetworkThrottleContext;
 
 /**
  * @brief                    Initialize a new network throttler.
  *
- * @param coin_bucket_ms     The size of the coin bucket in milliseconds.
- * @param fill_bucket_initially    Whether the coin bucket should be filled up initially.
+ * @param group_ms           The minimum length of a group of packets in milliseconds. A batch
+ *                           that departs this long after the current group started starts a new
+ *                           group.
  *
  * @return                   The created network throttler context.
  */
-NetworkThrottleContext* network_throttler_create(double coin_bucket_ms, bool fill_bucket_initially);
+NetworkThrottleContext* network_throttler_create(double group_ms);
 
 /**
  * @brief                    Destroy a network throttler.
@@ -27,7 +37,8 @@ NetworkThrottleContext* network_throttler_create(double coin_bucket_ms, bool fil
 void network_throttler_destroy(NetworkThrottleContext* ctx);
 
 /**
- * @brief                    Set the bandwidth for the network throttler.
+ * @brief                    Set the bandwidth for the network throttler. Packets that have
+ *                           already been scheduled keep their departure times.
  *
  * @param ctx                The network throttler context.
  * @param burst_bitrate      The burst bandwidth in bits per second.
@@ -46,4 +57,54 @@ void network_throttler_set_burst_bitrate(NetworkThrottleContext* ctx, int burst_
  */
 int network_throttler_wait_byte_allocation(NetworkThrottleContext* ctx, size_t bytes);
 
+/**
+ * @brief                    Reserve a departure time for every packet of a batch, back to back
+ *                           at the burst bitrate, after every previously scheduled packet.
+ *                           This doesn't block.
+ *
+ * @param ctx                The network throttler context.
+ * @param packet_sizes       The size of each packet of the batch, in bytes.
+ * @param num_packets        The number of packets in the batch. Must be positive.
+ * @param departure_times    Filled with the departure time of each packet, as current_time_us()
+ *                           values. They're all the current time if nothing is throttled.
+ *
+ * @return                   The ID of the group that every packet of the batch belongs to,
+ *                           or -1 if nothing is throttled
+ */
+int network_throttler_schedule_batch(NetworkThrottleContext* ctx, const size_t* packet_sizes,
+                                     int num_packets, timestamp_us* departure_times);
+
+/**
+ * @brief                    Account for bytes that were sent on top of the scheduled packets,
+ *                           such as encryption padding, by pushing back the packets that are
+ *                           scheduled next. This doesn't block.
+ *
+ * @param ctx                The network throttler context.
+ * @param bytes              The number of extra bytes that were sent.
+ */
+void network_throttler_charge_bytes(NetworkThrottleContext* ctx, size_t bytes);
+
+/**
+ * @brief                    Give back the departure times of scheduled packets that won't be
+ *                           sent at them, such as the rest of a frame that gets rescheduled
+ *                           behind a retransmit, by pulling forward the packets that are
+ *                           scheduled next. It never pulls them before the current time.
+ *                           This doesn't block.
+ *
+ * @param ctx                The network throttler context.
+ * @param bytes              The number of scheduled bytes that won't be sent as scheduled.
+ */
+void network_throttler_release_bytes(NetworkThrottleContext* ctx, size_t bytes);
+
+/**
+ * @brief                    Block the current thread until a departure time. It sleeps while the
+ *                           departure is far, and spins for the last stretch, since sleeps
+ *                           overshoot by more than packets are apart at high bitrates.
+ *
+ * @param ctx                The network throttler context. The wait ends early if it's being
+ *                           destroyed.
+ * @param departure_time     The departure time, as a current_time_us() value.
+ */
+void network_throttler_wait_until(NetworkThrottleContext* ctx, timestamp_us departure_time);
+
 #endif  // WHIST_NETWORK_THROTTLE_H
@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file transport_feedback.c
+ * @brief This file contains the per-packet arrival feedback that the client sends to the server.
+============================
+Usage
+============================
+
+See transport_feedback.h.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include "transport_feedback.h"
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+void transport_feedback_builder_init(TransportFeedbackBuilder* builder, timestamp_us current_time) {
+    memset(builder, 0, sizeof(TransportFeedbackBuilder));
+    builder->last_send_time = current_time;
+}
+
+bool transport_feedback_builder_add_packet(TransportFeedbackBuilder* builder, int id, int index,
+                                           timestamp_us arrival_time) {
+    TransportFeedback* feedback = &builder->feedback;
+    FATAL_ASSERT(feedback->num_packets < TRANSPORT_FEEDBACK_MAX_PACKETS);
+    if (feedback->num_packets == 0) {
+        feedback->base_arrival_time = arrival_time;
+    }
+    // The feedback is sent long before the delta could overflow, unless this thread stalled
+    timestamp_us delta = arrival_time > feedback->base_arrival_time
+                             ? (arrival_time - feedback->base_arrival_time) /
+                                   TRANSPORT_FEEDBACK_DELTA_US
+                             : 0;
+    TransportFeedbackPacket* packet = &feedback->packets[feedback->num_packets++];
+    packet->id = id;
+    packet->index = (unsigned short)index;
+    packet->arrival_delta = (unsigned short)min(delta, USHRT_MAX);
+    builder->last_arrival_time = arrival_time;
+    return feedback->num_packets == TRANSPORT_FEEDBACK_MAX_PACKETS;
+}
+
+bool transport_feedback_builder_is_due(TransportFeedbackBuilder* builder,
+                                       timestamp_us current_time) {
+    return current_time - builder->last_send_time >= TRANSPORT_FEEDBACK_INTERVAL_MS * US_IN_MS;
+}
+
+void transport_feedback_builder_finish(TransportFeedbackBuilder* builder,
+                                       timestamp_us current_time, TransportFeedback* feedback) {
+    TransportFeedback* pending = &builder->feedback;
+    pending->hold_time_us =
+        pending->num_packets > 0 ? (int)(current_time - builder->last_arrival_time) : 0;
+    memcpy(feedback, pending, TRANSPORT_FEEDBACK_SIZE(pending->num_packets));
+    pending->num_packets = 0;
+    builder->last_send_time = current_time;
+}
+
+timestamp_us transport_feedback_get_arrival_time(const TransportFeedback* feedback, int i) {
+    return feedback->base_arrival_time +
+           (timestamp_us)feedback->packets[i].arrival_delta * TRANSPORT_FEEDBACK_DELTA_US;
+}
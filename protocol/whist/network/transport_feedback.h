@@ -0,0 +1,141 @@
+#ifndef WHIST_NETWORK_TRANSPORT_FEEDBACK_H
+#define WHIST_NETWORK_TRANSPORT_FEEDBACK_H
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file transport_feedback.h
+ * @brief This file contains the per-packet arrival feedback that the client sends to the server,
+ *        so that the server can estimate the bandwidth over every packet's timing.
+============================
+Usage
+============================
+With `--transport-feedback`, the client doesn't run congestion control itself. Instead, it calls
+transport_feedback_builder_add_packet for every original video segment that it receives, and sends
+the feedback whenever that returns true, or transport_feedback_builder_is_due does. The feedback is
+sent every TRANSPORT_FEEDBACK_INTERVAL_MS even if it's empty, so that the server can tell
+congestion apart from silence.
+
+The server looks the reported segments up in its video nack buffer, where it finds their departure
+time, group and size, and feeds them through the same congestion feedback and congestion controller
+that the client would have used. Segments that were sent but never reported count as lost.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// How often the client sends feedback
+#define TRANSPORT_FEEDBACK_INTERVAL_MS 50
+// The feedback is sent early once it holds this many segments
+#define TRANSPORT_FEEDBACK_MAX_PACKETS 128
+// The resolution of the arrival times in the feedback
+#define TRANSPORT_FEEDBACK_DELTA_US 250
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    // The video segment's frame id and index
+    int id;
+    unsigned short index;
+    // The arrival time, after the feedback's base_arrival_time,
+    // in units of TRANSPORT_FEEDBACK_DELTA_US
+    unsigned short arrival_delta;
+} TransportFeedbackPacket;
+
+// The feedback as it's sent. Only the first num_packets packets are on the wire.
+typedef struct TransportFeedback {
+    // The arrival time of the first packet, in the client's clock
+    timestamp_us base_arrival_time;
+    // How long the client held on to the last packet's feedback, so that the server can tell the
+    // round trip time apart from the batching
+    int hold_time_us;
+    int num_packets;
+    // Must be last, see TRANSPORT_FEEDBACK_SIZE
+    TransportFeedbackPacket packets[TRANSPORT_FEEDBACK_MAX_PACKETS];
+} TransportFeedback;
+
+// The size on the wire of a feedback with num_packets packets
+#define TRANSPORT_FEEDBACK_SIZE(num_packets) \
+    ((int)(offsetof(TransportFeedback, packets) + (num_packets) * sizeof(TransportFeedbackPacket)))
+
+typedef struct {
+    TransportFeedback feedback;
+    timestamp_us last_arrival_time;
+    timestamp_us last_send_time;
+} TransportFeedbackBuilder;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Initialize a feedback builder, with no packets
+ *
+ * @param builder                  The feedback builder to initialize
+ * @param current_time             The current time, which the first interval starts at
+ */
+void transport_feedback_builder_init(TransportFeedbackBuilder* builder, timestamp_us current_time);
+
+/**
+ * @brief                          Add a received video segment to the feedback
+ *
+ * @param builder                  The feedback builder
+ * @param id                       The segment's frame id
+ * @param index                    The segment's index
+ * @param arrival_time             When the segment was received
+ *
+ * @returns                        True if the feedback is full, and must be sent before the next
+ *                                 segment is added
+ */
+bool transport_feedback_builder_add_packet(TransportFeedbackBuilder* builder, int id, int index,
+                                           timestamp_us arrival_time);
+
+/**
+ * @brief                          Check whether TRANSPORT_FEEDBACK_INTERVAL_MS passed since the
+ *                                 last feedback was sent
+ *
+ * @param builder                  The feedback builder
+ * @param current_time             The current time
+ *
+ * @returns                        True if the feedback should be sent now
+ */
+bool transport_feedback_builder_is_due(TransportFeedbackBuilder* builder,
+                                       timestamp_us current_time);
+
+/**
+ * @brief                          Take the feedback out of the builder to send it, and start a
+ *                                 new one
+ *
+ * @param builder                  The feedback builder
+ * @param current_time             The current time, when the feedback is sent
+ * @param feedback                 Filled with the feedback to send
+ */
+void transport_feedback_builder_finish(TransportFeedbackBuilder* builder,
+                                       timestamp_us current_time, TransportFeedback* feedback);
+
+/**
+ * @brief                          Get the arrival time of a packet of a feedback
+ *
+ * @param feedback                 The feedback
+ * @param i                        The index of the packet in the feedback
+ *
+ * @returns                        The arrival time, in the client's clock
+ */
+timestamp_us transport_feedback_get_arrival_time(const TransportFeedback* feedback, int i);
+
+#endif  // WHIST_NETWORK_TRANSPORT_FEEDBACK_H
@@ -19,17 +19,29 @@ extern "C" {
 #include <whist/utils/queue.h>
 #include <whist/network/network_algorithm.h>
 #include <whist/network/ringbuffer.h>
+#include <whist/network/segment_header.h>
+#include <whist/network/congestion_feedback.h>
+#include <whist/network/transport_feedback.h>
+#include <whist/network/egress_scheduler.h>
+#include <whist/network/udp_uring.h>
 #include <whist/logging/log_statistic.h>
 #include <whist/network/throttle.h>
 #include <whist/core/features.h>
 #include <whist/debug/debug_console.h>
+#include <whist/utils/command_line.h>
 #include <whist/fec/fec_controller.h>
 }
 
+#include <atomic>
+
 #if !OS_IS(OS_WIN32)
 #include <fcntl.h>
 #endif
 
+#if OS_IS(OS_LINUX)
+#include <linux/net_tstamp.h>
+#endif
+
 /*
 ============================
 Defines
@@ -46,6 +58,10 @@ typedef enum {
     UDP_NETWORK_SETTINGS,
     UDP_CONNECTION_ATTEMPT,
     UDP_CONNECTION_CONFIRMATION,
+    UDP_PATH_MTU_PROBE,
+    UDP_PATH_MTU_PROBE_ACK,
+    UDP_PATH_MTU_PROBE_DONE,
+    UDP_TRANSPORT_FEEDBACK,
 } UDPPacketType;
 
 // A struct for UDPPacket,
@@ -70,6 +86,8 @@ typedef struct {
         } udp_nack_data;
 
         // UDP_BITARRAY_NACK
+        // Bit i of ba_raw is set if index + i is being nacked for.
+        // Only the first BITS_TO_CHARS(numBits) bytes of ba_raw are sent.
         struct {
             WhistPacketType type;
             int id;
@@ -101,6 +119,16 @@ typedef struct {
         struct {
             NetworkSettings network_settings;
         } udp_network_settings_data;
+
+        // UDP_PATH_MTU_PROBE / UDP_PATH_MTU_PROBE_ACK / UDP_PATH_MTU_PROBE_DONE
+        struct {
+            // The IP MTU that a probe fills, or the largest one that was received
+            int mtu;
+        } udp_path_mtu_probe_data;
+
+        // UDP_TRANSPORT_FEEDBACK
+        // Only the first num_packets packets are sent
+        TransportFeedback udp_transport_feedback_data;
     };
 } UDPPacket;
 
@@ -117,6 +145,33 @@ typedef struct {
 
 // Size of the UDPPacket header, excluding the payload
 #define UDPNETWORKPACKET_HEADER_SIZE ((int)(offsetof(UDPNetworkPacket, payload)))
+// Size of a UDP_WHIST_SEGMENT UDPPacket, excluding the segment data
+#define UDPPACKET_SEGMENT_HEADER_SIZE \
+    ((int)(offsetof(UDPPacket, udp_whist_segment_data.segment_data)))
+// A compact segment header must be decrypted whole within the bytes of a regular one
+static_assert(COMPACT_SEGMENT_HEADER_MAX_SIZE <= UDPPACKET_SEGMENT_HEADER_SIZE,
+              "The compact segment header must not be larger than the regular one");
+// Size of the IPv4 and UDP headers in front of every datagram
+#define UDP_IP_HEADER_SIZE 28
+// The largest segment whose UDP_WHIST_SEGMENT fits in a single IP packet of the given MTU
+#define UDP_SEGMENT_SIZE_FOR_MTU(mtu) \
+    ((mtu)-UDP_IP_HEADER_SIZE - UDPNETWORKPACKET_HEADER_SIZE - UDPPACKET_SEGMENT_HEADER_SIZE)
+static_assert(UDP_SEGMENT_SIZE_FOR_MTU(1500) == MAX_PACKET_SEGMENT_SIZE,
+              "MAX_PACKET_SEGMENT_SIZE must fill a 1500-byte MTU");
+static_assert(UDP_SEGMENT_SIZE_FOR_MTU(576) == MIN_PACKET_SEGMENT_SIZE,
+              "MIN_PACKET_SEGMENT_SIZE must fill a 576-byte MTU");
+static_assert(DEFAULT_PACKET_SEGMENT_SIZE <= MAX_PACKET_SEGMENT_SIZE,
+              "A normal-sized WhistPacket must fit in a single segment");
+// The IP MTUs that path MTU discovery probes for, from largest to smallest:
+// Ethernet, PPPoE, WireGuard, common tunnels, the IPv6 minimum, and the IPv4 minimum
+static const int udp_path_mtu_candidates[] = {1500, 1492, 1420, 1400, 1280, 1200, 1000, 576};
+// How long the server waits for acks of a round of path MTU probes
+#define UDP_PATH_MTU_PROBE_INTERVAL_MS 50
+// How many rounds of path MTU probes the server sends, before keeping the default segment size
+#define UDP_PATH_MTU_PROBE_ATTEMPTS 3
+// How long the client answers path MTU probes for, if the server never says it's done
+#define UDP_PATH_MTU_PROBE_TIMEOUT_MS \
+    ((UDP_PATH_MTU_PROBE_ATTEMPTS + 1) * UDP_PATH_MTU_PROBE_INTERVAL_MS)
 // How often to ping
 #define UDP_PING_INTERVAL_SEC 0.01
 // How long to go without a pong, before the connection is marked as lost
@@ -125,16 +180,9 @@ typedef struct {
 #define UDP_PONG_CONGESTION_SEC 0.5
 // How often to print ping logs
 #define UDP_PING_LOG_INTERVAL_SEC 1.0
-#define MAX_GROUP_STATS 8
-// Incoming bitrate related constants. Choose power-of-two only for an efficient computations
-#define INCOMING_BITRATE_WINDOW_MS 1024
-#define INCOMING_BITRATE_NUM_BUCKETS 8
-#define DURATION_PER_BUCKET (INCOMING_BITRATE_WINDOW_MS / INCOMING_BITRATE_NUM_BUCKETS)
-// If video bitrate received over a timeperiod(100ms or more) is less than this value than it will
-// be considered as idle video. Actual video stream will consume much more than 500Kbps.
-#define IDLE_VIDEO_MAX_BITRATE 500000
-// Atleast 75% of the buckets should contain actual video data.
-#define MIN_VALID_BUCKETS ((INCOMING_BITRATE_NUM_BUCKETS * 3) / 4)
+// Newer transport feedback gets this weightage in the server's packet loss ratio. The feedback
+// comes every TRANSPORT_FEEDBACK_INTERVAL_MS, so this averages over the last 250ms or so.
+#define TRANSPORT_FEEDBACK_LOSS_EWMA_FACTOR 0.2
 
 // Newer out-of-order values will get this weightage in EWMA filter
 #define OUT_OF_ORDER_EWMA_FACTOR 0.01
@@ -142,31 +190,96 @@ typedef struct {
 // Let's choose a nearest power of two, greater than (UDP_PONG_TIMEOUT_SEC / UDP_PING_INTERVAL_SEC)
 #define MAX_PINGS_IN_FLIGHT 256
 
+// Maximum number of datagrams drained from the socket per receive syscall.
+// On platforms without recvmmsg, the batch will only ever hold a single datagram.
+#if OS_IS(OS_LINUX)
+#define UDP_RECV_BATCH_SIZE 32
+#else
+#define UDP_RECV_BATCH_SIZE 1
+#endif
+
+// Maximum number of segments encrypted and submitted together by the batched send path.
+// On Linux, a batch is sent with a single sendmmsg syscall.
+#define UDP_SEND_BATCH_SIZE 64
+// How far ahead of their departure paced segments are handed to the kernel, with --txtime.
+// It covers how late a sleep may wake up, while keeping the qdisc's flow queue short.
+#define UDP_TXTIME_LEAD_US 2000
+// Whether multi-segment payloads use the batched send path, unless udp_set_batched_send says
+// otherwise
+#define UDP_BATCHED_SEND_DEFAULT true
+
 typedef struct {
     bool pending_stream_reset;
     int greatest_failed_id;
 } StreamResetData;
 
-typedef struct IncomingBitrate {
-    uint64_t bucket_id;
-    int num_bits;
-} IncomingBitrate;
-
 typedef struct NackID {
     int frame_id;
     int packet_index;
+    // When the NACK was received, to measure how long it waits to be retransmitted
+    timestamp_us arrival_time;
 } NackID;
 
+// Maximum number of video NACKs waiting to be retransmitted
+#define MAX_QUEUED_NACKS (VIDEO_NACKBUFFER_SIZE * MAX_VIDEO_PACKETS)
+
+// Maximum number of chunks a payload may be scattered across,
+// including the WhistPacket header and the padding after its data
+#define MAX_PAYLOAD_CHUNKS 16
+
+// Reads a WhistPacket sequentially, out of the chunks it is scattered across
+typedef struct {
+    UDPPayloadChunk chunks[MAX_PAYLOAD_CHUNKS];
+    int num_chunks;
+    int chunk_index;
+    int chunk_offset;
+} WhistPacketReader;
+
+// Describes how a WhistPacket is split into the segments being sent
+typedef struct {
+    WhistPacketType type;
+    int id;
+    int num_total_packets;
+    int num_fec_packets;
+    // The last num_probe_packets FEC packets are probe parity, which isn't sent with the rest,
+    // see udp_send_probe_parity
+    int num_probe_packets;
+    int prev_frame_num_duplicates;
+    // The size that the payload was split with, see WhistSegment
+    int segment_stride;
+    // The size of each segment
+    int* buffer_sizes;
+    // The data of each segment, when FEC encoding was used.
+    // Otherwise NULL, and the segments are read in-order out of reader.
+    char** buffers;
+    WhistPacketReader reader;
+    // The encoder of the FEC segments when FEC encoding was used, otherwise NULL.
+    // Each FEC segment's buffer stays NULL until it's encoded, right before it's constructed.
+    FECEncoder* fec_encoder;
+    // The time spent encoding FEC segments so far, in seconds
+    double fec_encode_time;
+} SegmentedPayload;
+
 // An instance of the UDP Context
 typedef struct {
     int timeout;
     SOCKET socket;
     int ack;
     WhistMutex mutex;
+    // The size to split WhistPackets with a nack buffer into, picked by path MTU discovery
+    int segment_size;
     char binary_aes_private_key[16];
+    // Keyed with binary_aes_private_key, so that the key schedule runs once per connection
+    AESSession* aes_session;
     NetworkThrottleContext* network_throttler;
 
     double fec_packet_ratios[NUM_PACKET_TYPES];
+    // How much the video FEC ratio is raised by for probe parity, which is 0 unless the client
+    // asked to saturate the bandwidth
+    double video_probe_ratio;
+    // Decaying history of the bytes sent per FEC protection class, which decides how
+    // fec_packet_ratios is split between the classes
+    double fec_class_bytes[NUM_PACKET_TYPES][NUM_FEC_PROTECTION_CLASSES];
 
     // last_addr is the last address we received a packet from.
     // When connected == true, this must equal connection_addr
@@ -180,8 +293,6 @@ typedef struct {
     WhistTimer ping_timer[MAX_PINGS_IN_FLIGHT];
     WhistTimer last_pong_timer;
     bool connection_lost;
-    double long_term_latency;
-    double short_term_latency;
 
     // Latency Calculation (Only used on server)
     WhistMutex timestamp_mutex;
@@ -194,13 +305,15 @@ typedef struct {
 
     // Nack Buffer Data
     UDPPacket** nack_buffers[NUM_PACKET_TYPES];
-    // Whether or not a nack buffer is being used right now
-    bool** nack_buffer_valid[NUM_PACKET_TYPES];
-    // This mutex will protect the data in nack_buffers
-    WhistMutex nack_mutex[NUM_PACKET_TYPES];
+    // The seqlock of each UDPPacket of the nack buffers. It's odd while the sending thread
+    // writes the UDPPacket, and 0 if the UDPPacket has never been written.
+    // We hold these separately, since reading a nack buffer's region causes it to allocate.
+    std::atomic<uint32_t>** nack_buffer_seqs[NUM_PACKET_TYPES];
     int nack_num_buffers[NUM_PACKET_TYPES];
     int nack_buffer_max_indices[NUM_PACKET_TYPES];
     int nack_buffer_max_payload_size[NUM_PACKET_TYPES];
+    // Holds the gathered WhistPacket that gets FEC encoded, for types with a nack buffer
+    char* fec_input_buffers[NUM_PACKET_TYPES];
     int num_duplicate_packets[NUM_PACKET_TYPES];
     RingBuffer* ring_buffers[NUM_PACKET_TYPES];
 
@@ -216,16 +329,90 @@ typedef struct {
     WhistTimer last_network_settings_send_time;
     // Last time UDP thread bottleneck (mostly due to CPU starvation) was detected
     WhistTimer last_bottleneck_timer;
-    // Group related stats and variables required for congestion control
-    GroupStats group_stats[MAX_GROUP_STATS];
-    int prev_group_id;
-    int curr_group_id;
-    IncomingBitrate incoming_bitrate_buckets[INCOMING_BITRATE_NUM_BUCKETS];
+    // Incoming bitrate, group stats and latencies that congestion control is fed from
+    CongestionFeedback congestion_feedback;
     void* nack_queue;
+    // Decides what the video send thread sends next, see egress_scheduler.h. Only the server has
+    // one, once its video nack buffer is registered. egress_mutex is held while it's used,
+    // which includes the whole time that it's drained.
+    EgressScheduler* egress_scheduler;
+    WhistMutex egress_mutex;
+    // The scheduled size and departure time of each segment of the video frame that's being sent,
+    // guarded by egress_mutex, see udp_schedule_frame_segments
+    size_t* frame_packet_sizes;
+    timestamp_us* frame_departure_times;
+    // The probe parity of the last video frame that's left to send, from next_probe_parity_index
+    // up to its last index, guarded by egress_mutex
+    int probe_parity_id;
+    int next_probe_parity_index;
+    int probe_parity_end_index;
+    // Called whenever NACKs get queued, guarded by nack_notify_mutex
+    WhistMutex nack_notify_mutex;
+    UDPNackNotifyFn nack_notify;
+    void* nack_notify_data;
+
+    // The io_uring backend of the socket, or NULL when the regular syscalls are used
+    UDPRing* ring;
+
+    // Receive batch, filled by one recv syscall and then drained by udp_get_udp_packet.
+    // recv_batch_packets points into recv_batch, or into the ring's buffers.
+    UDPNetworkPacket* recv_batch;
+    UDPNetworkPacket* recv_batch_packets[UDP_RECV_BATCH_SIZE];
+    int recv_batch_lens[UDP_RECV_BATCH_SIZE];
+    struct sockaddr_in recv_batch_addrs[UDP_RECV_BATCH_SIZE];
+    // Number of datagrams in the batch, and the index of the next one to hand out
+    int recv_batch_size;
+    int recv_batch_index;
+    // Arrival time shared by every datagram of the batch
+    timestamp_us recv_batch_arrival_time;
+
+    // Send batch, holding the encrypted wire packets of up to UDP_SEND_BATCH_SIZE segments
+    bool batched_send;
+    UDPNetworkPacket* send_batch;
+    int send_batch_sizes[UDP_SEND_BATCH_SIZE];
+    // The retransmits and probes of the send batch, copied out of the nack buffer
+    UDPPacket* send_batch_copies;
+    // Whether paced segments are handed to the kernel ahead of their departure, see --txtime
+    bool use_txtime;
+
+    // Departure times of compact segment headers, see segment_header.h.
+    // The sent ones are guarded by compact_header_mutex, the received ones
+    // are only used by the receiving thread
+    WhistMutex compact_header_mutex;
+    timestamp_us last_sent_departure_time[NUM_PACKET_TYPES];
+    uint8_t sent_departure_time_epoch[NUM_PACKET_TYPES];
+    timestamp_us last_received_departure_time[NUM_PACKET_TYPES];
+    uint8_t received_departure_time_epoch[NUM_PACKET_TYPES];
+    bool has_received_departure_time[NUM_PACKET_TYPES];
 
     void* fec_controller;
+    // The client's congestion controller, or the server's when the client sends transport
+    // feedback. Otherwise NULL on the server.
+    CongestionController* congestion_controller;
+
+    // Per-packet arrival feedback, see transport_feedback.h. The client builds it, and the server
+    // keeps when it last got some, and the last video segment that it reported.
+    TransportFeedbackBuilder transport_feedback_builder;
+    WhistTimer last_transport_feedback_timer;
+    int last_reported_id;
+    int last_reported_index;
+    double transport_packet_loss_ratio;
 } UDPContext;
 
+// The state of udp_get_segment_destination during a decryption
+typedef struct {
+    UDPContext* context;
+    // The UDPPacket being decrypted into
+    UDPPacket* udp_packet;
+    // Whether the segment data may be given a destination in its ringbuffer
+    bool allow_in_place;
+    // Whether the segment data was given a destination in its ringbuffer
+    bool found_destination;
+    // The size of the compact segment header that was decoded into udp_packet, or 0 if none was
+    int compact_header_size;
+    CompactSegmentInfo compact_info;
+} UDPSegmentDestination;
+
 // Define how many times to retry sending a UDP packet in case of Error 55 (buffer full). The
 // current value (5) is an arbitrary choice that was found to work well in practice.
 #define RETRIES_ON_BUFFER_FULL 5
@@ -236,19 +423,12 @@ typedef struct {
 // NOTE that this is matching ./client/audio.c
 #define MAX_NUM_AUDIO_FRAMES 10
 
-// The amount to weigh a older pings' latency,
-// on the ewma latency value
-#define PING_LAMBDA_SHORT_TERM 0.9
-#define PING_LAMBDA_LONG_TERM 0.999
-
 // How often should the client send connection attempts
 #define CONNECTION_ATTEMPT_INTERVAL_MS 5
 // How many confirmation packets the server should respond with,
 // When it receives a valid client connection attempt
 #define NUM_CONFIRMATION_MESSAGES 10
 
-#define get_bucket_id(time) ((time) / US_IN_MS) / DURATION_PER_BUCKET;
-
 // UDP recv buffer size, when a ringbuffer is being used (1MB)
 // This is 450ms-800ms in the 10mbps-18mbps
 // This should withstand the highest variance, while still being very small in RAM usage
@@ -276,50 +456,34 @@ extern "C" {
 extern unsigned short port_mappings[USHRT_MAX + 1];
 int override_bitrate;
 }
+
+// The IP MTU that udp_set_simulated_path_mtu asked to simulate, or 0
+static int simulated_path_mtu = 0;
+
+// Whether new connections send and receive through io_uring, see udp_uring.h
+static bool use_io_uring = false;
+COMMAND_LINE_BOOL_OPTION(use_io_uring, 0, "io-uring",
+                         "Send and receive UDP packets through io_uring, where the kernel "
+                         "supports it.")
+
+// Whether the client sends transport feedback, so that the server estimates the bandwidth
+static bool use_transport_feedback = false;
+COMMAND_LINE_BOOL_OPTION(use_transport_feedback, 0, "transport-feedback",
+                         "Send per-packet arrival feedback, so that the server estimates the "
+                         "bandwidth instead of the client.")
+
+// Whether paced video segments are handed to the kernel with their departure time
+static bool use_txtime = false;
+COMMAND_LINE_BOOL_OPTION(use_txtime, 0, "txtime",
+                         "Pace video segments in the kernel with SO_TXTIME, rather than by waiting "
+                         "for each departure. The outgoing interface needs the fq qdisc, which "
+                         "holds every segment until its departure time.")
 /*
 ============================
 Private Functions
 ============================
 */
 
-static void add_incoming_bits(UDPContext* context, timestamp_us arrival_time, int num_bits) {
-    uint64_t bucket_id = get_bucket_id(arrival_time);
-    IncomingBitrate* bucket =
-        &context->incoming_bitrate_buckets[bucket_id % INCOMING_BITRATE_NUM_BUCKETS];
-    if (bucket_id > bucket->bucket_id) {
-        bucket->bucket_id = bucket_id;
-        bucket->num_bits = num_bits;
-    } else {
-        bucket->num_bits += num_bits;
-    }
-}
-
-static int get_incoming_bitrate(UDPContext* context) {
-    uint64_t current_bucket_id = get_bucket_id(current_time_us());
-    int total_bits = 0;
-    int num_buckets = 0;
-    for (uint64_t i = current_bucket_id - INCOMING_BITRATE_NUM_BUCKETS + 1; i <= current_bucket_id;
-         i++) {
-        IncomingBitrate* bucket =
-            &context->incoming_bitrate_buckets[i % INCOMING_BITRATE_NUM_BUCKETS];
-        if (i == bucket->bucket_id) {
-            // If the bucket's bitrate is less than IDLE_VIDEO_MAX_BITRATE, then it must have
-            // contained idle frames, where video frames would be still. We ignore such idle-video
-            // buckets to avoid skewing the average bitrate calculation
-            if (bucket->num_bits < (IDLE_VIDEO_MAX_BITRATE * DURATION_PER_BUCKET) / MS_IN_SECOND) {
-                continue;
-            }
-            total_bits += bucket->num_bits;
-            num_buckets++;
-        }
-    }
-    // Atleast MIN_VALID_BUCKETS of the buckets should have actual video data
-    if (num_buckets >= MIN_VALID_BUCKETS)
-        return (int)(((uint64_t)total_bits * MS_IN_SECOND) / (num_buckets * DURATION_PER_BUCKET));
-    else
-        return -1;
-}
-
 // Currently considers only out of order packets within a frame, to keep this logic simpler
 // TODO : Consider out-of-order packets across frames as well.
 void update_max_unordered_packets(UnOrderedPacketInfo* unordered_info, int frame_id,
@@ -379,6 +543,30 @@ int create_udp_server_context(UDPContext* context, int port, int connection_time
 int create_udp_client_context(UDPContext* context, const char* destination, int port,
                               int connection_timeout_ms);
 
+/**
+ * @brief                          Discovers the path MTU to the client, by sending it probes
+ *                                 that fill each of udp_path_mtu_candidates with the
+ *                                 Don't Fragment bit set, and seeing which ones get acked
+ *
+ * @param context                  The UDP context of the server, that just connected
+ *
+ * @returns                        The largest IP MTU that got through,
+ *                                 or -1 if no probe was acked
+ *
+ * @note                           This overwrites the timeout on context->socket
+ */
+static int udp_probe_path_mtu(UDPContext* context);
+
+/**
+ * @brief                          Acks the server's path MTU probes, until the server says
+ *                                 it's done or UDP_PATH_MTU_PROBE_TIMEOUT_MS has passed
+ *
+ * @param context                  The UDP context of the client, that just connected
+ *
+ * @note                           This overwrites the timeout on context->socket
+ */
+static void udp_answer_path_mtu_probes(UDPContext* context);
+
 /**
  * @brief                        Encrypts and sends a UDPPacket over the network
  *
@@ -387,6 +575,174 @@ int create_udp_client_context(UDPContext* context, const char* destination, int
  */
 static int udp_send_udp_packet(UDPContext* context, UDPPacket* udp_packet);
 
+/**
+ * @brief                        Encrypts an array of UDPPackets into the UDPNetworkPackets
+ *                               that will be sent over the wire
+ *
+ * @param udp_packets            The UDPPackets to encrypt
+ * @param udp_network_packets    The UDPNetworkPackets to write to
+ * @param network_packet_sizes   Receives the number of bytes of each udp_network_packet
+ *                               that must be sent over the network
+ * @param num_packets            The number of packets to encrypt,
+ *                               at most UDP_SEND_BATCH_SIZE
+ */
+static void udp_encrypt_udp_packets(UDPContext* context, UDPPacket** udp_packets,
+                                    UDPNetworkPacket* udp_network_packets,
+                                    int* network_packet_sizes, int num_packets);
+
+/**
+ * @brief                        Encodes the compact header of a UDP_WHIST_SEGMENT,
+ *                               omitting the departure time if it's the same as that of
+ *                               the previous compact segment of its type.
+ *                               Must be called with compact_header_mutex held
+ *
+ * @param udp_packet             The UDP_WHIST_SEGMENT whose header to encode
+ * @param compact_header         The buffer to write to, of at least
+ *                               COMPACT_SEGMENT_HEADER_MAX_SIZE bytes
+ *
+ * @returns                      The size of the compact header
+ */
+static int udp_write_compact_segment_header(UDPContext* context, UDPPacket* udp_packet,
+                                            char* compact_header);
+
+/**
+ * @brief                        Returns the number of bytes that the UDPPacket takes up
+ *                               before encryption. That's get_udp_packet_size, unless the
+ *                               packet will be sent with a compact segment header,
+ *                               whose departure time is counted even if it ends up omitted.
+ *
+ * @param udp_packet             The UDPPacket to be sent
+ *
+ * @returns                      The size of the UDPPacket on the wire, before encryption
+ */
+static int udp_get_wire_packet_size(UDPPacket* udp_packet);
+
+/**
+ * @brief                        Sends the first num_packets UDPNetworkPackets
+ *                               of context->send_batch, with as few syscalls
+ *                               as the platform allows
+ *
+ * @param num_packets            The number of packets of the send batch to send
+ * @param departure_times        The departure time of each packet, which the kernel holds
+ *                               them until when context->use_txtime is set. May be NULL.
+ *
+ * @returns                      0 on success, -1 if the remaining packets had to be dropped
+ */
+static int udp_send_network_packet_batch(UDPContext* context, int num_packets,
+                                         const timestamp_us* departure_times);
+
+/**
+ * @brief                        Asks the kernel to hold the socket's packets until the
+ *                               departure times that they're sent with, see --txtime
+ *
+ * @returns                      True if the kernel will, false if segments must be paced
+ *                               in userspace
+ */
+static bool udp_enable_txtime(UDPContext* context);
+
+/**
+ * @brief                        Encrypts and sends a batch of UDPPackets through the send batch.
+ *                               The network throttler is charged for the bytes that it didn't
+ *                               schedule: the encryption overhead of paced packets, or all of
+ *                               the others, which take their share of the bitrate without
+ *                               waiting for it.
+ *
+ * @param udp_packets            The UDPPackets to send
+ * @param departure_times        The departure time of each packet, see
+ *                               udp_send_network_packet_batch. May be NULL.
+ * @param num_packets            The number of packets to send, at most UDP_SEND_BATCH_SIZE
+ * @param paced                  Whether the packets were scheduled on the network throttler
+ */
+static void udp_send_udp_packet_batch(UDPContext* context, UDPPacket** udp_packets,
+                                      const timestamp_us* departure_times, int num_packets,
+                                      bool paced);
+
+/**
+ * @brief                        Writes, encrypts and sends every segment of a payload right
+ *                               away, UDP_SEND_BATCH_SIZE segments at a time at most.
+ *                               The segments are written into the type's nack buffer.
+ *
+ * @param payload                The segmented payload to send, whose type must have a
+ *                               nack buffer
+ */
+static void udp_send_segments_batched(UDPContext* context, SegmentedPayload* payload);
+
+/**
+ * @brief                        Queues every segment of a video payload on the egress scheduler,
+ *                               as new video and FEC, and sends everything that's queued.
+ *                               The segments are written into the video nack buffer.
+ *                               Must be called with egress_mutex held.
+ *
+ * @param payload                The segmented video payload to send
+ */
+static void udp_send_video_segments(UDPContext* context, SegmentedPayload* payload);
+
+/**
+ * @brief                        Sends everything that the egress scheduler holds, highest
+ *                               priority first, paced by the network throttler, and drops the
+ *                               stale ones. The payload's segments are scheduled as one batch.
+ *                               The NACKs that arrive meanwhile are queued as retransmits.
+ *                               Must be called with egress_mutex held.
+ *
+ * @param payload                The video payload whose segments are queued, which are only
+ *                               filled in as they're dequeued, or NULL if none are
+ */
+static void udp_send_egress_packets(UDPContext* context, SegmentedPayload* payload);
+
+/**
+ * @brief                        Schedules the video frame's segments from first_index up to
+ *                               end_index as one batch on the network throttler, into
+ *                               frame_packet_sizes and frame_departure_times. Must be called
+ *                               with egress_mutex held.
+ *
+ * @param nack_buffer            The frame's nack buffer, whose segment headers are constructed
+ * @param first_index            The first segment to schedule
+ * @param end_index              One past the last segment to schedule
+ *
+ * @returns                      The group id of the batch, or -1 if nothing is throttled
+ */
+static int udp_schedule_frame_segments(UDPContext* context, UDPPacket* nack_buffer,
+                                       int first_index, int end_index);
+
+/**
+ * @brief                        Gives the departure times of the video frame's segments from
+ *                               first_index up to end_index back to the network throttler,
+ *                               since they won't be sent at them. Must be called with
+ *                               egress_mutex held.
+ *
+ * @param first_index            The first segment to give back
+ * @param end_index              One past the last segment to give back
+ */
+static void udp_release_frame_segments(UDPContext* context, int first_index, int end_index);
+
+/**
+ * @brief                        Moves the NACKs of the nack queue to the egress scheduler,
+ *                               as retransmits. Must be called with egress_mutex held.
+ *
+ * @returns                      True if there were any
+ */
+static bool udp_queue_pending_nacks(UDPContext* context);
+
+/**
+ * @brief                        Splits a WhistPacket into segments, FEC encoding it if needed,
+ *                               and sends them. The WhistPacket's payload is read directly out
+ *                               of the given chunks, and written straight into the nack buffer
+ *                               if there is one.
+ *
+ * @param packet_type            The type of the WhistPacket
+ * @param chunks                 The chunks that make up the WhistPacket's payload, in order
+ * @param num_chunks             The number of chunks
+ * @param packet_id              The ID of the WhistPacket
+ * @param start_of_stream        Whether this packet is the start of a new stream
+ * @param protection_class       How strongly to protect this packet with FEC, relative to the
+ *                               other packets of its type
+ *
+ * @returns                      0 on success, -1 on failure
+ */
+static int udp_send_payload_chunks(UDPContext* context, WhistPacketType packet_type,
+                                   const UDPPayloadChunk* chunks, int num_chunks, int packet_id,
+                                   bool start_of_stream, FECProtectionClass protection_class);
+
 /**
  * @brief                        Gets and decrypts a UDPPacket over the network
  *
@@ -399,14 +755,90 @@ static int udp_send_udp_packet(UDPContext* context, UDPPacket* udp_packet);
  * @param network_payload_size   Writes the payload size of the packet over the network (if
  *                               non-NULL). Valid if the return value of this function is true
  *
+ * @param segment_in_place       If non-NULL, the data of a UDP_WHIST_SEGMENT may be decrypted
+ *                               directly into its ringbuffer frame, rather than into udp_packet.
+ *                               Whether that happened is written to the pointed location,
+ *                               in which case the segment must be given to
+ *                               ring_buffer_receive_segment_in_place
+ *
  * @returns                      True if a packet was received and written to,
  *                               False if no packet was received
  *
- * @note                         This will call recv on context->socket, which will
- *                               wait for as long as the socket's most recent set_timeout
+ * @note                         If the current receive batch has been consumed, this will call
+ *                               udp_recv_batch, which will wait for as long as the socket's
+ *                               most recent set_timeout. Otherwise, the next datagram of the
+ *                               batch is returned without any syscall.
  */
 static bool udp_get_udp_packet(UDPContext* context, UDPPacket* udp_packet,
-                               timestamp_us* arrival_time, int* network_payload_size);
+                               timestamp_us* arrival_time, int* network_payload_size,
+                               bool* segment_in_place);
+
+/**
+ * @brief                        An AESDestinationFn, that finds where the data of a
+ *                               UDP_WHIST_SEGMENT would be stored in its ringbuffer
+ *
+ * @param opaque                 The UDPSegmentDestination
+ * @param header                 The unauthenticated UDPPacket, up to its segment data
+ * @param remaining_len          The number of bytes left to decrypt
+ *
+ * @returns                      The segment's destination in its ringbuffer frame,
+ *                               or NULL if it must be decrypted into the UDPPacket
+ *
+ * @note                         If the header is a compact segment header, it's decoded
+ *                               into the UDPPacket here, and the segment data that was
+ *                               decrypted along with it is moved to the segment's destination
+ */
+static void* udp_get_segment_destination(void* opaque, const void* header, int remaining_len);
+
+/**
+ * @brief                        Finds where the data of a UDP_WHIST_SEGMENT would be stored
+ *                               in its ringbuffer
+ *
+ * @param udp_packet             The unauthenticated UDPPacket, up to its segment data
+ * @param segment_size           The size of the segment data
+ *
+ * @returns                      The segment's destination in its ringbuffer frame,
+ *                               or NULL if there is none
+ */
+static char* udp_find_segment_destination(UDPContext* context, const UDPPacket* udp_packet,
+                                          int segment_size);
+
+/**
+ * @brief                        Turns a compact segment that was decrypted whole into the
+ *                               UDPPacket, into a regular UDP_WHIST_SEGMENT
+ *
+ * @param udp_packet             The UDPPacket holding the compact segment
+ * @param len                    The number of bytes of the compact segment
+ * @param compact_info           Receives the rest of the compact header
+ *
+ * @returns                      The new size of the UDPPacket,
+ *                               or -1 if it isn't a valid compact segment
+ */
+static int udp_expand_compact_segment(UDPPacket* udp_packet, int len,
+                                      CompactSegmentInfo* compact_info);
+
+/**
+ * @brief                        Sets the departure time of a received compact segment,
+ *                               which is 0 if it was omitted and can't be recovered
+ *
+ * @param udp_packet             The received UDP_WHIST_SEGMENT
+ * @param compact_info           Its compact header info
+ */
+static void udp_resolve_departure_time(UDPContext* context, UDPPacket* udp_packet,
+                                       const CompactSegmentInfo* compact_info);
+
+/**
+ * @brief                        Refills the receive batch from the network, receiving up to
+ *                               UDP_RECV_BATCH_SIZE datagrams with a single syscall
+ *
+ * @returns                      True if at least one datagram was received,
+ *                               False on timeout or network error
+ *
+ * @note                         Only the first datagram waits for the socket's timeout,
+ *                               the rest of the batch is whatever was already queued.
+ *                               All datagrams of the batch share one arrival timestamp.
+ */
+static bool udp_recv_batch(UDPContext* context);
 
 /**
  * @brief                        Returns the size, in bytes, of the relevant part of
@@ -438,6 +870,55 @@ UDP Message Handling
  */
 static void udp_handle_message(UDPContext* context, UDPPacket* packet);
 
+/**
+ * @brief                   Marks a UDPPacket of a nack buffer as being written,
+ *                          so that nack readers skip it until udp_end_nack_buffer_write.
+ *                          Only the thread that sends packets of that type may write.
+ *
+ * @param seq               The seqlock of the UDPPacket
+ */
+static void udp_begin_nack_buffer_write(std::atomic<uint32_t>* seq);
+
+/**
+ * @brief                   Publishes a UDPPacket of a nack buffer, once it has been written
+ *
+ * @param seq               The seqlock of the UDPPacket
+ */
+static void udp_end_nack_buffer_write(std::atomic<uint32_t>* seq);
+
+/**
+ * @brief                   Copies a UDPPacket out of the nack buffer, without blocking the
+ *                          thread that writes it. This may be called from any thread.
+ *
+ * @param context           The UDPContext
+ * @param type              The WhistPacketType of the nack buffer
+ * @param packet_id         The ID of the WhistPacket, which selects the nack buffer slot
+ * @param packet_index      The index of the UDPPacket within the slot
+ * @param packet            Receives the UDPPacket. Its ID may differ from packet_id,
+ *                          if the slot has since been reused by a newer WhistPacket.
+ *
+ * @returns                 False if that UDPPacket has never been written,
+ *                          or was being written while we read it
+ */
+static bool udp_read_nack_buffer(UDPContext* context, WhistPacketType type, int packet_id,
+                                 int packet_index, UDPPacket* packet);
+
+/**
+ * @brief                   Copies a packet that's being resent out of the nack buffer,
+ *                          marked as a NACK response or as a duplicate
+ *
+ * @param context           The UDPContext
+ * @param type              The WhistPacketType of the nack buffer
+ * @param id                The ID of the WhistPacket
+ * @param index             The index of the packet
+ * @param is_duplicate      Whether the packet is a duplicate, rather than a NACK response
+ * @param packet            Receives the packet
+ *
+ * @returns                 False if the packet isn't in the nack buffer
+ */
+static bool udp_get_resent_packet(UDPContext* context, WhistPacketType type, int id, int index,
+                                  bool is_duplicate, UDPPacket* packet);
+
 // Handler functions for the various UDP messages
 static void udp_handle_nack(UDPContext* context, WhistPacketType type, int id, int index,
                             bool is_duplicate);
@@ -446,6 +927,35 @@ static void udp_handle_pong(UDPContext* context, int id, timestamp_us ping_send_
 static void udp_handle_stream_reset(UDPContext* context, WhistPacketType type,
                                     int greatest_failed_id);
 
+/**
+ * @brief                   Sends the transport feedback that the client has built so far
+ *
+ * @param context           The client's UDPContext
+ */
+static void udp_send_transport_feedback(UDPContext* context);
+
+/**
+ * @brief                   Counts the original video segments that the server sent after the
+ *                          last reported one, up to and including the given one, from the
+ *                          sent-but-not-acked history of the nack buffer. The given segment
+ *                          becomes the last reported one.
+ *
+ * @param context           The server's UDPContext
+ * @param id                The frame id of a segment that transport feedback reported
+ * @param index             Its index
+ *
+ * @returns                 The number of segments sent, or 0 if the segment was reordered
+ */
+static int udp_count_sent_video_segments(UDPContext* context, int id, int index);
+
+/**
+ * @brief                   Tells whoever registered with udp_set_nack_notify,
+ *                          that there are NACKs in the nack queue
+ *
+ * @param context           The UDPContext that queued the NACKs
+ */
+static void udp_notify_nack(UDPContext* context);
+
 /*
 ============================
 RingBuffer Lambda Functions
@@ -473,6 +983,51 @@ static void udp_nack_packet(SocketContext* socket_context, WhistPacketType type,
     udp_send_udp_packet(context, &packet);
 }
 
+/**
+ * @brief                    Send nacks to the server indicating that the client is missing
+ *                           several packets of the given type and ID, as UDP_BITARRAY_NACKs
+ *                           of up to MAX_VIDEO_PACKETS indices each
+ *
+ * @param socket_context     the context we're sending the nacks over
+ * @param type               type of packet
+ * @param ID                 ID of packet
+ * @param indices            The bitset of indices to nack for, see NackPacketsFn
+ * @param start_index        The first index that may be set in indices
+ * @param end_index          One past the last index that may be set in indices
+ */
+static void udp_nack_packets(SocketContext* socket_context, WhistPacketType type, int id,
+                             const uint64_t* indices, int start_index, int end_index) {
+    UDPContext* context = (UDPContext*)socket_context->context;
+    for (int chunk_start = start_index; chunk_start < end_index;
+         chunk_start += MAX_VIDEO_PACKETS) {
+        int num_bits = min(end_index - chunk_start, MAX_VIDEO_PACKETS);
+        UDPPacket packet = {};
+        packet.type = UDP_BITARRAY_NACK;
+        packet.udp_bitarray_nack_data.type = type;
+        packet.udp_bitarray_nack_data.id = id;
+        packet.udp_bitarray_nack_data.index = chunk_start;
+        packet.udp_bitarray_nack_data.numBits = num_bits;
+
+        BitArray* bit_arr = bit_array_create(num_bits);
+        bit_array_clear_all(bit_arr);
+        bool any_bit_set = false;
+        for (int i = 0; i < num_bits; i++) {
+            int index = chunk_start + i;
+            if ((indices[index / 64] >> (index % 64)) & 1) {
+                bit_array_set_bit(bit_arr, i);
+                any_bit_set = true;
+            }
+        }
+        memcpy(packet.udp_bitarray_nack_data.ba_raw, bit_array_get_bits(bit_arr),
+               BITS_TO_CHARS(num_bits));
+        bit_array_free(bit_arr);
+
+        if (any_bit_set) {
+            udp_send_udp_packet(context, &packet);
+        }
+    }
+}
+
 static void udp_request_stream_reset(SocketContext* socket_context, WhistPacketType type,
                                      int greatest_failed_id) {
     UDPContext* context = (UDPContext*)socket_context->context;
@@ -512,53 +1067,40 @@ static void udp_congestion_control(UDPContext* context, timestamp_us departure_t
         send_desired_network_settings(context);
     }
     bool send_network_settings = false;
-    GroupStats* group_stats = &context->group_stats[group_id % MAX_GROUP_STATS];
-    // As per WCC.md,
-    // An inter-departure time is computed between consecutive groups as T(i) - T(i-1),
-    // where T(i) is the departure timestamp of the last packet in the current packet
-    // group being processed.  Any packets received out of order are ignored by the
-    // arrival-time model.
-    if (departure_time > group_stats->departure_time) {
-        group_stats->departure_time = departure_time;
-        group_stats->arrival_time = arrival_time;
-    }
-
-    if (group_id > context->curr_group_id) {
-        if (context->prev_group_id != 0 &&
-            get_timer(&context->last_bottleneck_timer) > WCC_HOLD_TIME_AFTER_UDP_BOTTLENECK_SEC) {
-            GroupStats* curr_group_stats =
-                &context->group_stats[context->curr_group_id % MAX_GROUP_STATS];
-            GroupStats* prev_group_stats =
-                &context->group_stats[context->prev_group_id % MAX_GROUP_STATS];
-
-            int incoming_bitrate = get_incoming_bitrate(context);
-            double packet_loss_ratio = get_packet_loss_ratio(context->ring_buffers[PACKET_VIDEO],
-                                                             context->short_term_latency);
-            if (ENABLE_FEC) {
-                // feed current time and latency info into fec controller
-                double current_time = get_timestamp_sec();
-                fec_controller_feed_latency(context->fec_controller, current_time,
-                                            context->short_term_latency);
-                if (LOG_FEC_CONTROLLER) {
-                    static double last_log_time = 0;
-                    if (current_time - last_log_time > 0.2) {
-                        last_log_time = current_time;
-                        LOG_INFO(
-                            "[FEC_CONTROLLER]"
-                            "loss=%.2f%% short_term_latecny=%.1fms long_term_latency=%.1f "
-                            "inbits=%d\n",
-                            packet_loss_ratio * 100, context->short_term_latency * MS_IN_SECOND,
-                            context->long_term_latency * MS_IN_SECOND, incoming_bitrate);
-                    }
+    CongestionFeedback* feedback = &context->congestion_feedback;
+    GroupStats curr_group_stats;
+    GroupStats prev_group_stats;
+    if (congestion_feedback_add_group_sample(feedback, departure_time, arrival_time, group_id,
+                                             &curr_group_stats, &prev_group_stats) &&
+        get_timer(&context->last_bottleneck_timer) > WCC_HOLD_TIME_AFTER_UDP_BOTTLENECK_SEC) {
+        int incoming_bitrate =
+            congestion_feedback_get_incoming_bitrate(feedback, current_time_us());
+        double packet_loss_ratio = get_packet_loss_ratio(context->ring_buffers[PACKET_VIDEO],
+                                                         feedback->short_term_latency);
+        if (ENABLE_FEC) {
+            // feed current time and latency info into fec controller
+            double current_time = get_timestamp_sec();
+            fec_controller_feed_latency(context->fec_controller, current_time,
+                                        feedback->short_term_latency);
+            if (LOG_FEC_CONTROLLER) {
+                static double last_log_time = 0;
+                if (current_time - last_log_time > 0.2) {
+                    last_log_time = current_time;
+                    LOG_INFO(
+                        "[FEC_CONTROLLER]"
+                        "loss=%.2f%% short_term_latecny=%.1fms long_term_latency=%.1f "
+                        "inbits=%d\n",
+                        packet_loss_ratio * 100, feedback->short_term_latency * MS_IN_SECOND,
+                        feedback->long_term_latency * MS_IN_SECOND, incoming_bitrate);
                 }
             }
-            send_network_settings = whist_congestion_controller(
-                curr_group_stats, prev_group_stats, incoming_bitrate, packet_loss_ratio,
-                context->short_term_latency, context->long_term_latency, &context->network_settings,
-                context->fec_controller);
         }
-        context->prev_group_id = context->curr_group_id;
-        context->curr_group_id = group_id;
+        congestion_controller_on_rtt(context->congestion_controller,
+                                     feedback->short_term_latency, feedback->long_term_latency);
+        congestion_controller_on_loss(context->congestion_controller, packet_loss_ratio);
+        send_network_settings = congestion_controller_on_group_feedback(
+            context->congestion_controller, &curr_group_stats, &prev_group_stats,
+            incoming_bitrate, &context->network_settings);
     }
 
     // resend values periodically since UDP packet might get lost
@@ -569,6 +1111,76 @@ static void udp_congestion_control(UDPContext* context, timestamp_us departure_t
     whist_unlock_mutex(context->congestion_control_mutex);
 }
 
+// Route a received UDPPacket to congestion control and its ringbuffer, or to udp_handle_message
+// If segment_in_place, the segment's data is already in its ringbuffer frame
+static void udp_handle_received_packet(UDPContext* context, UDPPacket* udp_packet,
+                                       timestamp_us arrival_time, int network_payload_size,
+                                       bool segment_in_place) {
+    // if the packet is a whist_segment, store the data to give later via get_packet
+    // Otherwise, pass it to udp_handle_message
+    if (udp_packet->type == UDP_WHIST_SEGMENT) {
+        WhistPacketType packet_type = udp_packet->udp_whist_segment_data.whist_type;
+        if (packet_type == PACKET_VIDEO) {
+            congestion_feedback_add_incoming_bits(&context->congestion_feedback, arrival_time,
+                                                  network_payload_size * BITS_IN_BYTE);
+            if (!udp_packet->udp_whist_segment_data.is_a_nack &&
+                !udp_packet->udp_whist_segment_data.is_a_duplicate) {
+                update_max_unordered_packets(&context->unordered_packet_info,
+                                             udp_packet->udp_whist_segment_data.id,
+                                             udp_packet->udp_whist_segment_data.index);
+                if (use_transport_feedback) {
+                    if (transport_feedback_builder_add_packet(
+                            &context->transport_feedback_builder,
+                            udp_packet->udp_whist_segment_data.id,
+                            udp_packet->udp_whist_segment_data.index, arrival_time)) {
+                        udp_send_transport_feedback(context);
+                    }
+                } else if (udp_packet->group_id >= context->congestion_feedback.curr_group_id &&
+                           udp_packet->udp_whist_segment_data.departure_time != 0) {
+                    // A compact segment's departure time may be unknown, if the segment that
+                    // carried it was lost
+                    udp_congestion_control(context,
+                                           udp_packet->udp_whist_segment_data.departure_time,
+                                           arrival_time, udp_packet->group_id);
+                }
+            }
+        }
+        // If there's a ringbuffer, store in the ringbuffer to reconstruct the original packet
+        if (context->ring_buffers[packet_type] != NULL) {
+            RingBuffer* ring_buffer = context->ring_buffers[packet_type];
+            WhistSegment* segment = &udp_packet->udp_whist_segment_data;
+            bool ring_buffer_ok = segment_in_place
+                                      ? ring_buffer_receive_segment_in_place(ring_buffer, segment)
+                                      : ring_buffer_receive_segment(ring_buffer, segment);
+            if (!ring_buffer_ok) {
+                // Log when the ringbuffer overflows
+                LOG_ERROR("Ringbuffer overflowed; stream resets have been failing to recover.");
+                // Optionally mark the connection has lost during such an event
+                // context->connection_lost = true;
+            }
+        } else {
+            FATAL_ASSERT(!segment_in_place);
+            FATAL_ASSERT(udp_packet->udp_whist_segment_data.num_indices == 1);
+            FATAL_ASSERT(udp_packet->udp_whist_segment_data.num_fec_indices == 0);
+            // if there is no ring buffer (packet is message), store it in the 1-packet buffer
+            // instead memcpy the segment_data (WhistPacket*) into pending_packets
+            memcpy(&context->pending_packets[packet_type],
+                   &udp_packet->udp_whist_segment_data.segment_data,
+                   udp_packet->udp_whist_segment_data.segment_size);
+            if (context->has_pending_packet[packet_type]) {
+                LOG_ERROR(
+                    "get_packet has not been called, unclaimed PACKET_MESSAGE being "
+                    "overwritten!");
+            } else {
+                context->has_pending_packet[packet_type] = true;
+            }
+        }
+    } else {
+        // Handle the UDP message
+        udp_handle_message(context, udp_packet);
+    }
+}
+
 static bool udp_update(void* raw_context) {
     /*
      * Read a WhistPacket from the socket, decrypt it if necessary, and store the decrypted data for
@@ -618,59 +1230,30 @@ static bool udp_update(void* raw_context) {
     UDPPacket udp_packet;
     timestamp_us arrival_time;
     int network_payload_size;
-    bool received_packet =
-        udp_get_udp_packet(context, &udp_packet, &arrival_time, &network_payload_size);
+    bool segment_in_place;
+    bool received_packet = udp_get_udp_packet(context, &udp_packet, &arrival_time,
+                                              &network_payload_size, &segment_in_place);
     start_timer(&last_recv_timer);
     current_time = last_recv_timer;
 
-    if (received_packet) {
-        // if the packet is a whist_segment, store the data to give later via get_packet
-        // Otherwise, pass it to udp_handle_message
-        if (udp_packet.type == UDP_WHIST_SEGMENT) {
-            WhistPacketType packet_type = udp_packet.udp_whist_segment_data.whist_type;
-            if (packet_type == PACKET_VIDEO) {
-                add_incoming_bits(context, arrival_time, network_payload_size * BITS_IN_BYTE);
-                if (!udp_packet.udp_whist_segment_data.is_a_nack &&
-                    !udp_packet.udp_whist_segment_data.is_a_duplicate) {
-                    update_max_unordered_packets(&context->unordered_packet_info,
-                                                 udp_packet.udp_whist_segment_data.id,
-                                                 udp_packet.udp_whist_segment_data.index);
-                    if (udp_packet.group_id >= context->curr_group_id) {
-                        udp_congestion_control(context,
-                                               udp_packet.udp_whist_segment_data.departure_time,
-                                               arrival_time, udp_packet.group_id);
-                    }
-                }
-            }
-            // If there's a ringbuffer, store in the ringbuffer to reconstruct the original packet
-            if (context->ring_buffers[packet_type] != NULL) {
-                if (!ring_buffer_receive_segment(context->ring_buffers[packet_type],
-                                                 &udp_packet.udp_whist_segment_data)) {
-                    // Log when the ringbuffer overflows
-                    LOG_ERROR("Ringbuffer overflowed; stream resets have been failing to recover.");
-                    // Optionally mark the connection has lost during such an event
-                    // context->connection_lost = true;
-                }
-            } else {
-                FATAL_ASSERT(udp_packet.udp_whist_segment_data.num_indices == 1);
-                FATAL_ASSERT(udp_packet.udp_whist_segment_data.num_fec_indices == 0);
-                // if there is no ring buffer (packet is message), store it in the 1-packet buffer
-                // instead memcpy the segment_data (WhistPacket*) into pending_packets
-                memcpy(&context->pending_packets[packet_type],
-                       &udp_packet.udp_whist_segment_data.segment_data,
-                       udp_packet.udp_whist_segment_data.segment_size);
-                if (context->has_pending_packet[packet_type]) {
-                    LOG_ERROR(
-                        "get_packet has not been called, unclaimed PACKET_MESSAGE being "
-                        "overwritten!");
-                } else {
-                    context->has_pending_packet[packet_type] = true;
-                }
+    // Process every datagram of the batch that was just received, so that the datagrams recvmmsg
+    // already pulled off the socket don't wait for another round of pings and nacks
+    while (true) {
+        if (received_packet) {
+            udp_handle_received_packet(context, &udp_packet, arrival_time, network_payload_size,
+                                       segment_in_place);
+            // A pending packet must be claimed by get_packet before another one can be stored,
+            // so leave the rest of the batch for the next udp_update
+            if (udp_packet.type == UDP_WHIST_SEGMENT &&
+                context->ring_buffers[udp_packet.udp_whist_segment_data.whist_type] == NULL) {
+                break;
             }
-        } else {
-            // Handle the UDP message
-            udp_handle_message(context, &udp_packet);
         }
+        if (context->recv_batch_index >= context->recv_batch_size) {
+            break;
+        }
+        received_packet = udp_get_udp_packet(context, &udp_packet, &arrival_time,
+                                             &network_payload_size, &segment_in_place);
     }
 
     // *************
@@ -678,20 +1261,116 @@ static bool udp_update(void* raw_context) {
     // *************
 
     if (context->ring_buffers[PACKET_VIDEO] != NULL) {
-        // If no pong is received for UDP_PONG_CONGESTION_SEC, then we signal severe congestion.
-        if (diff_timer(&context->last_pong_timer, &current_time) > UDP_PONG_CONGESTION_SEC &&
-            whist_congestion_controller_handle_severe_congestion(&context->network_settings)) {
+        if (use_transport_feedback) {
+            if (transport_feedback_builder_is_due(&context->transport_feedback_builder,
+                                                  current_time_us())) {
+                udp_send_transport_feedback(context);
+            }
+        } else if (diff_timer(&context->last_pong_timer, &current_time) >
+                       UDP_PONG_CONGESTION_SEC &&
+                   congestion_controller_handle_severe_congestion(context->congestion_controller,
+                                                                  &context->network_settings)) {
+            // If no pong is received for UDP_PONG_CONGESTION_SEC, then we signal severe congestion
             send_desired_network_settings(context);
         }
         try_recovering_missing_packets_or_frames(
-            context->ring_buffers[PACKET_VIDEO], context->short_term_latency,
+            context->ring_buffers[PACKET_VIDEO], context->congestion_feedback.short_term_latency,
             (int)round(context->unordered_packet_info.max_unordered_packets),
             &context->network_settings, &current_time);
     }
 
+    // Once the client sends transport feedback, the server estimates the bandwidth. Like the client
+    // without pongs, it signals severe congestion when the feedback stops for a while.
+    if (context->network_throttler != NULL && context->congestion_controller != NULL) {
+        whist_lock_mutex(context->congestion_control_mutex);
+        NetworkSettings network_settings = context->network_settings;
+        if (diff_timer(&context->last_transport_feedback_timer, &current_time) >
+                UDP_PONG_CONGESTION_SEC &&
+            congestion_controller_handle_severe_congestion(context->congestion_controller,
+                                                           &network_settings)) {
+            udp_handle_network_settings(context, network_settings);
+            send_desired_network_settings(context);
+        }
+        whist_unlock_mutex(context->congestion_control_mutex);
+    }
+
     return true;
 }
 
+// Copy the next `size` bytes of the WhistPacket into dst
+static void whist_packet_reader_read(WhistPacketReader* reader, char* dst, int size) {
+    while (size > 0) {
+        FATAL_ASSERT(reader->chunk_index < reader->num_chunks);
+        UDPPayloadChunk* chunk = &reader->chunks[reader->chunk_index];
+        int num_bytes = min(size, chunk->size - reader->chunk_offset);
+        memcpy(dst, (const char*)chunk->data + reader->chunk_offset, num_bytes);
+        dst += num_bytes;
+        size -= num_bytes;
+        reader->chunk_offset += num_bytes;
+        if (reader->chunk_offset == chunk->size) {
+            reader->chunk_index++;
+            reader->chunk_offset = 0;
+        }
+    }
+}
+
+// Fill in the header of a UDP_WHIST_SEGMENT UDPPacket, for the segment at the given index of a
+// payload. It already has the segment's size, so it can be scheduled before its data is filled in.
+static void udp_construct_segment_header(UDPPacket* packet, SegmentedPayload* payload,
+                                         int packet_index) {
+    packet->type = UDP_WHIST_SEGMENT;
+    packet->udp_whist_segment_data.whist_type = payload->type;
+    packet->udp_whist_segment_data.id = payload->id;
+    packet->udp_whist_segment_data.index = (unsigned short)packet_index;
+    packet->udp_whist_segment_data.num_indices = (unsigned short)payload->num_total_packets;
+    packet->udp_whist_segment_data.num_fec_indices = (unsigned short)payload->num_fec_packets;
+    packet->udp_whist_segment_data.num_probe_indices = (unsigned short)payload->num_probe_packets;
+    packet->udp_whist_segment_data.prev_frame_num_duplicates =
+        (unsigned short)payload->prev_frame_num_duplicates;
+    packet->udp_whist_segment_data.is_a_nack = false;
+    packet->udp_whist_segment_data.is_a_duplicate = false;
+    packet->udp_whist_segment_data.segment_size = payload->buffer_sizes[packet_index];
+    packet->udp_whist_segment_data.segment_stride = (unsigned short)payload->segment_stride;
+
+    FATAL_ASSERT(packet->udp_whist_segment_data.segment_size <=
+                 sizeof(packet->udp_whist_segment_data.segment_data));
+}
+
+// Fill in the data of a UDP_WHIST_SEGMENT UDPPacket whose header has been constructed.
+// When the payload wasn't FEC encoded, segments must be filled in in-order.
+static void udp_construct_segment_data(UDPPacket* packet, SegmentedPayload* payload,
+                                       int packet_index) {
+    // FEC segments are encoded as they're constructed, so that the original segments can be
+    // sent without waiting for the whole frame to be encoded
+    if (payload->fec_encoder != NULL && payload->buffers[packet_index] == NULL) {
+        WhistTimer encode_timer;
+        start_timer(&encode_timer);
+        fec_get_fec_buffer(payload->fec_encoder, packet_index,
+                           (void**)&payload->buffers[packet_index],
+                           &payload->buffer_sizes[packet_index]);
+        payload->fec_encode_time += get_timer(&encode_timer);
+        // The header was constructed with the size that udp_send_payload_chunks expected
+        FATAL_ASSERT(packet->udp_whist_segment_data.segment_size ==
+                     payload->buffer_sizes[packet_index]);
+    }
+
+    if (payload->buffers != NULL) {
+        memcpy(packet->udp_whist_segment_data.segment_data, payload->buffers[packet_index],
+               payload->buffer_sizes[packet_index]);
+    } else {
+        whist_packet_reader_read(&payload->reader, packet->udp_whist_segment_data.segment_data,
+                                 payload->buffer_sizes[packet_index]);
+    }
+}
+
+// Fill in a UDP_WHIST_SEGMENT UDPPacket, holding the segment at the given index of a payload.
+// When the payload wasn't FEC encoded, segments must be constructed in-order.
+static void udp_construct_segment(UDPPacket* packet, SegmentedPayload* payload,
+                                  int packet_index) {
+    udp_construct_segment_header(packet, payload, packet_index);
+    udp_construct_segment_data(packet, payload, packet_index);
+}
+
 // NOTE that this function is in the hotpath.
 // The hotpath *must* return in under ~10000 assembly instructions.
 // Please pass this comment into any non-trivial function that this function calls.
@@ -700,217 +1379,48 @@ static int udp_send_packet(void* raw_context, WhistPacketType packet_type,
                            void* whist_packet_payload, int whist_packet_payload_size, int packet_id,
                            bool start_of_stream) {
     FATAL_ASSERT(raw_context != NULL);
+    UDPPayloadChunk chunk = {whist_packet_payload, whist_packet_payload_size};
+    return udp_send_payload_chunks((UDPContext*)raw_context, packet_type, &chunk, 1, packet_id,
+                                   start_of_stream, FEC_PROTECTION_NORMAL);
+}
+
+static void* udp_get_packet(void* raw_context, WhistPacketType type) {
+    FATAL_ASSERT(raw_context != NULL);
     UDPContext* context = (UDPContext*)raw_context;
-    FATAL_ASSERT(context != NULL);
+    RingBuffer* ring_buffer = context->ring_buffers[type];
 
     if (context->connection_lost) {
-        return -1;
+        return NULL;
     }
 
-    // Update what the most recent start of stream ID was
-    if (start_of_stream) {
-        context->last_start_of_stream_id[packet_type] = packet_id;
-    }
+    // TODO: This function is a bit too audio/video specific,
+    // Rather than data-agnostic
 
-    // The caller should either start counting at 1,
-    // Or use -1 for a packet without an ID
-    FATAL_ASSERT(packet_id != 0);
-
-    // Get the nack_buffer, if there is one for this type of packet
-    UDPPacket* nack_buffer = NULL;
-
-    int type_index = (int)packet_type;
-    FATAL_ASSERT(type_index < NUM_PACKET_TYPES);
-    if (context->nack_buffers[type_index] != NULL) {
-        // Sending payloads that must be split into multiple packets,
-        // is only allowed for WhistPacketType's that have a nack buffer
-        // This includes allowing the application to fec_ratio at all
-        nack_buffer =
-            context->nack_buffers[type_index][packet_id % context->nack_num_buffers[type_index]];
-        // Packets that are using a nack buffer need a positive ID
-        FATAL_ASSERT(packet_id > 0);
-    }
-
-    // Construct the WhistPacket based on the parameters given
-    WhistPacket* whist_packet =
-        (WhistPacket*)allocate_region(PACKET_HEADER_SIZE + whist_packet_payload_size);
-    whist_packet->id = packet_id;
-    whist_packet->type = packet_type;
-    whist_packet->payload_size = whist_packet_payload_size;
-    memcpy(whist_packet->data, whist_packet_payload, whist_packet_payload_size);
-    int whist_packet_size = get_packet_size(whist_packet);
-
-    // Calculate number of packets needed to send the payload, rounding up.
-    int num_indices_if_no_fec =
-        (whist_packet_size == 0 ? 1 : int_div_roundup(whist_packet_size, MAX_PACKET_SEGMENT_SIZE));
-    int num_indices_if_use_fec =
-        fec_encoder_get_num_real_buffers(whist_packet_size, MAX_PACKET_SEGMENT_SIZE);
-
-    // Calculate the number of FEC packets we'll be using, if any
-    // A nack buffer is required to use FEC
-    int num_fec_packets = 0;
-    double fec_packet_ratio = context->fec_packet_ratios[packet_type];
-    if (nack_buffer && fec_packet_ratio > 0.0) {
-        num_fec_packets = get_num_fec_packets(num_indices_if_use_fec, fec_packet_ratio);
-    }
-
-    int num_indices;
-    if (num_fec_packets == 0) {
-        num_indices = num_indices_if_no_fec;
-    } else {
-        num_indices = num_indices_if_use_fec;
-    }
-
-    int num_total_packets = num_indices + num_fec_packets;
-
-// Feel free to increase this #define if the fatal assert gets triggered
-#define MAX_TOTAL_PACKETS 4096
-    char* buffers[MAX_TOTAL_PACKETS];
-    int buffer_sizes[MAX_TOTAL_PACKETS];
-    FATAL_ASSERT(num_total_packets < MAX_TOTAL_PACKETS);
-
-    // If nack buffer can't hold a packet with that many indices,
-    // OR the original buffer is illegally large
-    // OR there's no nack buffer but it's a packet that needed to be split up,
-    // THEN there's a problem and we LOG_ERROR
-    if ((nack_buffer && num_total_packets > context->nack_buffer_max_indices[type_index]) ||
-        (nack_buffer && whist_packet_size > context->nack_buffer_max_payload_size[type_index]) ||
-        (!nack_buffer && num_total_packets > 1)) {
-        LOG_ERROR("Packet is too large to send the payload! %d/%d", num_indices, num_total_packets);
-        deallocate_region(whist_packet);
-        return -1;
-    }
-
-    FECEncoder* fec_encoder = NULL;
-    if (num_fec_packets > 0) {
-        fec_encoder = create_fec_encoder(num_indices, num_fec_packets, MAX_PACKET_SEGMENT_SIZE);
-        // Pass the buffer that we'll be encoding with FEC
-        fec_encoder_register_buffer(fec_encoder, (char*)whist_packet, whist_packet_size);
-
-        WhistTimer encode_timer;
-        start_timer(&encode_timer);
-        // If using FEC, populate the UDP payload buffers with the FEC encoded buffers
-        fec_get_encoded_buffers(fec_encoder, (void**)buffers, buffer_sizes);
-        double encode_time = get_timer(&encode_timer) * MS_IN_SECOND;
-        if (LOG_FEC_ENCODE) {
-            LOG_INFO("[FEC] encoded %d original + %d redundant buffers, in %f ms", num_indices,
-                     num_fec_packets, encode_time);
-        }
-    } else {
-        // When not using FEC, split up the packets using MAX_PACKET_SEGMENT_SIZE
-        int current_position = 0;
-        for (int packet_index = 0; packet_index < num_indices; packet_index++) {
-            // Populate the buffers directly when not using FEC
-            int udp_packet_payload_size =
-                min(whist_packet_size - current_position, MAX_PACKET_SEGMENT_SIZE);
-            buffers[packet_index] = (char*)whist_packet + current_position;
-            buffer_sizes[packet_index] = udp_packet_payload_size;
-            // Progress the pointer by this payload's size
-            current_position += udp_packet_payload_size;
-        }
-        FATAL_ASSERT(current_position == whist_packet_size);
-    }
-
-    int prev_frame_num_duplicates = context->num_duplicate_packets[packet_type];
-    // Send all the packets, and write them into the nack buffer if there is one
-    for (int packet_index = 0; packet_index < num_total_packets; packet_index++) {
-        if (nack_buffer) {
-            // Lock on a per-loop basis to not starve nack() calls
-            whist_lock_mutex(context->nack_mutex[type_index]);
-        }
-
-        // The UDPPacket that we will construct
-        UDPPacket local_packet;
-        UDPPacket* packet = &local_packet;
-
-        // Potentially use the nack buffer instead though
-        if (nack_buffer) {
-            packet = &nack_buffer[packet_index];
-            context
-                ->nack_buffer_valid[type_index][packet_id % context->nack_num_buffers[type_index]]
-                                   [packet_index] = true;
-        }
-
-        // Construct the UDPPacket, potentially into the nack buffer
-        packet->type = UDP_WHIST_SEGMENT;
-        packet->udp_whist_segment_data.whist_type = packet_type;
-        packet->udp_whist_segment_data.id = packet_id;
-        packet->udp_whist_segment_data.index = (unsigned short)packet_index;
-        packet->udp_whist_segment_data.num_indices = (unsigned short)num_total_packets;
-        packet->udp_whist_segment_data.num_fec_indices = (unsigned short)num_fec_packets;
-        packet->udp_whist_segment_data.prev_frame_num_duplicates =
-            (unsigned short)prev_frame_num_duplicates;
-        packet->udp_whist_segment_data.is_a_nack = false;
-        packet->udp_whist_segment_data.is_a_duplicate = false;
-        packet->udp_whist_segment_data.segment_size = buffer_sizes[packet_index];
-
-        FATAL_ASSERT(packet->udp_whist_segment_data.segment_size <=
-                     sizeof(packet->udp_whist_segment_data.segment_data));
-        memcpy(packet->udp_whist_segment_data.segment_data, buffers[packet_index],
-               buffer_sizes[packet_index]);
-
-        // Before sending the video packets for current frame, handle any nack requests for
-        // previous frames.
-        if (packet_type == PACKET_VIDEO) {
-            udp_handle_pending_nacks(raw_context);
-        }
-
-        // Send the packet
-        // We don't need to propagate the return code because it's lossy anyway,
-        // The client will just have to nack
-        udp_send_udp_packet(context, packet);
-
-        if (nack_buffer) {
-            whist_unlock_mutex(context->nack_mutex[type_index]);
-        }
-    }
-
-    // Cleanup
-    if (fec_encoder) {
-        destroy_fec_encoder(fec_encoder);
-    }
-    deallocate_region(whist_packet);
-
-    return 0;
-}
-
-static void* udp_get_packet(void* raw_context, WhistPacketType type) {
-    FATAL_ASSERT(raw_context != NULL);
-    UDPContext* context = (UDPContext*)raw_context;
-    RingBuffer* ring_buffer = context->ring_buffers[type];
-
-    if (context->connection_lost) {
-        return NULL;
-    }
-
-    // TODO: This function is a bit too audio/video specific,
-    // Rather than data-agnostic
-
-    switch (type) {
-        case PACKET_MESSAGE: {
-            // If there's a pending whist packet,
-            if (context->has_pending_packet[PACKET_MESSAGE]) {
-                // Give them a copy, consuming the pending packet in the process
-                WhistPacket* pending_whist_packet = &context->pending_packets[PACKET_MESSAGE];
-                WhistPacket* whist_packet =
-                    (WhistPacket*)malloc(get_packet_size(pending_whist_packet));
-                memcpy(whist_packet, pending_whist_packet, get_packet_size(pending_whist_packet));
-                context->has_pending_packet[PACKET_MESSAGE] = false;
-                return whist_packet;
-            } else {
-                // Otherwise, return NULL
-                return NULL;
-            }
-            break;
-        }
-        case PACKET_GPU: {
-            if (ring_buffer->last_rendered_id == -1) {
-                ring_buffer->last_rendered_id = 0;
-            }
-            int next_to_render_id = ring_buffer->last_rendered_id + 1;
-            is_ready_to_render(ring_buffer, next_to_render_id);
-            break;
-        }
+    switch (type) {
+        case PACKET_MESSAGE: {
+            // If there's a pending whist packet,
+            if (context->has_pending_packet[PACKET_MESSAGE]) {
+                // Give them a copy, consuming the pending packet in the process
+                WhistPacket* pending_whist_packet = &context->pending_packets[PACKET_MESSAGE];
+                WhistPacket* whist_packet =
+                    (WhistPacket*)malloc(get_packet_size(pending_whist_packet));
+                memcpy(whist_packet, pending_whist_packet, get_packet_size(pending_whist_packet));
+                context->has_pending_packet[PACKET_MESSAGE] = false;
+                return whist_packet;
+            } else {
+                // Otherwise, return NULL
+                return NULL;
+            }
+            break;
+        }
+        case PACKET_GPU: {
+            if (ring_buffer->last_rendered_id == -1) {
+                ring_buffer->last_rendered_id = 0;
+            }
+            int next_to_render_id = ring_buffer->last_rendered_id + 1;
+            is_ready_to_render(ring_buffer, next_to_render_id);
+            break;
+        }
 
         case PACKET_AUDIO: {
             if (ring_buffer->last_rendered_id == -1) {
@@ -1033,11 +1543,11 @@ static void udp_destroy_socket_context(void* raw_context) {
         if (context->nack_buffers[type_id] != NULL) {
             for (int i = 0; i < context->nack_num_buffers[type_id]; i++) {
                 deallocate_region(context->nack_buffers[type_id][i]);
-                free(context->nack_buffer_valid[type_id][i]);
+                delete[] context->nack_buffer_seqs[type_id][i];
             }
             free(context->nack_buffers[type_id]);
-            free(context->nack_buffer_valid[type_id]);
-            whist_destroy_mutex(context->nack_mutex[type_id]);
+            free(context->nack_buffer_seqs[type_id]);
+            deallocate_region(context->fec_input_buffers[type_id]);
             context->nack_buffers[type_id] = NULL;
         }
     }
@@ -1053,18 +1563,32 @@ static void udp_destroy_socket_context(void* raw_context) {
     // Destroy the mutexes
     whist_destroy_mutex(context->timestamp_mutex);
     whist_destroy_mutex(context->congestion_control_mutex);
+    whist_destroy_mutex(context->compact_header_mutex);
+    whist_destroy_mutex(context->nack_notify_mutex);
+    whist_destroy_mutex(context->egress_mutex);
 
+    if (context->ring != NULL) {
+        udp_ring_destroy(context->ring);
+    }
     closesocket(context->socket);
     if (context->fec_controller != NULL) {
         destroy_fec_controller(context->fec_controller);
     }
+    destroy_congestion_controller(context->congestion_controller);
     if (context->network_throttler != NULL) {
         network_throttler_destroy(context->network_throttler);
     }
     if (context->nack_queue != NULL) {
         fifo_queue_destroy((QueueContext*)context->nack_queue);
     }
+    egress_scheduler_destroy(context->egress_scheduler);
+    free(context->frame_packet_sizes);
+    free(context->frame_departure_times);
     whist_destroy_mutex(context->mutex);
+    aes_session_destroy(context->aes_session);
+    free(context->recv_batch);
+    free(context->send_batch);
+    free(context->send_batch_copies);
     free(context);
 }
 
@@ -1083,11 +1607,23 @@ bool create_udp_socket_context(SocketContext* network_context, const char* desti
     // Create the UDPContext, and set to zero
     UDPContext* context = (UDPContext*)safe_malloc(sizeof(UDPContext));
     memset(context, 0, sizeof(UDPContext));
+    context->recv_batch =
+        (UDPNetworkPacket*)safe_malloc(sizeof(UDPNetworkPacket) * UDP_RECV_BATCH_SIZE);
+    context->send_batch =
+        (UDPNetworkPacket*)safe_malloc(sizeof(UDPNetworkPacket) * UDP_SEND_BATCH_SIZE);
+    context->send_batch_copies = (UDPPacket*)safe_malloc(sizeof(UDPPacket) * UDP_SEND_BATCH_SIZE);
+    context->batched_send = UDP_BATCHED_SEND_DEFAULT;
+    context->segment_size = DEFAULT_PACKET_SEGMENT_SIZE;
     // Create the mutex
     context->timestamp_mutex = whist_create_mutex();
     context->congestion_control_mutex = whist_create_mutex();
+    context->compact_header_mutex = whist_create_mutex();
+    context->nack_notify_mutex = whist_create_mutex();
+    context->egress_mutex = whist_create_mutex();
     context->last_ping_id = -1;
     context->last_pong_id = -1;
+    congestion_feedback_init(&context->congestion_feedback);
+    transport_feedback_builder_init(&context->transport_feedback_builder, current_time_us());
     // Whether or not we've ever connected
     context->connected = false;
     // Whether or not we've connected, but then lost the connection
@@ -1109,10 +1645,15 @@ bool create_udp_socket_context(SocketContext* network_context, const char* desti
     context->mutex = whist_create_mutex();
     memcpy(context->binary_aes_private_key, binary_aes_private_key,
            sizeof(context->binary_aes_private_key));
+    context->aes_session = aes_session_create(context->binary_aes_private_key);
+    FATAL_ASSERT(context->aes_session != NULL);
     for (int i = 0; i < NUM_PACKET_TYPES; i++) {
         context->reset_data[i].greatest_failed_id = -1;
         context->reset_data[i].pending_stream_reset = true;
         context->fec_packet_ratios[i] = 0.0;
+        for (int j = 0; j < NUM_FEC_PROTECTION_CLASSES; j++) {
+            context->fec_class_bytes[i][j] = 0.0;
+        }
     }
 
     int ret;
@@ -1122,8 +1663,7 @@ bool create_udp_socket_context(SocketContext* network_context, const char* desti
         if (ret == 0) {
             // On the server, we create a network throttler to limit the
             // outgoing bitrate.
-            context->network_throttler =
-                network_throttler_create(UDP_NETWORK_THROTTLER_BUCKET_MS, true);
+            context->network_throttler = network_throttler_create(UDP_NETWORK_THROTTLER_GROUP_MS);
             // When creating a network throttler to throttle high-bandwidth,
             // we also want to ensure the send buffer size is large enough
             int a = UDP_SEND_BUFFER_SIZE;
@@ -1139,6 +1679,13 @@ bool create_udp_socket_context(SocketContext* network_context, const char* desti
         ret = create_udp_client_context(context, destination, port, connection_timeout_ms);
         if (ret == 0) {
             context->fec_controller = create_fec_controller(get_timestamp_sec());
+            context->congestion_controller =
+                create_congestion_controller(NULL, context->fec_controller);
+            if (context->congestion_controller == NULL) {
+                destroy_fec_controller(context->fec_controller);
+                closesocket(context->socket);
+                ret = -1;
+            }
         }
     }
 
@@ -1155,9 +1702,29 @@ bool create_udp_socket_context(SocketContext* network_context, const char* desti
         context->connected = true;
         // Restore the socket's timeout
         set_timeout(context->socket, context->timeout);
+        // Now that the handshake is over, hand the socket over to io_uring if requested
+        if (use_io_uring) {
+            context->ring = udp_ring_create(
+                context->socket, context->send_batch,
+                sizeof(UDPNetworkPacket) * UDP_SEND_BATCH_SIZE, UDP_SEND_BATCH_SIZE,
+                (int)sizeof(UDPNetworkPacket), UDP_RECV_BATCH_SIZE);
+            if (context->ring != NULL) {
+                LOG_INFO("Using io_uring for the UDP socket");
+            } else {
+                LOG_WARNING("io_uring isn't supported, falling back to regular UDP syscalls");
+            }
+        }
+        // io_uring's sends don't carry departure times, so they're paced in userspace
+        if (use_txtime && context->network_throttler != NULL && context->ring == NULL) {
+            context->use_txtime = udp_enable_txtime(context);
+        }
         return true;
     } else {
         memset(network_context, 0, sizeof(*network_context));
+        aes_session_destroy(context->aes_session);
+        free(context->recv_batch);
+        free(context->send_batch);
+        free(context->send_batch_copies);
         free(context);
         return false;
     }
@@ -1175,8 +1742,9 @@ void udp_register_nack_buffer(SocketContext* socket_context, WhistPacketType typ
     FATAL_ASSERT(0 <= type_index && type_index < NUM_PACKET_TYPES);
     FATAL_ASSERT(context->nack_buffers[type_index] == NULL);
 
-    // Get max original IDs possible, based off of max payload size and segment size
-    int max_original_ids = max_payload_size / MAX_PACKET_SEGMENT_SIZE + 1;
+    // Get max original IDs possible, based off of max payload size and the smallest segment size
+    // that the path MTU may call for
+    int max_original_ids = max_payload_size / MIN_PACKET_SEGMENT_SIZE + 1;
     // Get max FEC ids possible, based on MAX_FEC_RATIO
     int max_fec_ids = get_num_fec_packets(max_original_ids, MAX_FEC_RATIO);
 
@@ -1187,24 +1755,30 @@ void udp_register_nack_buffer(SocketContext* socket_context, WhistPacketType typ
     // Memory isn't an issue here, because we'll use our region allocator,
     // so unused memory never gets allocated by the kernel
     context->nack_buffers[type_index] = (UDPPacket**)malloc(sizeof(UDPPacket*) * num_buffers);
-    context->nack_buffer_valid[type_index] = (bool**)malloc(sizeof(bool*) * num_buffers);
-    context->nack_mutex[type_index] = whist_create_mutex();
+    context->nack_buffer_seqs[type_index] =
+        (std::atomic<uint32_t>**)malloc(sizeof(std::atomic<uint32_t>*) * num_buffers);
     context->nack_num_buffers[type_index] = num_buffers;
     // This is just used to sanitize the pre-FEC buffer that's passed into send_packet
     context->nack_buffer_max_payload_size[type_index] = max_payload_size;
     context->nack_buffer_max_indices[type_index] = max_num_ids;
+    // The server's video goes through the egress scheduler, which must hold a whole frame of
+    // the most segments that the client accepts, or every NACK of the nack queue
+    if (type == PACKET_VIDEO && context->network_throttler != NULL) {
+        context->egress_scheduler = egress_scheduler_create(MAX_PACKETS, MAX_QUEUED_NACKS);
+        context->frame_packet_sizes = (size_t*)safe_malloc(sizeof(size_t) * MAX_PACKETS);
+        context->frame_departure_times =
+            (timestamp_us*)safe_malloc(sizeof(timestamp_us) * MAX_PACKETS);
+    }
+    // Only the pages that FEC actually uses will be allocated
+    context->fec_input_buffers[type_index] = (char*)allocate_region(max_payload_size);
 
     // Allocate each nack buffer, based on num_buffers
     for (int i = 0; i < num_buffers; i++) {
         // Allocate a buffer of max_num_ids WhistPacket's
         context->nack_buffers[type_index][i] =
             (UDPPacket*)allocate_region(sizeof(UDPPacket) * max_num_ids);
-        // Allocate nack buffer validity
-        // We hold this separately, since writing anything to the region causes it to allocate
-        context->nack_buffer_valid[type_index][i] = (bool*)malloc(sizeof(bool) * max_num_ids);
-        for (int j = 0; j < max_num_ids; j++) {
-            context->nack_buffer_valid[type_index][i][j] = false;
-        }
+        // Allocate the seqlocks, zero-initialized to mark the UDPPackets as never written
+        context->nack_buffer_seqs[type_index][i] = new std::atomic<uint32_t>[max_num_ids]();
     }
 }
 
@@ -1276,7 +1850,7 @@ void udp_register_ring_buffer(SocketContext* socket_context, WhistPacketType typ
 
     context->ring_buffers[type_index] =
         init_ring_buffer(type, max_frame_size, num_buffers, socket_context, udp_nack_packet,
-                         udp_request_stream_reset);
+                         udp_nack_packets, udp_request_stream_reset);
 
     // We'll want to increase the UDP buffer size,
     // when we know we may be accepting high-volume packets
@@ -1328,11 +1902,43 @@ void udp_resend_packet(SocketContext* socket_context, WhistPacketType type, int
         return;
     }
 
+    if (type == PACKET_VIDEO && context->egress_scheduler != NULL) {
+        // Video duplicates are probes, which only go out once nothing else is queued,
+        // and are only counted once they do
+        whist_lock_mutex(context->egress_mutex);
+        EgressPacket egress_packet = {id, index, current_time_us(), 0};
+        egress_scheduler_enqueue(context->egress_scheduler, EGRESS_CLASS_PROBE, &egress_packet);
+        udp_send_egress_packets(context, NULL);
+        whist_unlock_mutex(context->egress_mutex);
+        return;
+    }
     context->num_duplicate_packets[type]++;
     // Treat this the same as a nack, but set duplicate flag as true
     udp_handle_nack(context, type, id, index, true);
 }
 
+bool udp_send_probe_parity(SocketContext* socket_context, int id) {
+    FATAL_ASSERT(socket_context != NULL);
+    FATAL_ASSERT(socket_context->context != NULL);
+    UDPContext* context = (UDPContext*)socket_context->context;
+
+    if (context->connection_lost || context->egress_scheduler == NULL) {
+        return false;
+    }
+
+    whist_lock_mutex(context->egress_mutex);
+    bool has_probe_parity = context->probe_parity_id == id &&
+                            context->next_probe_parity_index < context->probe_parity_end_index;
+    if (has_probe_parity) {
+        EgressPacket egress_packet = {id, context->next_probe_parity_index++, current_time_us(),
+                                      0};
+        egress_scheduler_enqueue(context->egress_scheduler, EGRESS_CLASS_PROBE, &egress_packet);
+        udp_send_egress_packets(context, NULL);
+    }
+    whist_unlock_mutex(context->egress_mutex);
+    return has_probe_parity;
+}
+
 void udp_reset_duplicate_packet_counter(SocketContext* socket_context, WhistPacketType type) {
     UDPContext* context = (UDPContext*)socket_context->context;
     context->num_duplicate_packets[type] = 0;
@@ -1340,29 +1946,65 @@ void udp_reset_duplicate_packet_counter(SocketContext* socket_context, WhistPack
 
 int udp_get_num_indices(SocketContext* socket_context, WhistPacketType type, int packet_id) {
     UDPContext* context = (UDPContext*)socket_context->context;
-    UDPPacket* packet =
-        &context->nack_buffers[type][packet_id % context->nack_num_buffers[type]][0];
-    if (packet->udp_whist_segment_data.id == packet_id) {
-        return packet->udp_whist_segment_data.num_indices;
+    UDPPacket packet;
+    if (!udp_read_nack_buffer(context, type, packet_id, 0, &packet)) {
+        LOG_WARNING("%s packet %d not found", type == PACKET_VIDEO ? "video" : "audio",
+                    packet_id);
+        return -1;
+    }
+    if (packet.udp_whist_segment_data.id == packet_id) {
+        return packet.udp_whist_segment_data.num_indices;
     } else {
         LOG_WARNING("%s packet %d not found, ID %d was located instead.",
                     type == PACKET_VIDEO ? "video" : "audio", packet_id,
-                    packet->udp_whist_segment_data.id);
+                    packet.udp_whist_segment_data.id);
         return -1;
     }
 }
 
 bool udp_handle_pending_nacks(void* raw_context) {
     UDPContext* context = (UDPContext*)raw_context;
-    NackID nack_id;
-    bool ret = false;
-    while (fifo_queue_dequeue_item((QueueContext*)context->nack_queue, &nack_id) != -1) {
-        udp_handle_nack(context, PACKET_VIDEO, nack_id.frame_id, nack_id.packet_index, false);
-        ret = true;
+    if (context->egress_scheduler == NULL) {
+        // Video NACKs can't be answered without a video nack buffer
+        return false;
     }
+    whist_lock_mutex(context->egress_mutex);
+    bool ret = udp_queue_pending_nacks(context);
+    udp_send_egress_packets(context, NULL);
+    whist_unlock_mutex(context->egress_mutex);
     return ret;
 }
 
+void udp_set_nack_notify(SocketContext* socket_context, UDPNackNotifyFn notify, void* data) {
+    UDPContext* context = (UDPContext*)socket_context->context;
+    whist_lock_mutex(context->nack_notify_mutex);
+    context->nack_notify = notify;
+    context->nack_notify_data = data;
+    whist_unlock_mutex(context->nack_notify_mutex);
+}
+
+int udp_send_packet_chunks(SocketContext* socket_context, WhistPacketType packet_type,
+                           const UDPPayloadChunk* chunks, int num_chunks, int packet_id,
+                           bool start_of_stream, FECProtectionClass protection_class) {
+    FATAL_ASSERT(socket_context != NULL);
+    return udp_send_payload_chunks((UDPContext*)socket_context->context, packet_type, chunks,
+                                   num_chunks, packet_id, start_of_stream, protection_class);
+}
+
+void udp_set_batched_send(SocketContext* socket_context, bool batched_send) {
+    UDPContext* context = (UDPContext*)socket_context->context;
+    context->batched_send = batched_send;
+}
+
+int udp_get_segment_size(SocketContext* socket_context) {
+    UDPContext* context = (UDPContext*)socket_context->context;
+    return context->segment_size;
+}
+
+void udp_set_simulated_path_mtu(int mtu) { simulated_path_mtu = mtu; }
+
+void udp_set_use_io_uring(bool use) { use_io_uring = use; }
+
 void udp_handle_resize(SocketContext* socket_context, int dpi) {
     UDPContext* context = (UDPContext*)socket_context->context;
     if (context == NULL) {
@@ -1372,8 +2014,9 @@ void udp_handle_resize(SocketContext* socket_context, int dpi) {
     network_algo_set_dpi(dpi);
     NetworkSettings starting_network_settings = get_starting_network_settings();
     // If the current bitrate is lesser than the starting bitrate of the new screen, use the
-    // new starting bitrate to avoid pixelation
-    if (context->network_settings.video_bitrate < starting_network_settings.video_bitrate) {
+    // new starting bitrate to avoid pixelation. With transport feedback, that's up to the server.
+    if (!use_transport_feedback &&
+        context->network_settings.video_bitrate < starting_network_settings.video_bitrate) {
         context->network_settings = starting_network_settings;
         send_desired_network_settings(context);
     }
@@ -1416,7 +2059,7 @@ int create_udp_server_context(UDPContext* context, int port, int connection_time
         }
         // Check to see if we received a UDP_CONNECTION_ATTEMPT
         UDPPacket client_packet;
-        if (udp_get_udp_packet(context, &client_packet, NULL, NULL)) {
+        if (udp_get_udp_packet(context, &client_packet, NULL, NULL, NULL)) {
             if (client_packet.type == UDP_CONNECTION_ATTEMPT) {
                 received_connection_attempt = true;
             }
@@ -1446,8 +2089,19 @@ int create_udp_server_context(UDPContext* context, int port, int connection_time
         confirmation_packet.type = UDP_CONNECTION_CONFIRMATION;
         udp_send_udp_packet(context, &confirmation_packet);
     }
-    context->nack_queue =
-        fifo_queue_create(sizeof(NackID), VIDEO_NACKBUFFER_SIZE * MAX_VIDEO_PACKETS);
+
+    // Size the segments to the path MTU, so that they don't get IP-fragmented
+    int path_mtu = udp_probe_path_mtu(context);
+    if (path_mtu > 0) {
+        int segment_size = UDP_SEGMENT_SIZE_FOR_MTU(path_mtu);
+        context->segment_size =
+            min(max(segment_size, MIN_PACKET_SEGMENT_SIZE), MAX_PACKET_SEGMENT_SIZE);
+        LOG_INFO("Path MTU to the client is %d, using %d byte segments", path_mtu,
+                 context->segment_size);
+    } else {
+        LOG_WARNING("Path MTU discovery failed, using %d byte segments", context->segment_size);
+    }
+    context->nack_queue = fifo_queue_create(sizeof(NackID), MAX_QUEUED_NACKS);
 
     // Connection successful!
     LOG_INFO("Client received on %d from %s:%d over UDP!\n", port,
@@ -1508,7 +2162,7 @@ int create_udp_client_context(UDPContext* context, const char* destination, int
         }
         // Check to see if we received a UDP_CONNECTION_CONFIRMATION
         UDPPacket server_response;
-        if (udp_get_udp_packet(context, &server_response, NULL, NULL)) {
+        if (udp_get_udp_packet(context, &server_response, NULL, NULL, NULL)) {
             if (server_response.type == UDP_CONNECTION_CONFIRMATION) {
                 connection_succeeded = true;
             }
@@ -1523,6 +2177,9 @@ int create_udp_client_context(UDPContext* context, const char* destination, int
         return -1;
     }
 
+    // Let the server find out how large its segments can be
+    udp_answer_path_mtu_probes(context);
+
     // Mark as successfully connected
     LOG_INFO("Connected to %s:%d over UDP! (Private %d)\n",
              inet_ntoa(context->connection_addr.sin_addr), port,
@@ -1531,6 +2188,96 @@ int create_udp_client_context(UDPContext* context, const char* destination, int
     return 0;
 }
 
+int udp_probe_path_mtu(UDPContext* context) {
+#if OS_IS(OS_LINUX)
+    // Set the Don't Fragment bit on the probes, ignoring the kernel's cached path MTU,
+    // so that a probe that's too large for the path gets dropped instead of fragmented
+    int old_mtu_discover;
+    socklen_t old_mtu_discover_len = sizeof(old_mtu_discover);
+    bool restore_mtu_discover = getsockopt(context->socket, IPPROTO_IP, IP_MTU_DISCOVER,
+                                           &old_mtu_discover, &old_mtu_discover_len) == 0;
+    int mtu_discover = IP_PMTUDISC_PROBE;
+    if (setsockopt(context->socket, IPPROTO_IP, IP_MTU_DISCOVER, &mtu_discover,
+                   sizeof(mtu_discover)) == -1) {
+        LOG_WARNING("Failed to set IP_MTU_DISCOVER: %d", get_last_network_error());
+    }
+#else
+    // Elsewhere, fragmented probes get through, and we end up with the largest segment size
+#endif
+
+    int largest_mtu = -1;
+    for (int attempt = 0; attempt < UDP_PATH_MTU_PROBE_ATTEMPTS && largest_mtu == -1; attempt++) {
+        for (int i = 0; i < (int)ARRAY_LENGTH(udp_path_mtu_candidates); i++) {
+            // Zero-initialize the padding, which is encrypted and sent too
+            UDPPacket probe = {};
+            probe.type = UDP_PATH_MTU_PROBE;
+            probe.udp_path_mtu_probe_data.mtu = udp_path_mtu_candidates[i];
+            udp_send_udp_packet(context, &probe);
+        }
+
+        // Collect the acks of this round, until the largest probe gets acked
+        WhistTimer probe_timer;
+        start_timer(&probe_timer);
+        double elapsed_ms;
+        while ((elapsed_ms = get_timer(&probe_timer) * MS_IN_SECOND) <
+                   UDP_PATH_MTU_PROBE_INTERVAL_MS &&
+               largest_mtu != udp_path_mtu_candidates[0]) {
+            set_timeout(context->socket, (int)(UDP_PATH_MTU_PROBE_INTERVAL_MS - elapsed_ms));
+            UDPPacket response;
+            if (udp_get_udp_packet(context, &response, NULL, NULL, NULL) &&
+                response.type == UDP_PATH_MTU_PROBE_ACK) {
+                largest_mtu = max(largest_mtu, response.udp_path_mtu_probe_data.mtu);
+            }
+        }
+    }
+
+#if OS_IS(OS_LINUX)
+    if (restore_mtu_discover) {
+        setsockopt(context->socket, IPPROTO_IP, IP_MTU_DISCOVER, &old_mtu_discover,
+                   sizeof(old_mtu_discover));
+    }
+#endif
+
+    // Let the client stop waiting for probes.
+    // We send several, as a best attempt against the Two Generals' Problem
+    for (int i = 0; i < NUM_CONFIRMATION_MESSAGES; i++) {
+        UDPPacket done_packet;
+        done_packet.type = UDP_PATH_MTU_PROBE_DONE;
+        done_packet.udp_path_mtu_probe_data.mtu = largest_mtu;
+        udp_send_udp_packet(context, &done_packet);
+    }
+
+    return largest_mtu;
+}
+
+void udp_answer_path_mtu_probes(UDPContext* context) {
+    WhistTimer answer_timer;
+    start_timer(&answer_timer);
+    int largest_mtu = -1;
+    double elapsed_ms;
+    while ((elapsed_ms = get_timer(&answer_timer) * MS_IN_SECOND) <
+           UDP_PATH_MTU_PROBE_TIMEOUT_MS) {
+        set_timeout(context->socket, (int)(UDP_PATH_MTU_PROBE_TIMEOUT_MS - elapsed_ms));
+        UDPPacket packet;
+        if (!udp_get_udp_packet(context, &packet, NULL, NULL, NULL)) {
+            continue;
+        }
+        if (packet.type == UDP_PATH_MTU_PROBE) {
+            // Always ack with the largest probe so far, in case earlier acks get lost
+            largest_mtu = max(largest_mtu, packet.udp_path_mtu_probe_data.mtu);
+            UDPPacket ack_packet;
+            ack_packet.type = UDP_PATH_MTU_PROBE_ACK;
+            ack_packet.udp_path_mtu_probe_data.mtu = largest_mtu;
+            udp_send_udp_packet(context, &ack_packet);
+        } else if (packet.type == UDP_PATH_MTU_PROBE_DONE) {
+            LOG_INFO("The server found a path MTU of %d", packet.udp_path_mtu_probe_data.mtu);
+            return;
+        }
+    }
+    LOG_WARNING("The server didn't finish path MTU discovery within %dms",
+                UDP_PATH_MTU_PROBE_TIMEOUT_MS);
+}
+
 int get_udp_packet_size(UDPPacket* udp_packet) {
     switch (udp_packet->type) {
         case UDP_WHIST_SEGMENT: {
@@ -1541,9 +2288,9 @@ int get_udp_packet_size(UDPPacket* udp_packet) {
             return offsetof(UDPPacket, udp_nack_data) + sizeof(udp_packet->udp_nack_data);
         }
         case UDP_BITARRAY_NACK: {
-            // TODO: Only use bitarray_nack.numBits / 8
-            return offsetof(UDPPacket, udp_bitarray_nack_data) +
-                   sizeof(udp_packet->udp_bitarray_nack_data);
+            int num_bits = udp_packet->udp_bitarray_nack_data.numBits;
+            return offsetof(UDPPacket, udp_bitarray_nack_data.ba_raw) +
+                   BITS_TO_CHARS(max(min(num_bits, MAX_VIDEO_PACKETS), 1));
         }
         case UDP_STREAM_RESET: {
             return offsetof(UDPPacket, udp_stream_reset_data) +
@@ -1564,6 +2311,24 @@ int get_udp_packet_size(UDPPacket* udp_packet) {
             // This should include only the MetaData
             return offsetof(UDPPacket, udp_whist_segment_data);
         }
+        case UDP_PATH_MTU_PROBE: {
+            // Probes are padded to fill an IP packet of their MTU.
+            // The largest candidate MTU fills the whole UDPPacket.
+            return udp_packet->udp_path_mtu_probe_data.mtu - UDP_IP_HEADER_SIZE -
+                   UDPNETWORKPACKET_HEADER_SIZE;
+        }
+        case UDP_PATH_MTU_PROBE_ACK:
+        case UDP_PATH_MTU_PROBE_DONE: {
+            return offsetof(UDPPacket, udp_path_mtu_probe_data) +
+                   sizeof(udp_packet->udp_path_mtu_probe_data);
+        }
+        case UDP_TRANSPORT_FEEDBACK: {
+            int num_packets = max(min(udp_packet->udp_transport_feedback_data.num_packets,
+                                      TRANSPORT_FEEDBACK_MAX_PACKETS),
+                                  0);
+            return offsetof(UDPPacket, udp_transport_feedback_data) +
+                   TRANSPORT_FEEDBACK_SIZE(num_packets);
+        }
         default: {
             LOG_FATAL("Unknown UDP Packet Type: %d", udp_packet->type);
         }
@@ -1576,16 +2341,11 @@ int get_udp_packet_size(UDPPacket* udp_packet) {
 // Don't call this function in hotpath for video packets, as it can wait in throttle.
 int udp_send_udp_packet(UDPContext* context, UDPPacket* udp_packet) {
     FATAL_ASSERT(context != NULL);
-    int udp_packet_size = get_udp_packet_size(udp_packet);
-    bool throttle = false;
-    if (udp_packet->type == UDP_WHIST_SEGMENT) {
-        udp_packet->udp_whist_segment_data.departure_time = current_time_us();
-        // Throttle only video packet. Audio packets are very small and run on reserved bandwidth
-        // and ping/pong packets use negligible bandwidth.
-        if (udp_packet->udp_whist_segment_data.whist_type == PACKET_VIDEO) {
-            throttle = true;
-        }
-    }
+    int udp_packet_size = udp_get_wire_packet_size(udp_packet);
+    // Throttle only video packet. Everything else outranks video, so it's sent right away,
+    // and only takes its share of the bitrate, see egress_scheduler.h.
+    bool throttle = udp_packet->type == UDP_WHIST_SEGMENT &&
+                    udp_packet->udp_whist_segment_data.whist_type == PACKET_VIDEO;
 
     // NOTE: This doesn't interfere with clientside hotpath,
     // since the throttler only throttles the serverside
@@ -1593,22 +2353,15 @@ int udp_send_udp_packet(UDPContext* context, UDPPacket* udp_packet) {
         udp_packet->group_id = network_throttler_wait_byte_allocation(
             context->network_throttler, (size_t)(UDPNETWORKPACKET_HEADER_SIZE + udp_packet_size));
     }
-
-    UDPNetworkPacket udp_network_packet;
-    if (FEATURE_ENABLED(PACKET_ENCRYPTION)) {
-        // Encrypt the packet during normal operation
-        int encrypted_len =
-            (int)encrypt_packet(udp_network_packet.payload, &udp_network_packet.aes_metadata,
-                                udp_packet, udp_packet_size, context->binary_aes_private_key);
-        udp_network_packet.payload_size = encrypted_len;
-    } else {
-        // Or, just memcpy the segment if PACKET_ENCRYPTION is disabled
-        memcpy(udp_network_packet.payload, udp_packet, udp_packet_size);
-        udp_network_packet.payload_size = udp_packet_size;
+    if (udp_packet->type == UDP_WHIST_SEGMENT) {
+        udp_packet->udp_whist_segment_data.departure_time = current_time_us();
     }
 
+    UDPNetworkPacket udp_network_packet;
     // The size of the udp packet that actually needs to be sent over the network
-    int udp_network_packet_size = UDPNETWORKPACKET_HEADER_SIZE + udp_network_packet.payload_size;
+    int udp_network_packet_size;
+    udp_encrypt_udp_packets(context, &udp_packet, &udp_network_packet, &udp_network_packet_size,
+                            1);
 
     // If sending fails because of no buffer space available on the system, retry a few times.
     for (int i = 0; i < RETRIES_ON_BUFFER_FULL; i++) {
@@ -1645,127 +2398,1040 @@ int udp_send_udp_packet(UDPContext* context, UDPPacket* udp_packet) {
         }
     }
 
-    // If encryption has added any extra bytes due to padding, then network throttler should be
-    // called again to adjust for these extra bytes, so that the requested bitrate limit is not
-    // exceeded.
+    // If encryption has added any extra bytes due to padding, then the packets that are scheduled
+    // next are pushed back to adjust for these extra bytes, so that the requested bitrate limit is
+    // not exceeded.
     if (throttle && udp_network_packet.payload_size > udp_packet_size) {
-        network_throttler_wait_byte_allocation(context->network_throttler,
-                                               udp_network_packet.payload_size - udp_packet_size);
+        network_throttler_charge_bytes(context->network_throttler,
+                                       udp_network_packet.payload_size - udp_packet_size);
+    } else if (!throttle) {
+        network_throttler_charge_bytes(context->network_throttler,
+                                       (size_t)udp_network_packet_size);
     }
     return 0;
 }
 
-static bool udp_get_udp_packet(UDPContext* context, UDPPacket* udp_packet,
-                               timestamp_us* arrival_time, int* network_payload_size) {
-    // Wait to receive a packet over UDP, until timing out
-    UDPNetworkPacket udp_network_packet;
-    socklen_t slen = sizeof(context->last_addr);
-
-    static double last_time_after_recv = 0;
+int udp_send_payload_chunks(UDPContext* context, WhistPacketType packet_type,
+                            const UDPPayloadChunk* chunks, int num_chunks, int packet_id,
+                            bool start_of_stream, FECProtectionClass protection_class) {
+    FATAL_ASSERT(context != NULL);
 
-    if (PLOT_UDP_RECV_GAP) {
-        double current_time = get_timestamp_sec();
-        double gap = current_time - last_time_after_recv;
-        whist_plotter_insert_sample("udp_recv_gap", current_time, gap * MS_IN_SECOND);
+    if (context->connection_lost) {
+        return -1;
     }
 
-    int recv_len =
-        recvfrom_no_intr(context->socket, &udp_network_packet, sizeof(udp_network_packet), 0,
-                         (struct sockaddr*)(&context->last_addr), &slen);
-
-    if (PLOT_UDP_RECV_GAP) {
-        last_time_after_recv = get_timestamp_sec();
+    // Update what the most recent start of stream ID was
+    if (start_of_stream) {
+        context->last_start_of_stream_id[packet_type] = packet_id;
     }
 
-    if (context->connected) {
-        // TODO: Compare last_addr, with connection_addr, more accurately than memcmp
-        // Not strictly necessary, since we validate decryption anyway
-    }
+    // The caller should either start counting at 1,
+    // Or use -1 for a packet without an ID
+    FATAL_ASSERT(packet_id != 0);
 
-    // If the packet was successfully received, decrypt and process it it
-    if (recv_len > 0) {
-        int decrypted_len;
+    // Get the nack_buffer, if there is one for this type of packet
+    UDPPacket* nack_buffer = NULL;
 
-        // Tracks arrival time for congestion control algo
-        if (arrival_time) {
-            *arrival_time = current_time_us();
-        }
-
-        // Verify the reported packet length
-        // This is before the `decrypt_packet` call, so the packet might be malicious
-        // ~ We check recv_len against UDPNETWORKPACKET_HEADER_SIZE first, to ensure that
-        //  the access to udp_network_packet.{payload_size/aes_metadata} is in-bounds
-        // ~ We check bounds on udp_network_packet.payload_size, so that the
-        //  the addition check on payload_size doesn't maliciously overflow
-        // ~ We make an addition check, to ensure that the payload_size matches recv_len
-        if (recv_len < UDPNETWORKPACKET_HEADER_SIZE || udp_network_packet.payload_size < 0 ||
-            (int)sizeof(udp_network_packet.payload) < udp_network_packet.payload_size ||
-            UDPNETWORKPACKET_HEADER_SIZE + udp_network_packet.payload_size != recv_len) {
-            LOG_WARNING("The UDPPacket's payload size %d doesn't agree with recv_len %d!",
-                        udp_network_packet.payload_size, recv_len);
-            return false;
-        }
+    int type_index = (int)packet_type;
+    FATAL_ASSERT(type_index < NUM_PACKET_TYPES);
+    if (context->nack_buffers[type_index] != NULL) {
+        // Sending payloads that must be split into multiple packets,
+        // is only allowed for WhistPacketType's that have a nack buffer
+        // This includes allowing the application to fec_ratio at all
+        nack_buffer =
+            context->nack_buffers[type_index][packet_id % context->nack_num_buffers[type_index]];
+        // Packets that are using a nack buffer need a positive ID
+        FATAL_ASSERT(packet_id > 0);
+    }
 
-        if (FEATURE_ENABLED(PACKET_ENCRYPTION)) {
-            // Decrypt the packet, into udp_packet
-            decrypted_len =
-                decrypt_packet(udp_packet, sizeof(UDPPacket), udp_network_packet.aes_metadata,
-                               udp_network_packet.payload, udp_network_packet.payload_size,
-                               context->binary_aes_private_key);
-            // If there was an issue decrypting it, warn and return NULL
-            if (decrypted_len < 0) {
-                // This is warning, since it could just be someone else sending packets,
-                // Not necessarily our fault
-                LOG_WARNING("Failed to decrypt packet");
-                return false;
-            }
-            // AFTER THIS LINE,
-            // The contents of udp_packet are confirmed to be from the server,
-            // And thus can be trusted as not maliciously formed.
-        } else {
-            // The decrypted packet is just in the payload, during no-encryption dev mode
-            decrypted_len = udp_network_packet.payload_size;
-            memcpy(udp_packet, udp_network_packet.payload, udp_network_packet.payload_size);
-        }
-        if (LOG_NETWORKING) {
-            LOG_INFO("Received a WhistPacket of size %d over UDP", decrypted_len);
-        }
-        if (network_payload_size) {
-            *network_payload_size =
-                (UDPNETWORKPACKET_HEADER_SIZE + udp_network_packet.payload_size);
-        }
+    // Construct the WhistPacket's header based on the parameters given.
+    // Its payload stays scattered across the given chunks, and is only ever copied
+    // into its segments.
+    FATAL_ASSERT(0 < num_chunks && num_chunks + 2 <= MAX_PAYLOAD_CHUNKS);
+    int whist_packet_payload_size = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        whist_packet_payload_size += chunks[i].size;
+    }
+    WhistPacket whist_packet_header;
+    whist_packet_header.id = packet_id;
+    whist_packet_header.type = packet_type;
+    whist_packet_header.payload_size = whist_packet_payload_size;
+    int whist_packet_size = get_packet_size(&whist_packet_header);
+
+    SegmentedPayload payload;
+    payload.type = packet_type;
+    payload.id = packet_id;
+    // PACKET_HEADER_SIZE counts the struct's tail padding, which a contiguous WhistPacket sends
+    // after its data, so the header chunk stops where data[] starts and zeroes make up the rest
+    static const char whist_packet_padding[PACKET_HEADER_SIZE] = {0};
+    int header_size = (int)offsetof(WhistPacket, data);
+    payload.reader.chunks[0].data = &whist_packet_header;
+    payload.reader.chunks[0].size = header_size;
+    memcpy(&payload.reader.chunks[1], chunks, sizeof(UDPPayloadChunk) * num_chunks);
+    payload.reader.chunks[num_chunks + 1].data = whist_packet_padding;
+    payload.reader.chunks[num_chunks + 1].size = (int)PACKET_HEADER_SIZE - header_size;
+    payload.reader.num_chunks = num_chunks + 2;
+    payload.reader.chunk_index = 0;
+    payload.reader.chunk_offset = 0;
+
+    // Packets that get split up use the segment size that fits the path MTU,
+    // while packets without a nack buffer must fit in a single segment of any size
+    int segment_size = nack_buffer ? context->segment_size : MAX_PACKET_SEGMENT_SIZE;
+    payload.segment_stride = segment_size;
 
-        // Verify the UDP Packet's size
-        FATAL_ASSERT(decrypted_len == get_udp_packet_size(udp_packet));
+    // Calculate number of packets needed to send the payload, rounding up.
+    int num_indices_if_no_fec =
+        (whist_packet_size == 0 ? 1 : int_div_roundup(whist_packet_size, segment_size));
+    int num_indices_if_use_fec = fec_encoder_get_num_real_buffers(whist_packet_size, segment_size);
 
-        return true;
+    // Calculate the number of FEC packets we'll be using, if any
+    // A nack buffer is required to use FEC
+    // The type's fec ratio is split between the protection classes, so that more important
+    // packets get more of it, without changing how much FEC is sent overall
+    int num_fec_packets = 0;
+    double fec_packet_ratio = context->fec_packet_ratios[packet_type];
+    if (nack_buffer) {
+        fec_controller_record_class_bytes(context->fec_class_bytes[type_index], protection_class,
+                                          whist_packet_size);
+    }
+    if (nack_buffer && fec_packet_ratio > 0.0) {
+        double class_fec_ratios[NUM_FEC_PROTECTION_CLASSES];
+        fec_controller_get_class_fec_ratios(fec_packet_ratio, context->fec_class_bytes[type_index],
+                                            class_fec_ratios);
+        fec_packet_ratio = class_fec_ratios[protection_class];
+        num_fec_packets = get_num_fec_packets(num_indices_if_use_fec, fec_packet_ratio);
+    }
+    // While the bandwidth is saturated, video frames also get probe parity, which is only sent
+    // to fill the spare bandwidth once the frame has been sent. Only frames that have FEC anyway
+    // get it, so that the others are still received without FEC, even if no probe goes out.
+    int num_probe_packets = 0;
+    double probe_ratio = context->video_probe_ratio;
+    if (packet_type == PACKET_VIDEO && context->egress_scheduler != NULL && probe_ratio > 0.0 &&
+        num_fec_packets > 0) {
+        double fec_ratio_with_probes = min(fec_packet_ratio + probe_ratio, MAX_FEC_RATIO);
+        num_probe_packets = max(
+            get_num_fec_packets(num_indices_if_use_fec, fec_ratio_with_probes) - num_fec_packets,
+            0);
+        num_fec_packets += num_probe_packets;
+    }
+
+    int num_indices;
+    if (num_fec_packets == 0) {
+        num_indices = num_indices_if_no_fec;
+    } else {
+        num_indices = num_indices_if_use_fec;
+    }
+
+    int num_total_packets = num_indices + num_fec_packets;
+
+// Feel free to increase this #define if the fatal assert gets triggered
+#define MAX_TOTAL_PACKETS 4096
+    char* buffers[MAX_TOTAL_PACKETS];
+    int buffer_sizes[MAX_TOTAL_PACKETS];
+    FATAL_ASSERT(num_total_packets < MAX_TOTAL_PACKETS);
+
+    // If nack buffer can't hold a packet with that many indices,
+    // OR the egress scheduler can't hold a video frame with that many indices,
+    // OR the original buffer is illegally large
+    // OR there's no nack buffer but it's a packet that needed to be split up,
+    // THEN there's a problem and we LOG_ERROR
+    if ((nack_buffer && num_total_packets > context->nack_buffer_max_indices[type_index]) ||
+        (packet_type == PACKET_VIDEO && context->egress_scheduler != NULL &&
+         num_total_packets > MAX_PACKETS) ||
+        (nack_buffer && whist_packet_size > context->nack_buffer_max_payload_size[type_index]) ||
+        (!nack_buffer && num_total_packets > 1)) {
+        LOG_ERROR("Packet is too large to send the payload! %d/%d", num_indices, num_total_packets);
+        return -1;
+    }
+
+    payload.num_total_packets = num_total_packets;
+    payload.num_fec_packets = num_fec_packets;
+    payload.num_probe_packets = num_probe_packets;
+    payload.prev_frame_num_duplicates = context->num_duplicate_packets[packet_type];
+    payload.buffer_sizes = buffer_sizes;
+    payload.fec_encoder = NULL;
+    payload.fec_encode_time = 0.0;
+
+    FECEncoder* fec_encoder = NULL;
+    if (num_fec_packets > 0) {
+        // The FEC encoder needs the WhistPacket in one piece,
+        // so gather it into this type's persistent FEC input buffer
+        char* fec_input_buffer = context->fec_input_buffers[type_index];
+        whist_packet_reader_read(&payload.reader, fec_input_buffer, whist_packet_size);
+
+        fec_encoder = create_fec_encoder(num_indices, num_fec_packets, segment_size,
+                                         fec_get_codec(num_indices));
+        // Pass the buffer that we'll be encoding with FEC
+        fec_encoder_register_buffer(fec_encoder, fec_input_buffer, whist_packet_size);
+
+        // If using FEC, populate the UDP payload buffers with the original buffers.
+        // The FEC buffers are only encoded as they're sent, after the original buffers,
+        // so that the frame's first segment doesn't wait for the whole encode.
+        fec_get_original_buffers(fec_encoder, (void**)buffers, buffer_sizes);
+        // Every FEC buffer is as large as the largest original buffer, which is already known
+        // so that the whole payload can be paced before the FEC buffers are encoded
+        int fec_buffer_size = 0;
+        for (int packet_index = 0; packet_index < num_indices; packet_index++) {
+            fec_buffer_size = max(fec_buffer_size, buffer_sizes[packet_index]);
+        }
+        for (int packet_index = num_indices; packet_index < num_total_packets; packet_index++) {
+            buffers[packet_index] = NULL;
+            buffer_sizes[packet_index] = fec_buffer_size;
+        }
+        payload.buffers = buffers;
+        payload.fec_encoder = fec_encoder;
+    } else {
+        // When not using FEC, split up the packets using segment_size.
+        // Each segment will be read straight out of the chunks, when it gets constructed.
+        int current_position = 0;
+        for (int packet_index = 0; packet_index < num_indices; packet_index++) {
+            int udp_packet_payload_size = min(whist_packet_size - current_position, segment_size);
+            buffer_sizes[packet_index] = udp_packet_payload_size;
+            // Progress the pointer by this payload's size
+            current_position += udp_packet_payload_size;
+        }
+        FATAL_ASSERT(current_position == whist_packet_size);
+        payload.buffers = NULL;
+    }
+
+    if (packet_type == PACKET_VIDEO && context->egress_scheduler != NULL) {
+        // Queue the packets behind the retransmits, and send them as they're paced
+        whist_lock_mutex(context->egress_mutex);
+        udp_send_video_segments(context, &payload);
+        whist_unlock_mutex(context->egress_mutex);
+    } else if (context->batched_send && nack_buffer && num_total_packets > 1) {
+        // Send all the packets in batches, writing them into the nack buffer
+        udp_send_segments_batched(context, &payload);
+    } else {
+        // Send all the packets one at a time, and write them into the nack buffer if there is one
+        for (int packet_index = 0; packet_index < num_total_packets; packet_index++) {
+            // The UDPPacket that we will construct
+            UDPPacket local_packet;
+            UDPPacket* packet = &local_packet;
+
+            // Potentially use the nack buffer instead though,
+            // in which case nack readers must skip it until it's sent
+            std::atomic<uint32_t>* seq = NULL;
+            if (nack_buffer) {
+                packet = &nack_buffer[packet_index];
+                seq = &context->nack_buffer_seqs[type_index][packet_id %
+                                                             context->nack_num_buffers[type_index]]
+                                                [packet_index];
+                udp_begin_nack_buffer_write(seq);
+            }
+
+            // Construct the UDPPacket, potentially into the nack buffer
+            udp_construct_segment(packet, &payload, packet_index);
+
+            // Send the packet, which also stamps its departure time
+            // We don't need to propagate the return code because it's lossy anyway,
+            // The client will just have to nack
+            udp_send_udp_packet(context, packet);
+
+            if (nack_buffer) {
+                udp_end_nack_buffer_write(seq);
+            }
+        }
+    }
+
+    // Cleanup
+    if (fec_encoder) {
+        if (LOG_FEC_ENCODE) {
+            LOG_INFO("[FEC] encoded %d original + %d redundant buffers, in %f ms", num_indices,
+                     num_fec_packets, payload.fec_encode_time * MS_IN_SECOND);
+        }
+        destroy_fec_encoder(fec_encoder);
+    }
+
+    return 0;
+}
+
+void udp_encrypt_udp_packets(UDPContext* context, UDPPacket** udp_packets,
+                             UDPNetworkPacket* udp_network_packets, int* network_packet_sizes,
+                             int num_packets) {
+    FATAL_ASSERT(num_packets <= UDP_SEND_BATCH_SIZE);
+
+    // Segments are sent as their compact header followed by their segment data,
+    // if the compact segment header is enabled
+    char compact_headers[UDP_SEND_BATCH_SIZE][COMPACT_SEGMENT_HEADER_MAX_SIZE];
+    int compact_header_sizes[UDP_SEND_BATCH_SIZE] = {0};
+    if (FEATURE_ENABLED(COMPACT_SEGMENT_HEADER)) {
+        whist_lock_mutex(context->compact_header_mutex);
+        for (int i = 0; i < num_packets; i++) {
+            if (udp_packets[i]->type == UDP_WHIST_SEGMENT) {
+                compact_header_sizes[i] = udp_write_compact_segment_header(
+                    context, udp_packets[i], compact_headers[i]);
+            }
+        }
+        whist_unlock_mutex(context->compact_header_mutex);
+    }
+
+    if (FEATURE_ENABLED(PACKET_ENCRYPTION)) {
+        // Encrypt the packets during normal operation,
+        // with a single pass over the connection's keyed AES session
+        AESPacket aes_packets[UDP_SEND_BATCH_SIZE];
+        for (int i = 0; i < num_packets; i++) {
+            if (compact_header_sizes[i] > 0) {
+                aes_packets[i].prefix = compact_headers[i];
+                aes_packets[i].prefix_len = compact_header_sizes[i];
+                aes_packets[i].input = udp_packets[i]->udp_whist_segment_data.segment_data;
+                aes_packets[i].input_len = udp_packets[i]->udp_whist_segment_data.segment_size;
+            } else {
+                aes_packets[i].prefix = NULL;
+                aes_packets[i].prefix_len = 0;
+                aes_packets[i].input = udp_packets[i];
+                aes_packets[i].input_len = get_udp_packet_size(udp_packets[i]);
+            }
+            aes_packets[i].output = udp_network_packets[i].payload;
+            aes_packets[i].output_buffer_len = (int)sizeof(udp_network_packets[i].payload);
+            aes_packets[i].aes_metadata = &udp_network_packets[i].aes_metadata;
+        }
+        aes_session_encrypt_packets(context->aes_session, aes_packets, num_packets);
+        for (int i = 0; i < num_packets; i++) {
+            udp_network_packets[i].payload_size = aes_packets[i].output_len;
+        }
     } else {
-        // Network error or no packets to receive
-        if (recv_len < 0) {
+        // Or, just memcpy the segments if PACKET_ENCRYPTION is disabled
+        for (int i = 0; i < num_packets; i++) {
+            if (compact_header_sizes[i] > 0) {
+                const WhistSegment* segment = &udp_packets[i]->udp_whist_segment_data;
+                memcpy(udp_network_packets[i].payload, compact_headers[i],
+                       compact_header_sizes[i]);
+                memcpy(udp_network_packets[i].payload + compact_header_sizes[i],
+                       segment->segment_data, segment->segment_size);
+                udp_network_packets[i].payload_size =
+                    compact_header_sizes[i] + segment->segment_size;
+                continue;
+            }
+            int udp_packet_size = get_udp_packet_size(udp_packets[i]);
+            memcpy(udp_network_packets[i].payload, udp_packets[i], udp_packet_size);
+            udp_network_packets[i].payload_size = udp_packet_size;
+        }
+    }
+    for (int i = 0; i < num_packets; i++) {
+        network_packet_sizes[i] =
+            UDPNETWORKPACKET_HEADER_SIZE + udp_network_packets[i].payload_size;
+    }
+}
+
+int udp_write_compact_segment_header(UDPContext* context, UDPPacket* udp_packet,
+                                     char* compact_header) {
+    WhistSegment* segment = &udp_packet->udp_whist_segment_data;
+    int type_index = (int)segment->whist_type;
+    CompactSegmentInfo compact_info;
+    compact_info.group_id = udp_packet->group_id;
+    // A batch of segments shares one departure time, so only its first segment carries it.
+    // A new departure time starts a new epoch, so that segments referring to the previous one
+    // aren't given the new one.
+    compact_info.has_departure_time =
+        segment->departure_time != context->last_sent_departure_time[type_index];
+    if (compact_info.has_departure_time) {
+        context->last_sent_departure_time[type_index] = segment->departure_time;
+        context->sent_departure_time_epoch[type_index]++;
+    }
+    compact_info.departure_time_epoch = context->sent_departure_time_epoch[type_index];
+    return write_compact_segment_header(compact_header, segment, &compact_info);
+}
+
+int udp_get_wire_packet_size(UDPPacket* udp_packet) {
+    if (udp_packet->type == UDP_WHIST_SEGMENT && FEATURE_ENABLED(COMPACT_SEGMENT_HEADER)) {
+        char compact_header[COMPACT_SEGMENT_HEADER_MAX_SIZE];
+        CompactSegmentInfo compact_info = {udp_packet->group_id, true, 0};
+        return write_compact_segment_header(compact_header, &udp_packet->udp_whist_segment_data,
+                                            &compact_info) +
+               udp_packet->udp_whist_segment_data.segment_size;
+    }
+    return get_udp_packet_size(udp_packet);
+}
+
+bool udp_enable_txtime(UDPContext* context) {
+#if OS_IS(OS_LINUX) && defined(SO_TXTIME)
+    // fq only understands departure times on the monotonic clock
+    struct sock_txtime txtime_config = {CLOCK_MONOTONIC, 0};
+    if (setsockopt(context->socket, SOL_SOCKET, SO_TXTIME, &txtime_config,
+                   sizeof(txtime_config)) == 0) {
+        LOG_INFO("Pacing video segments in the kernel with SO_TXTIME");
+        return true;
+    }
+    LOG_WARNING("SO_TXTIME isn't supported, pacing video segments in userspace: %d",
+                get_last_network_error());
+#else
+    LOG_WARNING("SO_TXTIME is only supported on Linux, pacing video segments in userspace");
+#endif
+    return false;
+}
+
+int udp_send_network_packet_batch(UDPContext* context, int num_packets,
+                                  const timestamp_us* departure_times) {
+    int num_sent = 0;
+    int num_retries = 0;
+    while (num_sent < num_packets) {
+        int ret;
+        if (context->ring != NULL) {
+            void* packets[UDP_SEND_BATCH_SIZE];
+            for (int i = 0; i < num_packets - num_sent; i++) {
+                packets[i] = &context->send_batch[num_sent + i];
+            }
+            whist_lock_mutex(context->mutex);
+            ret = udp_ring_send(context->ring, packets, &context->send_batch_sizes[num_sent],
+                                num_packets - num_sent);
+            whist_unlock_mutex(context->mutex);
+        } else {
+#if OS_IS(OS_LINUX)
+            struct mmsghdr msgs[UDP_SEND_BATCH_SIZE];
+            struct iovec iovecs[UDP_SEND_BATCH_SIZE];
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < num_packets - num_sent; i++) {
+                iovecs[i].iov_base = &context->send_batch[num_sent + i];
+                iovecs[i].iov_len = (size_t)context->send_batch_sizes[num_sent + i];
+                msgs[i].msg_hdr.msg_iov = &iovecs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+#if defined(SO_TXTIME)
+            char txtime_cmsgs[UDP_SEND_BATCH_SIZE][CMSG_SPACE(sizeof(uint64_t))];
+            if (context->use_txtime && departure_times != NULL) {
+                // Departure times are current_time_us() values, but fq wants monotonic ones
+                struct timespec monotonic_time;
+                clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+                int64_t monotonic_offset_ns =
+                    (int64_t)monotonic_time.tv_sec * US_IN_SECOND * NS_IN_US +
+                    monotonic_time.tv_nsec - (int64_t)current_time_us() * NS_IN_US;
+                for (int i = 0; i < num_packets - num_sent; i++) {
+                    msgs[i].msg_hdr.msg_control = txtime_cmsgs[i];
+                    msgs[i].msg_hdr.msg_controllen = sizeof(txtime_cmsgs[i]);
+                    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+                    cmsg->cmsg_level = SOL_SOCKET;
+                    cmsg->cmsg_type = SCM_TXTIME;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                    uint64_t txtime = (uint64_t)(
+                        (int64_t)departure_times[num_sent + i] * NS_IN_US + monotonic_offset_ns);
+                    memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+                }
+            }
+#endif
+            whist_lock_mutex(context->mutex);
+            // The socket is connected, so no destination address is needed
+            ret = sendmmsg(context->socket, msgs, num_packets - num_sent, 0);
+            whist_unlock_mutex(context->mutex);
+#else
+            // Without sendmmsg, we still save on the locking and throttling round-trips
+            whist_lock_mutex(context->mutex);
+            ret = send(context->socket, (const char*)&context->send_batch[num_sent],
+                       (size_t)context->send_batch_sizes[num_sent], 0);
+            whist_unlock_mutex(context->mutex);
+            if (ret >= 0) {
+                ret = 1;
+            }
+#endif
+        }
+        if (ret < 0) {
             int error = get_last_network_error();
-            switch (error) {
-                case WHIST_ETIMEDOUT:
-                case WHIST_EWOULDBLOCK:
-                    // Break on expected network errors
-                    break;
-                case WHIST_ECONNREFUSED: {
-                    if (context->connected) {
-                        // The connection has been lost
-                        LOG_WARNING("UDP connection Lost: ECONNREFUSED");
-                        context->connection_lost = true;
-                    }
-                    break;
+            if (error == WHIST_ECONNREFUSED) {
+                if (context->connected) {
+                    // The connection has been lost
+                    LOG_WARNING("UDP connection Lost: ECONNREFUSED");
+                    context->connection_lost = true;
                 }
-                default:
-                    LOG_WARNING("Unexpected Packet Error: %d", error);
-                    break;
+                return -1;
+            } else if (error == WHIST_ENOBUFS && num_retries < RETRIES_ON_BUFFER_FULL) {
+                LOG_WARNING("Unexpected UDP Packet Error: %d (Retrying to send packet!)", error);
+                num_retries++;
+                continue;
+            } else {
+                LOG_WARNING("Unexpected UDP Packet Error: %d", error);
+                return -1;
+            }
+        }
+        if (LOG_NETWORKING) {
+            LOG_INFO("Sent a batch of %d UDP packets", ret);
+        }
+        num_sent += ret;
+    }
+    return 0;
+}
+
+void udp_send_udp_packet_batch(UDPContext* context, UDPPacket** udp_packets,
+                               const timestamp_us* departure_times, int num_packets, bool paced) {
+    if (num_packets == 0) {
+        return;
+    }
+    udp_encrypt_udp_packets(context, udp_packets, context->send_batch, context->send_batch_sizes,
+                            num_packets);
+    int unscheduled_bytes = 0;
+    for (int i = 0; i < num_packets; i++) {
+        unscheduled_bytes += context->send_batch_sizes[i];
+        if (paced) {
+            unscheduled_bytes -=
+                UDPNETWORKPACKET_HEADER_SIZE + udp_get_wire_packet_size(udp_packets[i]);
+        }
+    }
+
+    // We don't need to propagate the return code because it's lossy anyway,
+    // The client will just have to nack
+    udp_send_network_packet_batch(context, num_packets, departure_times);
+
+    // The packets that are scheduled next are pushed back to adjust for the bytes that weren't
+    // scheduled, such as encryption padding, so that the requested bitrate limit is not exceeded
+    if (unscheduled_bytes > 0) {
+        network_throttler_charge_bytes(context->network_throttler, (size_t)unscheduled_bytes);
+    }
+}
+
+void udp_send_segments_batched(UDPContext* context, SegmentedPayload* payload) {
+    int type_index = (int)payload->type;
+    int nack_buffer_index = payload->id % context->nack_num_buffers[type_index];
+    UDPPacket* nack_buffer = context->nack_buffers[type_index][nack_buffer_index];
+    std::atomic<uint32_t>* nack_buffer_seqs =
+        context->nack_buffer_seqs[type_index][nack_buffer_index];
+    int num_packets = payload->num_total_packets;
+
+    int num_sent = 0;
+    while (num_sent < num_packets) {
+        // Construct the batch into the nack buffer, where nack readers skip it until it's stamped
+        int batch_size = min(num_packets - num_sent, UDP_SEND_BATCH_SIZE);
+        UDPPacket* batch[UDP_SEND_BATCH_SIZE];
+        timestamp_us current_time = current_time_us();
+        for (int i = 0; i < batch_size; i++) {
+            UDPPacket* packet = &nack_buffer[num_sent + i];
+            udp_begin_nack_buffer_write(&nack_buffer_seqs[num_sent + i]);
+            udp_construct_segment(packet, payload, num_sent + i);
+            packet->udp_whist_segment_data.departure_time = current_time;
+            udp_end_nack_buffer_write(&nack_buffer_seqs[num_sent + i]);
+            batch[i] = packet;
+        }
+        udp_send_udp_packet_batch(context, batch, NULL, batch_size, false);
+        num_sent += batch_size;
+    }
+}
+
+void udp_send_video_segments(UDPContext* context, SegmentedPayload* payload) {
+    int nack_buffer_index = payload->id % context->nack_num_buffers[PACKET_VIDEO];
+    UDPPacket* nack_buffer = context->nack_buffers[PACKET_VIDEO][nack_buffer_index];
+    std::atomic<uint32_t>* nack_buffer_seqs =
+        context->nack_buffer_seqs[PACKET_VIDEO][nack_buffer_index];
+    int num_original_packets = payload->num_total_packets - payload->num_fec_packets;
+    int probe_parity_index = payload->num_total_packets - payload->num_probe_packets;
+
+    // Construct the headers of every UDPPacket into the nack buffer, which is all it takes to
+    // queue them. Nack readers skip them until they've been stamped, right before they're sent.
+    // The data is only filled in as they're dequeued, so that FEC encoding doesn't hold up the
+    // first segments.
+    timestamp_us current_time = current_time_us();
+    for (int i = 0; i < payload->num_total_packets; i++) {
+        udp_begin_nack_buffer_write(&nack_buffer_seqs[i]);
+        udp_construct_segment_header(&nack_buffer[i], payload, i);
+        if (i >= probe_parity_index) {
+            continue;
+        }
+        EgressPacket egress_packet = {payload->id, i, current_time, 0};
+        // Every packet of the previous frame was dequeued, and a whole frame fits
+        bool queued = egress_scheduler_enqueue(
+            context->egress_scheduler,
+            i < num_original_packets ? EGRESS_CLASS_VIDEO : EGRESS_CLASS_FEC, &egress_packet);
+        FATAL_ASSERT(queued);
+    }
+    udp_send_egress_packets(context, payload);
+
+    // Only encode the probe parity once the frame is out, and keep it in the nack buffer for
+    // udp_send_probe_parity
+    for (int i = probe_parity_index; i < payload->num_total_packets; i++) {
+        udp_construct_segment_data(&nack_buffer[i], payload, i);
+        udp_end_nack_buffer_write(&nack_buffer_seqs[i]);
+    }
+    context->probe_parity_id = payload->id;
+    context->next_probe_parity_index = probe_parity_index;
+    context->probe_parity_end_index = payload->num_total_packets;
+}
+
+void udp_send_egress_packets(UDPContext* context, SegmentedPayload* payload) {
+    NetworkThrottleContext* throttler = context->network_throttler;
+    UDPPacket* nack_buffer = NULL;
+    std::atomic<uint32_t>* nack_buffer_seqs = NULL;
+    if (payload != NULL) {
+        int nack_buffer_index = payload->id % context->nack_num_buffers[PACKET_VIDEO];
+        nack_buffer = context->nack_buffers[PACKET_VIDEO][nack_buffer_index];
+        nack_buffer_seqs = context->nack_buffer_seqs[PACKET_VIDEO][nack_buffer_index];
+    }
+    int max_batch_size = context->batched_send ? UDP_SEND_BATCH_SIZE : 1;
+    // With SO_TXTIME, the kernel holds the segments until their departure, so they're handed over
+    // a bit ahead. Otherwise, we wait for each departure ourselves.
+    timestamp_us lead_time = context->use_txtime ? UDP_TXTIME_LEAD_US : 0;
+
+    // The payload's new video and FEC segments are scheduled as one batch, so that the frame
+    // departs back to back in one group. A retransmit that cuts in front of them, or a stale
+    // segment, gives the rest of the frame's departure times back, and the rest of the frame is
+    // rescheduled once it's dequeued again.
+    int frame_end_index = 0;
+    int frame_group_id = -1;
+    bool frame_is_scheduled = false;
+    if (payload != NULL) {
+        frame_end_index = payload->num_total_packets - payload->num_probe_packets;
+        frame_group_id = udp_schedule_frame_segments(context, nack_buffer, 0, frame_end_index);
+        frame_is_scheduled = true;
+    }
+    // The next segment of the frame that'll be dequeued
+    int next_frame_index = 0;
+
+    // The packets that are due, which are sent together
+    UDPPacket* batch[UDP_SEND_BATCH_SIZE];
+    timestamp_us departure_times[UDP_SEND_BATCH_SIZE];
+    int batch_size = 0;
+    while (true) {
+        // NACKs that arrived in the meantime cut in front of what's left of the frame
+        udp_queue_pending_nacks(context);
+        EgressPacket egress_packet;
+        EgressClass egress_class;
+        bool is_stale;
+        if (!egress_scheduler_dequeue(context->egress_scheduler, current_time_us(),
+                                      context->reset_data[PACKET_VIDEO].greatest_failed_id,
+                                      &egress_packet, &egress_class, &is_stale)) {
+            break;
+        }
+
+        bool is_new = egress_class == EGRESS_CLASS_VIDEO || egress_class == EGRESS_CLASS_FEC;
+        UDPPacket* packet;
+        if (is_new) {
+            // New video and then FEC are dequeued in the frame's order
+            FATAL_ASSERT(payload != NULL && egress_packet.id == payload->id &&
+                         egress_packet.index == next_frame_index);
+            next_frame_index++;
+            // They're only stale once they're late for their departure, so that the tail of a
+            // frame that takes a while to pace out isn't dropped after its head was sent.
+            // Segments that aren't scheduled get scheduled from now, once they're dequeued.
+            if (!is_stale && frame_is_scheduled) {
+                is_stale = current_time_us() > context->frame_departure_times[egress_packet.index] +
+                                                   EGRESS_VIDEO_DEADLINE_MS * US_IN_MS;
+            }
+            // Stale segments are still filled in, so that the nack buffer never holds a
+            // half-written frame
+            packet = &nack_buffer[egress_packet.index];
+            udp_construct_segment_data(packet, payload, egress_packet.index);
+            if (is_stale) {
+                udp_end_nack_buffer_write(&nack_buffer_seqs[egress_packet.index]);
+            }
+        } else {
+            packet = &context->send_batch_copies[batch_size];
+            if (!is_stale && !udp_get_resent_packet(context, PACKET_VIDEO, egress_packet.id,
+                                                    egress_packet.index,
+                                                    egress_class == EGRESS_CLASS_PROBE, packet)) {
+                continue;
+            }
+        }
+        if (is_stale) {
+            log_double_statistic(VIDEO_EGRESS_STALE_PACKETS, 1.0);
+            if (is_new && frame_is_scheduled) {
+                udp_release_frame_segments(context, egress_packet.index, frame_end_index);
+                frame_is_scheduled = false;
+            }
+            continue;
+        }
+        if (egress_class == EGRESS_CLASS_RETRANSMIT) {
+            log_double_statistic(
+                VIDEO_NACK_RETRANSMIT_LATENCY,
+                (double)(current_time_us() - egress_packet.queued_time) / US_IN_MS);
+        }
+
+        timestamp_us departure_time;
+        int group_id;
+        if (is_new) {
+            if (!frame_is_scheduled) {
+                frame_group_id = udp_schedule_frame_segments(context, nack_buffer,
+                                                             egress_packet.index, frame_end_index);
+                frame_is_scheduled = true;
             }
+            departure_time = context->frame_departure_times[egress_packet.index];
+            group_id = frame_group_id;
         } else {
-            // Ignore packets of size 0
+            if (frame_is_scheduled && next_frame_index < frame_end_index) {
+                udp_release_frame_segments(context, next_frame_index, frame_end_index);
+                frame_is_scheduled = false;
+            }
+            size_t packet_size =
+                (size_t)(UDPNETWORKPACKET_HEADER_SIZE + udp_get_wire_packet_size(packet));
+            group_id =
+                network_throttler_schedule_batch(throttler, &packet_size, 1, &departure_time);
+        }
+        if (departure_time > current_time_us() + lead_time) {
+            // Send what's due before waiting for this packet
+            udp_send_udp_packet_batch(context, batch, departure_times, batch_size, true);
+            if (packet == &context->send_batch_copies[batch_size] && batch_size > 0) {
+                // Copies are held at their position in the batch, which this packet now starts
+                context->send_batch_copies[0] = *packet;
+                packet = &context->send_batch_copies[0];
+            }
+            batch_size = 0;
+            network_throttler_wait_until(throttler, departure_time - lead_time);
+        }
+
+        // A packet that we're late for leaves now, rather than at its departure time
+        departure_time = max(departure_time, current_time_us());
+        packet->udp_whist_segment_data.departure_time = departure_time;
+        packet->group_id = group_id;
+        if (is_new) {
+            udp_end_nack_buffer_write(&nack_buffer_seqs[egress_packet.index]);
+        }
+        if (egress_class == EGRESS_CLASS_PROBE) {
+            // The client counts probe parity along with the duplicates that it replaces, and
+            // only the probes that actually went out
+            context->num_duplicate_packets[PACKET_VIDEO]++;
+        }
+        batch[batch_size] = packet;
+        departure_times[batch_size] = departure_time;
+        batch_size++;
+        if (batch_size == max_batch_size) {
+            udp_send_udp_packet_batch(context, batch, departure_times, batch_size, true);
+            batch_size = 0;
+        }
+    }
+    udp_send_udp_packet_batch(context, batch, departure_times, batch_size, true);
+}
+
+int udp_schedule_frame_segments(UDPContext* context, UDPPacket* nack_buffer, int first_index,
+                                int end_index) {
+    if (first_index == end_index) {
+        return -1;
+    }
+    // The headers are constructed before the data, and they're all that the wire size depends on,
+    // but for the varint of the group id, which rarely changes length
+    for (int i = first_index; i < end_index; i++) {
+        context->frame_packet_sizes[i] =
+            (size_t)(UDPNETWORKPACKET_HEADER_SIZE + udp_get_wire_packet_size(&nack_buffer[i]));
+    }
+    return network_throttler_schedule_batch(
+        context->network_throttler, &context->frame_packet_sizes[first_index],
+        end_index - first_index, &context->frame_departure_times[first_index]);
+}
+
+void udp_release_frame_segments(UDPContext* context, int first_index, int end_index) {
+    size_t bytes = 0;
+    for (int i = first_index; i < end_index; i++) {
+        bytes += context->frame_packet_sizes[i];
+    }
+    network_throttler_release_bytes(context->network_throttler, bytes);
+}
+
+bool udp_queue_pending_nacks(UDPContext* context) {
+    NackID nack_id;
+    bool ret = false;
+    while (fifo_queue_dequeue_item((QueueContext*)context->nack_queue, &nack_id) != -1) {
+        EgressPacket egress_packet = {nack_id.frame_id, nack_id.packet_index,
+                                      nack_id.arrival_time, 0};
+        if (!egress_scheduler_enqueue(context->egress_scheduler, EGRESS_CLASS_RETRANSMIT,
+                                      &egress_packet)) {
+            LOG_WARNING("Too many NACKs are queued, dropping the NACK for %d %d",
+                        nack_id.frame_id, nack_id.packet_index);
+        }
+        ret = true;
+    }
+    return ret;
+}
+
+static bool udp_recv_batch(UDPContext* context) {
+    static double last_time_after_recv = 0;
+
+    if (PLOT_UDP_RECV_GAP) {
+        double current_time = get_timestamp_sec();
+        double gap = current_time - last_time_after_recv;
+        whist_plotter_insert_sample("udp_recv_gap", current_time, gap * MS_IN_SECOND);
+    }
+
+    context->recv_batch_size = 0;
+    context->recv_batch_index = 0;
+
+    int num_received;
+    if (context->ring != NULL) {
+        void* packets[UDP_RECV_BATCH_SIZE];
+        num_received = udp_ring_recv(context->ring, packets, context->recv_batch_lens,
+                                     context->timeout);
+        for (int i = 0; i < num_received; i++) {
+            context->recv_batch_packets[i] = (UDPNetworkPacket*)packets[i];
+            // The socket is connected, so every datagram comes from the peer
+            context->recv_batch_addrs[i] = context->connection_addr;
+        }
+    } else {
+        for (int i = 0; i < UDP_RECV_BATCH_SIZE; i++) {
+            context->recv_batch_packets[i] = &context->recv_batch[i];
+        }
+#if OS_IS(OS_LINUX)
+        struct mmsghdr msgs[UDP_RECV_BATCH_SIZE];
+        struct iovec iovecs[UDP_RECV_BATCH_SIZE];
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_RECV_BATCH_SIZE; i++) {
+            iovecs[i].iov_base = &context->recv_batch[i];
+            iovecs[i].iov_len = sizeof(UDPNetworkPacket);
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &context->recv_batch_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(context->recv_batch_addrs[i]);
+        }
+        // MSG_WAITFORONE blocks for the first datagram only, and then drains whatever is queued
+        num_received = recvmmsg_no_intr(context->socket, msgs, UDP_RECV_BATCH_SIZE, MSG_WAITFORONE);
+        for (int i = 0; i < num_received; i++) {
+            context->recv_batch_lens[i] = (int)msgs[i].msg_len;
+        }
+#else
+        socklen_t slen = sizeof(context->recv_batch_addrs[0]);
+        int recv_len = recvfrom_no_intr(context->socket, &context->recv_batch[0],
+                                        sizeof(UDPNetworkPacket), 0,
+                                        (struct sockaddr*)(&context->recv_batch_addrs[0]), &slen);
+        num_received = recv_len < 0 ? -1 : 1;
+        context->recv_batch_lens[0] = recv_len;
+#endif
+    }
+
+    if (PLOT_UDP_RECV_GAP) {
+        last_time_after_recv = get_timestamp_sec();
+    }
+
+    if (num_received > 0) {
+        // Tracks arrival time for congestion control algo
+        context->recv_batch_arrival_time = current_time_us();
+        context->recv_batch_size = num_received;
+        if (LOG_NETWORKING && num_received > 1) {
+            LOG_INFO("Received a batch of %d datagrams over UDP", num_received);
+        }
+        return true;
+    }
+
+    // Network error or no packets to receive
+    if (num_received < 0) {
+        int error = get_last_network_error();
+        switch (error) {
+            case WHIST_ETIMEDOUT:
+            case WHIST_EWOULDBLOCK:
+                // Break on expected network errors
+                break;
+            case WHIST_ECONNREFUSED: {
+                if (context->connected) {
+                    // The connection has been lost
+                    LOG_WARNING("UDP connection Lost: ECONNREFUSED");
+                    context->connection_lost = true;
+                }
+                break;
+            }
+            default:
+                LOG_WARNING("Unexpected Packet Error: %d", error);
+                break;
+        }
+    }
+    return false;
+}
+
+void* udp_get_segment_destination(void* opaque, const void* header, int remaining_len) {
+    UDPSegmentDestination* destination = (UDPSegmentDestination*)opaque;
+    UDPPacket* udp_packet = destination->udp_packet;
+    FATAL_ASSERT(header == udp_packet);
+
+    if (*(const uint8_t*)header != COMPACT_SEGMENT_HEADER_V1) {
+        if (!destination->allow_in_place) {
+            return NULL;
         }
+        char* segment_destination =
+            udp_find_segment_destination(destination->context, udp_packet, remaining_len);
+        destination->found_destination = segment_destination != NULL;
+        return segment_destination;
+    }
+
+    // The decrypted bytes hold the compact header, followed by the start of the segment data.
+    // Set them aside, since decoding the header overwrites them.
+    char decrypted[UDPPACKET_SEGMENT_HEADER_SIZE];
+    memcpy(decrypted, header, sizeof(decrypted));
+    int compact_header_size =
+        read_compact_segment_header(&udp_packet->udp_whist_segment_data,
+                                    &destination->compact_info, decrypted,
+                                    (int)sizeof(decrypted) + remaining_len);
+    if (compact_header_size < 0) {
+        // Let the packet be decrypted whole, it'll be rejected afterwards
+        return NULL;
+    }
+    udp_packet->type = UDP_WHIST_SEGMENT;
+    udp_packet->group_id = destination->compact_info.group_id;
+    destination->compact_header_size = compact_header_size;
+
+    char* segment_destination = NULL;
+    if (destination->allow_in_place) {
+        segment_destination = udp_find_segment_destination(
+            destination->context, udp_packet, udp_packet->udp_whist_segment_data.segment_size);
+        destination->found_destination = segment_destination != NULL;
+    }
+    if (segment_destination == NULL) {
+        segment_destination = udp_packet->udp_whist_segment_data.segment_data;
+    }
+    int decrypted_data_len = (int)sizeof(decrypted) - compact_header_size;
+    memcpy(segment_destination, decrypted + compact_header_size, decrypted_data_len);
+    return segment_destination + decrypted_data_len;
+}
+
+char* udp_find_segment_destination(UDPContext* context, const UDPPacket* udp_packet,
+                                   int segment_size) {
+    // Nothing in the header has been authenticated yet, so bounds-check the type before using it
+    if (udp_packet->type != UDP_WHIST_SEGMENT) {
+        return NULL;
+    }
+    int type_index = (int)udp_packet->udp_whist_segment_data.whist_type;
+    if (type_index < 0 || type_index >= NUM_PACKET_TYPES ||
+        context->ring_buffers[type_index] == NULL) {
+        return NULL;
+    }
+    return ring_buffer_get_segment_destination(context->ring_buffers[type_index],
+                                               &udp_packet->udp_whist_segment_data, segment_size);
+}
+
+int udp_expand_compact_segment(UDPPacket* udp_packet, int len, CompactSegmentInfo* compact_info) {
+    // Decoding the header overwrites the bytes after it, so set them aside first,
+    // just like udp_get_segment_destination does
+    char decrypted[UDPPACKET_SEGMENT_HEADER_SIZE];
+    int decrypted_len = min(len, (int)sizeof(decrypted));
+    memcpy(decrypted, udp_packet, decrypted_len);
+    int compact_header_size = read_compact_segment_header(&udp_packet->udp_whist_segment_data,
+                                                          compact_info, decrypted, len);
+    if (compact_header_size < 0) {
+        return -1;
+    }
+    udp_packet->type = UDP_WHIST_SEGMENT;
+    udp_packet->group_id = compact_info->group_id;
+    char* segment_data = udp_packet->udp_whist_segment_data.segment_data;
+    int decrypted_data_len = decrypted_len - compact_header_size;
+    // The bytes past the set-aside ones move forward by the header size difference
+    memmove(segment_data + decrypted_data_len, (char*)udp_packet + decrypted_len,
+            len - decrypted_len);
+    memcpy(segment_data, decrypted + compact_header_size, decrypted_data_len);
+    return get_udp_packet_size(udp_packet);
+}
+
+void udp_resolve_departure_time(UDPContext* context, UDPPacket* udp_packet,
+                                const CompactSegmentInfo* compact_info) {
+    WhistSegment* segment = &udp_packet->udp_whist_segment_data;
+    int type_index = (int)segment->whist_type;
+    if (compact_info->has_departure_time) {
+        context->last_received_departure_time[type_index] = segment->departure_time;
+        context->received_departure_time_epoch[type_index] = compact_info->departure_time_epoch;
+        context->has_received_departure_time[type_index] = true;
+    } else if (context->has_received_departure_time[type_index] &&
+               context->received_departure_time_epoch[type_index] ==
+                   compact_info->departure_time_epoch) {
+        segment->departure_time = context->last_received_departure_time[type_index];
+    } else {
+        // The segment that carried this departure time hasn't arrived
+        segment->departure_time = 0;
+    }
+}
+
+static bool udp_get_udp_packet(UDPContext* context, UDPPacket* udp_packet,
+                               timestamp_us* arrival_time, int* network_payload_size,
+                               bool* segment_in_place) {
+    if (segment_in_place) {
+        *segment_in_place = false;
+    }
+
+    // Only go to the network once the previous batch has been fully consumed,
+    // waiting to receive a packet over UDP until timing out
+    if (context->recv_batch_index >= context->recv_batch_size && !udp_recv_batch(context)) {
+        return false;
+    }
+
+    int batch_index = context->recv_batch_index++;
+    UDPNetworkPacket* udp_network_packet = context->recv_batch_packets[batch_index];
+    int recv_len = context->recv_batch_lens[batch_index];
+    context->last_addr = context->recv_batch_addrs[batch_index];
+
+    if (context->connected) {
+        // TODO: Compare last_addr, with connection_addr, more accurately than memcmp
+        // Not strictly necessary, since we validate decryption anyway
+    }
+
+    // Ignore packets of size 0
+    if (recv_len == 0) {
+        return false;
+    }
+
+    // Drop the packets that wouldn't have fit through the simulated path MTU
+    if (simulated_path_mtu > 0 && recv_len + UDP_IP_HEADER_SIZE > simulated_path_mtu) {
+        return false;
+    }
+
+    // The packet was successfully received, decrypt and process it
+    int decrypted_len;
+
+    // Tracks arrival time for congestion control algo
+    if (arrival_time) {
+        *arrival_time = context->recv_batch_arrival_time;
+    }
 
+    // Verify the reported packet length
+    // This is before the `decrypt_packet` call, so the packet might be malicious
+    // ~ We check recv_len against UDPNETWORKPACKET_HEADER_SIZE first, to ensure that
+    //  the access to udp_network_packet->{payload_size/aes_metadata} is in-bounds
+    // ~ We check bounds on udp_network_packet->payload_size, so that the
+    //  the addition check on payload_size doesn't maliciously overflow
+    // ~ We make an addition check, to ensure that the payload_size matches recv_len
+    if (recv_len < UDPNETWORKPACKET_HEADER_SIZE || udp_network_packet->payload_size < 0 ||
+        (int)sizeof(udp_network_packet->payload) < udp_network_packet->payload_size ||
+        UDPNETWORKPACKET_HEADER_SIZE + udp_network_packet->payload_size != recv_len) {
+        LOG_WARNING("The UDPPacket's payload size %d doesn't agree with recv_len %d!",
+                    udp_network_packet->payload_size, recv_len);
         return false;
     }
+
+    UDPSegmentDestination destination = {};
+    if (FEATURE_ENABLED(PACKET_ENCRYPTION)) {
+        // Decrypt the packet into udp_packet, except for the data of a segment whose frame
+        // is already in its ringbuffer, if allowed. That gets decrypted straight into the frame,
+        // saving a copy of every audio/video byte. A compact segment header gets decoded
+        // as soon as it's decrypted, so that its segment data can go to the right place too.
+        destination.context = context;
+        destination.udp_packet = udp_packet;
+        destination.allow_in_place = segment_in_place != NULL;
+        decrypted_len = aes_session_decrypt_packet_split(
+            context->aes_session, udp_packet, sizeof(UDPPacket), UDPPACKET_SEGMENT_HEADER_SIZE,
+            udp_get_segment_destination, &destination, &udp_network_packet->aes_metadata,
+            udp_network_packet->payload, udp_network_packet->payload_size);
+        // If decryption failed after writing into the frame, nothing needs to be rolled back:
+        // the index was unreceived, and remains so until a valid copy arrives
+        if (segment_in_place) {
+            *segment_in_place = decrypted_len >= 0 && destination.found_destination;
+        }
+        // If there was an issue decrypting it, warn and return NULL
+        if (decrypted_len < 0) {
+            // This is warning, since it could just be someone else sending packets,
+            // Not necessarily our fault
+            LOG_WARNING("Failed to decrypt packet");
+            return false;
+        }
+        // AFTER THIS LINE,
+        // The contents of udp_packet are confirmed to be from the server,
+        // And thus can be trusted as not maliciously formed.
+    } else {
+        // The decrypted packet is just in the payload, during no-encryption dev mode
+        decrypted_len = udp_network_packet->payload_size;
+        memcpy(udp_packet, udp_network_packet->payload, udp_network_packet->payload_size);
+    }
+
+    // Bring a compact segment into the regular UDPPacket format
+    if (destination.compact_header_size > 0) {
+        decrypted_len = get_udp_packet_size(udp_packet);
+        udp_resolve_departure_time(context, udp_packet, &destination.compact_info);
+    } else if (decrypted_len > 0 && *(uint8_t*)udp_packet == COMPACT_SEGMENT_HEADER_V1) {
+        // The compact segment was small enough to be decrypted whole, or wasn't encrypted
+        CompactSegmentInfo compact_info;
+        decrypted_len = udp_expand_compact_segment(udp_packet, decrypted_len, &compact_info);
+        if (decrypted_len < 0) {
+            LOG_WARNING("Received an invalid compact segment");
+            return false;
+        }
+        udp_resolve_departure_time(context, udp_packet, &compact_info);
+    }
+    if (LOG_NETWORKING) {
+        LOG_INFO("Received a WhistPacket of size %d over UDP", decrypted_len);
+    }
+    if (network_payload_size) {
+        *network_payload_size = (UDPNETWORKPACKET_HEADER_SIZE + udp_network_packet->payload_size);
+    }
+
+    // Verify the UDP Packet's size
+    FATAL_ASSERT(decrypted_len == get_udp_packet_size(udp_packet));
+
+    return true;
 }
 
 /*
@@ -1780,6 +3446,7 @@ void udp_handle_message(UDPContext* context, UDPPacket* packet) {
             FATAL_ASSERT(packet->udp_nack_data.whist_type == PACKET_VIDEO);
             NackID nack_id;
             nack_id.frame_id = packet->udp_nack_data.id;
+            nack_id.arrival_time = current_time_us();
             if ((short)packet->udp_nack_data.index >= 0) {
                 nack_id.packet_index = packet->udp_nack_data.index;
                 if (fifo_queue_enqueue_item((QueueContext*)context->nack_queue, &nack_id) < 0) {
@@ -1787,18 +3454,18 @@ void udp_handle_message(UDPContext* context, UDPPacket* packet) {
                 }
             } else {
                 // NACK for all packets in a frame when index is negative
-                whist_lock_mutex(context->nack_mutex[PACKET_VIDEO]);
-                UDPPacket* first_packet =
-                    &context
-                         ->nack_buffers[PACKET_VIDEO][nack_id.frame_id %
-                                                      context->nack_num_buffers[PACKET_VIDEO]][0];
-                if (first_packet->udp_whist_segment_data.id != nack_id.frame_id) {
+                UDPPacket first_packet;
+                if (!udp_read_nack_buffer(context, PACKET_VIDEO, nack_id.frame_id, 0,
+                                          &first_packet)) {
+                    LOG_WARNING("NACKed video packet %d not found", nack_id.frame_id);
+                    break;
+                }
+                if (first_packet.udp_whist_segment_data.id != nack_id.frame_id) {
                     LOG_WARNING("NACKed video packet %d not found, ID %d was located instead.",
-                                nack_id.frame_id, first_packet->udp_whist_segment_data.id);
-                    whist_unlock_mutex(context->nack_mutex[PACKET_VIDEO]);
+                                nack_id.frame_id, first_packet.udp_whist_segment_data.id);
                     break;
                 }
-                for (int i = 0; i < first_packet->udp_whist_segment_data.num_indices; i++) {
+                for (int i = 0; i < first_packet.udp_whist_segment_data.num_indices; i++) {
                     nack_id.packet_index = i;
                     if (LOG_NACKING) {
                         LOG_INFO("Generating Nack for Frame ID %d, index %d", nack_id.frame_id, i);
@@ -1807,12 +3474,18 @@ void udp_handle_message(UDPContext* context, UDPPacket* packet) {
                         LOG_ERROR("Failed to enqueue NACK request");
                     }
                 }
-                whist_unlock_mutex(context->nack_mutex[PACKET_VIDEO]);
             }
+            udp_notify_nack(context);
             break;
         }
         case UDP_BITARRAY_NACK: {
             // nack for everything in the bitarray
+            if (packet->udp_bitarray_nack_data.numBits <= 0 ||
+                packet->udp_bitarray_nack_data.numBits > MAX_VIDEO_PACKETS) {
+                LOG_WARNING("Bitarray NACK of invalid size %d",
+                            packet->udp_bitarray_nack_data.numBits);
+                break;
+            }
             BitArray* bit_arr = bit_array_create(packet->udp_bitarray_nack_data.numBits);
             bit_array_clear_all(bit_arr);
 
@@ -1822,16 +3495,17 @@ void udp_handle_message(UDPContext* context, UDPPacket* packet) {
             FATAL_ASSERT(packet->udp_bitarray_nack_data.type == PACKET_VIDEO);
             NackID nack_id;
             nack_id.frame_id = packet->udp_bitarray_nack_data.id;
-            for (int i = packet->udp_bitarray_nack_data.index;
-                 i < packet->udp_bitarray_nack_data.numBits; i++) {
+            nack_id.arrival_time = current_time_us();
+            for (int i = 0; i < packet->udp_bitarray_nack_data.numBits; i++) {
                 if (bit_array_test_bit(bit_arr, i)) {
-                    nack_id.packet_index = i;
+                    nack_id.packet_index = packet->udp_bitarray_nack_data.index + i;
                     if (fifo_queue_enqueue_item((QueueContext*)context->nack_queue, &nack_id) < 0) {
                         LOG_ERROR("Failed to enqueue NACK request");
                     }
                 }
             }
             bit_array_free(bit_arr);
+            udp_notify_nack(context);
             break;
         }
         case UDP_PING: {
@@ -1850,13 +3524,28 @@ void udp_handle_message(UDPContext* context, UDPPacket* packet) {
             break;
         }
         case UDP_NETWORK_SETTINGS: {
-            udp_handle_network_settings(context,
-                                        packet->udp_network_settings_data.network_settings);
+            if (context->network_throttler == NULL) {
+                // The client only receives the network settings that the server estimated from
+                // transport feedback. It budgets its NACKs with them.
+                whist_lock_mutex(context->congestion_control_mutex);
+                context->network_settings = packet->udp_network_settings_data.network_settings;
+                whist_unlock_mutex(context->congestion_control_mutex);
+            } else {
+                udp_handle_network_settings(context,
+                                            packet->udp_network_settings_data.network_settings);
+            }
+            break;
+        }
+        case UDP_TRANSPORT_FEEDBACK: {
+            udp_handle_transport_feedback(context, &packet->udp_transport_feedback_data);
             break;
         }
         // Ignore handshake packets after the handshake happens
         case UDP_CONNECTION_ATTEMPT:
-        case UDP_CONNECTION_CONFIRMATION: {
+        case UDP_CONNECTION_CONFIRMATION:
+        case UDP_PATH_MTU_PROBE:
+        case UDP_PATH_MTU_PROBE_ACK:
+        case UDP_PATH_MTU_PROBE_DONE: {
             break;
         }
         default: {
@@ -1865,12 +3554,53 @@ void udp_handle_message(UDPContext* context, UDPPacket* packet) {
     }
 }
 
-void udp_handle_nack(UDPContext* context, WhistPacketType type, int packet_id, int packet_index,
-                     bool is_duplicate) {
-    /*
-     * Respond to a client nack by sending the requested packet from the nack buffer if possible.
-     */
+void udp_notify_nack(UDPContext* context) {
+    whist_lock_mutex(context->nack_notify_mutex);
+    if (context->nack_notify != NULL) {
+        context->nack_notify(context->nack_notify_data);
+    }
+    whist_unlock_mutex(context->nack_notify_mutex);
+}
+
+void udp_begin_nack_buffer_write(std::atomic<uint32_t>* seq) {
+    // Only the writer changes seq, so this doesn't need to be an atomic increment
+    seq->store(seq->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    // Keep the UDPPacket's writes from being reordered before the odd seq
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void udp_end_nack_buffer_write(std::atomic<uint32_t>* seq) {
+    seq->store(seq->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
 
+bool udp_read_nack_buffer(UDPContext* context, WhistPacketType type, int packet_id,
+                          int packet_index, UDPPacket* packet) {
+    int type_index = (int)type;
+    int buffer_index = packet_id % context->nack_num_buffers[type_index];
+    std::atomic<uint32_t>* seq = &context->nack_buffer_seqs[type_index][buffer_index][packet_index];
+
+    uint32_t seq_before = seq->load(std::memory_order_acquire);
+    if (seq_before == 0 || seq_before % 2 == 1) {
+        // Never written, or being written right now
+        return false;
+    }
+    memcpy(packet, &context->nack_buffers[type_index][buffer_index][packet_index],
+           sizeof(UDPPacket));
+    // Keep the copy from being reordered after the seq check
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq->load(std::memory_order_relaxed) != seq_before) {
+        // The writer got to it while we were copying, so the copy may be torn
+        if (LOG_NACKING) {
+            LOG_INFO("Nack buffer packet %d %d was overwritten while being read", packet_id,
+                     packet_index);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool udp_get_resent_packet(UDPContext* context, WhistPacketType type, int packet_id,
+                           int packet_index, bool is_duplicate, UDPPacket* packet) {
     int type_index = (int)type;
     FATAL_ASSERT(type_index < NUM_PACKET_TYPES);
     FATAL_ASSERT(context->nack_buffers[type_index] != NULL);
@@ -1884,20 +3614,11 @@ void udp_handle_nack(UDPContext* context, WhistPacketType type, int packet_id, i
         // TODO: Nack for whole frames in a cleaner way
         // LOG_ERROR("Nacked Index %d is >= max indices %d!", packet_index,
         //          context->nack_buffer_max_indices[type_index]);
-        return;
+        return false;
     }
 
-    // retrieve the WhistPacket from the nack buffer and send using `udp_send_udp_packet`
-    // TODO: change to WhistUDPPacket
-    whist_lock_mutex(context->nack_mutex[type_index]);
-
-    // Check if the nack buffer we're looking for is valid
-    if (context->nack_buffer_valid[type_index][packet_id % context->nack_num_buffers[type_index]]
-                                  [packet_index]) {
-        UDPPacket* packet =
-            &context->nack_buffers[type_index][packet_id % context->nack_num_buffers[type_index]]
-                                  [packet_index];
-
+    // Check if the nack buffer we're looking for is valid, without blocking the sending thread
+    if (udp_read_nack_buffer(context, type, packet_id, packet_index, packet)) {
         // Check that the nack buffer ID's match
         if (packet->udp_whist_segment_data.id == packet_id) {
             packet->udp_whist_segment_data.is_a_nack = !is_duplicate;
@@ -1908,7 +3629,7 @@ void udp_handle_nack(UDPContext* context, WhistPacketType type, int packet_id, i
                 LOG_INFO("NACKed video packet ID %d Index %d found of length %d. Relaying!",
                          packet_id, packet_index, packet->udp_whist_segment_data.segment_size);
             }
-            udp_send_udp_packet(context, packet);
+            return true;
         } else {
             // TODO: Calculate an aggregate and LOG_WARNING that,
             // Insteads of per-packet logging
@@ -1928,8 +3649,22 @@ void udp_handle_nack(UDPContext* context, WhistPacketType type, int packet_id, i
                         type == PACKET_VIDEO ? "video" : "audio", packet_id, packet_index);
         }
     }
+    return false;
+}
+
+void udp_handle_nack(UDPContext* context, WhistPacketType type, int packet_id, int packet_index,
+                     bool is_duplicate) {
+    /*
+     * Respond to a client nack by sending the requested packet from the nack buffer if possible.
+     * Video NACKs go through the egress scheduler instead, see udp_send_egress_packets.
+     */
 
-    whist_unlock_mutex(context->nack_mutex[type_index]);
+    // retrieve the WhistPacket from the nack buffer and send using `udp_send_udp_packet`
+    // TODO: change to WhistUDPPacket
+    UDPPacket packet;
+    if (udp_get_resent_packet(context, type, packet_id, packet_index, is_duplicate, &packet)) {
+        udp_send_udp_packet(context, &packet);
+    }
 }
 
 void udp_handle_stream_reset(UDPContext* context, WhistPacketType type, int greatest_failed_id) {
@@ -2006,32 +3741,176 @@ void udp_handle_pong(UDPContext* context, int id, timestamp_us ping_send_timesta
     start_timer(&context->last_pong_timer);
 
     double ping_time = (current_time_us() - ping_send_timestamp) / (double)US_IN_SECOND;
-    // Initialize the latency
-    if (context->last_pong_id == -1) {
-        context->short_term_latency = context->long_term_latency = ping_time;
-    }
     context->last_pong_id = id;
+    CongestionFeedback* feedback = &context->congestion_feedback;
 
     log_double_statistic(NETWORK_RTT_UDP, ping_time * MS_IN_SECOND);
     // Comment logs once every second, or when latency spikes
     if (LOG_VIDEO || LOG_AUDIO || LOG_NETWORKING ||
         id % max((int)(UDP_PING_LOG_INTERVAL_SEC / (double)UDP_PING_INTERVAL_SEC), 1) == 0 ||
-        ping_time > 2.0 * context->long_term_latency) {
+        (feedback->has_latency && ping_time > 2.0 * feedback->long_term_latency)) {
         LOG_INFO_RATE_LIMITED(
             1, 5,
             "Pong %d received: took %.2fms, long term latency %.2fms, short term latency %.2fms",
-            id, ping_time * MS_IN_SECOND, context->long_term_latency * MS_IN_SECOND,
-            context->short_term_latency * MS_IN_SECOND);
+            id, ping_time * MS_IN_SECOND, feedback->long_term_latency * MS_IN_SECOND,
+            feedback->short_term_latency * MS_IN_SECOND);
     }
 
     // Calculate latency
-    context->short_term_latency = PING_LAMBDA_SHORT_TERM * context->short_term_latency +
-                                  (1 - PING_LAMBDA_SHORT_TERM) * ping_time;
-    // Don't update long term latency during congestion
-    if (!context->network_settings.congestion_detected) {
-        context->long_term_latency = PING_LAMBDA_LONG_TERM * context->long_term_latency +
-                                     (1 - PING_LAMBDA_LONG_TERM) * ping_time;
+    congestion_feedback_add_rtt(feedback, ping_time,
+                                context->network_settings.congestion_detected);
+}
+
+void udp_send_transport_feedback(UDPContext* context) {
+    whist_lock_mutex(context->congestion_control_mutex);
+    // The client budgets its NACKs with the network settings, until the server sends its own
+    if (context->network_settings.video_bitrate == 0) {
+        context->network_settings = get_starting_network_settings();
+    }
+    whist_unlock_mutex(context->congestion_control_mutex);
+
+    UDPPacket packet;
+    packet.type = UDP_TRANSPORT_FEEDBACK;
+    transport_feedback_builder_finish(&context->transport_feedback_builder, current_time_us(),
+                                      &packet.udp_transport_feedback_data);
+    udp_send_udp_packet(context, &packet);
+}
+
+int udp_count_sent_video_segments(UDPContext* context, int id, int index) {
+    int last_id = context->last_reported_id;
+    int last_index = context->last_reported_index;
+    if (last_id != 0 && (id < last_id || (id == last_id && index <= last_index))) {
+        // Reordered, so it was already counted
+        return 0;
+    }
+    context->last_reported_id = id;
+    context->last_reported_index = index;
+    if (last_id == 0 || id - last_id >= context->nack_num_buffers[PACKET_VIDEO]) {
+        // There's no history to count from
+        return 1;
+    }
+    if (id == last_id) {
+        return index - last_index;
+    }
+
+    // The rest of the last reported frame, the frames in between, and this frame up to index
+    int num_sent = index + 1 - (last_index + 1);
+    for (int frame_id = last_id; frame_id < id; frame_id++) {
+        UDPPacket packet;
+        if (udp_read_nack_buffer(context, PACKET_VIDEO, frame_id, 0, &packet) &&
+            packet.udp_whist_segment_data.id == frame_id) {
+            // Probe parity is flagged as a duplicate, which transport feedback skips
+            num_sent += packet.udp_whist_segment_data.num_indices -
+                        packet.udp_whist_segment_data.num_probe_indices;
+        }
+    }
+    return max(num_sent, 1);
+}
+
+void udp_handle_transport_feedback(void* raw_context, TransportFeedback* feedback) {
+    UDPContext* context = (UDPContext*)raw_context;
+    if (context->nack_buffers[PACKET_VIDEO] == NULL || feedback->num_packets < 0 ||
+        feedback->num_packets > TRANSPORT_FEEDBACK_MAX_PACKETS) {
+        LOG_WARNING("Invalid transport feedback of %d packets", feedback->num_packets);
+        return;
     }
+
+    whist_lock_mutex(context->congestion_control_mutex);
+    start_timer(&context->last_transport_feedback_timer);
+    if (context->congestion_controller == NULL) {
+        // Wait for the server to pick the starting network settings, which the estimation
+        // starts from
+        if (context->network_settings.video_bitrate == 0) {
+            whist_unlock_mutex(context->congestion_control_mutex);
+            return;
+        }
+        LOG_INFO("The client sends transport feedback, so the server estimates the bandwidth");
+        context->fec_controller = create_fec_controller(get_timestamp_sec());
+        context->congestion_controller =
+            create_congestion_controller(NULL, context->fec_controller);
+        FATAL_ASSERT(context->congestion_controller != NULL);
+    }
+
+    CongestionFeedback* congestion_feedback = &context->congestion_feedback;
+    NetworkSettings network_settings = context->network_settings;
+    bool send_network_settings = false;
+    int num_sent = 0;
+    int num_received = 0;
+    timestamp_us last_departure_time = 0;
+    for (int i = 0; i < feedback->num_packets; i++) {
+        TransportFeedbackPacket* reported = &feedback->packets[i];
+        // The nack buffer knows when and in which group the segment was sent, even when its
+        // compact header didn't carry the departure time
+        UDPPacket packet;
+        if (reported->id <= 0 ||
+            reported->index >= context->nack_buffer_max_indices[PACKET_VIDEO] ||
+            !udp_read_nack_buffer(context, PACKET_VIDEO, reported->id, reported->index, &packet) ||
+            packet.udp_whist_segment_data.id != reported->id) {
+            // Too old for the nack buffer
+            last_departure_time = 0;
+            continue;
+        }
+        num_received++;
+        num_sent += udp_count_sent_video_segments(context, reported->id, reported->index);
+
+        timestamp_us arrival_time = transport_feedback_get_arrival_time(feedback, i);
+        last_departure_time = packet.udp_whist_segment_data.departure_time;
+        congestion_feedback_add_incoming_bits(
+            congestion_feedback, arrival_time,
+            (UDPNETWORKPACKET_HEADER_SIZE + udp_get_wire_packet_size(&packet)) * BITS_IN_BYTE);
+        GroupStats curr_group_stats;
+        GroupStats prev_group_stats;
+        if (congestion_feedback_add_group_sample(congestion_feedback, last_departure_time,
+                                                 arrival_time, packet.group_id,
+                                                 &curr_group_stats, &prev_group_stats)) {
+            int incoming_bitrate =
+                congestion_feedback_get_incoming_bitrate(congestion_feedback, arrival_time);
+            congestion_controller_on_rtt(context->congestion_controller,
+                                         congestion_feedback->short_term_latency,
+                                         congestion_feedback->long_term_latency);
+            congestion_controller_on_loss(context->congestion_controller,
+                                          context->transport_packet_loss_ratio);
+            send_network_settings |= congestion_controller_on_group_feedback(
+                context->congestion_controller, &curr_group_stats, &prev_group_stats,
+                incoming_bitrate, &network_settings);
+        }
+    }
+
+    // Segments that were sent but never reported were lost
+    if (num_sent > 0) {
+        double packet_loss_ratio = max(1.0 - (double)num_received / num_sent, 0.0);
+        context->transport_packet_loss_ratio =
+            (1.0 - TRANSPORT_FEEDBACK_LOSS_EWMA_FACTOR) * context->transport_packet_loss_ratio +
+            TRANSPORT_FEEDBACK_LOSS_EWMA_FACTOR * packet_loss_ratio;
+    }
+    // The last segment's round trip is measured from its departure, minus the time that the
+    // client held its feedback
+    if (last_departure_time != 0) {
+        double rtt =
+            ((double)(current_time_us() - last_departure_time) - feedback->hold_time_us) /
+            US_IN_SECOND;
+        if (rtt > 0.0) {
+            congestion_feedback_add_rtt(congestion_feedback, rtt,
+                                        network_settings.congestion_detected);
+        }
+    }
+
+    if (send_network_settings) {
+        udp_handle_network_settings(context, network_settings);
+    }
+    // Tell the client too, and resend periodically since UDP packets might get lost
+    if (send_network_settings || get_timer(&context->last_network_settings_send_time) > 1.0) {
+        send_desired_network_settings(context);
+    }
+    whist_unlock_mutex(context->congestion_control_mutex);
+}
+
+double udp_get_transport_packet_loss_ratio(void* raw_context) {
+    UDPContext* context = (UDPContext*)raw_context;
+    whist_lock_mutex(context->congestion_control_mutex);
+    double transport_packet_loss_ratio = context->transport_packet_loss_ratio;
+    whist_unlock_mutex(context->congestion_control_mutex);
+    return transport_packet_loss_ratio;
 }
 
 void udp_handle_network_settings(void* raw_context, NetworkSettings network_settings) {
@@ -2044,18 +3923,29 @@ void udp_handle_network_settings(void* raw_context, NetworkSettings network_sett
     // Check bounds
     FATAL_ASSERT(0.0 <= audio_fec_ratio && audio_fec_ratio <= MAX_FEC_RATIO);
     FATAL_ASSERT(0.0 <= video_fec_ratio && video_fec_ratio <= MAX_FEC_RATIO);
+    // The probe ratio comes from the peer, so clamp it instead of trusting it
+    double video_probe_ratio = network_settings.video_probe_ratio;
+    if (!(0.0 <= video_probe_ratio && video_probe_ratio <= MAX_FEC_RATIO)) {
+        LOG_WARNING("Clamping out-of-range video probe ratio %f", video_probe_ratio);
+        // NaN is clamped to 0 too
+        network_settings.video_probe_ratio =
+            video_probe_ratio > MAX_FEC_RATIO ? MAX_FEC_RATIO : 0.0;
+    }
 
     // Set burst bitrate, if possible
     if (context->network_throttler == NULL) {
         LOG_ERROR("Tried to set the burst bitrate, but there's no network throttler!");
     } else {
-        // Subtract audio bitrate from burst bitrate as audio is not throttled
+        // Audio isn't paced, but it's charged to the throttler as it's sent, so the burst bitrate
+        // covers it too, see udp_send_udp_packet
         network_throttler_set_burst_bitrate(context->network_throttler, burst_bitrate);
     }
 
     // Set FEC Packet Ratios
     context->fec_packet_ratios[PACKET_VIDEO] = video_fec_ratio;
     context->fec_packet_ratios[PACKET_AUDIO] = audio_fec_ratio;
+    context->video_probe_ratio =
+        network_settings.saturate_bandwidth ? network_settings.video_probe_ratio : 0.0;
 
     // Set internal network settings, so that it can be requested for later
     context->network_settings = network_settings;
@@ -30,6 +30,7 @@ Includes
 */
 
 #include <whist/core/whist.h>
+#include <whist/fec/fec.h>
 
 /*
 ============================
@@ -38,10 +39,15 @@ Defines
 */
 
 // We should be able to fix a normal-sized WhistPacket,
-// in just a single segment
-#define MAX_PACKET_SEGMENT_SIZE ((int)sizeof(WhistPacket))
-// Burst interval of the network throttler
-#define UDP_NETWORK_THROTTLER_BUCKET_MS 5.0
+// in just a single segment. This is the segment size until path MTU discovery picks one.
+#define DEFAULT_PACKET_SEGMENT_SIZE ((int)sizeof(WhistPacket))
+// The segment sizes that fill a UDP datagram on the standard 1500-byte Ethernet MTU,
+// and on the 576-byte minimum IPv4 MTU. Path MTU discovery picks a size in between.
+#define MAX_PACKET_SEGMENT_SIZE 1396
+#define MIN_PACKET_SEGMENT_SIZE 472
+// Minimum length of a group of packets that the network throttler paces,
+// which congestion control measures the delay gradient between
+#define UDP_NETWORK_THROTTLER_GROUP_MS 5.0
 
 // Represents a WhistSegment, which will be managed by the ringbuffer
 typedef struct {
@@ -51,7 +57,13 @@ typedef struct {
     unsigned short index;
     unsigned short num_indices;
     unsigned short num_fec_indices;
+    // The last num_probe_indices FEC indices are probe parity, which is only sent while the
+    // server probes the bandwidth, so the client can't count on getting it
+    unsigned short num_probe_indices;
     unsigned short segment_size;
+    // The size that the WhistPacket was split with, i.e. the size of every segment but the last
+    // original one, and the distance between consecutive segments in the reassembled WhistPacket
+    unsigned short segment_stride;
     unsigned short prev_frame_num_duplicates;
     bool is_a_nack;
     bool is_a_duplicate;
@@ -66,6 +78,15 @@ typedef struct {
     timestamp_us arrival_time;    // This time is measured in client's clock
 } GroupStats;
 
+// One contiguous piece of a payload that is scattered in memory
+typedef struct {
+    const void* data;
+    int size;
+} UDPPayloadChunk;
+
+// Called from the receiving thread when NACKs arrive, see udp_set_nack_notify
+typedef void (*UDPNackNotifyFn)(void* data);
+
 /*
 ============================
 Public Functions
@@ -104,7 +125,10 @@ bool create_udp_socket_context(SocketContext* context, const char* destination,
  * @brief                          Registers a nack buffer, so that future nacks can be handled.
  *                                 It will be able to respond to nacks from the most recent
  *                                 `buffer_size` ID's that have been send via send_packet
- *                                 NOTE: This function is not thread-safe on SocketContext
+ *                                 NOTE: This function is not thread-safe on SocketContext.
+ *                                 Packets of this type must be sent by one thread at a time,
+ *                                 but nacks and resends may come from any thread, since they
+ *                                 never block the sending thread.
  *
  * @param context                  The SocketContext that will have a nack buffer
  * @param type                     The WhistPacketType that this nack buffer will be used for
@@ -155,9 +179,30 @@ int udp_get_num_pending_frames(SocketContext* context, WhistPacketType type);
  * @param id                       Frame ID
  * @param index                    Packet index
  *
+ * @note                           This may be called from any thread. A packet that's being
+ *                                 overwritten by a newer frame isn't resent. Video packets are
+ *                                 resent as probes, once every other video packet has been sent.
  */
 void udp_resend_packet(SocketContext* context, WhistPacketType type, int id, int index);
 
+/**
+ * @brief                          Sends the next probe parity segment of a video frame, to fill
+ *                                 the spare bandwidth while saturating it. Unlike a duplicate,
+ *                                 it can also recover any one missing segment of the frame.
+ *
+ * @param context                  The UDP Socket Context
+ * @param id                       Frame ID. Only the most recently sent video frame has
+ *                                 probe parity.
+ *
+ * @returns                        True if a probe was sent, false if the frame has no probe
+ *                                 parity left, or never had any because it has no FEC, in which
+ *                                 case duplicates should be sent instead
+ *
+ * @note                           This may be called from any thread. Probe parity counts as
+ *                                 duplicates, see udp_reset_duplicate_packet_counter.
+ */
+bool udp_send_probe_parity(SocketContext* context, int id);
+
 /**
  * @brief                          Resets the duplicate packet counter for the specified frame type
  *
@@ -180,8 +225,9 @@ void udp_reset_duplicate_packet_counter(SocketContext* context, WhistPacketType
 int udp_get_num_indices(SocketContext* context, WhistPacketType type, int id);
 
 /**
- * @brief                          Handle all pending nacks. This function could take a while, as
- *                                 can wait in throttle.
+ * @brief                          Handle all pending nacks, by sending everything that the egress
+ *                                 scheduler holds, see egress_scheduler.h. This function could
+ *                                 take a while, as it waits in throttle.
  *
  * @param raw_context              The UDP Socket Context's internal raw context
  *
@@ -189,6 +235,87 @@ int udp_get_num_indices(SocketContext* context, WhistPacketType type, int id);
  */
 bool udp_handle_pending_nacks(void* raw_context);
 
+/**
+ * @brief                          Registers a function to call whenever video NACKs are received,
+ *                                 so that a sending thread can wait for them to arrive
+ *                                 rather than polling udp_handle_pending_nacks
+ *
+ * @param context                  The UDP SocketContext
+ * @param notify                   The function to call, from the receiving thread.
+ *                                 It must return promptly. NULL unregisters it.
+ * @param data                     The data to pass to notify
+ *
+ * @note                           Once this returns, the previous function won't be called again
+ */
+void udp_set_nack_notify(SocketContext* context, UDPNackNotifyFn notify, void* data);
+
+/**
+ * @brief                          Send a WhistPacket whose payload is scattered across several
+ *                                 chunks, without first gathering it into one buffer.
+ *                                 Each segment is read straight out of the chunks into its
+ *                                 nack buffer slot, and encrypted from there onto the wire.
+ *                                 This is otherwise identical to send_packet.
+ *
+ * @param context                  The UDP SocketContext
+ * @param type                     The WhistPacketType of the payload
+ * @param chunks                   The chunks that make up the payload, in order
+ * @param num_chunks               The number of chunks, which must be at most 14
+ * @param packet_id                The ID of the payload
+ * @param start_of_stream          Whether this payload is the start of a new stream
+ * @param protection_class         How strongly to protect this payload with FEC, relative to the
+ *                                 other payloads of its type. The type's fec ratio is split
+ *                                 between the classes by fec_controller_get_class_fec_ratios.
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int udp_send_packet_chunks(SocketContext* context, WhistPacketType type,
+                           const UDPPayloadChunk* chunks, int num_chunks, int packet_id,
+                           bool start_of_stream, FECProtectionClass protection_class);
+
+/**
+ * @brief                          Choose how payloads that span multiple segments are sent.
+ *                                 The batched path throttles, encrypts and sends up to
+ *                                 64 segments at a time (with one sendmmsg on Linux),
+ *                                 while the other path handles one segment at a time.
+ *                                 The batched path is used by default.
+ *
+ * @param context                  The UDP SocketContext
+ * @param batched_send             Whether to use the batched send path
+ */
+void udp_set_batched_send(SocketContext* context, bool batched_send);
+
+/**
+ * @brief                          Returns the size that WhistPackets with a nack buffer are
+ *                                 split into. The server picks it by probing the path MTU to
+ *                                 the client during the handshake, so that segments don't get
+ *                                 IP-fragmented, and are as large as the path allows.
+ *
+ * @param context                  The UDP SocketContext
+ *
+ * @returns                        The segment size, between MIN_PACKET_SEGMENT_SIZE and
+ *                                 MAX_PACKET_SEGMENT_SIZE
+ */
+int udp_get_segment_size(SocketContext* context);
+
+/**
+ * @brief                          Makes every UDP SocketContext drop the datagrams it receives
+ *                                 that a path with the given IP MTU couldn't have carried.
+ *                                 This is for testing path MTU discovery on loopback.
+ *
+ * @param mtu                      The IP MTU to simulate, or 0 to not simulate one
+ */
+void udp_set_simulated_path_mtu(int mtu);
+
+/**
+ * @brief                          Choose whether UDP SocketContexts created from now on send and
+ *                                 receive through io_uring, see udp_uring.h. This is what the
+ *                                 --io-uring option sets. Where io_uring isn't supported,
+ *                                 the regular syscalls are used regardless.
+ *
+ * @param use_io_uring             Whether to use io_uring
+ */
+void udp_set_use_io_uring(bool use_io_uring);
+
 // TODO: Try to remove by making the client detect a nack buffer
 /**
  * @brief                          Registers a ring buffer to reconstruct WhistPackets
@@ -242,4 +369,12 @@ typedef struct {
 void update_max_unordered_packets(UnOrderedPacketInfo* unordered_info, int frame_id,
                                   int packet_index);
 
+// What the server does with the transport feedback that the client sends it,
+// see transport_feedback.h
+struct TransportFeedback;
+void udp_handle_transport_feedback(void* raw_context, struct TransportFeedback* feedback);
+
+// The server's running average of the video segments that transport feedback didn't report
+double udp_get_transport_packet_loss_ratio(void* raw_context);
+
 #endif  // WHIST_UDP_H
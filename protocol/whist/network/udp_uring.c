@@ -0,0 +1,626 @@
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file udp_uring.c
+ * @brief This file contains an io_uring backend for the syscalls of a connected UDP socket.
+============================
+Usage
+============================
+
+See udp_uring.h. liburing isn't a dependency, so the rings are set up and driven
+through the raw io_uring syscalls. Multishot receives need Linux 6.0 or later.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include "udp_uring.h"
+
+#if OS_IS(OS_LINUX) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if OS_IS(OS_LINUX) && defined(IORING_RECV_MULTISHOT)
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// The buffer group that the multishot receive picks its buffers from
+#define UDP_RING_RECV_BUFFER_GROUP 0
+// The user_data of the multishot receive, and of its cancellation
+#define UDP_RING_RECV_USER_DATA 1
+#define UDP_RING_CANCEL_USER_DATA 2
+// How many receive buffers there are for each datagram that udp_ring_recv can return,
+// so that the kernel keeps receiving while a batch is being processed
+#define UDP_RING_RECV_BUFFERS_PER_BATCH 4
+// How long udp_ring_destroy waits for the multishot receive to be cancelled
+#define UDP_RING_CANCEL_TIMEOUT_MS 100
+
+// The mapped submission and completion queues of one io_uring instance
+typedef struct {
+    int fd;
+    void* ring_memory;
+    size_t ring_memory_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    // The tail of the SQEs that have been filled in, but not yet given to the kernel
+    unsigned local_sq_tail;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} IOURing;
+
+struct UDPRing {
+    SOCKET socket;
+
+    IOURing send_ring;
+    int max_send_batch_size;
+
+    IOURing recv_ring;
+    int max_recv_batch_size;
+    // Whether the multishot receive is still running
+    bool recv_armed;
+    // The provided buffer ring that the multishot receive takes its buffers from
+    struct io_uring_buf_ring* buffer_ring;
+    size_t buffer_ring_size;
+    unsigned short buffer_ring_tail;
+    char* recv_buffers;
+    int recv_buffer_size;
+    int num_recv_buffers;
+    // The buffers that the last udp_ring_recv returned, to give back to the kernel
+    unsigned short* returned_buffer_ids;
+    int num_returned_buffers;
+    // An error that was reaped after some datagrams, to report on the next udp_ring_recv
+    int pending_recv_error;
+};
+
+/*
+============================
+Private Function Declarations
+============================
+*/
+
+/**
+ * @brief                          Sets up and maps an io_uring instance
+ *
+ * @param ring                     The IOURing to initialize
+ * @param sq_entries               The size of the submission queue
+ * @param cq_entries               The size of the completion queue
+ *
+ * @returns                        True on success, false if io_uring or a required
+ *                                 feature of it isn't supported
+ */
+static bool io_uring_init(IOURing* ring, unsigned sq_entries, unsigned cq_entries);
+
+/**
+ * @brief                          Unmaps and closes an io_uring instance, if it was initialized
+ *
+ * @param ring                     The IOURing to destroy
+ */
+static void io_uring_exit(IOURing* ring);
+
+/**
+ * @brief                          Gets the next free SQE, zeroed
+ *
+ * @param ring                     The IOURing
+ *
+ * @returns                        The SQE, or NULL if the submission queue is full
+ */
+static struct io_uring_sqe* io_uring_get_sqe(IOURing* ring);
+
+/**
+ * @brief                          Submits the SQEs that were filled in, and waits for completions
+ *
+ * @param ring                     The IOURing
+ * @param min_complete             How many completions to wait for, in total
+ * @param timeout_ms               How long to wait for them, where -1 waits forever
+ *
+ * @returns                        The number of SQEs submitted, or -1 with errno set.
+ *                                 errno is ETIME if the timeout passed.
+ */
+static int io_uring_submit_and_wait(IOURing* ring, unsigned min_complete, int timeout_ms);
+
+/**
+ * @brief                          Gets the next completion, without waiting for it
+ *
+ * @param ring                     The IOURing
+ *
+ * @returns                        The CQE, or NULL if there are no completions.
+ *                                 Call io_uring_cqe_seen once it's been read.
+ */
+static struct io_uring_cqe* io_uring_peek_cqe(IOURing* ring);
+
+/**
+ * @brief                          Consumes the CQE that io_uring_peek_cqe returned
+ *
+ * @param ring                     The IOURing
+ */
+static void io_uring_cqe_seen(IOURing* ring);
+
+/**
+ * @brief                          Hands a receive buffer to the kernel. It's only visible to the
+ *                                 kernel once udp_ring_publish_buffers is called.
+ *
+ * @param ring                     The UDPRing
+ * @param buffer_id                The ID of the receive buffer
+ */
+static void udp_ring_provide_buffer(UDPRing* ring, unsigned short buffer_id);
+
+/**
+ * @brief                          Makes the buffers from udp_ring_provide_buffer visible
+ *                                 to the kernel
+ *
+ * @param ring                     The UDPRing
+ */
+static void udp_ring_publish_buffers(UDPRing* ring);
+
+/**
+ * @brief                          Queues a multishot receive on the socket. It's submitted
+ *                                 with the next io_uring_submit_and_wait on the receive ring.
+ *
+ * @param ring                     The UDPRing
+ */
+static void udp_ring_arm_recv(UDPRing* ring);
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+UDPRing* udp_ring_create(SOCKET socket, void* send_buffer, size_t send_buffer_size,
+                         int max_send_batch_size, int recv_buffer_size, int max_recv_batch_size) {
+    FATAL_ASSERT(max_send_batch_size > 0 && max_recv_batch_size > 0);
+    UDPRing* ring = (UDPRing*)safe_malloc(sizeof(UDPRing));
+    memset(ring, 0, sizeof(UDPRing));
+    ring->socket = socket;
+    ring->send_ring.fd = -1;
+    ring->recv_ring.fd = -1;
+    ring->buffer_ring = MAP_FAILED;
+
+    // The send ring only ever holds one batch, whose writes are linked together
+    ring->max_send_batch_size = max_send_batch_size;
+    if (!io_uring_init(&ring->send_ring, max_send_batch_size, 2 * max_send_batch_size)) {
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+    struct iovec send_iovec = {send_buffer, send_buffer_size};
+    if (syscall(__NR_io_uring_register, ring->send_ring.fd, IORING_REGISTER_BUFFERS, &send_iovec,
+                1) < 0) {
+        LOG_WARNING("Failed to register the io_uring send buffer: %d", errno);
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+
+    // The receive ring holds the multishot receive, and at most one completion per buffer.
+    // Buffer rings must have a power of two number of entries.
+    ring->max_recv_batch_size = max_recv_batch_size;
+    ring->recv_buffer_size = recv_buffer_size;
+    ring->num_recv_buffers = 1;
+    while (ring->num_recv_buffers < max_recv_batch_size * UDP_RING_RECV_BUFFERS_PER_BATCH) {
+        ring->num_recv_buffers *= 2;
+    }
+    FATAL_ASSERT(ring->num_recv_buffers <= USHRT_MAX);
+    if (!io_uring_init(&ring->recv_ring, 4, 2 * ring->num_recv_buffers)) {
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+    ring->recv_buffers = (char*)safe_malloc((size_t)ring->num_recv_buffers * recv_buffer_size);
+    ring->returned_buffer_ids =
+        (unsigned short*)safe_malloc(sizeof(unsigned short) * max_recv_batch_size);
+    // The buffer ring must be page-aligned
+    ring->buffer_ring_size = sizeof(struct io_uring_buf) * ring->num_recv_buffers;
+    ring->buffer_ring = (struct io_uring_buf_ring*)mmap(
+        NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED) {
+        LOG_WARNING("Failed to allocate the io_uring buffer ring: %d", errno);
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+    struct io_uring_buf_reg buffer_ring_reg;
+    memset(&buffer_ring_reg, 0, sizeof(buffer_ring_reg));
+    buffer_ring_reg.ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring;
+    buffer_ring_reg.ring_entries = (uint32_t)ring->num_recv_buffers;
+    buffer_ring_reg.bgid = UDP_RING_RECV_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->recv_ring.fd, IORING_REGISTER_PBUF_RING,
+                &buffer_ring_reg, 1) < 0) {
+        LOG_WARNING("Failed to register the io_uring buffer ring: %d", errno);
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+    for (int i = 0; i < ring->num_recv_buffers; i++) {
+        udp_ring_provide_buffer(ring, (unsigned short)i);
+    }
+    udp_ring_publish_buffers(ring);
+
+    // Kernels without multishot receives reject it as soon as it's submitted
+    udp_ring_arm_recv(ring);
+    if (io_uring_submit_and_wait(&ring->recv_ring, 0, 0) < 0) {
+        LOG_WARNING("Failed to submit the io_uring multishot receive: %d", errno);
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+    struct io_uring_cqe* cqe = io_uring_peek_cqe(&ring->recv_ring);
+    if (cqe != NULL && cqe->res == -EINVAL) {
+        LOG_WARNING("This kernel doesn't support io_uring multishot receives");
+        io_uring_cqe_seen(&ring->recv_ring);
+        ring->recv_armed = false;
+        udp_ring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+int udp_ring_send(UDPRing* ring, void* const* packets, const int* sizes, int num_packets) {
+    FATAL_ASSERT(0 < num_packets && num_packets <= ring->max_send_batch_size);
+
+    // Link the writes, so that they go out in order,
+    // and the ones after a failed write get cancelled like they would by sendmmsg
+    for (int i = 0; i < num_packets; i++) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring->send_ring);
+        FATAL_ASSERT(sqe != NULL);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = ring->socket;
+        sqe->addr = (uint64_t)(uintptr_t)packets[i];
+        sqe->len = (uint32_t)sizes[i];
+        sqe->buf_index = 0;
+        sqe->user_data = (uint64_t)i;
+        if (i < num_packets - 1) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+    }
+
+    int ret;
+    do {
+        ret = io_uring_submit_and_wait(&ring->send_ring, (unsigned)num_packets, -1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return -1;
+    }
+
+    int num_sent = 0;
+    int error = 0;
+    for (int i = 0; i < num_packets; i++) {
+        struct io_uring_cqe* cqe = io_uring_peek_cqe(&ring->send_ring);
+        FATAL_ASSERT(cqe != NULL);
+        if (cqe->res >= 0) {
+            num_sent++;
+        } else if (error == 0 || error == ECANCELED) {
+            error = -cqe->res;
+        }
+        io_uring_cqe_seen(&ring->send_ring);
+    }
+
+    if (num_sent == 0) {
+        errno = error;
+        return -1;
+    }
+    return num_sent;
+}
+
+int udp_ring_recv(UDPRing* ring, void** packets, int* lens, int timeout_ms) {
+    // The previous batch has been processed, so give its buffers back to the kernel
+    for (int i = 0; i < ring->num_returned_buffers; i++) {
+        udp_ring_provide_buffer(ring, ring->returned_buffer_ids[i]);
+    }
+    if (ring->num_returned_buffers > 0) {
+        udp_ring_publish_buffers(ring);
+        ring->num_returned_buffers = 0;
+    }
+
+    if (ring->pending_recv_error != 0) {
+        errno = ring->pending_recv_error;
+        ring->pending_recv_error = 0;
+        return -1;
+    }
+
+    WhistTimer wait_timer;
+    start_timer(&wait_timer);
+    while (true) {
+        int num_received = 0;
+        struct io_uring_cqe* cqe;
+        while (num_received < ring->max_recv_batch_size &&
+               (cqe = io_uring_peek_cqe(&ring->recv_ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            io_uring_cqe_seen(&ring->recv_ring);
+            if (user_data != UDP_RING_RECV_USER_DATA) {
+                continue;
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                // The multishot receive has ended, and must be rearmed
+                ring->recv_armed = false;
+            }
+            if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+                unsigned short buffer_id = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+                packets[num_received] =
+                    ring->recv_buffers + (size_t)buffer_id * ring->recv_buffer_size;
+                lens[num_received] = res;
+                ring->returned_buffer_ids[ring->num_returned_buffers++] = buffer_id;
+                num_received++;
+            } else if (res < 0 && res != -ENOBUFS) {
+                // ENOBUFS only means that every buffer was in use, so it's rearmed below
+                if (num_received == 0) {
+                    errno = -res;
+                    return -1;
+                }
+                ring->pending_recv_error = -res;
+                break;
+            }
+        }
+
+        if (!ring->recv_armed) {
+            udp_ring_arm_recv(ring);
+        }
+
+        if (num_received > 0 || ring->pending_recv_error != 0 || timeout_ms == 0) {
+            // Submit the rearmed receive, if any, without waiting
+            if (ring->recv_ring.local_sq_tail != *ring->recv_ring.sq_tail) {
+                io_uring_submit_and_wait(&ring->recv_ring, 0, 0);
+            }
+            if (num_received == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            return num_received;
+        }
+
+        int remaining_ms = -1;
+        if (timeout_ms > 0) {
+            remaining_ms = timeout_ms - (int)(get_timer(&wait_timer) * MS_IN_SECOND);
+            if (remaining_ms <= 0) {
+                timeout_ms = 0;
+                continue;
+            }
+        }
+        if (io_uring_submit_and_wait(&ring->recv_ring, 1, remaining_ms) < 0 && errno != ETIME &&
+            errno != EINTR) {
+            return -1;
+        }
+        // Loop around, to reap whatever arrived or to time out
+    }
+}
+
+void udp_ring_destroy(UDPRing* ring) {
+    if (ring == NULL) {
+        return;
+    }
+
+    // Cancel the multishot receive, and wait for its last completion,
+    // so that the kernel is done with the receive buffers before they're freed
+    if (ring->recv_armed) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring->recv_ring);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = UDP_RING_RECV_USER_DATA;
+            sqe->user_data = UDP_RING_CANCEL_USER_DATA;
+        }
+        WhistTimer cancel_timer;
+        start_timer(&cancel_timer);
+        while (ring->recv_armed &&
+               get_timer(&cancel_timer) * MS_IN_SECOND < UDP_RING_CANCEL_TIMEOUT_MS) {
+            io_uring_submit_and_wait(&ring->recv_ring, 1, UDP_RING_CANCEL_TIMEOUT_MS);
+            struct io_uring_cqe* cqe;
+            while ((cqe = io_uring_peek_cqe(&ring->recv_ring)) != NULL) {
+                if (cqe->user_data == UDP_RING_RECV_USER_DATA &&
+                    !(cqe->flags & IORING_CQE_F_MORE)) {
+                    ring->recv_armed = false;
+                }
+                io_uring_cqe_seen(&ring->recv_ring);
+            }
+        }
+        if (ring->recv_armed) {
+            LOG_ERROR("Timed out cancelling the io_uring multishot receive");
+        }
+    }
+
+    io_uring_exit(&ring->send_ring);
+    io_uring_exit(&ring->recv_ring);
+    if (ring->buffer_ring != MAP_FAILED) {
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+    }
+    // If the receive couldn't be cancelled, the kernel may still write to its buffers
+    if (!ring->recv_armed) {
+        free(ring->recv_buffers);
+    }
+    free(ring->returned_buffer_ids);
+    free(ring);
+}
+
+/*
+============================
+Private Function Implementations
+============================
+*/
+
+static bool io_uring_init(IOURing* ring, unsigned sq_entries, unsigned cq_entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    ring->fd = (int)syscall(__NR_io_uring_setup, sq_entries, &params);
+    if (ring->fd < 0) {
+        LOG_WARNING("io_uring_setup failed: %d", errno);
+        return false;
+    }
+
+    // NODROP and EXT_ARG date from Linux 5.5 and 5.11,
+    // so kernels without them won't have multishot receives either
+    unsigned required_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required_features) != required_features) {
+        LOG_WARNING("io_uring lacks required features, it only has %#x", params.features);
+        io_uring_exit(ring);
+        return false;
+    }
+
+    // With IORING_FEAT_SINGLE_MMAP, the submission and completion queues share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_memory_size = max(sq_size, cq_size);
+    ring->ring_memory = mmap(NULL, ring->ring_memory_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_memory == MAP_FAILED) {
+        LOG_WARNING("Failed to map the io_uring queues: %d", errno);
+        ring->ring_memory = NULL;
+        io_uring_exit(ring);
+        return false;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        LOG_WARNING("Failed to map the io_uring SQEs: %d", errno);
+        ring->sqes = NULL;
+        io_uring_exit(ring);
+        return false;
+    }
+
+    char* ring_memory = (char*)ring->ring_memory;
+    ring->sq_head = (unsigned*)(ring_memory + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(ring_memory + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(ring_memory + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(ring_memory + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->local_sq_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(ring_memory + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ring_memory + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(ring_memory + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring_memory + params.cq_off.cqes);
+    return true;
+}
+
+static void io_uring_exit(IOURing* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->ring_memory != NULL) {
+        munmap(ring->ring_memory, ring->ring_memory_size);
+        ring->ring_memory = NULL;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+static struct io_uring_sqe* io_uring_get_sqe(IOURing* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->local_sq_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = ring->local_sq_tail & *ring->sq_mask;
+    ring->local_sq_tail++;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static int io_uring_submit_and_wait(IOURing* ring, unsigned min_complete, int timeout_ms) {
+    // Publish the filled-in SQEs. The kernel consumes every one it's told about,
+    // unless it fails before submitting anything.
+    __atomic_store_n(ring->sq_tail, ring->local_sq_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->local_sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        timeout.tv_sec = timeout_ms / MS_IN_SECOND;
+        timeout.tv_nsec = (long long)(timeout_ms % MS_IN_SECOND) * NS_IN_MS;
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+    }
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, &arg,
+                        sizeof(arg));
+}
+
+static struct io_uring_cqe* io_uring_peek_cqe(IOURing* ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void io_uring_cqe_seen(IOURing* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void udp_ring_provide_buffer(UDPRing* ring, unsigned short buffer_id) {
+    // Writing bufs[] leaves the ring's tail alone, even though it overlays the first entry
+    struct io_uring_buf* buffer =
+        &ring->buffer_ring->bufs[ring->buffer_ring_tail & (ring->num_recv_buffers - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(ring->recv_buffers +
+                                         (size_t)buffer_id * ring->recv_buffer_size);
+    buffer->len = (uint32_t)ring->recv_buffer_size;
+    buffer->bid = buffer_id;
+    ring->buffer_ring_tail++;
+}
+
+static void udp_ring_publish_buffers(UDPRing* ring) {
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+static void udp_ring_arm_recv(UDPRing* ring) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring->recv_ring);
+    FATAL_ASSERT(sqe != NULL);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ring->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UDP_RING_RECV_BUFFER_GROUP;
+    sqe->user_data = UDP_RING_RECV_USER_DATA;
+    ring->recv_armed = true;
+}
+
+#else
+
+/*
+============================
+Public Function Implementations
+============================
+*/
+
+// io_uring isn't available, so the regular syscalls are always used
+
+UDPRing* udp_ring_create(SOCKET socket, void* send_buffer, size_t send_buffer_size,
+                         int max_send_batch_size, int recv_buffer_size, int max_recv_batch_size) {
+    LOG_WARNING("io_uring isn't supported on this platform");
+    return NULL;
+}
+
+int udp_ring_send(UDPRing* ring, void* const* packets, const int* sizes, int num_packets) {
+    LOG_FATAL("udp_ring_send called without io_uring support");
+}
+
+int udp_ring_recv(UDPRing* ring, void** packets, int* lens, int timeout_ms) {
+    LOG_FATAL("udp_ring_recv called without io_uring support");
+}
+
+void udp_ring_destroy(UDPRing* ring) { FATAL_ASSERT(ring == NULL); }
+
+#endif
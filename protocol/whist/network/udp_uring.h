@@ -0,0 +1,108 @@
+#ifndef WHIST_NETWORK_UDP_URING_H
+#define WHIST_NETWORK_UDP_URING_H
+/**
+ * Copyright (c) 2022 Whist Technologies, Inc.
+ * @file udp_uring.h
+ * @brief This file contains an io_uring backend for the syscalls of a connected UDP socket.
+============================
+Usage
+============================
+
+When io_uring is enabled, udp.cpp hands its batched sends and receives to a UDPRing,
+rather than calling sendmmsg and recvmmsg. A UDPRing owns two io_uring instances, one
+for the sending thread and one for the receiving thread, so that neither ring needs a
+lock of its own.
+
+The send ring has the caller's send buffer registered as a fixed buffer, and writes a
+whole batch of wire packets with a single io_uring_enter.
+
+The receive ring keeps a multishot receive armed on the socket, which fills the buffers
+of a provided buffer ring. Datagrams that have already arrived are reaped straight from
+the completion queue, and a single io_uring_enter waits for them otherwise.
+
+udp_ring_create returns NULL on kernels that lack any of these features, or on other
+platforms, in which case the caller should keep using the regular syscalls.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <whist/core/whist.h>
+
+/*
+============================
+Public Structures
+============================
+*/
+
+typedef struct UDPRing UDPRing;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Creates the send and receive rings of a connected UDP socket,
+ *                                 and arms the multishot receive
+ *
+ * @param socket                   The connected UDP socket. From now on, it must only be
+ *                                 received from through udp_ring_recv
+ * @param send_buffer              The buffer that every packet passed to udp_ring_send lies in
+ * @param send_buffer_size         The size of send_buffer
+ * @param max_send_batch_size      The largest number of packets that udp_ring_send sends at once
+ * @param recv_buffer_size         The size of each receive buffer, i.e. the largest datagram
+ * @param max_recv_batch_size      The largest number of datagrams that udp_ring_recv returns
+ *
+ * @returns                        The UDPRing, or NULL if io_uring isn't supported
+ */
+UDPRing* udp_ring_create(SOCKET socket, void* send_buffer, size_t send_buffer_size,
+                         int max_send_batch_size, int recv_buffer_size, int max_recv_batch_size);
+
+/**
+ * @brief                          Sends a batch of datagrams with a single io_uring_enter.
+ *                                 Like sendmmsg, it stops at the first datagram that fails.
+ *
+ * @param ring                     The UDPRing
+ * @param packets                  The datagrams, which must lie in the ring's send buffer
+ * @param sizes                    The size of each datagram
+ * @param num_packets              The number of datagrams, at most max_send_batch_size
+ *
+ * @returns                        The number of datagrams sent, or -1 with errno set
+ *                                 if the first one failed
+ *
+ * @note                           This must only be called by one thread at a time
+ */
+int udp_ring_send(UDPRing* ring, void* const* packets, const int* sizes, int num_packets);
+
+/**
+ * @brief                          Receives whatever datagrams have arrived, waiting up to
+ *                                 timeout_ms for the first one if there are none
+ *
+ * @param ring                     The UDPRing
+ * @param packets                  Filled with the datagrams, which stay valid until the
+ *                                 next call to udp_ring_recv
+ * @param lens                     Filled with the size of each datagram
+ * @param timeout_ms               How long to wait, where -1 waits forever and 0 doesn't wait
+ *
+ * @returns                        The number of datagrams received, at most max_recv_batch_size,
+ *                                 or -1 with errno set. errno is EAGAIN if nothing arrived
+ *                                 within timeout_ms.
+ *
+ * @note                           This must only be called by one thread at a time
+ */
+int udp_ring_recv(UDPRing* ring, void** packets, int* lens, int timeout_ms);
+
+/**
+ * @brief                          Destroys the rings, cancelling the multishot receive.
+ *                                 The socket isn't closed.
+ *
+ * @param ring                     The UDPRing to destroy
+ */
+void udp_ring_destroy(UDPRing* ring);
+
+#endif  // WHIST_NETWORK_UDP_URING_H
@@ -10,6 +10,10 @@ Usage
 The function encrypt_packet gets called when a new packet of data needs to be
 sent over the network, while decrypt_packet, which calls decrypt_packet_n, gets
 called on the receiving end to re-obtain the data and process it.
+
+An AESSession keeps one keyed cipher context per direction, so that
+aes_session_encrypt_packet/aes_session_decrypt_packet skip the context
+allocation and key schedule that encrypt_packet/decrypt_packet pay per packet.
 */
 
 #include <whist/core/platform.h>
@@ -40,20 +44,115 @@ Defines
 // Handles and prints the ssl error,
 // Then returns -1
 // We LOG_INFO to get the line number
-#define HANDLE_SSL_ERROR()                 \
-    do {                                   \
-        LOG_INFO("OpenSSL Error caught");  \
-        print_ssl_errors();                \
-        if (ctx) EVP_CIPHER_CTX_free(ctx); \
-        return -1;                         \
+#define HANDLE_SSL_ERROR()                \
+    do {                                  \
+        LOG_INFO("OpenSSL Error caught"); \
+        print_ssl_errors();               \
+        return -1;                        \
     } while (0)
 
+/*
+============================
+Private Types
+============================
+*/
+
+struct AESSession {
+    // Keyed contexts, only the IV changes between packets
+    EVP_CIPHER_CTX* encrypt_ctx;
+    EVP_CIPHER_CTX* decrypt_ctx;
+    // An EVP_CIPHER_CTX can only be used by one thread at a time
+    WhistMutex encrypt_mutex;
+    WhistMutex decrypt_mutex;
+};
+
 /*
 ============================
 Private Function Declarations
 ============================
 */
 
+/**
+ * @brief                          Create an AES-GCM cipher context, keyed with the given key
+ *
+ * @param private_key              AES Private Key to set on the context
+ *                                   must be KEY_SIZE bytes
+ * @param encrypt                  True to create an encryption context,
+ *                                 false to create a decryption context
+ *
+ * @returns                        The new context, or NULL on failure
+ */
+static EVP_CIPHER_CTX* aes_create_cipher_ctx(const void* private_key, bool encrypt);
+
+/**
+ * @brief                          AES-GCM Encrypt plaintext data, given a keyed context and the iv
+ *
+ * @param ctx                      An encryption context from aes_create_cipher_ctx
+ * @param ciphertext               Pointer to buffer for receiving ciphertext
+ * @param prefix                   Pointer to plaintext to encrypt before `plaintext`,
+ *                                   may be NULL if prefix_len is 0
+ * @param prefix_len               Length of the prefix
+ * @param plaintext                Pointer to the plaintext to encrypt
+ * @param plaintext_len            Length of the plaintext
+ * @param iv                       IV used to seed the AES encryption
+ *                                   must be IV_SIZE bytes
+ * @param tag                      tag output for verifying data integrity
+ *
+ * @returns                        Will return -1 on failure, else will return the
+ *                                 length of the encrypted result
+ */
+static int aes_encrypt_with_ctx(EVP_CIPHER_CTX* ctx, void* ciphertext, const void* prefix,
+                                int prefix_len, const void* plaintext, int plaintext_len,
+                                const void* iv, void* tag);
+
+/**
+ * @brief                          AES Decrypt ciphertext data, given a keyed context,
+ *                                 the iv and the tag
+ *
+ * @param ctx                      A decryption context from aes_create_cipher_ctx
+ * @param plaintext_buffer         Pointer to buffer for receiving plaintext
+ * @param plaintext_len            The size of the `plaintext` buffer
+ * @param ciphertext               Pointer to the ciphertext to encrypt
+ * @param ciphertext_len           Length of the ciphertext
+ * @param iv                       IV used to seed the AES encryption
+ *                                   must be IV_SIZE bytes
+ * @param tag                      tag value used for verifying data integrity
+ *
+ * @returns                        Will return the length of the decrypted result,
+ *                                 or -1 on failure
+ */
+static int aes_decrypt_with_ctx(EVP_CIPHER_CTX* ctx, void* plaintext_buffer, int plaintext_len,
+                                const void* ciphertext, int ciphertext_len, const void* iv,
+                                const void* tag);
+
+/**
+ * @brief                          AES Decrypt ciphertext data in two parts, given a keyed
+ *                                 context, the iv and the tag.
+ *                                 See aes_session_decrypt_packet_split
+ *
+ * @param ctx                      A decryption context from aes_create_cipher_ctx
+ * @param plaintext_buffer         Pointer to buffer for receiving the header,
+ *                                 and the rest of the plaintext by default
+ * @param plaintext_len            The size of the `plaintext` buffer
+ * @param header_len               The number of bytes to decrypt into plaintext_buffer
+ *                                 before asking get_destination for the rest
+ * @param get_destination          Chooses the buffer for the bytes after the header
+ * @param opaque                   Passed to get_destination
+ * @param ciphertext               Pointer to the ciphertext to encrypt
+ * @param ciphertext_len           Length of the ciphertext
+ * @param iv                       IV used to seed the AES encryption
+ *                                   must be IV_SIZE bytes
+ * @param tag                      tag value used for verifying data integrity
+ *
+ * @returns                        Will return the length of the decrypted result,
+ *                                 or -1 on failure
+ */
+static int aes_decrypt_split_with_ctx(EVP_CIPHER_CTX* ctx, void* plaintext_buffer,
+                                      int plaintext_len, int header_len,
+                                      AESDestinationFn get_destination, void* opaque,
+                                      const void* ciphertext, int ciphertext_len, const void* iv,
+                                      const void* tag);
+
 /**
  * @brief                          AES-GCM Encrypt plaintext data, given the iv/key
  *
@@ -215,33 +314,200 @@ int decrypt_packet(void* plaintext_buffer, int plaintext_buffer_len, AESMetadata
     return decrypt_len;
 }
 
+AESSession* aes_session_create(const void* private_key) {
+    AESSession* session = safe_malloc(sizeof(*session));
+    memset(session, 0, sizeof(*session));
+
+    session->encrypt_ctx = aes_create_cipher_ctx(private_key, true);
+    session->decrypt_ctx = aes_create_cipher_ctx(private_key, false);
+    if (session->encrypt_ctx == NULL || session->decrypt_ctx == NULL) {
+        LOG_ERROR("Failed to create the AES session's cipher contexts");
+        aes_session_destroy(session);
+        return NULL;
+    }
+
+    session->encrypt_mutex = whist_create_mutex();
+    session->decrypt_mutex = whist_create_mutex();
+
+    return session;
+}
+
+void aes_session_destroy(AESSession* session) {
+    if (session == NULL) {
+        return;
+    }
+    if (session->encrypt_ctx) EVP_CIPHER_CTX_free(session->encrypt_ctx);
+    if (session->decrypt_ctx) EVP_CIPHER_CTX_free(session->decrypt_ctx);
+    if (session->encrypt_mutex) whist_destroy_mutex(session->encrypt_mutex);
+    if (session->decrypt_mutex) whist_destroy_mutex(session->decrypt_mutex);
+    free(session);
+}
+
+// NOTE that this function is in the hotpath.
+// The hotpath *must* return in under ~10000 assembly instructions.
+// Please pass this comment into any non-trivial function that this function calls.
+int aes_session_encrypt_packet(AESSession* session, void* encrypted_data,
+                               AESMetadata* aes_metadata, const void* plaintext_data,
+                               int plaintext_len) {
+    AESPacket packet = {
+        .input = plaintext_data,
+        .input_len = plaintext_len,
+        .output = encrypted_data,
+        .output_buffer_len = plaintext_len + MAX_ENCRYPTION_SIZE_INCREASE,
+        .aes_metadata = aes_metadata,
+    };
+    aes_session_encrypt_packets(session, &packet, 1);
+    return packet.output_len;
+}
+
+int aes_session_decrypt_packet(AESSession* session, void* plaintext_buffer,
+                               int plaintext_buffer_len, const AESMetadata* aes_metadata,
+                               const void* encrypted_data, int encrypted_len) {
+    AESPacket packet = {
+        .input = encrypted_data,
+        .input_len = encrypted_len,
+        .output = plaintext_buffer,
+        .output_buffer_len = plaintext_buffer_len,
+        .aes_metadata = (AESMetadata*)aes_metadata,
+    };
+    aes_session_decrypt_packets(session, &packet, 1);
+    return packet.output_len;
+}
+
+int aes_session_decrypt_packet_split(AESSession* session, void* plaintext_buffer,
+                                     int plaintext_buffer_len, int header_len,
+                                     AESDestinationFn get_destination, void* opaque,
+                                     const AESMetadata* aes_metadata, const void* encrypted_data,
+                                     int encrypted_len) {
+    whist_lock_mutex(session->decrypt_mutex);
+    int decrypted_len;
+    if (encrypted_len <= header_len) {
+        // There's nothing after the header, so this is just a normal decryption
+        decrypted_len = aes_decrypt_with_ctx(session->decrypt_ctx, plaintext_buffer,
+                                             plaintext_buffer_len, encrypted_data, encrypted_len,
+                                             aes_metadata->iv, aes_metadata->tag);
+    } else {
+        decrypted_len = aes_decrypt_split_with_ctx(
+            session->decrypt_ctx, plaintext_buffer, plaintext_buffer_len, header_len,
+            get_destination, opaque, encrypted_data, encrypted_len, aes_metadata->iv,
+            aes_metadata->tag);
+    }
+    whist_unlock_mutex(session->decrypt_mutex);
+    return decrypted_len;
+}
+
+int aes_session_encrypt_packets(AESSession* session, AESPacket* packets, int num_packets) {
+    int num_encrypted = 0;
+    whist_lock_mutex(session->encrypt_mutex);
+    for (int i = 0; i < num_packets; i++) {
+        AESPacket* packet = &packets[i];
+        FATAL_ASSERT(packet->output_buffer_len >=
+                     packet->prefix_len + packet->input_len + MAX_ENCRYPTION_SIZE_INCREASE);
+        // Every packet still gets its own IV, only the keyed context is reused
+        gen_iv(packet->aes_metadata->iv);
+        packet->output_len = aes_encrypt_with_ctx(
+            session->encrypt_ctx, packet->output, packet->prefix, packet->prefix_len,
+            packet->input, packet->input_len, packet->aes_metadata->iv, packet->aes_metadata->tag);
+        if (packet->output_len >= 0) {
+            num_encrypted++;
+        }
+    }
+    whist_unlock_mutex(session->encrypt_mutex);
+    return num_encrypted;
+}
+
+int aes_session_decrypt_packets(AESSession* session, AESPacket* packets, int num_packets) {
+    int num_decrypted = 0;
+    whist_lock_mutex(session->decrypt_mutex);
+    for (int i = 0; i < num_packets; i++) {
+        AESPacket* packet = &packets[i];
+        FATAL_ASSERT(packet->prefix_len == 0);
+        packet->output_len = aes_decrypt_with_ctx(
+            session->decrypt_ctx, packet->output, packet->output_buffer_len, packet->input,
+            packet->input_len, packet->aes_metadata->iv, packet->aes_metadata->tag);
+        if (packet->output_len >= 0) {
+            num_decrypted++;
+        }
+    }
+    whist_unlock_mutex(session->decrypt_mutex);
+    return num_decrypted;
+}
+
 /*
 ============================
 Private Function Implementations
 ============================
 */
 
+static EVP_CIPHER_CTX* aes_create_cipher_ctx(const void* key, bool encrypt) {
+    const EVP_CIPHER* cipher = EVP_aes_128_gcm();
+
+    // Verify the constants of aes.h before usage
+    FATAL_ASSERT(IV_SIZE == EVP_CIPHER_iv_length(cipher));
+    FATAL_ASSERT(KEY_SIZE == EVP_CIPHER_key_length(cipher));
+
+    // Create and initialise the context
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        print_ssl_errors();
+        return NULL;
+    }
+
+    // Set the cipher and the key, the IV is set separately for every packet
+    int ret = encrypt ? EVP_EncryptInit_ex(ctx, cipher, NULL, (const unsigned char*)key, NULL)
+                      : EVP_DecryptInit_ex(ctx, cipher, NULL, (const unsigned char*)key, NULL);
+    if (ret != 1) {
+        print_ssl_errors();
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
 int aes_encrypt(void* ciphertext, const void* plaintext, int plaintext_len, const void* key,
                 const void* iv, void* tag) {
-    EVP_CIPHER_CTX* ctx = NULL;
-    const EVP_CIPHER* cipher = EVP_aes_128_gcm();
+    EVP_CIPHER_CTX* ctx = aes_create_cipher_ctx(key, true);
+    if (ctx == NULL) {
+        return -1;
+    }
 
-    int len;
+    int ciphertext_len =
+        aes_encrypt_with_ctx(ctx, ciphertext, NULL, 0, plaintext, plaintext_len, iv, tag);
 
-    int ciphertext_buffer_size = plaintext_len + MAX_ENCRYPTION_SIZE_INCREASE;
+    // Free the context
+    EVP_CIPHER_CTX_free(ctx);
 
-    int ciphertext_bytes_written = 0;
+    return ciphertext_len;
+}
 
-    // Create and initialise the context
-    if (!(ctx = EVP_CIPHER_CTX_new())) HANDLE_SSL_ERROR();
+int aes_decrypt(void* plaintext_buffer, int plaintext_len, const void* ciphertext,
+                int ciphertext_len, const void* key, const void* iv, void* tag) {
+    EVP_CIPHER_CTX* ctx = aes_create_cipher_ctx(key, false);
+    if (ctx == NULL) {
+        return -1;
+    }
 
-    // Verify the constants of aes.h before usage
-    FATAL_ASSERT(IV_SIZE == EVP_CIPHER_iv_length(cipher));
-    FATAL_ASSERT(KEY_SIZE == EVP_CIPHER_key_length(cipher));
+    int decrypted_len = aes_decrypt_with_ctx(ctx, plaintext_buffer, plaintext_len, ciphertext,
+                                             ciphertext_len, iv, tag);
+
+    // Free context
+    EVP_CIPHER_CTX_free(ctx);
+
+    return decrypted_len;
+}
+
+static int aes_encrypt_with_ctx(EVP_CIPHER_CTX* ctx, void* ciphertext, const void* prefix,
+                                int prefix_len, const void* plaintext, int plaintext_len,
+                                const void* iv, void* tag) {
+    int len;
+
+    int ciphertext_buffer_size = prefix_len + plaintext_len + MAX_ENCRYPTION_SIZE_INCREASE;
 
-    // Initialise the encryption operation.
-    if (1 !=
-        EVP_EncryptInit_ex(ctx, cipher, NULL, (const unsigned char*)key, (const unsigned char*)iv))
+    int ciphertext_bytes_written = 0;
+
+    // Reset the encryption operation with the new IV, keeping the cipher and key
+    if (1 != EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, (const unsigned char*)iv))
         HANDLE_SSL_ERROR();
 
     /*
@@ -256,7 +522,15 @@ int aes_encrypt(void* ciphertext, const void* plaintext, int plaintext_len, cons
 
     // Size of the remaining ciphertext buffer, must be >= inl + MAX_ENCRYPTION_SIZE_INCREASE
     FATAL_ASSERT(ciphertext_buffer_size - ciphertext_bytes_written >=
-                 plaintext_len + MAX_ENCRYPTION_SIZE_INCREASE);
+                 prefix_len + plaintext_len + MAX_ENCRYPTION_SIZE_INCREASE);
+
+    // Encrypt the prefix, the plaintext continues the same GCM stream right after it
+    if (prefix_len > 0) {
+        if (1 != EVP_EncryptUpdate(ctx, (unsigned char*)ciphertext + ciphertext_bytes_written,
+                                   &len, (const unsigned char*)prefix, prefix_len))
+            HANDLE_SSL_ERROR();
+        ciphertext_bytes_written += len;
+    }
 
     // Encrypt
     if (1 != EVP_EncryptUpdate(ctx, (unsigned char*)ciphertext + ciphertext_bytes_written, &len,
@@ -285,34 +559,21 @@ int aes_encrypt(void* ciphertext, const void* plaintext, int plaintext_len, cons
         HANDLE_SSL_ERROR();
     }
 
-    // Free the context
-    EVP_CIPHER_CTX_free(ctx);
-
-    FATAL_ASSERT(ciphertext_bytes_written == plaintext_len);
+    FATAL_ASSERT(ciphertext_bytes_written == prefix_len + plaintext_len);
 
     return ciphertext_bytes_written;
 }
 
-int aes_decrypt(void* plaintext_buffer, int plaintext_len, const void* ciphertext,
-                int ciphertext_len, const void* key, const void* iv, void* tag) {
-    EVP_CIPHER_CTX* ctx = NULL;
-    const EVP_CIPHER* cipher = EVP_aes_128_gcm();
-
+static int aes_decrypt_with_ctx(EVP_CIPHER_CTX* ctx, void* plaintext_buffer, int plaintext_len,
+                                const void* ciphertext, int ciphertext_len, const void* iv,
+                                const void* tag) {
     int len;
 
     int plaintext_bytes_written = 0;
     int ciphertext_bytes_read = 0;
 
-    // Create and initialize the context
-    if (!(ctx = EVP_CIPHER_CTX_new())) HANDLE_SSL_ERROR();
-
-    // Verify the constants of aes.h before usage
-    FATAL_ASSERT(IV_SIZE == EVP_CIPHER_iv_length(cipher));
-    FATAL_ASSERT(KEY_SIZE == EVP_CIPHER_key_length(cipher));
-
-    // Initialize decryption
-    if (1 !=
-        EVP_DecryptInit_ex(ctx, cipher, NULL, (const unsigned char*)key, (const unsigned char*)iv))
+    // Reset the decryption operation with the new IV, keeping the cipher and key
+    if (1 != EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, (const unsigned char*)iv))
         HANDLE_SSL_ERROR();
 
     /*
@@ -371,7 +632,7 @@ int aes_decrypt(void* plaintext_buffer, int plaintext_len, const void* ciphertex
     }
 
     /* Set expected tag value */
-    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag)) {
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, (void*)tag)) {
         HANDLE_SSL_ERROR();
     }
 
@@ -387,12 +648,70 @@ int aes_decrypt(void* plaintext_buffer, int plaintext_len, const void* ciphertex
     memcpy((char*)plaintext_buffer + plaintext_bytes_written, temporary_buf, len);
     plaintext_bytes_written += len;
 
-    // Free context
-    EVP_CIPHER_CTX_free(ctx);
-
     return plaintext_bytes_written;
 }
 
+static int aes_decrypt_split_with_ctx(EVP_CIPHER_CTX* ctx, void* plaintext_buffer,
+                                      int plaintext_len, int header_len,
+                                      AESDestinationFn get_destination, void* opaque,
+                                      const void* ciphertext, int ciphertext_len, const void* iv,
+                                      const void* tag) {
+    int len;
+
+    FATAL_ASSERT(0 < header_len && header_len < ciphertext_len);
+    if (header_len > plaintext_len) {
+        LOG_INFO("We want to write %d bytes, but we only have %d bytes", header_len,
+                 plaintext_len);
+        return -1;
+    }
+
+    // Reset the decryption operation with the new IV, keeping the cipher and key
+    if (1 != EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, (const unsigned char*)iv))
+        HANDLE_SSL_ERROR();
+
+    // AES-GCM is a stream cipher, so EVP_DecryptUpdate writes exactly as many bytes as it's fed,
+    // and EVP_DecryptFinal_ex writes none. That lets us decrypt each part straight into its
+    // final buffer, without the temporary buffer that aes_decrypt_with_ctx uses.
+    FATAL_ASSERT(EVP_CIPHER_CTX_block_size(ctx) == 1);
+
+    // Decrypt the header
+    if (1 != EVP_DecryptUpdate(ctx, (unsigned char*)plaintext_buffer, &len,
+                               (const unsigned char*)ciphertext, header_len))
+        HANDLE_SSL_ERROR();
+    FATAL_ASSERT(len == header_len);
+
+    // Let the caller pick where the rest goes, based on the unauthenticated header
+    int remaining_len = ciphertext_len - header_len;
+    unsigned char* destination =
+        (unsigned char*)get_destination(opaque, plaintext_buffer, remaining_len);
+    if (destination == NULL) {
+        if (ciphertext_len > plaintext_len) {
+            LOG_INFO("We want to write %d bytes, but we only have %d bytes", ciphertext_len,
+                     plaintext_len);
+            return -1;
+        }
+        destination = (unsigned char*)plaintext_buffer + header_len;
+    }
+
+    // Decrypt the rest of the packet
+    if (1 != EVP_DecryptUpdate(ctx, destination, &len,
+                               (const unsigned char*)ciphertext + header_len, remaining_len))
+        HANDLE_SSL_ERROR();
+    FATAL_ASSERT(len == remaining_len);
+
+    /* Set expected tag value */
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, (void*)tag)) {
+        HANDLE_SSL_ERROR();
+    }
+
+    // Finish decryption, which authenticates everything that was written above
+    unsigned char final_buf[EVP_MAX_BLOCK_LENGTH];
+    if (1 != EVP_DecryptFinal_ex(ctx, final_buf, &len)) HANDLE_SSL_ERROR();
+    FATAL_ASSERT(len == 0);
+
+    return ciphertext_len;
+}
+
 static void print_ssl_errors(void) { ERR_print_errors_cb(openssl_callback, NULL); }
 
 static int openssl_callback(const char* str, size_t len, void* opaque) {
@@ -12,6 +12,12 @@ Usage
 The function encrypt_packet gets called when a new packet of data needs to be
 sent over the network, while decrypt_packet, which calls decrypt_packet_n, gets
 called on the receiving end to re-obtain the data and process it.
+
+When many packets are encrypted with the same key, create an AESSession with
+aes_session_create instead. The session sets up the key once, so that
+aes_session_encrypt_packet/aes_session_decrypt_packet only need to reseed the IV
+of each packet. aes_session_encrypt_packets/aes_session_decrypt_packets handle
+a whole array of packets at a time.
 */
 
 /*
@@ -48,6 +54,48 @@ typedef struct {
     char tag[TAG_SIZE];  // tag used for AES-GCM data integrity
 } AESMetadata;
 
+/**
+ * @brief    A keyed AES-GCM cipher session, see aes_session_create
+ *
+ */
+typedef struct AESSession AESSession;
+
+/**
+ * @brief    One packet of an aes_session_encrypt_packets/aes_session_decrypt_packets batch
+ *
+ */
+typedef struct {
+    // Optional data to encrypt in front of input, e.g. a header that isn't stored
+    // contiguously with it. Must be NULL/0 on decryption
+    const void* prefix;
+    int prefix_len;
+    // The data to encrypt or decrypt
+    const void* input;
+    int input_len;
+    // The buffer to write the result to, and its size
+    void* output;
+    int output_buffer_len;
+    // Written on encryption, read on decryption
+    AESMetadata* aes_metadata;
+    // Set to the length of the result, or -1 on failure
+    int output_len;
+} AESPacket;
+
+/**
+ * @brief                          Chooses where the rest of a packet gets decrypted to,
+ *                                 see aes_session_decrypt_packet_split
+ *
+ * @param opaque                   The opaque pointer given to aes_session_decrypt_packet_split
+ * @param header                   The decrypted header of the packet.
+ *                                 It has NOT been authenticated yet,
+ *                                 so every field of it must be bounds-checked
+ * @param remaining_len            The number of bytes left to decrypt after the header
+ *
+ * @returns                        A buffer of at least remaining_len bytes,
+ *                                 or NULL to decrypt them right after the header
+ */
+typedef void* (*AESDestinationFn)(void* opaque, const void* header, int remaining_len);
+
 /*
 ============================
 Public Functions
@@ -132,4 +180,116 @@ int encrypt_packet(void* encrypted_data, AESMetadata* aes_metadata, const void*
 int decrypt_packet(void* plaintext_buffer, int plaintext_buffer_len, AESMetadata aes_metadata,
                    const void* encrypted_data, int encrypted_len, const void* private_key);
 
+/**
+ * @brief                          Creates an AES-GCM cipher session, which runs the
+ *                                 key schedule of the given key once for all packets
+ *                                 encrypted or decrypted with it
+ *
+ * @param private_key              AES private key used to encrypt and decrypt
+ *                                   must be KEY_SIZE bytes
+ *
+ * @returns                        The new session, or NULL on failure
+ *
+ * @note                           A session may be used from multiple threads,
+ *                                 encryptions and decryptions are each serialized
+ */
+AESSession* aes_session_create(const void* private_key);
+
+/**
+ * @brief                          Destroys an AES-GCM cipher session
+ *
+ * @param session                  The session to destroy, may be NULL
+ */
+void aes_session_destroy(AESSession* session);
+
+/**
+ * @brief                          Identical to encrypt_packet,
+ *                                 but using the session's key
+ *
+ * @param session                  The AES session to encrypt with
+ * @param encrypted_data           Pointer to receive the encrypted data
+ * @param aes_metadata             Metadata about the encrypted packet gets into this struct
+ * @param plaintext_data           Pointer to the plaintext data to encrypt
+ * @param plaintext_len            Length of the packet to encrypt, in bytes
+ *
+ * @returns                        Will return the encrypted packet length,
+ *                                 or -1 on failure
+ */
+int aes_session_encrypt_packet(AESSession* session, void* encrypted_data,
+                               AESMetadata* aes_metadata, const void* plaintext_data,
+                               int plaintext_len);
+
+/**
+ * @brief                          Identical to decrypt_packet,
+ *                                 but using the session's key
+ *
+ * @param session                  The AES session to decrypt with
+ * @param plaintext_buffer         Pointer to write the plaintext to
+ * @param plaintext_buffer_len     The size that the plaintext_buffer can take in
+ * @param aes_metadata             Metadata about the encrypted packet
+ * @param encrypted_data           Pointer to the encrypted data
+ * @param encrypted_len            The length of the encrypted data buffer
+ *
+ * @returns                        Will return the decrypted packet length,
+ *                                 or -1 on failure
+ */
+int aes_session_decrypt_packet(AESSession* session, void* plaintext_buffer,
+                               int plaintext_buffer_len, const AESMetadata* aes_metadata,
+                               const void* encrypted_data, int encrypted_len);
+
+/**
+ * @brief                          Identical to aes_session_decrypt_packet, except that only
+ *                                 the first header_len bytes are decrypted into plaintext_buffer.
+ *                                 get_destination is then given that header, and may return
+ *                                 another buffer to decrypt the rest of the packet into.
+ *
+ * @param session                  The AES session to decrypt with
+ * @param plaintext_buffer         Pointer to write the header to,
+ *                                 and the rest of the plaintext when get_destination returns NULL
+ * @param plaintext_buffer_len     The size that the plaintext_buffer can take in
+ * @param header_len               The number of bytes to decrypt before calling get_destination
+ * @param get_destination          Chooses where the bytes after the header are decrypted to.
+ *                                 Not called if the packet is no larger than the header
+ * @param opaque                   Passed to get_destination
+ * @param aes_metadata             Metadata about the encrypted packet
+ * @param encrypted_data           Pointer to the encrypted data
+ * @param encrypted_len            The length of the encrypted data buffer
+ *
+ * @returns                        Will return the total decrypted packet length,
+ *                                 or -1 on failure
+ *
+ * @note                           On failure, the buffer returned by get_destination may
+ *                                 already have been written to, with unauthenticated data.
+ *                                 The caller must then treat its contents as garbage.
+ */
+int aes_session_decrypt_packet_split(AESSession* session, void* plaintext_buffer,
+                                     int plaintext_buffer_len, int header_len,
+                                     AESDestinationFn get_destination, void* opaque,
+                                     const AESMetadata* aes_metadata, const void* encrypted_data,
+                                     int encrypted_len);
+
+/**
+ * @brief                          Encrypts a batch of packets, each one getting its own IV
+ *
+ * @param session                  The AES session to encrypt with
+ * @param packets                  The packets to encrypt. Each packet's output_len
+ *                                 is set to its encrypted length, or -1 on failure
+ * @param num_packets              The number of packets in the batch
+ *
+ * @returns                        The number of packets that were successfully encrypted
+ */
+int aes_session_encrypt_packets(AESSession* session, AESPacket* packets, int num_packets);
+
+/**
+ * @brief                          Decrypts a batch of packets
+ *
+ * @param session                  The AES session to decrypt with
+ * @param packets                  The packets to decrypt. Each packet's output_len
+ *                                 is set to its decrypted length, or -1 on failure
+ * @param num_packets              The number of packets in the batch
+ *
+ * @returns                        The number of packets that were successfully decrypted
+ */
+int aes_session_decrypt_packets(AESSession* session, AESPacket* packets, int num_packets);
+
 #endif  // AES_H
@@ -8,6 +8,9 @@ Usage
 
 You can use start_timer and get_timer to time specific pieces of code, or to
 relate different events across server and client.
+
+Offline simulations can call start_simulated_clock, after which every timer, timestamp and sleep
+follows a virtual clock that only moves forward when the simulation says so.
 */
 
 #include <stdbool.h>
@@ -18,6 +21,14 @@ relate different events across server and client.
 #include <whist/core/whist.h>
 #include "clock.h"
 
+// The simulated clock, see start_simulated_clock. While it's in use, a timer's first opaque
+// word holds the simulated time at which it was started.
+static bool clock_simulated = false;
+static timestamp_us simulated_time;
+static timestamp_us simulated_start_time;
+static SimulatedSleepFn simulated_sleep_handler;
+static void* simulated_sleep_data;
+
 struct WhistTimerInternal {
 #if OS_IS(OS_WIN32)
     LARGE_INTEGER pc;
@@ -27,6 +38,11 @@ struct WhistTimerInternal {
 };
 
 void start_timer(WhistTimer* timer_opaque) {
+    if (clock_simulated) {
+        timer_opaque->opaque[0] = simulated_time;
+        timer_opaque->opaque[1] = 0;
+        return;
+    }
     struct WhistTimerInternal* timer = (struct WhistTimerInternal*)timer_opaque;
 #if OS_IS(OS_WIN32)
     QueryPerformanceCounter(&timer->pc);
@@ -43,6 +59,9 @@ void start_timer(WhistTimer* timer_opaque) {
 }
 
 double get_timer(const WhistTimer* timer_opaque) {
+    if (clock_simulated) {
+        return (double)(int64_t)(simulated_time - timer_opaque->opaque[0]) / US_IN_SECOND;
+    }
     const struct WhistTimerInternal* timer = (const struct WhistTimerInternal*)timer_opaque;
 #if OS_IS(OS_WIN32)
     LARGE_INTEGER end;
@@ -64,6 +83,10 @@ double get_timer(const WhistTimer* timer_opaque) {
 }
 
 double diff_timer(const WhistTimer* start_timer_opaque, const WhistTimer* end_timer_opaque) {
+    if (clock_simulated) {
+        return (double)(int64_t)(end_timer_opaque->opaque[0] - start_timer_opaque->opaque[0]) /
+               US_IN_SECOND;
+    }
     const struct WhistTimerInternal* start_timer =
         (const struct WhistTimerInternal*)start_timer_opaque;
     const struct WhistTimerInternal* end_timer = (const struct WhistTimerInternal*)end_timer_opaque;
@@ -81,6 +104,10 @@ double diff_timer(const WhistTimer* start_timer_opaque, const WhistTimer* end_ti
 }
 
 void adjust_timer(WhistTimer* timer_opaque, int num_seconds) {
+    if (clock_simulated) {
+        timer_opaque->opaque[0] += (int64_t)num_seconds * US_IN_SECOND;
+        return;
+    }
     struct WhistTimerInternal* timer = (struct WhistTimerInternal*)timer_opaque;
 #if OS_IS(OS_WIN32)
     LARGE_INTEGER frequency;
@@ -112,6 +139,9 @@ int current_time_str(char* buffer, size_t size) {
 }
 
 timestamp_us current_time_us(void) {
+    if (clock_simulated) {
+        return simulated_time;
+    }
     uint64_t output;
 #if OS_IS(OS_WIN32)
 /* Windows epoch starts on 1601-01-01T00:00:00Z. But UNIX/Linux epoch starts on
@@ -134,6 +164,9 @@ timestamp_us current_time_us(void) {
 }
 
 double get_timestamp_sec(void) {
+    if (clock_simulated) {
+        return (double)(simulated_time - simulated_start_time) / US_IN_SECOND;
+    }
     static WhistTimer timer;
     static int initalized = 0;
     if (initalized == 0) {
@@ -143,3 +176,28 @@ double get_timestamp_sec(void) {
     }
     return get_timer(&timer);
 }
+
+void start_simulated_clock(timestamp_us start_time, SimulatedSleepFn sleep_handler, void* data) {
+    simulated_time = start_time;
+    simulated_start_time = start_time;
+    simulated_sleep_handler = sleep_handler;
+    simulated_sleep_data = data;
+    clock_simulated = true;
+}
+
+bool is_clock_simulated(void) { return clock_simulated; }
+
+void set_simulated_time(timestamp_us time) {
+    FATAL_ASSERT(clock_simulated && time >= simulated_time);
+    simulated_time = time;
+}
+
+void simulated_sleep(uint64_t duration_us) {
+    FATAL_ASSERT(clock_simulated);
+    timestamp_us target_time = simulated_time + max(duration_us, 1);
+    if (simulated_sleep_handler != NULL) {
+        simulated_sleep_handler(simulated_sleep_data, target_time);
+    }
+    // The handler may have stopped short of the target time
+    set_simulated_time(max(simulated_time, target_time));
+}
@@ -12,6 +12,9 @@ Usage
 
 You can use start_timer and get_timer to time specific pieces of code, or to
 relate different events across server and client.
+
+Offline simulations can call start_simulated_clock, after which every timer, timestamp and sleep
+follows a virtual clock that only moves forward when the simulation says so.
 */
 
 /*
@@ -20,6 +23,7 @@ Includes
 ============================
 */
 
+#include <stdbool.h>
 #include <stdint.h>
 #if OS_IS(OS_WIN32)
 #include <windows.h>
@@ -73,6 +77,16 @@ typedef struct WhistTimerOpaque {
  */
 typedef uint64_t timestamp_us;
 
+/**
+ * @brief                          Called by a simulated clock whenever something sleeps.
+ *                                 It should handle everything that happens before target_time,
+ *                                 moving the clock forward with set_simulated_time as it goes.
+ *
+ * @param data                     The data given to start_simulated_clock
+ * @param target_time              The simulated time that the sleep ends at
+ */
+typedef void (*SimulatedSleepFn)(void* data, timestamp_us target_time);
+
 /*
 ============================
 Public Functions
@@ -151,6 +165,46 @@ timestamp_us current_time_us(void);
  */
 double get_timestamp_sec(void);
 
+/**
+ * @brief                          Switch every timer, timestamp and sleep over to a simulated
+ *                                 clock, which only moves when it's told to.
+ *
+ * @param start_time               The simulated time to start at, as a current_time_us() value
+ * @param sleep_handler            Called by every sleep, see SimulatedSleepFn. May be NULL.
+ * @param data                     Passed to sleep_handler
+ *
+ * @note                           The simulated clock isn't thread-safe, so it's only meant for
+ *                                 single-threaded programs such as the network simulator.
+ *                                 Timers started before the switch mustn't be used after it.
+ */
+void start_simulated_clock(timestamp_us start_time, SimulatedSleepFn sleep_handler, void* data);
+
+/**
+ * @brief                          Whether start_simulated_clock has been called
+ *
+ * @returns                        True if the clock is simulated
+ */
+bool is_clock_simulated(void);
+
+/**
+ * @brief                          Move the simulated clock forward
+ *
+ * @param time                     The new simulated time. It can't be in the past.
+ */
+void set_simulated_time(timestamp_us time);
+
+/**
+ * @brief                          Sleep on the simulated clock, by running its sleep handler
+ *                                 and then moving the clock to the end of the sleep.
+ *                                 whist_sleep and whist_usleep end up here, when the clock is
+ *                                 simulated.
+ *
+ * @param duration_us              The number of microseconds to sleep for. Sleeps always move
+ *                                 the clock forward by at least a microsecond, so that a loop
+ *                                 that sleeps until a deadline will reach it.
+ */
+void simulated_sleep(uint64_t duration_us);
+
 /** @} */
 
 #endif /* WHIST_UTILS_CLOCK_H */
@@ -272,9 +272,21 @@ void *whist_get_thread_local_storage(WhistThreadLocalStorageKey key) {
     return tls_map.at(key).data;
 }
 
-void whist_sleep(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+void whist_sleep(uint32_t ms) {
+    if (is_clock_simulated()) {
+        simulated_sleep((uint64_t)ms * US_IN_MS);
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
 
-void whist_usleep(uint32_t us) { std::this_thread::sleep_for(std::chrono::microseconds(us)); }
+void whist_usleep(uint32_t us) {
+    if (is_clock_simulated()) {
+        simulated_sleep(us);
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
 
 struct WhistMutexStruct {
     std::recursive_mutex mutex;
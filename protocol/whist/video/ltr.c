@@ -246,6 +246,7 @@ static int ltr_pick_next_action(LTRState *ltr, LTRAction *action) {
         default:
             FATAL_ASSERT(0 && "invalid frame->action.frame_type");
     }
+    frame->action.long_term_recovery_available = ltr->have_good_long_term_frame;
 
     *action = frame->action;
     return 0;
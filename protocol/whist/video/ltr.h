@@ -22,6 +22,12 @@ typedef struct LTRAction {
      * slot to use.
      */
     int long_term_frame_index;
+    /**
+     * Whether a known-good long-term reference exists after this
+     * frame, so that losing the frame can be fixed by referring to it
+     * rather than needing a new intra frame.
+     */
+    bool long_term_recovery_available;
 } LTRAction;
 
 /**
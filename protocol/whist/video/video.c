@@ -19,3 +19,11 @@ const char *video_frame_type_string(VideoFrameType type) {
             return "invalid frame type";
     }
 }
+
+FECProtectionClass video_frame_type_protection_class(VideoFrameType type, bool ltr_recovery) {
+    if (VIDEO_FRAME_TYPE_IS_RECOVERY_POINT(type) || !ltr_recovery) {
+        return FEC_PROTECTION_HIGH;
+    } else {
+        return FEC_PROTECTION_NORMAL;
+    }
+}
@@ -6,6 +6,9 @@
 #ifndef WHIST_CODEC_VIDEO_H
 #define WHIST_CODEC_VIDEO_H
 
+#include <stdbool.h>
+#include <whist/fec/fec.h>
+
 typedef enum {
     /**
      * A normal frame.
@@ -54,4 +57,20 @@ typedef enum {
  */
 const char *video_frame_type_string(VideoFrameType type);
 
+/**
+ * Pick how strongly a frame should be protected by FEC, from how
+ * expensive it would be for the stream to lose it.
+ *
+ * Losing a recovery point leaves the stream broken until the next one,
+ * and losing any frame when there is no known-good long-term reference
+ * forces a new intra frame, so those get the most protection.  Other
+ * frames can be recovered from by referring to the long-term reference.
+ *
+ * @param type          Frame type.
+ * @param ltr_recovery  Whether a known-good long-term reference exists
+ *                      after this frame.
+ * @return              The FEC protection class of the frame.
+ */
+FECProtectionClass video_frame_type_protection_class(VideoFrameType type, bool ltr_recovery);
+
 #endif /* WHIST_CODEC_VIDEO_H */